@@ -10,30 +10,118 @@
 #include <netdb.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include "intercept.h"
 #include "cmdserv.h"
 #include "cmdserv_helpers.h"
+#include "cmdserv_udp.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/**
+ * Maximum number of simultaneous clients on the metrics listener.
+ */
+#define CMDSERV_METRICS_CLIENTS_MAX 4
+
+/**
+ * Maximum size of an HTTP request header on the metrics listener.
+ */
+#define CMDSERV_METRICS_REQUEST_MAX 1024
+
+/**
+ * Seconds after which a metrics client is dropped, whatever state
+ * it is in.
+ */
+#define CMDSERV_METRICS_TIMEOUT     5
+
+
+/**
+ * Close reasons counted separately (with the label used in the
+ * metrics output).  Everything else is counted as "other", the last
+ * entry.
+ */
+static const struct {
+  enum cmdserv_close_reason reason;
+  const char *name;
+} cmdserv_close_reasons[] = {
+  { CMDSERV_APPLICATION_CLOSE,           "application_close"           },
+  { CMDSERV_CLIENT_DISCONNECT,           "client_disconnect"           },
+  { CMDSERV_CLIENT_RECEIVE_ERROR,        "client_receive_error"        },
+  { CMDSERV_CLIENT_TIMEOUT,              "client_timeout"              },
+  { CMDSERV_CLIENT_PROTOCOL_ERROR,       "client_protocol_error"       },
+  { CMDSERV_CLIENT_SEND_ERROR,           "client_send_error"           },
+  { CMDSERV_SERVER_SHUTDOWN,             "server_shutdown"             },
+  { CMDSERV_SERVER_TOO_MANY_CONNECTIONS, "server_too_many_connections" },
+  { CMDSERV_NO_CLOSE,                    "other"                       },
+};
+
+#define CMDSERV_CLOSE_REASONS                                           \
+  (sizeof(cmdserv_close_reasons) / sizeof(cmdserv_close_reasons[0]))
+
+
+/**
+ * A client of the metrics listener: We read the request header into
+ * req until it's complete, then render the response into resp and
+ * send it on writability.
+ */
+struct cmdserv_metrics_client {
+  int fd;                          /**< socket or -1 for a free entry      */
+  time_t time_accept;              /**< for CMDSERV_METRICS_TIMEOUT        */
+  size_t reqlen;                   /**< octets in req                      */
+  char req[CMDSERV_METRICS_REQUEST_MAX + 1];
+  char *resp;                      /**< complete response or NULL          */
+  size_t resplen;                  /**< length of resp                     */
+  size_t respsent;                 /**< octets of resp already sent        */
+};
+
+/**
+ * A listening socket for client connections.
+ */
+struct cmdserv_listener {
+  int fd;                          /**< listening socket or -1             */
+  char *path;                      /**< Unix socket to unlink() or NULL    */
+  bool shm;                        /**< clients get shared memory rings    */
+  bool binary;                     /**< clients send binary frames         */
+  bool resp;                       /**< clients speak RESP2                */
+  cmdserv_udp *udp;                /**< datagram listener or NULL          */
+};
 
 struct cmdserv {
   int connections_max;
   fd_set fds;                      /**< socket file descriptor list        */
-  int    listener;                 /**< listening socket file descriptor   */
+  struct cmdserv_listener listeners[CMDSERV_LISTEN_MAX];
+  int    listeners_count;          /**< listeners in use                   */
   int    fdmax;                    /**< maximum file descriptor number     */
   unsigned long long int conns;    /**< number of connections handled      */
   struct cmdserv_connection_config connection_config;
+  bool udp_reply;                  /**< reply to datagrams                 */
 
   time_t time_start;
 
+  cmdserv_latency *latency;        /**< owned latency histograms or NULL */
+
+  unsigned long long int closes[CMDSERV_CLOSE_REASONS]; /**< per reason */
+  unsigned long long int commands_closed; /**< on connections closed    */
+  unsigned long long int grown_closed;    /**< read buffers grown, ditto */
+  unsigned long long int shrunk_closed;   /**< ... and shrunk            */
+
+  int metrics_listener;            /**< metrics listener or -1             */
+  struct cmdserv_metrics_client metrics[CMDSERV_METRICS_CLIENTS_MAX];
+
   void (*log_handler)(void *log_object,
                       enum cmdserv_logseverity severity,
                       const char *msg);
@@ -48,9 +136,34 @@ struct cmdserv {
 };
 
 
-static void cmdserv_accept(cmdserv* self);
+static void cmdserv_accept(cmdserv* self,
+                           struct cmdserv_listener *listener);
 static int cmdserv_get_free_slot(cmdserv* self);
 static int cmdserv_get_slot_id_from_fd(cmdserv* self, int fd);
+static struct cmdserv_listener *cmdserv_listener_from_fd(cmdserv* self,
+                                                         int fd);
+static int cmdserv_listen_endpoint(cmdserv* self,
+                                   const char *endpoint,
+                                   unsigned int backlog,
+                                   struct cmdserv_listener *listener);
+static int cmdserv_listen_tcp(cmdserv* self,
+                              unsigned int port,
+                              unsigned int backlog);
+static int cmdserv_listen_addr(cmdserv* self,
+                               const struct sockaddr *addr,
+                               socklen_t addrlen,
+                               int type,
+                               unsigned int backlog);
+static bool cmdserv_unix_socket_stale(const struct sockaddr_un *addr,
+                                      socklen_t addrlen);
+static void cmdserv_metrics_accept(cmdserv* self);
+static struct cmdserv_metrics_client
+*cmdserv_metrics_client_from_fd(cmdserv* self, int fd);
+static void cmdserv_metrics_read(cmdserv* self,
+                                 struct cmdserv_metrics_client* client);
+static void cmdserv_metrics_write(cmdserv* self,
+                                  struct cmdserv_metrics_client* client);
+static void cmdserv_metrics_close(struct cmdserv_metrics_client* client);
 
 void cmdserv_close_handler(void *close_object,
                            cmdserv_connection *connection,
@@ -60,8 +173,21 @@ void __attribute__ ((format (printf, 3, 0)))
 cmdserv_vlog(cmdserv* self, enum cmdserv_logseverity severity,
              const char *fmt, va_list ap) {
   if (self->log_handler) {
+    char buf[CMDSERV_LOG_MSG_MAX];
     char *msg = NULL;
-    if (vasprintf(&msg, fmt, ap) >= 0) {
+    va_list ap2;
+    int len;
+
+    va_copy(ap2, ap);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap2);
+    va_end(ap2);
+
+    if (len < 0)
+      return;
+
+    if ((size_t)len < sizeof(buf))
+      self->log_handler(self->log_object, severity, buf);
+    else if (vasprintf(&msg, fmt, ap) >= 0) {
       self->log_handler(self->log_object, severity, msg);
       free(msg);
     }
@@ -80,67 +206,195 @@ cmdserv_log(cmdserv* self, enum cmdserv_logseverity severity,
 char *cmdserv_server_status(cmdserv* self,
                             const char* lt,
                             unsigned long long int mark_conn) {
-  char *client_info = NULL;
-  char *idle = NULL;
-  char *str = strdup("");
-  char *tmp; /* Keep pointer around for free() */
+  char *str = NULL;
+  size_t len = 0;
+  FILE *out;
+  char uptime[CMDSERV_DURATION_STR_MAX];
+  char connected[CMDSERV_DURATION_STR_MAX];
+  char idle[CMDSERV_DURATION_STR_MAX];
+  char client_info[CMDSERV_CLIENT_STR_MAX];
 
-  if (str == NULL)
+  if ((out = open_memstream(&str, &len)) == NULL)
     return NULL;
 
-  tmp = str;
-  if (asprintf(&str,
-               "=======================================================================================%s"
-               "SERVER STATUS%s"
-               "=======================================================================================%s"
-               "server uptime:       %s%s"
-               "connections handled: %llu%s"
-               "connections/sec:     %.2f%s"
-               "listener fd:         #%d%s"
-               "=======================================================================================%s"
-               "slot  connection fd    connected     idle          client%s"
-               "===== ========== ===== ============= ============= ====================================%s",
-               lt, lt, lt,
-               cmdserv_duration_str(self->time_start, time(NULL)), lt,
-               self->conns, lt,
-               (double)self->conns / (double)(time(NULL) + 1 - self->time_start), lt,
-               self->listener, lt,
-               lt, lt, lt)
-      == -1) {
-    free(tmp);
+  fprintf(out,
+          "=======================================================================================%s"
+          "SERVER STATUS%s"
+          "=======================================================================================%s"
+          "server uptime:       %s%s"
+          "connections handled: %llu%s"
+          "connections/sec:     %.2f%s"
+          "listener fds:        ",
+          lt, lt, lt,
+          cmdserv_duration_str_r(self->time_start, time(NULL),
+                                 uptime, sizeof(uptime)), lt,
+          self->conns, lt,
+          (double)self->conns / (double)(time(NULL) + 1 - self->time_start), lt);
+
+  for (int i = 0; i < self->listeners_count; i++)
+    fprintf(out, "%s#%d", i > 0 ? " " : "", self->listeners[i].fd);
+
+  fprintf(out,
+          "%s"
+          "=======================================================================================%s"
+          "slot  connection fd    connected     idle          client%s"
+          "===== ========== ===== ============= ============= ====================================%s",
+          lt, lt, lt, lt);
+
+  for (int slot_id = 0; slot_id < self->connections_max; slot_id++) {
+    cmdserv_connection *conn = self->conn[slot_id];
+
+    if (conn == NULL)
+      continue;
+
+    fprintf(out,
+            "%s% 4d #%-9llu #%-4d %13s %13s %s%s",
+            cmdserv_connection_id(conn) == mark_conn ? "*" : " ",
+            slot_id + 1,
+            cmdserv_connection_id(conn),
+            cmdserv_connection_fd(conn),
+            cmdserv_duration_str_r(0, cmdserv_connection_time_connected(conn),
+                                   connected, sizeof(connected)),
+            cmdserv_duration_str_r(0, cmdserv_connection_time_idle(conn),
+                                   idle, sizeof(idle)),
+            cmdserv_connection_client_r(conn, client_info,
+                                        sizeof(client_info)),
+            lt);
+  }
+
+  if (fclose(out) != 0) {
+    free(str);
     return NULL;
   }
-  free(tmp);
+
+  return str;
+}
+
+cmdserv_latency *cmdserv_server_latency(cmdserv* self) {
+  return self->connection_config.latency;
+}
+
+/**
+ * Write s as a Prometheus label value (without the quotes).
+ */
+static void cmdserv_metrics_label(FILE *out, const char *s) {
+  for (; *s != '\0'; s++) {
+    if (*s == '\\' || *s == '"')
+      fprintf(out, "\\%c", *s);
+    else if (*s == '\n')
+      fputs("\\n", out);
+    else
+      fputc(*s, out);
+  }
+}
+
+char *cmdserv_server_metrics(cmdserv* self) {
+  char *str = NULL;
+  size_t len = 0;
+  FILE *out;
+  unsigned int active = 0;
+  size_t buffers = 0;
+  unsigned long long int commands = self->commands_closed;
+  unsigned long long int grown    = self->grown_closed;
+  unsigned long long int shrunk   = self->shrunk_closed;
+
+  if ((out = open_memstream(&str, &len)) == NULL)
+    return NULL;
 
   for (int slot_id = 0; slot_id < self->connections_max; slot_id++) {
     if (self->conn[slot_id] == NULL)
       continue;
+    active++;
+    buffers  += cmdserv_connection_buffer_size(self->conn[slot_id]);
+    commands += cmdserv_connection_commands(self->conn[slot_id]);
+    grown    += cmdserv_connection_readbuf_grown(self->conn[slot_id]);
+    shrunk   += cmdserv_connection_readbuf_shrunk(self->conn[slot_id]);
+  }
 
-    client_info = cmdserv_connection_client(self->conn[slot_id]);
-    idle = strdup(cmdserv_duration_str(0,
-        cmdserv_connection_time_idle(self->conn[slot_id])));
-    tmp = str;
-    if (asprintf(&str,
-                 "%s%s% 4d #%-9llu #%-4d %13s %13s %s%s",
-                 str,
-                 (cmdserv_connection_id(self->conn[slot_id]) == mark_conn
-                  ? "*" : " "),
-                 slot_id + 1,
-                 cmdserv_connection_id(self->conn[slot_id]),
-                 cmdserv_connection_fd(self->conn[slot_id]),
-                 cmdserv_duration_str(0, cmdserv_connection_time_connected(self->conn[slot_id])),
-                 idle,
-                 client_info,
-                 lt)
-        == -1) {
-      free(client_info);
-      free(idle);
-      free(tmp);
+  fprintf(out,
+          "# HELP cmdserv_uptime_seconds Time since the server was started.\n"
+          "# TYPE cmdserv_uptime_seconds gauge\n"
+          "cmdserv_uptime_seconds %lld\n"
+          "# HELP cmdserv_connections_total Connections accepted.\n"
+          "# TYPE cmdserv_connections_total counter\n"
+          "cmdserv_connections_total %llu\n"
+          "# HELP cmdserv_connections_active Connections currently open.\n"
+          "# TYPE cmdserv_connections_active gauge\n"
+          "cmdserv_connections_active %u\n"
+          "# HELP cmdserv_connections_max Maximum simultaneous connections.\n"
+          "# TYPE cmdserv_connections_max gauge\n"
+          "cmdserv_connections_max %d\n"
+          "# HELP cmdserv_connections_closed_total Connections closed by reason.\n"
+          "# TYPE cmdserv_connections_closed_total counter\n",
+          (long long int)(time(NULL) - self->time_start),
+          self->conns,
+          active,
+          self->connections_max);
+
+  for (size_t i = 0; i < CMDSERV_CLOSE_REASONS; i++)
+    fprintf(out, "cmdserv_connections_closed_total{reason=\"%s\"} %llu\n",
+            cmdserv_close_reasons[i].name, self->closes[i]);
+
+  fprintf(out,
+          "# HELP cmdserv_buffer_bytes Buffer memory of open connections.\n"
+          "# TYPE cmdserv_buffer_bytes gauge\n"
+          "cmdserv_buffer_bytes %zu\n"
+          "# HELP cmdserv_commands_total Command lines handled.\n"
+          "# TYPE cmdserv_commands_total counter\n"
+          "cmdserv_commands_total %llu\n"
+          "# HELP cmdserv_readbuf_resizes_total Read buffers grown and shrunk.\n"
+          "# TYPE cmdserv_readbuf_resizes_total counter\n"
+          "cmdserv_readbuf_resizes_total{direction=\"grow\"} %llu\n"
+          "cmdserv_readbuf_resizes_total{direction=\"shrink\"} %llu\n",
+          buffers,
+          commands,
+          grown,
+          shrunk);
+
+  if (self->connection_config.latency) {
+    cmdserv_latency *latency = self->connection_config.latency;
+    struct cmdserv_latency_stats *stats;
+    unsigned int n;
+
+    if ((stats = malloc(cmdserv_latency_stats_max(latency)
+                        * sizeof(struct cmdserv_latency_stats))) == NULL) {
+      fclose(out);
+      free(str);
       return NULL;
     }
-    free(client_info);
-    free(idle);
-    free(tmp);
+    n = cmdserv_latency_stats(latency, stats,
+                              cmdserv_latency_stats_max(latency));
+
+    fputs("# HELP cmdserv_command_latency_seconds Command latency by command.\n"
+          "# TYPE cmdserv_command_latency_seconds summary\n", out);
+
+    for (unsigned int i = 0; i < n; i++) {
+      fputs("cmdserv_command_latency_seconds{command=\"", out);
+      cmdserv_metrics_label(out, stats[i].command);
+      fprintf(out, "\",quantile=\"0.5\"} %.9f\n", stats[i].p50 / 1e9);
+      fputs("cmdserv_command_latency_seconds{command=\"", out);
+      cmdserv_metrics_label(out, stats[i].command);
+      fprintf(out, "\",quantile=\"0.99\"} %.9f\n", stats[i].p99 / 1e9);
+      fputs("cmdserv_command_latency_seconds{command=\"", out);
+      cmdserv_metrics_label(out, stats[i].command);
+      fprintf(out, "\",quantile=\"0.999\"} %.9f\n", stats[i].p999 / 1e9);
+      fputs("cmdserv_command_latency_seconds{command=\"", out);
+      cmdserv_metrics_label(out, stats[i].command);
+      fprintf(out, "\",quantile=\"1\"} %.9f\n", stats[i].max / 1e9);
+      fputs("cmdserv_command_latency_seconds_sum{command=\"", out);
+      cmdserv_metrics_label(out, stats[i].command);
+      fprintf(out, "\"} %.9f\n", stats[i].sum / 1e9);
+      fputs("cmdserv_command_latency_seconds_count{command=\"", out);
+      cmdserv_metrics_label(out, stats[i].command);
+      fprintf(out, "\"} %llu\n", stats[i].count);
+    }
+
+    free(stats);
+  }
+
+  if (fclose(out) != 0) {
+    free(str);
+    return NULL;
   }
 
   return str;
@@ -161,6 +415,24 @@ void cmdserv_shutdown(cmdserv* self) {
     }
   }
 
+  for (int i = 0; i < CMDSERV_METRICS_CLIENTS_MAX; i++)
+    cmdserv_metrics_close(&self->metrics[i]);
+
+  if (self->metrics_listener != -1)
+    close(self->metrics_listener);
+  for (int i = 0; i < self->listeners_count; i++) {
+    if (self->listeners[i].udp != NULL)
+      cmdserv_udp_free(self->listeners[i].udp, CMDSERV_SERVER_SHUTDOWN);
+    else
+      close(self->listeners[i].fd);
+    if (self->listeners[i].path != NULL) {
+      unlink(self->listeners[i].path);
+      free(self->listeners[i].path);
+    }
+  }
+
+  cmdserv_latency_free(self->latency);
+
   cmdserv_log(self, CMDSERV_INFO, "server shutdown reached");
   free(self);
 }
@@ -170,12 +442,6 @@ cmdserv* cmdserv_start(struct cmdserv_config config) {
   cmdserv* self;
   int saverrno = 0;
 
-  struct sockaddr_in6 servaddr = {
-    .sin6_family = AF_INET6,
-    .sin6_addr   = IN6ADDR_ANY_INIT,
-    .sin6_port   = htons(config.port)
-  };
-
   if ((self = malloc(sizeof(struct cmdserv)
                      + (sizeof(cmdserv_connection*)
                         * config.connections_max)))
@@ -185,14 +451,20 @@ cmdserv* cmdserv_start(struct cmdserv_config config) {
   }
 
   *self = (struct cmdserv){
-    .listener          = -1,
+    .listeners_count   = 0,
     .fdmax             = 0,
     .conns             = 0,
     .time_start        = time(NULL),
+    .latency           = NULL,
+    .commands_closed   = 0,
+    .grown_closed      = 0,
+    .shrunk_closed     = 0,
+    .metrics_listener  = -1,
     .log_handler       = config.log_handler,
     .log_object        = config.log_object,
     .connections_max   = config.connections_max,
-    .connection_config = config.connection_config
+    .connection_config = config.connection_config,
+    .udp_reply         = config.udp_reply
   };
 
   /*
@@ -209,23 +481,348 @@ cmdserv* cmdserv_start(struct cmdserv_config config) {
 
   for (int slot_id = 0; slot_id < self->connections_max; slot_id++)
     self->conn[slot_id] = NULL;
+  for (int i = 0; i < CMDSERV_METRICS_CLIENTS_MAX; i++)
+    self->metrics[i] = (struct cmdserv_metrics_client){ .fd = -1 };
   FD_ZERO(&self->fds);
 
-  if ((self->listener = socket(AF_INET6, SOCK_STREAM, 0)) == -1) {
+#ifdef INTERCEPT
+  if (intercept_configure(getenv(INTERCEPT_ENV)) == -1)
+    cmdserv_log(self, CMDSERV_WARNING,
+                "invalid %s ignored: %s", INTERCEPT_ENV, getenv(INTERCEPT_ENV));
+#endif
+
+  if (config.latency_commands_max > 0) {
+    if ((self->latency = cmdserv_latency_create(config.latency_commands_max))
+        == NULL) {
+      saverrno = errno;
+      cmdserv_log(self, CMDSERV_ERR,
+                  "cmdserv_latency_create() error: %s", strerror(saverrno));
+      goto CMDSERV_ABORT;
+    }
+    self->connection_config.latency = self->latency;
+  }
+
+  if (config.listen[0] == NULL) {
+    if ((self->listeners[0].fd = cmdserv_listen_tcp(self,
+                                                    config.port,
+                                                    config.connections_backlog))
+        == -1) {
+      saverrno = errno;
+      goto CMDSERV_ABORT;
+    }
+    self->listeners[0].path = NULL;
+    self->listeners[0].udp  = NULL;
+    self->listeners_count   = 1;
+
+    cmdserv_log(self, CMDSERV_INFO,
+                "server ready for connections on port %u",
+                config.port);
+  }
+
+  for (int i = 0; i < CMDSERV_LISTEN_MAX && config.listen[i] != NULL; i++) {
+    if (cmdserv_listen_endpoint(self,
+                                config.listen[i],
+                                config.connections_backlog,
+                                &self->listeners[self->listeners_count])
+        == -1) {
+      saverrno = errno;
+      goto CMDSERV_ABORT;
+    }
+    self->listeners_count++;
+
+    cmdserv_log(self, CMDSERV_INFO,
+                "server ready for connections on %s",
+                config.listen[i]);
+  }
+
+  for (int i = 0; i < self->listeners_count; i++)
+    FD_SET(self->listeners[i].fd, &self->fds);
+
+  if (config.metrics_port > 0) {
+    if ((self->metrics_listener = cmdserv_listen_tcp(self,
+                                                     config.metrics_port,
+                                                     CMDSERV_METRICS_CLIENTS_MAX))
+        == -1) {
+      saverrno = errno;
+      goto CMDSERV_ABORT;
+    }
+
+    cmdserv_log(self, CMDSERV_INFO,
+                "metrics ready for scraping on port %u",
+                config.metrics_port);
+  }
+
+  return self;
+
+ CMDSERV_ABORT:
+  cmdserv_shutdown(self);
+  errno = saverrno;
+  return NULL;
+}
+
+
+/**
+ * Private method to open a non-blocking TCP listener on all
+ * addresses.
+ *
+ * Returns the listening socket or -1 with errno set on failure.
+ */
+static int cmdserv_listen_tcp(cmdserv* self,
+                              unsigned int port,
+                              unsigned int backlog) {
+  struct sockaddr_in6 servaddr = {
+    .sin6_family = AF_INET6,
+    .sin6_addr   = IN6ADDR_ANY_INIT,
+    .sin6_port   = htons(port)
+  };
+
+  return cmdserv_listen_addr(self,
+                             (struct sockaddr *)&servaddr, sizeof(servaddr),
+                             SOCK_STREAM, backlog);
+}
+
+
+/**
+ * Private method to open a non-blocking listener on one of the
+ * endpoints described in cmdserv_config::listen.
+ *
+ * Returns 0 and fills in listener or returns -1 with errno set on
+ * failure.
+ */
+static int cmdserv_listen_endpoint(cmdserv* self,
+                                   const char *endpoint,
+                                   unsigned int backlog,
+                                   struct cmdserv_listener *listener) {
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  char host[INET6_ADDRSTRLEN + 1];
+  const char *port;
+  bool udp = false;
+
+  *listener = (struct cmdserv_listener){ .fd = -1, .path = NULL,
+                                         .udp = NULL };
+
+  for (;;) {
+    if (strncmp(endpoint, "shm:", 4) == 0) {
+      endpoint += 4;
+      listener->shm = true;
+    } else if (strncmp(endpoint, "binary:", 7) == 0) {
+      endpoint += 7;
+      listener->binary = true;
+    } else if (strncmp(endpoint, "resp:", 5) == 0) {
+      endpoint += 5;
+      listener->resp = true;
+    } else if (strncmp(endpoint, "udp:", 4) == 0) {
+      endpoint += 4;
+      udp = true;
+    } else {
+      break;
+    }
+  }
+
+  if (listener->shm && strchr(endpoint, '/') == NULL && endpoint[0] != '@') {
+    cmdserv_log(self, CMDSERV_ERR,
+                "shm endpoint must be a Unix socket: %s", endpoint);
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (udp && (listener->shm || listener->binary || listener->resp)) {
+    cmdserv_log(self, CMDSERV_ERR,
+                "udp endpoint takes command lines only: %s", endpoint);
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (strchr(endpoint, '/') != NULL || endpoint[0] == '@') {
+    struct sockaddr_un *unaddr = (struct sockaddr_un *)&addr;
+    size_t len = strlen(endpoint);
+    struct stat st;
+
+    if (len >= sizeof(unaddr->sun_path)) {
+      cmdserv_log(self, CMDSERV_ERR,
+                  "Unix socket path too long: %s", endpoint);
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+
+    *unaddr = (struct sockaddr_un){ .sun_family = AF_UNIX };
+    memcpy(unaddr->sun_path, endpoint, len);
+    addrlen = offsetof(struct sockaddr_un, sun_path) + len;
+
+    if (endpoint[0] == '@') {
+      unaddr->sun_path[0] = '\0'; /* Linux abstract namespace */
+    } else {
+      addrlen++;
+      if (lstat(endpoint, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (!cmdserv_unix_socket_stale(unaddr, addrlen)) {
+          cmdserv_log(self, CMDSERV_ERR,
+                      "Unix socket in use: %s", endpoint);
+          errno = EADDRINUSE;
+          return -1;
+        }
+        unlink(endpoint);   /* Stale socket from an earlier run */
+      }
+      if ((listener->path = strdup(endpoint)) == NULL)
+        return -1;
+    }
+
+  } else {
+    struct addrinfo *ai;
+    const char *colon = strrchr(endpoint, ':');
+    size_t hostlen;
+    int gai_status;
+
+    if (colon == NULL) {
+      host[0] = '\0';
+      port    = endpoint;
+    } else {
+      const char *start = endpoint;
+
+      if (endpoint[0] == '[' && colon > endpoint + 1 && colon[-1] == ']') {
+        start++;
+        hostlen = colon - endpoint - 2;
+      } else {
+        hostlen = colon - endpoint;
+      }
+      if (hostlen >= sizeof(host)) {
+        cmdserv_log(self, CMDSERV_ERR, "invalid endpoint: %s", endpoint);
+        errno = EINVAL;
+        return -1;
+      }
+      memcpy(host, start, hostlen);
+      host[hostlen] = '\0';
+      port = colon + 1;
+    }
+
+    if (host[0] == '\0' || strcmp(host, "*") == 0) {
+      char *end;
+      unsigned long portnum = strtoul(port, &end, 10);
+
+      if (*port == '\0' || *end != '\0' || portnum > 65535) {
+        cmdserv_log(self, CMDSERV_ERR, "invalid port in endpoint: %s", port);
+        errno = EINVAL;
+        return -1;
+      }
+      if (!udp)
+        return (listener->fd = cmdserv_listen_tcp(self, portnum, backlog))
+          == -1 ? -1 : 0;
+
+      *(struct sockaddr_in6 *)&addr = (struct sockaddr_in6){
+        .sin6_family = AF_INET6,
+        .sin6_addr   = IN6ADDR_ANY_INIT,
+        .sin6_port   = htons(portnum)
+      };
+      addrlen = sizeof(struct sockaddr_in6);
+
+    } else {
+      if ((gai_status = getaddrinfo(host, port,
+                                    &(struct addrinfo){
+                                      .ai_family   = AF_UNSPEC,
+                                      .ai_socktype = udp ? SOCK_DGRAM
+                                                         : SOCK_STREAM,
+                                      .ai_flags    = AI_PASSIVE
+                                                     | AI_NUMERICHOST
+                                                     | AI_NUMERICSERV
+                                    },
+                                    &ai)) != 0) {
+        cmdserv_log(self, CMDSERV_ERR, "invalid endpoint %s:%s: %s",
+                    host, port, gai_strerror(gai_status));
+        errno = EINVAL;
+        return -1;
+      }
+
+      memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+      addrlen = ai->ai_addrlen;
+      freeaddrinfo(ai);
+    }
+  }
+
+  if ((listener->fd = cmdserv_listen_addr(self,
+                                          (struct sockaddr *)&addr, addrlen,
+                                          udp ? SOCK_DGRAM : SOCK_STREAM,
+                                          backlog))
+      == -1)
+    goto CMDSERV_LISTEN_ENDPOINT_ABORT;
+
+  if (udp
+      && (listener->udp = cmdserv_udp_create(listener->fd, ++self->conns,
+                                             &self->connection_config,
+                                             self->udp_reply))
+      == NULL) {
+    cmdserv_log(self, CMDSERV_ERR,
+                "cmdserv_udp_create() error: %s", strerror(errno));
+    goto CMDSERV_LISTEN_ENDPOINT_ABORT;
+  }
+
+  return 0;
+
+ CMDSERV_LISTEN_ENDPOINT_ABORT:
+  {
+    int saverrno = errno;
+    if (listener->fd != -1)
+      close(listener->fd);
+    listener->fd = -1;
+    free(listener->path);
+    listener->path = NULL;
+    errno = saverrno;
+  }
+  return -1;
+}
+
+
+/**
+ * Private method to find out whether the Unix socket at addr is
+ * left over from an earlier run: Nobody accepts connections on it
+ * anymore.  Anything else than a refused connection (including a
+ * full backlog or no permission to connect) means it's still in use.
+ */
+static bool cmdserv_unix_socket_stale(const struct sockaddr_un *addr,
+                                      socklen_t addrlen) {
+  bool stale;
+  int probe;
+
+  if ((probe = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    return false;
+
+  /* Don't wait for a server that's too busy to accept */
+  stale = fcntl(probe, F_SETFL, O_NONBLOCK) != -1
+    && connect(probe, (const struct sockaddr *)addr, addrlen) == -1
+    && errno == ECONNREFUSED;
+
+  close(probe);
+  return stale;
+}
+
+
+/**
+ * Private method to open a non-blocking listener on a socket address
+ * of any family, of type SOCK_STREAM or (bound only) SOCK_DGRAM.
+ *
+ * Returns the listening socket or -1 with errno set on failure.
+ */
+static int cmdserv_listen_addr(cmdserv* self,
+                               const struct sockaddr *addr,
+                               socklen_t addrlen,
+                               int type,
+                               unsigned int backlog) {
+  int listener;
+  int saverrno;
+
+  if ((listener = socket(addr->sa_family, type, 0)) == -1) {
     saverrno = errno;
     cmdserv_log(self, CMDSERV_ERR, "socket() error: %s", strerror(saverrno));
-    goto CMDSERV_ABORT;
+    errno = saverrno;
+    return -1;
   }
 
-  FD_SET(self->listener, &self->fds);
-  self->fdmax = self->listener;
-
-  if (setsockopt(self->listener, SOL_SOCKET,
-                 SO_REUSEADDR, &(int){1}, sizeof(int))
+  if (addr->sa_family != AF_UNIX
+      && setsockopt(listener, SOL_SOCKET,
+                    SO_REUSEADDR, &(int){1}, sizeof(int))
       == -1) {
     saverrno = errno;
     cmdserv_log(self, CMDSERV_ERR, "setsockopt() error: %s", strerror(saverrno));
-    goto CMDSERV_ABORT;
+    goto CMDSERV_LISTEN_ABORT;
   }
 
   /*
@@ -242,43 +839,43 @@ cmdserv* cmdserv_start(struct cmdserv_config config) {
    *     O_NONBLOCK flag set (see socket(7)).
    */
   {
-    int fdflags = fcntl(self->listener, F_GETFL, 0);
+    int fdflags = fcntl(listener, F_GETFL, 0);
     if (fdflags == -1
-        || fcntl(self->listener, F_SETFL, fdflags | O_NONBLOCK) == -1) {
+        || fcntl(listener, F_SETFL, fdflags | O_NONBLOCK) == -1) {
       saverrno = errno;
       cmdserv_log(self, CMDSERV_ERR, "fcntl() error: %s", strerror(saverrno));
-      goto CMDSERV_ABORT;
+      goto CMDSERV_LISTEN_ABORT;
     }
   }
 
-  if (bind(self->listener,
-           (struct sockaddr *)&servaddr, sizeof(servaddr))
+  if (bind(listener, addr, addrlen)
       == -1) {
     saverrno = errno;
     cmdserv_log(self, CMDSERV_ERR, "bind() error: %s", strerror(saverrno));
-    goto CMDSERV_ABORT;
+    goto CMDSERV_LISTEN_ABORT;
   }
 
-  if (listen(self->listener, config.connections_backlog)
+  if (type == SOCK_STREAM
+      && listen(listener, backlog)
       == -1) {
     saverrno = errno;
     cmdserv_log(self, CMDSERV_ERR, "listen() error: %s", strerror(saverrno));
-    goto CMDSERV_ABORT;
+    goto CMDSERV_LISTEN_ABORT;
   }
 
-  cmdserv_log(self, CMDSERV_INFO,
-              "server ready for connections on port %u",
-              config.port);
+  if (listener > self->fdmax)
+    self->fdmax = listener;
 
-  return self;
+  return listener;
 
- CMDSERV_ABORT:
-  cmdserv_shutdown(self);
+ CMDSERV_LISTEN_ABORT:
+  close(listener);
   errno = saverrno;
-  return NULL;
+  return -1;
 }
 
 
+
 void cmdserv_close_handler(void *object,
                            cmdserv_connection* connection,
                            enum cmdserv_close_reason reason) {
@@ -289,11 +886,22 @@ void cmdserv_close_handler(void *object,
   if (self->close_handler_orig)
     self->close_handler_orig(self->close_object_orig, connection, reason);
 
+  {
+    size_t i = 0;
+    while (i < CMDSERV_CLOSE_REASONS - 1
+           && cmdserv_close_reasons[i].reason != reason)
+      i++;
+    self->closes[i]++;
+  }
+  self->commands_closed += cmdserv_connection_commands(connection);
+  self->grown_closed    += cmdserv_connection_readbuf_grown(connection);
+  self->shrunk_closed   += cmdserv_connection_readbuf_shrunk(connection);
+
   /*
    * Remove connection, but skip for those that have never been added
    * to a slot/the FD list (e.g. on too many connections)
    */
-  if (FD_ISSET(fd, &self->fds)) {
+  if (fd >= 0 && fd < FD_SETSIZE && FD_ISSET(fd, &self->fds)) {
     FD_CLR(fd, &self->fds);
     self->conn[cmdserv_get_slot_id_from_fd(self, fd)] = NULL;
   }
@@ -303,20 +911,36 @@ void cmdserv_close_handler(void *object,
 /**
  * Private method to handle a new incoming connection.
  */
-static void cmdserv_accept(cmdserv* self) {
+static void cmdserv_accept(cmdserv* self,
+                           struct cmdserv_listener *listener) {
+  struct cmdserv_connection_config config = self->connection_config;
   int slot_id;
   struct cmdserv_connection* new_conn;
 
+  if (listener->binary)
+    config.framing = CMDSERV_FRAMING_BINARY;
+  else if (listener->resp)
+    config.framing = CMDSERV_FRAMING_RESP;
+
   self->conns++;
   slot_id = cmdserv_get_free_slot(self);
 
-  if ((new_conn = cmdserv_connection_create(self->listener,
-                                            self->conns,
-                                            &self->connection_config,
-                                            slot_id == -1
-                                            ? CMDSERV_SERVER_TOO_MANY_CONNECTIONS
-                                            : CMDSERV_NO_CLOSE))
-      == NULL) {
+  if (listener->shm)
+    new_conn = cmdserv_connection_create_shm(listener->fd,
+                                             self->conns,
+                                             &config,
+                                             slot_id == -1
+                                             ? CMDSERV_SERVER_TOO_MANY_CONNECTIONS
+                                             : CMDSERV_NO_CLOSE);
+  else
+    new_conn = cmdserv_connection_create(listener->fd,
+                                         self->conns,
+                                         &config,
+                                         slot_id == -1
+                                         ? CMDSERV_SERVER_TOO_MANY_CONNECTIONS
+                                         : CMDSERV_NO_CLOSE);
+
+  if (new_conn == NULL) {
     cmdserv_log(self, CMDSERV_ERR,
                 "cmdserv_connection_create(#%llu) failed: %s",
                 self->conns,
@@ -332,6 +956,15 @@ static void cmdserv_accept(cmdserv* self) {
     return;
   }
 
+  /* select() can't watch file descriptors beyond FD_SETSIZE */
+  if (cmdserv_connection_fd(new_conn) >= FD_SETSIZE) {
+    cmdserv_log(self, CMDSERV_WARNING,
+                "#%d beyond FD_SETSIZE (%d), turning #%llu away",
+                cmdserv_connection_fd(new_conn), FD_SETSIZE, self->conns);
+    cmdserv_connection_close(new_conn, CMDSERV_SERVER_TOO_MANY_CONNECTIONS);
+    return;
+  }
+
   self->conn[slot_id] = new_conn;
   FD_SET(cmdserv_connection_fd(self->conn[slot_id]), &self->fds);
 
@@ -352,6 +985,14 @@ static int cmdserv_get_slot_id_from_fd(cmdserv* self, int fd) {
   return -1;
 }
 
+static struct cmdserv_listener *cmdserv_listener_from_fd(cmdserv* self,
+                                                         int fd) {
+  for (int i = 0; i < self->listeners_count; i++)
+    if (self->listeners[i].fd == fd)
+      return &self->listeners[i];
+  return NULL;
+}
+
 static int cmdserv_get_free_slot(cmdserv* self) {
   for (int slot_id = 0; slot_id < self->connections_max; slot_id++)
     if (self->conn[slot_id] == NULL) 
@@ -360,16 +1001,187 @@ static int cmdserv_get_free_slot(cmdserv* self) {
 }
 
 
+/**
+ * Private method to accept a new client on the metrics listener.
+ */
+static void cmdserv_metrics_accept(cmdserv* self) {
+  struct cmdserv_metrics_client* client = NULL;
+  int fd;
+
+  if ((fd = accept(self->metrics_listener, NULL, NULL)) == -1) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      cmdserv_log(self, CMDSERV_ERR,
+                  "metrics accept() error: %s", strerror(errno));
+    return;
+  }
+
+  if (fd >= FD_SETSIZE) {
+    cmdserv_log(self, CMDSERV_WARNING,
+                "metrics client #%d beyond FD_SETSIZE (%d), turning it away",
+                fd, FD_SETSIZE);
+    close(fd);
+    return;
+  }
+
+  for (int i = 0; i < CMDSERV_METRICS_CLIENTS_MAX && client == NULL; i++)
+    if (self->metrics[i].fd == -1)
+      client = &self->metrics[i];
+
+  if (client == NULL) {
+    cmdserv_log(self, CMDSERV_WARNING,
+                "too many metrics clients, turning one away");
+    close(fd);
+    return;
+  }
+
+  {
+    int fdflags = fcntl(fd, F_GETFL, 0);
+    if (fdflags == -1
+        || fcntl(fd, F_SETFL, fdflags | O_NONBLOCK) == -1) {
+      cmdserv_log(self, CMDSERV_ERR,
+                  "metrics fcntl() error: %s", strerror(errno));
+      close(fd);
+      return;
+    }
+  }
+
+  *client = (struct cmdserv_metrics_client){
+    .fd          = fd,
+    .time_accept = time(NULL),
+    .reqlen      = 0,
+    .resp        = NULL
+  };
+
+  if (fd > self->fdmax)
+    self->fdmax = fd;
+}
+
+static struct cmdserv_metrics_client
+*cmdserv_metrics_client_from_fd(cmdserv* self, int fd) {
+  for (int i = 0; i < CMDSERV_METRICS_CLIENTS_MAX; i++)
+    if (self->metrics[i].fd == fd)
+      return &self->metrics[i];
+  return NULL;
+}
+
+/**
+ * Private method to read (more of) an HTTP request from a metrics
+ * client.  Once the request header is complete, the response is
+ * rendered and we start sending it.
+ */
+static void cmdserv_metrics_read(cmdserv* self,
+                                 struct cmdserv_metrics_client* client) {
+  const char *status = "200 OK";
+  char *body = NULL;
+  ssize_t received;
+  int len;
+
+  received = recv(client->fd,
+                  client->req + client->reqlen,
+                  CMDSERV_METRICS_REQUEST_MAX - client->reqlen,
+                  0);
+
+  if (received == -1
+      && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return;
+
+  if (received <= 0) {
+    cmdserv_metrics_close(client);
+    return;
+  }
+
+  client->reqlen += received;
+  client->req[client->reqlen] = '\0';
+
+  if (strstr(client->req, "\r\n\r\n") == NULL
+      && strstr(client->req, "\n\n") == NULL) {
+    if (client->reqlen < CMDSERV_METRICS_REQUEST_MAX)
+      return;
+    status = "431 Request Header Fields Too Large";
+  } else if (strncmp(client->req, "GET ", 4) != 0) {
+    status = "405 Method Not Allowed";
+  } else if (strncmp(client->req + 4, "/metrics", 8) != 0
+             || (client->req[12] != ' ' && client->req[12] != '?')) {
+    status = "404 Not Found";
+  } else if ((body = cmdserv_server_metrics(self)) == NULL) {
+    cmdserv_log(self, CMDSERV_ERR,
+                "cmdserv_server_metrics() error: %s", strerror(errno));
+    status = "500 Internal Server Error";
+  }
+
+  len = asprintf(&client->resp,
+                 "HTTP/1.0 %s\r\n"
+                 "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                 "Content-Length: %zu\r\n"
+                 "Connection: close\r\n"
+                 "\r\n"
+                 "%s%s",
+                 status,
+                 body ? strlen(body) : strlen(status) + 1,
+                 body ? body : status,
+                 body ? "" : "\n");
+  free(body);
+
+  if (len == -1) {
+    client->resp = NULL;
+    cmdserv_metrics_close(client);
+    return;
+  }
+
+  client->resplen  = len;
+  client->respsent = 0;
+
+  cmdserv_metrics_write(self, client);
+}
+
+/**
+ * Private method to send (more of) the response to a metrics client
+ * without blocking.  The client is closed once everything is sent.
+ */
+static void cmdserv_metrics_write(cmdserv* self,
+                                  struct cmdserv_metrics_client* client) {
+  ssize_t sent = send(client->fd,
+                      client->resp + client->respsent,
+                      client->resplen - client->respsent,
+                      MSG_NOSIGNAL | MSG_DONTWAIT);
+
+  (void)self; /* UNUSED */
+
+  if (sent == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return;
+    cmdserv_metrics_close(client);
+    return;
+  }
+
+  client->respsent += sent;
+
+  if (client->respsent == client->resplen)
+    cmdserv_metrics_close(client);
+}
+
+static void cmdserv_metrics_close(struct cmdserv_metrics_client* client) {
+  if (client->fd != -1)
+    close(client->fd);
+  free(client->resp);
+  *client = (struct cmdserv_metrics_client){ .fd = -1 };
+}
+
+
 void cmdserv_sleep(cmdserv* self, struct timeval *timeout) {
   /* Some implementations of select() change the timeout parameter to
      reflect the time actually slept. So we need a copy. Also the file
      descriptor sets can become undefined on errors in select(), so
      also a copy there... */
   struct timeval timeout_copy = *timeout;
-  fd_set read_fds;
+  fd_set read_fds, write_fds;
+  struct cmdserv_listener* listener;
+  struct cmdserv_metrics_client* client;
 
   FD_ZERO(&read_fds);
-  FD_SET(self->listener, &read_fds);
+  FD_ZERO(&write_fds);
+  for (int i = 0; i < self->listeners_count; i++)
+    FD_SET(self->listeners[i].fd, &read_fds);
 
   for (int slot_id = 0; slot_id < self->connections_max; slot_id++) {
     if (self->conn[slot_id] != NULL) {
@@ -379,12 +1191,30 @@ void cmdserv_sleep(cmdserv* self, struct timeval *timeout) {
         cmdserv_connection_log(self->conn[slot_id], CMDSERV_INFO, "client timeout");
         cmdserv_connection_close(self->conn[slot_id], CMDSERV_CLIENT_TIMEOUT);
       } else {
-        FD_SET(cmdserv_connection_fd(self->conn[slot_id]), &read_fds);
+        /* No new commands until the client has taken our output */
+        FD_SET(cmdserv_connection_fd(self->conn[slot_id]),
+               cmdserv_connection_output_pending(self->conn[slot_id])
+               && !cmdserv_connection_room_readable(self->conn[slot_id])
+               ? &write_fds
+               : &read_fds);
       }
     }
   }
 
-  if (select(self->fdmax + 1, &read_fds, NULL, NULL, &timeout_copy)
+  if (self->metrics_listener != -1)
+    FD_SET(self->metrics_listener, &read_fds);
+
+  for (int i = 0; i < CMDSERV_METRICS_CLIENTS_MAX; i++) {
+    client = &self->metrics[i];
+    if (client->fd == -1)
+      continue;
+    if (time(NULL) - client->time_accept > CMDSERV_METRICS_TIMEOUT)
+      cmdserv_metrics_close(client);
+    else
+      FD_SET(client->fd, client->resp ? &write_fds : &read_fds);
+  }
+
+  if (select(self->fdmax + 1, &read_fds, &write_fds, NULL, &timeout_copy)
       == -1) {
     if (errno == EINTR)
       cmdserv_log(self, CMDSERV_DEBUG, "select() interrupted by signal");
@@ -395,10 +1225,23 @@ void cmdserv_sleep(cmdserv* self, struct timeval *timeout) {
 
   for (int fd = 0; fd <= self->fdmax; fd++) {
     if (FD_ISSET(fd, &read_fds)) {
-      if (fd == self->listener)
-        cmdserv_accept(self);
+      if ((listener = cmdserv_listener_from_fd(self, fd)) != NULL) {
+        if (listener->udp != NULL)
+          cmdserv_udp_read(listener->udp);
+        else
+          cmdserv_accept(self, listener);
+      }
+      else if (fd == self->metrics_listener)
+        cmdserv_metrics_accept(self);
+      else if ((client = cmdserv_metrics_client_from_fd(self, fd)) != NULL)
+        cmdserv_metrics_read(self, client);
       else
         cmdserv_connection_read(self->conn[cmdserv_get_slot_id_from_fd(self, fd)]);
+    } else if (FD_ISSET(fd, &write_fds)) {
+      if ((client = cmdserv_metrics_client_from_fd(self, fd)) != NULL)
+        cmdserv_metrics_write(self, client);
+      else
+        cmdserv_connection_flush(self->conn[cmdserv_get_slot_id_from_fd(self, fd)]);
     }
   }
 }
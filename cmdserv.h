@@ -50,6 +50,7 @@
 #include "cmdserv_config.h"
 #include "cmdserv_logger.h"
 #include "cmdserv_connection.h"
+#include "cmdserv_latency.h"
 
 
 /**
@@ -201,4 +202,54 @@ char *cmdserv_server_status(cmdserv* serv,
                             unsigned long long int mark_conn);
 
 
+/**
+ * Return the server metrics in the Prometheus text exposition format.
+ *
+ * The report contains the connection counters, connections closed
+ * per close reason, the buffer memory held by open connections, the
+ * number of commands handled, and (if latency recording is enabled)
+ * a summary of the command latencies per command.  This is what the
+ * metrics listener serves on GET /metrics, but it can be used to
+ * publish the metrics by other means, too.
+ *
+ * The string buffer is allocated by this method and must be free()'d
+ * by the caller after use.
+ *
+ * Returns NULL on failure and errno should be set by an underlying
+ * library in that case.
+ *
+ * @param serv
+ *
+ *     The cmdserv server object for which metrics should be
+ *     reported.
+ *
+ * @return Pointer to zero-terminated string (must be free()'d by the
+ *     user) or NULL in case of error.
+ *
+ * @see cmdserv_config::metrics_port
+ */
+char *cmdserv_server_metrics(cmdserv* serv);
+
+
+/**
+ * Retrieve the command latency histograms of this server.
+ *
+ * Use cmdserv_latency_stats() on the returned object to get the
+ * p50/p99/p999/max latencies per command, and
+ * cmdserv_latency_reset() to start over.  The object is owned by the
+ * server and must not be freed.
+ *
+ * @param serv
+ *
+ *     The cmdserv server object for which latency histograms should
+ *     be returned.
+ *
+ * @return The latency histograms or NULL if latency recording is
+ *     disabled.
+ *
+ * @see cmdserv_config::latency_commands_max
+ */
+cmdserv_latency *cmdserv_server_latency(cmdserv* serv);
+
+
 #endif /* CMDSERV_H */
@@ -7,8 +7,12 @@ struct cmdserv_config cmdserv_config_get_defaults() {
     .connections_max     = 16,
     .connections_backlog = 8,
     .port                = 50000,
+    .listen              = { NULL },
+    .udp_reply           = false,
     .log_handler         = &cmdserv_logger_stderr,
     .log_object          = NULL,
+    .latency_commands_max= 0,
+    .metrics_port        = 0,
     .connection_config   = cmdserv_connection_config_get_defaults()
   };
 }
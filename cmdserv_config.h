@@ -56,6 +56,11 @@
 #include "cmdserv_connection.h"
 #include "cmdserv_connection_config.h"
 
+/**
+ * The maximum number of endpoints in cmdserv_config::listen.
+ */
+#define CMDSERV_LISTEN_MAX 8
+
 
 /**
  * Start-up configuration for a cmdserv server.
@@ -84,9 +89,57 @@ struct cmdserv_config {
 
   /**
    * The TCP port number the server should listen on.
+   *
+   * Only used if no endpoints are given in listen.
    */
   unsigned int port;
 
+  /**
+   * The endpoints the server should listen on, all of them served by
+   * the same loop and sharing the same connections.  Unused entries
+   * are NULL.  If the first entry is NULL (the default), the server
+   * listens on port on all addresses.  An endpoint is one of:
+   *
+   *   - "PORT", "*:PORT": TCP on all IPv4 and IPv6 addresses
+   *   - "ADDRESS:PORT", "[IPV6-ADDRESS]:PORT": TCP on one numeric
+   *     address only, e.g. "127.0.0.1:50000" or "[::1]:50000"
+   *   - "/PATH", "./PATH" (anything with a slash): a Unix domain
+   *     socket in the file system.  A stale socket left at PATH is
+   *     replaced (one a server still accepts on is not: that fails
+   *     with EADDRINUSE), and the socket is removed again on
+   *     cmdserv_shutdown().
+   *   - "@NAME": a Unix domain socket in the Linux abstract
+   *     namespace
+   *   - "shm:/PATH", "shm:@NAME": a Unix domain socket as above, over
+   *     which clients are handed a pair of shared memory rings that
+   *     then carry all the commands and responses (Linux only, see
+   *     cmdserv_shm.h)
+   *   - "binary:" in front of any of the above (also together with
+   *     "shm:"): clients send binary frames instead of lines (see
+   *     CMDSERV_FRAMING_BINARY)
+   *   - "resp:" in front of any of the above: clients speak the
+   *     Redis protocol RESP2 (see CMDSERV_FRAMING_RESP), e.g.
+   *     "resp:127.0.0.1:6379" for Redis clients and benchmarks
+   *   - "udp:PORT", "udp:ADDRESS:PORT", "udp:/PATH", "udp:@NAME": a
+   *     datagram socket, every datagram carrying one or more command
+   *     lines (see cmdserv_udp.h and udp_reply)
+   *
+   * Local clients on the same host save the TCP/IP stack (and its
+   * latency) by connecting through a Unix domain socket, or save
+   * most of the system calls as well with shared memory.  Clients
+   * sending one-shot commands save connection setup and teardown
+   * altogether with UDP.
+   */
+  const char *listen[CMDSERV_LISTEN_MAX];
+
+  /**
+   * Whether commands arriving on "udp:" endpoints are answered: If
+   * set, everything a cmd_handler sends for a datagram is sent back
+   * to its sender as one datagram.  By default (false), the output is
+   * thrown away, for fire-and-forget commands.
+   */
+  bool udp_reply;
+
   /**
    * The callback the server will send log messages to.
    *
@@ -103,6 +156,31 @@ struct cmdserv_config {
    */
   void *log_object;
 
+  /**
+   * The number of distinct commands (by argv[0]) for which the
+   * server keeps latency histograms.
+   *
+   * If set, the server allocates the histograms on start-up and
+   * records the latency of every command handled on any of its
+   * connections.  Zero (the default) disables latency recording.
+   *
+   * @see cmdserv_server_latency() cmdserv_latency
+   */
+  unsigned int latency_commands_max;
+
+  /**
+   * The TCP port number for an optional metrics listener.
+   *
+   * If set, the server additionally answers plain HTTP "GET
+   * /metrics" requests on this port with cmdserv_server_metrics() in
+   * the Prometheus text exposition format.  The metrics clients are
+   * served from the same cmdserv_sleep() loop and never block it.
+   * Zero (the default) disables the metrics listener.
+   *
+   * @see cmdserv_server_metrics()
+   */
+  unsigned int metrics_port;
+
   /**
    * The configuration settings for an individual connection.
    *
@@ -115,9 +193,10 @@ struct cmdserv_config {
 /**
  * The default configuration for a cmdserv server.
  *
- * The current defaults are to listen on TCP port 50000 and handle a
- * maximum of 16 parallel connections (with a connection backlog of
- * 8). Logging will default to STDERR.
+ * The current defaults are to listen on TCP port 50000 (and no other
+ * endpoints) and handle a maximum of 16 parallel connections (with a
+ * connection backlog of 8). Logging will default to STDERR.  Latency recording and the
+ * metrics listener are disabled.
  *
  * All the handlers (except for the logging handler) and handler
  * objects are unset in the defaults.  You need to provide at least a
@@ -7,22 +7,70 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <float.h>
+#include <math.h>
 #include <netdb.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#endif
+
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#define CMDSERV_ZEROCOPY 1
+#else
+#define CMDSERV_ZEROCOPY 0
+#endif
+
+#ifndef CMDSERV_NO_ZLIB
+#include <zlib.h>
+#define CMDSERV_ZLIB 1
+#else
+#define CMDSERV_ZLIB 0
+/* Only to compile, compression can't be switched on without zlib */
+#define Z_NO_FLUSH   0
+#define Z_SYNC_FLUSH 2
+#define Z_FINISH     4
+#endif
+
 #include "intercept.h"
 #include "cmdserv_helpers.h"
 #include "cmdserv_connection.h"
 #include "cmdserv_connection_config.h"
+#include "cmdserv_shm.h"
+#include "cmdserv_transport.h"
+#include "cmdserv_trace.h"
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CMDSERV_USDT(probe, o, bytes)                                   \
+  DTRACE_PROBE2(cmdserv, probe, (o)->id, (bytes))
+#endif
+#endif
+
+#ifndef CMDSERV_USDT
+#define CMDSERV_USDT(probe, o, bytes) do { } while (0)
+#endif
+
+#if defined(__GNUC__)
+#define CMDSERV_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#else
+#define CMDSERV_UNLIKELY(x) (x)
+#endif
 
 
 #ifdef MSG_NOSIGNAL
@@ -54,6 +102,64 @@
 #define EOL(o) ((o)->lineterm == CMDSERV_LINETERM_LF ? "\n" : "\r\n")
 
 
+/**
+ * Room kept free in front of a RESP reply collected in respbuf, for
+ * the bulk string header ("$", up to 20 digits, CR LF).
+ */
+#define RESP_HEADER_MAX 24
+
+/**
+ * Maximum number of digits in a RESP array or bulk string length.
+ */
+#define RESP_DIGITS_MAX 18
+
+
+/**
+ * Minimum size of a queued block of output data, so that a burst of
+ * small writes to a client that isn't ready doesn't turn into as many
+ * allocations.
+ */
+#define OUTPUT_BLOCK_MIN 4096
+
+/**
+ * Size of the chunks read from a file for transfers without
+ * sendfile().
+ */
+#define OUTPUT_FILE_CHUNK 16384
+
+/**
+ * Initial size of the buffer for compressed output.
+ */
+#define DEFLATE_CHUNK 16384
+
+
+/**
+ * Initial size of the read buffer (unless readbuf_size is smaller):
+ * It only grows towards readbuf_size (or frame_max) while a command
+ * doesn't fit.
+ */
+#define READBUF_MIN 256
+
+/**
+ * Number of commands after which a grown read buffer is shrunk again
+ * if the input in the meantime would have fitted into a quarter of it.
+ */
+#define READBUF_SHRINK_COMMANDS 64
+
+
+/**
+ * Initial size of the buffer collecting the output of the append
+ * functions.
+ */
+#define APPEND_MIN 256
+
+/**
+ * Amount of appended output from which on it is sent right away
+ * rather than with the rest of the reply.
+ */
+#define APPEND_MAX 16384
+
+
 /**
  * Macro for use with snprintf()/vsnprintf() and the internal
  * cmdserv_connection writebuf.
@@ -83,6 +189,59 @@
   } while (0)
 
 
+/**
+ * Report a trace point of the cmdserv_connection object o to the USDT
+ * probe and the trace_handler (if any).
+ *
+ * The timestamp is only taken if there is a trace_handler, so with
+ * tracing disabled this costs a single, predictable branch.
+ *
+ * @see cmdserv_trace.h
+ */
+#define TRACE(o, point, probe, bytes) do {                              \
+    CMDSERV_USDT(probe, o, bytes);                                      \
+    if (CMDSERV_UNLIKELY((o)->trace_handler != NULL))                   \
+      (o)->trace_handler((o)->trace_object, (point), (o)->id,           \
+                         (size_t)(bytes), cmdserv_monotonic_ns());      \
+  } while (0)
+
+
+/**
+ * Worst case size of a line of length l escaped by capture_escape().
+ */
+#define CAPTURE_ESCAPED_MAX(l) (4 * (l))
+
+/**
+ * Escape a line for the capture file: Backslashes and all bytes
+ * outside of printable ASCII become \\ and \xHH respectively, so a
+ * record always fits on one line.
+ *
+ * @return The length of the escaped string in dst (not terminated).
+ */
+static size_t capture_escape(char *dst, const char *src, size_t len) {
+  static const char hex[] = "0123456789abcdef";
+  size_t d = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = (unsigned char)src[i];
+
+    if (c == '\\') {
+      dst[d++] = '\\';
+      dst[d++] = '\\';
+    } else if (c < 0x20 || c > 0x7e) {
+      dst[d++] = '\\';
+      dst[d++] = 'x';
+      dst[d++] = hex[c >> 4];
+      dst[d++] = hex[c & 0x0f];
+    } else {
+      dst[d++] = c;
+    }
+  }
+
+  return d;
+}
+
+
 /**
  * Special internal states of the connection object.
  *
@@ -117,15 +276,65 @@ enum cmdserv_state {
 };
 
 
+/**
+ * Kinds of entries in the output queue of a connection.
+ */
+enum cmdserv_output_kind {
+  CMDSERV_OUTPUT_DATA = 0,        /**< octets copied into the entry   */
+  CMDSERV_OUTPUT_FILE = 1,        /**< part of a file                 */
+  CMDSERV_OUTPUT_ZEROCOPY = 2,    /**< application's buffer, in place */
+  CMDSERV_OUTPUT_GENERATOR = 3,   /**< chunks from a generator        */
+  CMDSERV_OUTPUT_COMPRESS = 4,    /**< switch of the compression      */
+};
+
+/**
+ * An entry in the output queue of a connection: Output that couldn't
+ * be sent right away, or that was queued behind such output.
+ */
+struct cmdserv_output {
+  struct cmdserv_output *next;
+  enum cmdserv_output_kind kind;
+  size_t len;                     /**< octets still to be sent        */
+  int fd;                         /**< file to send from or -1        */
+  off_t offset;                   /**< next octet of the file         */
+  size_t pos;                     /**< first unsent octet in data/buf */
+  size_t size;                    /**< allocated size of data         */
+  const char *buf;                /**< application's buffer or NULL   */
+  cmdserv_release_handler release; /**< gives buf back or NULL        */
+  void *release_object;
+  bool zerocopy;                  /**< buf sent with MSG_ZEROCOPY     */
+  uint32_t seq;                   /**< number of last such send()     */
+  cmdserv_generator generate;     /**< fills data or NULL when done   */
+  void *generator_object;
+  struct z_stream_s *zstream;     /**< compressor from here on        */
+  char data[];
+};
+
+/**
+ * A status line prepared by cmdserv_response_prepare(), with its RESP
+ * variant behind it in the same allocation.
+ */
+struct cmdserv_response {
+  int status;
+  size_t linelen;                 /**< "nnn text" without terminator  */
+  const char *resp;               /**< simple string or error, CRLF   */
+  size_t resplen;
+  char line[];
+};
+
+
 /**
  * The cmdserv connection object.
  */
 struct cmdserv_connection {
   unsigned long long int id;      /**< unique connection id           */
 
-  int fd;                         /**< file descriptor                */
+  int fd;                         /**< file descriptor (readiness)    */
 
-  struct sockaddr_in6 clientaddr; /**< client IP address/port         */
+  const struct cmdserv_transport *transport;
+  void *transport_object;
+
+  struct sockaddr_storage clientaddr; /**< client address             */
   socklen_t clientaddrlen;        /**< size of client IP address/port */
   char clienthost[256];           /**< client address as string       */
   char clientport[128];           /**< client port as string          */
@@ -136,16 +345,62 @@ struct cmdserv_connection {
 
   ssize_t writebuf_size;          /**< maximum size of write buffer   */
   char *writebuf;                 /**< buffer for snprintf() strings  */
+  char *appbuf;                   /**< output of the append functions */
+  size_t appsize;                 /**< allocated size of appbuf       */
+  size_t applen;                  /**< octets waiting in appbuf       */
 
   size_t readbuf_size;            /**< maximum size of read buffer    */
   char *buf;                      /**< data read buffer               */
+  size_t bufsize;                 /**< allocated size of buf          */
   size_t buflen;                  /**< current length of read buffer  */
+  size_t buf_peak;                /**< most input in buf since shrink */
+  unsigned long long int buf_checked; /**< commands at last shrink    */
+  unsigned long long int buf_grown;   /**< times buf was grown        */
+  unsigned long long int buf_shrunk;  /**< times buf was shrunk       */
   bool overflow;                  /**< true if buffer was overflowed  */
 
+  cmdserv_body_handler body_handler; /**< receives body or NULL      */
+  void *body_object;
+  size_t body_left;               /**< octets of body still to come   */
+  char *body_term;                /**< terminator line or NULL        */
+  bool body_bol;                  /**< body is at beginning of a line */
+
+  enum cmdserv_framing framing;   /**< lines or binary frames         */
+  size_t frame_max;               /**< limit for growing buf (frames) */
+  size_t skip;                    /**< octets of overlong frame left  */
+
   unsigned int argc_max;          /**< size of argv (without NULL)    */
   char **argv;                    /**< parsed command arguments       */
+  size_t *argl;                   /**< argument lengths (frames)      */
   int argc;                       /**< number of parsed command args  */
 
+  char *respbuf;                  /**< RESP reply being collected     */
+  size_t respsize;                /**< allocated size of respbuf      */
+  size_t resplen;                 /**< length of reply in respbuf     */
+  bool replied;                   /**< RESP reply to command sent     */
+
+  struct cmdserv_output *output;  /**< queued output or NULL          */
+  struct cmdserv_output *output_last; /**< tail of the output queue   */
+  size_t output_len;              /**< octets in the output queue     */
+  bool output_full;               /**< transport took no more of it   */
+
+  size_t zerocopy_min;            /**< shorter buffers are copied     */
+  int zerocopy;                   /**< MSG_ZEROCOPY: 1 yes, 0 no, -1 ? */
+  uint32_t zerocopy_sent;         /**< send()s with MSG_ZEROCOPY      */
+  uint32_t zerocopy_done;         /**< ... completed by the kernel    */
+  struct cmdserv_output *completing; /**< sent, awaiting completion   */
+  struct cmdserv_output *completing_last;
+
+  int compression;                /**< level requested last, 0 off    */
+  struct z_stream_s *zstream;     /**< compressing output or NULL     */
+  char *zbuf;                     /**< compressed output or NULL      */
+  size_t zsize;                   /**< allocated size of zbuf         */
+  size_t zpos;                    /**< first unsent octet in zbuf     */
+  size_t zlen;                    /**< end of compressed data in zbuf */
+  bool zdirty;                    /**< output since last sync flush   */
+
+  unsigned long long int commands; /**< number of lines handled      */
+
   enum cmdserv_state state;       /**< special object states          */
 
   enum cmdserv_close_reason close_reason;
@@ -156,6 +411,17 @@ struct cmdserv_connection {
 
   bool forward_errors;            /**< from tokenizer to cmd_handler  */
 
+  cmdserv_latency *latency;       /**< command latency histograms     */
+  uint64_t time_line;             /**< line completion (monotonic ns) */
+
+  cmdserv_trace_handler trace_handler;
+  void *trace_object;
+
+  int capture_fd;                 /**< capture file or -1             */
+  char *capbuf;                   /**< escaped copy of current line   */
+  size_t capsize;                 /**< allocated size of capbuf       */
+  size_t caplen;                  /**< length of data in capbuf       */
+
   void (*cmd_handler)(void *cmd_object,
                       cmdserv_connection* connection,
                       int argc,
@@ -178,10 +444,92 @@ struct cmdserv_connection {
   void *log_object;
 };
 
-static void cmdserv_connection_handle_line(cmdserv_connection* self);
+static void cmdserv_connection_handle_line(cmdserv_connection* self,
+                                           size_t linelen);
+static bool cmdserv_connection_read_lines(cmdserv_connection* self,
+                                          size_t from);
+static bool cmdserv_connection_read_body(cmdserv_connection* self);
+static void cmdserv_connection_end_body(cmdserv_connection* self,
+                                        bool complete);
+static bool cmdserv_connection_read_frames(cmdserv_connection* self);
+static bool cmdserv_connection_read_resp(cmdserv_connection* self);
+static bool cmdserv_connection_handle_frame(cmdserv_connection* self,
+                                            size_t framelen);
+static void cmdserv_connection_protocol_error(cmdserv_connection* self);
+static ssize_t cmdserv_connection_write(cmdserv_connection* self,
+                                        const void *buf,
+                                        size_t nbyte,
+                                        int flags);
+static ssize_t cmdserv_connection_writev(cmdserv_connection* self,
+                                         const struct iovec *iov,
+                                         int iovcnt,
+                                         int flags);
+static int cmdserv_connection_queue(cmdserv_connection* self,
+                                    const void *buf,
+                                    size_t nbyte);
+static int cmdserv_connection_append_flush(cmdserv_connection* self);
+static size_t cmdserv_format_u64(char *end, uint64_t value);
+static double cmdserv_product_error(double a, double b, double p);
+static void cmdserv_connection_enqueue(cmdserv_connection* self,
+                                       struct cmdserv_output *output);
+static int cmdserv_connection_drain(cmdserv_connection* self);
+static bool cmdserv_connection_send_queued(cmdserv_connection* self);
+static ssize_t cmdserv_connection_send_output(cmdserv_connection* self,
+                                              struct cmdserv_output *output);
+static ssize_t cmdserv_connection_transmit(cmdserv_connection* self,
+                                           const void *buf,
+                                           size_t nbyte,
+                                           int flags);
+static ssize_t cmdserv_connection_deflate(cmdserv_connection* self,
+                                          const void *buf,
+                                          size_t nbyte,
+                                          int flags);
+static int cmdserv_connection_deflate_run(cmdserv_connection* self,
+                                          const void *buf,
+                                          size_t nbyte,
+                                          int flush);
+static int cmdserv_connection_deflate_push(cmdserv_connection* self);
+static int cmdserv_connection_deflate_sync(cmdserv_connection* self);
+static int cmdserv_connection_deflate_switch(cmdserv_connection* self,
+                                             struct z_stream_s *zstream);
+static void cmdserv_connection_deflate_end(struct z_stream_s *zstream);
+static int cmdserv_connection_generate(cmdserv_connection* self,
+                                       struct cmdserv_output *output);
+static void cmdserv_connection_output_free(cmdserv_connection* self,
+                                           struct cmdserv_output *output);
+static bool cmdserv_connection_zerocopy_enable(cmdserv_connection* self);
+static void cmdserv_connection_zerocopy_reap(cmdserv_connection* self);
+static ssize_t __attribute__ ((format (printf, 3, 0)))
+cmdserv_connection_resp_status(cmdserv_connection* self,
+                               int status,
+                               const char *fmt, va_list ap);
+static ssize_t cmdserv_connection_resp_bulk(cmdserv_connection* self);
+static ssize_t cmdserv_connection_resp_append(cmdserv_connection* self,
+                                              const void *buf,
+                                              size_t nbyte);
+static void cmdserv_connection_dispatch(cmdserv_connection* self,
+                                        size_t len);
 static void cmdserv_connection_free(cmdserv_connection* self);
+static cmdserv_connection
+*cmdserv_connection_new(unsigned long long int conn_id,
+                        struct cmdserv_connection_config* config);
+static void cmdserv_connection_open(cmdserv_connection* self,
+                                    enum cmdserv_close_reason close_reason);
+static cmdserv_connection
+*cmdserv_connection_accept(int listener_fd,
+                           unsigned long long int conn_id,
+                           struct cmdserv_connection_config* config,
+                           enum cmdserv_close_reason close_reason,
+                           bool shm);
+static void __attribute__ ((format (printf, 3, 4)))
+cmdserv_connection_capture(cmdserv_connection* self,
+                           bool with_line,
+                           const char *fmt, ...);
 static void *cmdserv_connection_resize_writebuf(cmdserv_connection* self,
                                                 ssize_t size);
+static void *cmdserv_connection_resize_readbuf(cmdserv_connection* self,
+                                               size_t size);
+static void cmdserv_connection_shrink_readbuf(cmdserv_connection* self);
 
 int cmdserv_connection_fd(cmdserv_connection* self) {
   return self->fd;
@@ -207,6 +555,47 @@ time_t cmdserv_connection_time_connected(cmdserv_connection* self) {
   return time(NULL) - self->time_connect;
 }
 
+unsigned long long int cmdserv_connection_commands(cmdserv_connection* self) {
+  return self->commands;
+}
+
+size_t cmdserv_connection_buffer_size(cmdserv_connection* self) {
+  size_t size = self->bufsize
+    + self->writebuf_size
+    + self->appsize
+    + (self->argc_max + 1) * (sizeof(char*) + sizeof(size_t))
+    + self->respsize
+    + self->zsize
+    + self->capsize;
+
+  for (struct cmdserv_output *o = self->output; o != NULL; o = o->next)
+    size += sizeof(struct cmdserv_output) + o->size;
+
+  return size;
+}
+
+unsigned long long int cmdserv_connection_readbuf_grown(cmdserv_connection* self) {
+  return self->buf_grown;
+}
+
+unsigned long long int cmdserv_connection_readbuf_shrunk(cmdserv_connection* self) {
+  return self->buf_shrunk;
+}
+
+size_t cmdserv_connection_output_queued(cmdserv_connection* self) {
+  return self->output_len + (self->zlen - self->zpos);
+}
+
+bool cmdserv_connection_output_pending(cmdserv_connection* self) {
+  return self->output != NULL
+    || self->applen > 0
+    || (self->zbuf != NULL && (self->zlen > self->zpos || self->zdirty));
+}
+
+bool cmdserv_connection_room_readable(cmdserv_connection* self) {
+  return self->transport->room_readable && self->output_full;
+}
+
 cmdserv_tokenizer cmdserv_connection_tokenizer(cmdserv_connection* self,
                                                cmdserv_tokenizer tokenizer) {
   cmdserv_tokenizer old_tokenizer = self->tokenizer;
@@ -214,6 +603,51 @@ cmdserv_tokenizer cmdserv_connection_tokenizer(cmdserv_connection* self,
   return old_tokenizer;
 }
 
+enum cmdserv_framing cmdserv_connection_framing(cmdserv_connection* self,
+                                                enum cmdserv_framing framing) {
+  enum cmdserv_framing old_framing = self->framing;
+  self->framing = framing;
+  return old_framing;
+}
+
+size_t cmdserv_connection_arglen(cmdserv_connection* self, int arg) {
+  if (arg < 0 || arg >= self->argc)
+    return 0;
+
+  return self->framing == CMDSERV_FRAMING_LINE
+    ? strlen(self->argv[arg])
+    : self->argl[arg];
+}
+
+int cmdserv_connection_receive_body(cmdserv_connection* self,
+                                    size_t len,
+                                    const char *terminator,
+                                    cmdserv_body_handler handler,
+                                    void *body_object) {
+  if (self->state != CMDSERV_CONNECTION_STATE_HANDLED
+      || self->framing != CMDSERV_FRAMING_LINE
+      || self->body_handler != NULL
+      || handler == NULL
+      || (terminator != NULL
+          && strlen(terminator) + 2 >= self->readbuf_size)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (terminator != NULL && (self->body_term = strdup(terminator)) == NULL)
+    return -1;
+
+  self->body_handler = handler;
+  self->body_object  = body_object;
+  self->body_left    = len;
+  self->body_bol     = true;
+
+  if (terminator == NULL && len == 0)
+    cmdserv_connection_end_body(self, true);
+
+  return 0;
+}
+
 char *cmdserv_connection_client(cmdserv_connection* self) {
   char *out = NULL;
   if (asprintf(&out, "[%s]:%s", self->clienthost, self->clientport) == -1)
@@ -221,30 +655,42 @@ char *cmdserv_connection_client(cmdserv_connection* self) {
   return out;
 }
 
+char *cmdserv_connection_client_r(cmdserv_connection* self,
+                                  char *buf,
+                                  size_t size) {
+  snprintf(buf, size, "[%s]:%s", self->clienthost, self->clientport);
+  return buf;
+}
+
 char *cmdserv_connection_command_string(cmdserv_connection* self,
                                         enum cmdserv_string_treatment trtmt) {
+  static char command_string[CMDSERV_LOGSAFE_STR_MAX];
+
+  return cmdserv_connection_command_string_r(self, trtmt, command_string,
+                                             sizeof(command_string));
+}
+
+char *cmdserv_connection_command_string_r(cmdserv_connection* self,
+                                          enum cmdserv_string_treatment trtmt,
+                                          char *buf,
+                                          size_t size) {
+  size_t len = 0;
+
   (void)trtmt;
-  char *a = strdup("");
-  char *b = NULL;
-  int len;
-  
-  for (int i = 0; i < self->argc; i++) {
-    if ((len = asprintf(&b, "%s\"%s\" ", a, self->argv[i])) == -1) {
-      free(a);
-      return NULL;
-    }
-    free(a);
-    a = b;
-    b = NULL;
-  }
 
-  /* Cut off additional space */
-  if (len > 0)
-    a[len - 1] = '\0';
-  
-  b = cmdserv_logsafe_str(a);
-  free(a);
-  return b;
+  if (size > 0)
+    buf[0] = '\0';
+
+  /* "arg0" "arg1" ..., escaped as a whole */
+  for (int i = 0; i < self->argc; i++)
+    if ((i > 0 && !cmdserv_logsafe_append(buf, size, &len, " ", 1))
+        || !cmdserv_logsafe_append(buf, size, &len, "\"", 1)
+        || !cmdserv_logsafe_append(buf, size, &len, self->argv[i],
+                                   strlen(self->argv[i]))
+        || !cmdserv_logsafe_append(buf, size, &len, "\"", 1))
+      break;
+
+  return buf;
 }
 
 void __attribute__ ((format (printf, 3, 0)))
@@ -252,14 +698,27 @@ cmdserv_connection_vlog(cmdserv_connection* self,
                         enum cmdserv_logseverity severity,
                         const char *fmt, va_list ap) {
   if (self->log_handler) {
-    char *msg  = NULL;
-    char *cfmt = NULL;
-    if (asprintf(&cfmt, "#%llu %s", self->id, fmt) >= 0) {
-      if (vasprintf(&msg, cfmt, ap) >= 0) {
-        self->log_handler(self->log_object, severity, msg);
-        free(msg);
-      }
-      free(cfmt);
+    char buf[CMDSERV_LOG_MSG_MAX];
+    char *msg;
+    va_list ap2;
+    int prefix, len;
+
+    prefix = snprintf(buf, sizeof(buf), "#%llu ", self->id);
+
+    va_copy(ap2, ap);
+    len = vsnprintf(buf + prefix, sizeof(buf) - prefix, fmt, ap2);
+    va_end(ap2);
+
+    if (len < 0)
+      return;
+
+    if ((size_t)(prefix + len) < sizeof(buf)) {
+      self->log_handler(self->log_object, severity, buf);
+    } else if ((msg = malloc(prefix + len + 1)) != NULL) {
+      memcpy(msg, buf, prefix);
+      vsnprintf(msg + prefix, len + 1, fmt, ap);
+      self->log_handler(self->log_object, severity, msg);
+      free(msg);
     }
   }
 }
@@ -285,6 +744,13 @@ cmdserv_connection_send_status(cmdserv_connection* self,
   if (status < 100 || status > 999)
     status = 500;
 
+  if (self->framing == CMDSERV_FRAMING_RESP) {
+    va_start(args, fmt);
+    len = cmdserv_connection_resp_status(self, status, fmt, args);
+    va_end(args);
+    return len;
+  }
+
  CMDSERV_CONNECTION_SEND_STATUS_REDO:
   added = snprintf(self->writebuf + len,
                    self->writebuf_size - len,
@@ -306,139 +772,2011 @@ cmdserv_connection_send_status(cmdserv_connection* self,
   return cmdserv_connection_send(self, self->writebuf, len, MSG_NOSIGNAL);
 }
 
-ssize_t cmdserv_connection_send(cmdserv_connection* self,
-                                const void *buf,
-                                size_t nbyte,
-                                int flags) {
-  return send(self->fd, buf, nbyte, flags);
-}
+cmdserv_response *cmdserv_response_prepare(int status, const char *text) {
+  size_t textlen = strlen(text);
+  size_t linelen = 4 + textlen;
+  size_t resplen;
+  cmdserv_response *response;
+  char *resp;
 
-ssize_t cmdserv_connection_print(cmdserv_connection* self,
-                                 const char *str) {
-  return cmdserv_connection_send(self,
-                                 str,
-                                 strlen(str),
-                                 MSG_NOSIGNAL);
-}
+  if (status < 100 || status > 999)
+    status = 500;
 
-ssize_t cmdserv_connection_println(cmdserv_connection* self,
-                                   const char *str) {
-  return cmdserv_connection_printf(self, "%s%s", str, EOL(self));
-}
+  resplen = (status < 400 ? 1 : 5) + textlen + 2;
 
-ssize_t __attribute__ ((format (printf, 2, 3)))
-cmdserv_connection_printf(cmdserv_connection* self,
-                          const char *fmt, ...) {
-  ssize_t sent;
-  va_list args;
-  va_start(args, fmt);
-  sent = cmdserv_connection_vprintf(self, fmt, args);
-  va_end(args);
-  return sent;
-}
+  if ((response = malloc(sizeof(cmdserv_response) + linelen + 1 + resplen + 1))
+      == NULL)
+    return NULL;
 
-ssize_t __attribute__ ((format (printf, 2, 0)))
-cmdserv_connection_vprintf(cmdserv_connection* self,
-                           const char *fmt, va_list ap) {
-  ssize_t len = 0, added;
-  va_list ap2;
+  resp = response->line + linelen + 1;
 
- CMDSERV_CONNECTION_VPRINTF_REDO:
-  va_copy(ap2, ap);
-  added = vsnprintf(self->writebuf, self->writebuf_size, fmt, ap2);
-  va_end(ap2);
-  WRITEBUF_CHECK_AND_RESIZE(self, len, added, CMDSERV_CONNECTION_VPRINTF_REDO);
+  *response = (cmdserv_response){
+    .status  = status,
+    .linelen = linelen,
+    .resp    = resp,
+    .resplen = resplen
+  };
 
-  return cmdserv_connection_send(self, self->writebuf, len, MSG_NOSIGNAL);
+  snprintf(response->line, linelen + 1, "%03d %s", status, text);
+  snprintf(resp, resplen + 1, "%s%s\r\n", status < 400 ? "+" : "-ERR ", text);
+
+  /* A simple string or error can't span lines */
+  for (size_t i = 0; i < resplen - 2; i++)
+    if (resp[i] == '\r' || resp[i] == '\n')
+      resp[i] = ' ';
+
+  return response;
 }
 
-void cmdserv_connection_close(cmdserv_connection* self,
-                              enum cmdserv_close_reason reason) {
-  self->close_reason = (reason == CMDSERV_NO_CLOSE
-                        ? CMDSERV_APPLICATION_CLOSE
-                        : reason);
+void cmdserv_response_free(cmdserv_response *response) {
+  free(response);
+}
 
-  if (self->state == CMDSERV_CONNECTION_STATE_HANDLED)
-    return;
+ssize_t cmdserv_connection_send_response(cmdserv_connection* self,
+                                         const cmdserv_response *response) {
+  const char *eol = EOL(self);
+  struct iovec iov[2] = {
+    { .iov_base = (void *)(uintptr_t)response->line,
+      .iov_len  = response->linelen },
+    { .iov_base = (void *)(uintptr_t)eol,
+      .iov_len  = strlen(eol) }
+  };
 
-  cmdserv_connection_log(self, CMDSERV_INFO, "closing");
+  if (self->framing == CMDSERV_FRAMING_RESP) {
+    self->replied = true;
 
-  if (self->close_handler)
-    self->close_handler(self->close_object, self, self->close_reason);
+    if (response->status < 400 && self->resplen > 0)
+      return cmdserv_connection_resp_bulk(self);
 
-  cmdserv_connection_free(self);
+    self->resplen = 0;
+    return cmdserv_connection_write(self, response->resp, response->resplen,
+                                    MSG_NOSIGNAL);
+  }
+
+  return cmdserv_connection_writev(self, iov, 2, MSG_NOSIGNAL);
 }
 
-void cmdserv_connection_read(cmdserv_connection* self) {
-  size_t oldbuflen = self->buflen;
+ssize_t cmdserv_connection_sendv(cmdserv_connection* self,
+                                 const struct iovec *iov,
+                                 int iovcnt,
+                                 int flags) {
+  ssize_t total = 0;
 
-  ssize_t received = recv(self->fd,
-                          self->buf + self->buflen,
-                          self->readbuf_size - self->buflen,
-                          0);
+  if (self->framing != CMDSERV_FRAMING_RESP)
+    return cmdserv_connection_writev(self, iov, iovcnt, flags);
 
-  if (received == 0) {
-    cmdserv_connection_log(self, CMDSERV_INFO, "client disconnect");
-    cmdserv_connection_close(self, CMDSERV_CLIENT_DISCONNECT);
-    return;
+  for (int i = 0; i < iovcnt; i++) {
+    if (cmdserv_connection_resp_append(self, iov[i].iov_base, iov[i].iov_len)
+        == -1)
+      return -1;
+    total += iov[i].iov_len;
+  }
 
-  } else if (received == -1) {
-    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
-      return;
-    cmdserv_connection_log(self, CMDSERV_ERR,
-                           "recv() error: %s", strerror(errno));
-    cmdserv_connection_close(self, CMDSERV_CLIENT_RECEIVE_ERROR);
-    return;
+  return total;
+}
+
+ssize_t cmdserv_connection_send(cmdserv_connection* self,
+                                const void *buf,
+                                size_t nbyte,
+                                int flags) {
+  if (self->framing == CMDSERV_FRAMING_RESP)
+    return cmdserv_connection_resp_append(self, buf, nbyte);
+
+  return cmdserv_connection_write(self, buf, nbyte, flags);
+}
+
+/**
+ * Private method to write to the transport, bypassing the collection
+ * of RESP replies.  What the transport doesn't take right away is
+ * queued, as is everything while there's output queued already.
+ *
+ * Returns nbyte or -1 with errno set on failure.
+ */
+static ssize_t cmdserv_connection_write(cmdserv_connection* self,
+                                        const void *buf,
+                                        size_t nbyte,
+                                        int flags) {
+  ssize_t sent = 0;
+
+  /* Appended output goes first, in the same write if possible */
+  if (self->applen > 0) {
+    struct iovec iov[2] = {
+      { .iov_base = self->appbuf,
+        .iov_len  = self->applen },
+      { .iov_base = (void *)(uintptr_t)buf,
+        .iov_len  = nbyte }
+    };
+
+    self->applen = 0;
+    if (cmdserv_connection_writev(self, iov, 2, flags) == -1)
+      return -1;
+    return nbyte;
   }
 
-  self->time_last = time(NULL);
+  if (self->output == NULL) {
+    sent = cmdserv_connection_transmit(self, buf, nbyte, flags);
 
-  self->buflen += received;
+    if (sent == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        return -1;
+      sent = 0;
+    } else if (sent > 0) {
+      TRACE(self, CMDSERV_TRACE_SEND, send, sent);
+    }
 
-  for (size_t i = oldbuflen; i < self->buflen; i++) {
-    if (self->buf[i] == '\n'
-        && (self->lineterm == CMDSERV_LINETERM_LF
-            || self->lineterm == CMDSERV_LINETERM_CRLF_OR_LF
-            || (self->lineterm == CMDSERV_LINETERM_CRLF
-                && i > 0 && self->buf[i - 1] == '\r'))) {
+    if ((size_t)sent == nbyte)
+      return sent;
+  }
 
-      /* End of line found: Parse it */
-      self->buf[i] = '\0';
-      if (self->lineterm == CMDSERV_LINETERM_CRLF
-          || (self->lineterm == CMDSERV_LINETERM_CRLF_OR_LF
-              && i > 0 && self->buf[i - 1] == '\r'))
-        self->buf[i - 1] = '\0';
-      
-      self->state = CMDSERV_CONNECTION_STATE_HANDLED;
-      cmdserv_connection_handle_line(self);
-      self->state = CMDSERV_CONNECTION_STATE_DEFAULT;
+  if (cmdserv_connection_queue(self, (const char *)buf + sent, nbyte - sent)
+      == -1)
+    return -1;
 
-      if (self->close_reason != CMDSERV_NO_CLOSE) {
-        cmdserv_connection_close(self, self->close_reason);
-        return;
-      }
+  return nbyte;
+}
 
-      /* Move rest of buffer to beginning */
-      self->buflen -= i + 1;
-      memmove(self->buf,
-              self->buf + i + 1,
-              self->buflen);
-      i = 0; /* Try again for one more line */
+/**
+ * Private method to write the iovcnt buffers of iov to the transport
+ * in one go, if it can do so and nothing is queued or compressed.
+ * Whatever isn't sent right away goes through
+ * cmdserv_connection_write().
+ *
+ * Returns the total length or -1 with errno set on failure.
+ */
+static ssize_t cmdserv_connection_writev(cmdserv_connection* self,
+                                         const struct iovec *iov,
+                                         int iovcnt,
+                                         int flags) {
+  ssize_t sent = 0, total = 0;
+  size_t done;
+
+  for (int i = 0; i < iovcnt; i++)
+    total += iov[i].iov_len;
+
+  if (cmdserv_connection_append_flush(self) == -1)
+    return -1;
+
+  if (self->output == NULL && self->zbuf == NULL
+      && self->transport->writev != NULL) {
+    sent = self->transport->writev(self->transport_object, iov, iovcnt, flags);
+
+    if (sent == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        return -1;
+      sent = 0;
+    } else if (sent > 0) {
+      TRACE(self, CMDSERV_TRACE_SEND, send, sent);
     }
   }
 
-  if (self->buflen == self->readbuf_size) {
-    self->overflow = true;
-    self->buflen   = 0;
+  done = sent;
+  for (int i = 0; i < iovcnt; i++) {
+    size_t skip = done < iov[i].iov_len ? done : iov[i].iov_len;
+
+    done -= skip;
+    if (iov[i].iov_len > skip
+        && cmdserv_connection_write(self,
+                                    (const char *)iov[i].iov_base + skip,
+                                    iov[i].iov_len - skip,
+                                    flags) == -1)
+      return -1;
   }
+
+  return total;
 }
 
-static void cmdserv_connection_handle_line(cmdserv_connection *self) {
-  if (self->overflow) {
-    self->argv[0]  = NULL;
-    self->argc     = CMDSERV_ERR_LINE_TOO_LONG;
-    self->overflow = false;
-  } else if (self->tokenizer == NULL) {
+/**
+ * Private method to append a copy of nbyte octets from buf to the
+ * output queue, filling up the last block if there's room.
+ *
+ * Returns 0 or -1 with errno set on failure.
+ */
+static int cmdserv_connection_queue(cmdserv_connection* self,
+                                    const void *buf,
+                                    size_t nbyte) {
+  struct cmdserv_output *last = self->output_last;
+  struct cmdserv_output *output;
+
+  if (last != NULL
+      && last->kind == CMDSERV_OUTPUT_DATA
+      && last->size - last->pos - last->len >= nbyte) {
+    memcpy(last->data + last->pos + last->len, buf, nbyte);
+    last->len        += nbyte;
+    self->output_len += nbyte;
+    return 0;
+  }
+
+  if ((output = malloc(sizeof(struct cmdserv_output)
+                       + (nbyte > OUTPUT_BLOCK_MIN
+                          ? nbyte
+                          : OUTPUT_BLOCK_MIN)))
+      == NULL)
+    return -1;
+
+  *output = (struct cmdserv_output){
+    .next = NULL,
+    .kind = CMDSERV_OUTPUT_DATA,
+    .len  = nbyte,
+    .fd   = -1,
+    .pos  = 0,
+    .size = nbyte > OUTPUT_BLOCK_MIN ? nbyte : OUTPUT_BLOCK_MIN
+  };
+  memcpy(output->data, buf, nbyte);
+
+  cmdserv_connection_enqueue(self, output);
+
+  return 0;
+}
+
+/**
+ * Private method to append an entry to the output queue.
+ */
+static void cmdserv_connection_enqueue(cmdserv_connection* self,
+                                       struct cmdserv_output *output) {
+  if (self->output_last != NULL)
+    self->output_last->next = output;
+  else
+    self->output = output;
+
+  self->output_last  = output;
+  self->output_len  += output->len;
+}
+
+int cmdserv_connection_send_file(cmdserv_connection* self,
+                                 int fd,
+                                 off_t offset,
+                                 size_t len) {
+  struct cmdserv_output *output;
+
+  if (len == 0) {
+    struct stat st;
+
+    if (fstat(fd, &st) == -1)
+      return -1;
+    if (st.st_size <= offset)
+      return 0;
+    len = st.st_size - offset;
+  }
+
+  if (self->framing == CMDSERV_FRAMING_RESP) {
+    /* The reply is collected anyway: Read the file right into it */
+    char chunk[OUTPUT_FILE_CHUNK];
+
+    while (len > 0) {
+      ssize_t got = pread(fd, chunk,
+                          len < sizeof(chunk) ? len : sizeof(chunk),
+                          offset);
+      if (got == 0)
+        errno = EIO;
+      if (got <= 0
+          || cmdserv_connection_resp_append(self, chunk, got) == -1)
+        return -1;
+      offset += got;
+      len    -= got;
+    }
+    return 0;
+  }
+
+  if (cmdserv_connection_append_flush(self) == -1
+      || (output = malloc(sizeof(struct cmdserv_output))) == NULL)
+    return -1;
+
+  *output = (struct cmdserv_output){
+    .next   = NULL,
+    .kind   = CMDSERV_OUTPUT_FILE,
+    .len    = len,
+    .fd     = fcntl(fd, F_DUPFD_CLOEXEC, 0),
+    .offset = offset,
+    .size   = 0
+  };
+
+  if (output->fd == -1) {
+    free(output);
+    return -1;
+  }
+
+  cmdserv_connection_enqueue(self, output);
+
+  /* Nothing in front of it: Get it going right away */
+  if (self->output == output)
+    return cmdserv_connection_drain(self);
+
+  return 0;
+}
+
+int cmdserv_connection_send_zerocopy(cmdserv_connection* self,
+                                     const void *buf,
+                                     size_t len,
+                                     cmdserv_release_handler release,
+                                     void *release_object) {
+  struct cmdserv_output *output;
+  int saverrno;
+
+  if (len == 0
+      || len < self->zerocopy_min
+      || self->zerocopy_min == 0
+      || self->framing == CMDSERV_FRAMING_RESP
+      || !cmdserv_connection_zerocopy_enable(self)) {
+    ssize_t sent = cmdserv_connection_send(self, buf, len, MSG_NOSIGNAL);
+
+    saverrno = errno;
+    if (release != NULL)
+      release(release_object, buf);
+    errno = saverrno;
+    return sent == -1 ? -1 : 0;
+  }
+
+  if (cmdserv_connection_append_flush(self) == -1
+      || (output = malloc(sizeof(struct cmdserv_output))) == NULL) {
+    saverrno = errno;
+    if (release != NULL)
+      release(release_object, buf);
+    errno = saverrno;
+    return -1;
+  }
+
+  *output = (struct cmdserv_output){
+    .next           = NULL,
+    .kind           = CMDSERV_OUTPUT_ZEROCOPY,
+    .len            = len,
+    .fd             = -1,
+    .pos            = 0,
+    .size           = 0,
+    .buf            = buf,
+    .release        = release,
+    .release_object = release_object,
+    .zerocopy       = false,
+    .seq            = 0
+  };
+
+  cmdserv_connection_enqueue(self, output);
+
+  if (self->output == output)
+    return cmdserv_connection_drain(self);
+
+  return 0;
+}
+
+int cmdserv_connection_compression(cmdserv_connection* self, int level) {
+  struct cmdserv_output *output;
+  struct z_stream_s *zstream = NULL;
+  int old_level = self->compression;
+
+  if (level < 0 || level > 9) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (level == old_level)
+    return old_level;
+
+  if (level > 0) {
+#if CMDSERV_ZLIB
+    if ((zstream = malloc(sizeof(z_stream))) == NULL)
+      return -1;
+    *zstream = (z_stream){ .zalloc = Z_NULL, .zfree = Z_NULL };
+    if (deflateInit(zstream, level) != Z_OK) {
+      free(zstream);
+      errno = ENOMEM;
+      return -1;
+    }
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+  }
+
+  /* Output sent before this call isn't affected */
+  if (cmdserv_connection_append_flush(self) == -1) {
+    int saverrno = errno;
+
+    if (zstream != NULL)
+      cmdserv_connection_deflate_end(zstream);
+    errno = saverrno;
+    return -1;
+  }
+
+  if (self->output == NULL) {
+    if (cmdserv_connection_deflate_switch(self, zstream) == -1)
+      return -1;
+  } else {
+    if ((output = malloc(sizeof(struct cmdserv_output))) == NULL) {
+      int saverrno = errno;
+
+      if (zstream != NULL)
+        cmdserv_connection_deflate_end(zstream);
+      errno = saverrno;
+      return -1;
+    }
+
+    *output = (struct cmdserv_output){
+      .next    = NULL,
+      .kind    = CMDSERV_OUTPUT_COMPRESS,
+      .len     = 0,
+      .fd      = -1,
+      .zstream = zstream
+    };
+
+    cmdserv_connection_enqueue(self, output);
+  }
+
+  self->compression = level;
+
+  return old_level;
+}
+
+/**
+ * Private method to find out (once) whether buffers can be sent with
+ * MSG_ZEROCOPY on this connection, and to enable it on the socket.
+ */
+static bool cmdserv_connection_zerocopy_enable(cmdserv_connection* self) {
+  if (self->zerocopy == -1) {
+    self->zerocopy = 0;
+#if CMDSERV_ZEROCOPY
+    if (self->transport == &cmdserv_socket_transport
+        && (self->clientaddr.ss_family == AF_INET
+            || self->clientaddr.ss_family == AF_INET6)
+        && setsockopt(self->fd, SOL_SOCKET, SO_ZEROCOPY,
+                      &(int){1}, sizeof(int)) == 0)
+      self->zerocopy = 1;
+#endif
+  }
+
+  return self->zerocopy == 1;
+}
+
+/**
+ * Private method to collect the completions of MSG_ZEROCOPY sends
+ * from the socket's error queue, and release the buffers the kernel
+ * is done with.
+ *
+ * A completion reports a range of send() calls by number.  On TCP
+ * they complete in order, so we only keep the number up to which
+ * everything is done.  If the kernel had to copy the data after all
+ * (as it does on the loopback interface), MSG_ZEROCOPY is just
+ * overhead: It's not used on the connection anymore.
+ */
+static void cmdserv_connection_zerocopy_reap(cmdserv_connection* self) {
+#if CMDSERV_ZEROCOPY
+  while (self->completing != NULL) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))
+                 + CMSG_SPACE(sizeof(struct sockaddr_in6))];
+    struct msghdr msg = {
+      .msg_control    = control,
+      .msg_controllen = sizeof(control)
+    };
+    struct cmsghdr *cmsg;
+
+    if (recvmsg(self->fd, &msg, MSG_ERRQUEUE) == -1)
+      break;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      struct sock_extended_err *serr;
+
+      if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+            || (cmsg->cmsg_level == SOL_IPV6
+                && cmsg->cmsg_type == IPV6_RECVERR)))
+        continue;
+
+      serr = (struct sock_extended_err *)(void *)CMSG_DATA(cmsg);
+      if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+
+      if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+        self->zerocopy = 0;
+      if ((int32_t)(serr->ee_data + 1 - self->zerocopy_done) > 0)
+        self->zerocopy_done = serr->ee_data + 1;
+    }
+
+    while (self->completing != NULL
+           && (int32_t)(self->completing->seq - self->zerocopy_done) < 0) {
+      struct cmdserv_output *done = self->completing;
+
+      if ((self->completing = done->next) == NULL)
+        self->completing_last = NULL;
+      cmdserv_connection_output_free(self, done);
+    }
+  }
+#else
+  (void)self;
+#endif
+}
+
+int cmdserv_connection_send_generator(cmdserv_connection* self,
+                                      cmdserv_generator generator,
+                                      void *generator_object) {
+  struct cmdserv_output *output;
+  int saverrno;
+
+  if (self->framing == CMDSERV_FRAMING_RESP) {
+    /* The reply is collected anyway: Run the generator to its end */
+    char chunk[CMDSERV_GENERATOR_CHUNK];
+    ssize_t got;
+
+    while ((got = generator(generator_object, self, chunk, sizeof(chunk)))
+           > 0) {
+      if (cmdserv_connection_resp_append(self, chunk, got) == -1) {
+        saverrno = errno;
+        generator(generator_object, self, NULL, 0);
+        errno = saverrno;
+        return -1;
+      }
+    }
+    if (got == -1) {
+      cmdserv_connection_log(self, CMDSERV_ERR, "generator failed");
+      cmdserv_connection_close(self, CMDSERV_APPLICATION_CLOSE);
+      return -1;
+    }
+    return 0;
+  }
+
+  if (cmdserv_connection_append_flush(self) == -1
+      || (output = malloc(sizeof(struct cmdserv_output)
+                          + CMDSERV_GENERATOR_CHUNK)) == NULL) {
+    saverrno = errno;
+    generator(generator_object, self, NULL, 0);
+    errno = saverrno;
+    return -1;
+  }
+
+  *output = (struct cmdserv_output){
+    .next             = NULL,
+    .kind             = CMDSERV_OUTPUT_GENERATOR,
+    .len              = 0,
+    .fd               = -1,
+    .pos              = 0,
+    .size             = CMDSERV_GENERATOR_CHUNK,
+    .generate         = generator,
+    .generator_object = generator_object
+  };
+
+  cmdserv_connection_enqueue(self, output);
+
+  if (self->output == output)
+    return cmdserv_connection_drain(self);
+
+  return 0;
+}
+
+void cmdserv_connection_flush(cmdserv_connection* self) {
+  cmdserv_connection_send_queued(self);
+}
+
+/**
+ * Private method to send as much of the pending output as the
+ * transport takes right now, closing the connection on errors.
+ *
+ * Returns false if the connection was closed (and is gone).
+ */
+static bool cmdserv_connection_send_queued(cmdserv_connection* self) {
+  cmdserv_connection_zerocopy_reap(self);
+
+  if (cmdserv_connection_append_flush(self) == -1
+      || cmdserv_connection_drain(self) == -1) {
+    if (self->close_reason == CMDSERV_NO_CLOSE) {
+      cmdserv_connection_log(self, CMDSERV_ERR,
+                             "send() error: %s", strerror(errno));
+      self->close_reason = CMDSERV_CLIENT_SEND_ERROR;
+    }
+    cmdserv_connection_close(self, self->close_reason);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Private method to send queued output until the queue is empty or
+ * the transport doesn't take any more.
+ *
+ * Returns 0 or -1 with errno set on errors other than the transport
+ * not being ready.
+ */
+static int cmdserv_connection_drain(cmdserv_connection* self) {
+  struct cmdserv_output *output;
+  int rounds = 0;
+
+  self->output_full = false;
+
+  while ((output = self->output) != NULL) {
+    for (;;) {
+      ssize_t sent;
+
+      if (output->len == 0) {
+        if (output->generate == NULL)
+          break;
+        /* Enough for now, the other clients' turn */
+        if (rounds++ == CMDSERV_GENERATOR_ROUNDS)
+          return 0;
+        if (cmdserv_connection_generate(self, output) == -1)
+          return -1;
+        continue;
+      }
+
+      sent = cmdserv_connection_send_output(self, output);
+
+      if (sent == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+          return -1;
+        self->output_full = true;
+        return 0;
+      }
+
+      if (sent == 0 && output->kind != CMDSERV_OUTPUT_FILE) {
+        self->output_full = true;
+        return 0;
+      }
+
+      /* The client was promised the full length: Can't go on */
+      if (sent == 0) {
+        cmdserv_connection_log(self, CMDSERV_ERR,
+                               "file ended %zu octets early", output->len);
+        self->close_reason = CMDSERV_CLIENT_SEND_ERROR;
+        errno = EIO;
+        return -1;
+      }
+
+      TRACE(self, CMDSERV_TRACE_SEND, send, sent);
+      self->time_last   = time(NULL);
+      self->output_len -= sent;
+      output->len      -= sent;
+    }
+
+    if ((self->output = output->next) == NULL)
+      self->output_last = NULL;
+
+    if (output->kind == CMDSERV_OUTPUT_COMPRESS) {
+      struct z_stream_s *zstream = output->zstream;
+
+      output->zstream = NULL;
+      cmdserv_connection_output_free(self, output);
+      if (cmdserv_connection_deflate_switch(self, zstream) == -1)
+        return -1;
+      continue;
+    }
+
+    /* Buffers still in use by the kernel wait for their completion */
+    if (output->zerocopy) {
+      output->next = NULL;
+      if (self->completing_last != NULL)
+        self->completing_last->next = output;
+      else
+        self->completing = output;
+      self->completing_last = output;
+      continue;
+    }
+
+    cmdserv_connection_output_free(self, output);
+  }
+
+  /* All responses sent: Let the client decompress them */
+  if (self->zbuf != NULL)
+    return cmdserv_connection_deflate_sync(self);
+
+  return 0;
+}
+
+/**
+ * Private method to have a generator fill the next chunk of its
+ * output queue entry.  When it's done, the entry is done as soon as
+ * its last chunk is sent.
+ *
+ * Returns 0 or -1 if the generator failed (the connection is to be
+ * closed then, close_reason is set).
+ */
+static int cmdserv_connection_generate(cmdserv_connection* self,
+                                       struct cmdserv_output *output) {
+  ssize_t got = output->generate(output->generator_object, self,
+                                 output->data, output->size);
+
+  if (got <= 0) {
+    output->generate = NULL;
+    if (got == -1) {
+      cmdserv_connection_log(self, CMDSERV_ERR, "generator failed");
+      self->close_reason = CMDSERV_APPLICATION_CLOSE;
+      return -1;
+    }
+    return 0;
+  }
+
+  output->pos       = 0;
+  output->len       = (size_t)got < output->size ? (size_t)got : output->size;
+  self->output_len += output->len;
+
+  return 0;
+}
+
+/**
+ * Private method to free an entry of the output queue, closing its
+ * file, releasing its buffer, or telling its generator that it's
+ * cancelled.
+ */
+static void cmdserv_connection_output_free(cmdserv_connection* self,
+                                           struct cmdserv_output *output) {
+  if (output->fd != -1)
+    close(output->fd);
+  if (output->release != NULL)
+    output->release(output->release_object, output->buf);
+  if (output->generate != NULL)
+    output->generate(output->generator_object, self, NULL, 0);
+  if (output->zstream != NULL)
+    cmdserv_connection_deflate_end(output->zstream);
+  free(output);
+}
+
+/**
+ * Private method to send (part of) one entry of the output queue.
+ *
+ * Returns the number of octets sent, 0 at the end of a file or -1
+ * with errno set on errors (including the transport not being ready).
+ */
+static ssize_t cmdserv_connection_send_output(cmdserv_connection* self,
+                                              struct cmdserv_output *output) {
+  char chunk[OUTPUT_FILE_CHUNK];
+  ssize_t sent, got;
+
+  if (output->kind == CMDSERV_OUTPUT_DATA
+      || output->kind == CMDSERV_OUTPUT_GENERATOR) {
+    if ((sent = cmdserv_connection_transmit(self,
+                                            output->data + output->pos,
+                                            output->len,
+                                            MSG_NOSIGNAL)) > 0)
+      output->pos += sent;
+    return sent;
+  }
+
+  if (output->kind == CMDSERV_OUTPUT_ZEROCOPY) {
+#if CMDSERV_ZEROCOPY
+    if (self->zerocopy == 1 && self->zbuf == NULL) {
+      if ((sent = send(self->fd, output->buf + output->pos, output->len,
+                       MSG_NOSIGNAL | MSG_ZEROCOPY)) >= 0) {
+        output->pos     += sent;
+        output->zerocopy = true;
+        output->seq      = self->zerocopy_sent++;
+        return sent;
+      }
+      /* Out of memory for pinning pages: Copy this time */
+      if (errno != ENOBUFS)
+        return -1;
+    }
+#endif
+    if ((sent = cmdserv_connection_transmit(self,
+                                            output->buf + output->pos,
+                                            output->len,
+                                            MSG_NOSIGNAL)) > 0)
+      output->pos += sent;
+    return sent;
+  }
+
+#ifdef __linux__
+  if (self->transport == &cmdserv_socket_transport && self->zbuf == NULL) {
+    sent = sendfile(self->fd, output->fd, &output->offset, output->len);
+
+    /* Not a file sendfile() can handle: Fall back to reading it */
+    if (sent != -1 || (errno != EINVAL && errno != ENOSYS))
+      return sent;
+  }
+#endif
+
+  if ((got = pread(output->fd, chunk,
+                   output->len < sizeof(chunk) ? output->len : sizeof(chunk),
+                   output->offset)) <= 0)
+    return got;
+
+  if ((sent = cmdserv_connection_transmit(self, chunk, got, MSG_NOSIGNAL)) > 0)
+    output->offset += sent;
+
+  return sent;
+}
+
+/**
+ * Private method to hand output to the transport, compressing it if
+ * the connection does.
+ *
+ * Returns the number of octets taken or -1 with errno set (including
+ * the transport not being ready).
+ */
+static ssize_t cmdserv_connection_transmit(cmdserv_connection* self,
+                                           const void *buf,
+                                           size_t nbyte,
+                                           int flags) {
+  if (CMDSERV_UNLIKELY(self->zbuf != NULL))
+    return cmdserv_connection_deflate(self, buf, nbyte, flags);
+
+  return self->transport->write(self->transport_object, buf, nbyte, flags);
+}
+
+/**
+ * Private method to transmit while compression is (or was until just
+ * now) on: New output is only taken once the compressed output before
+ * it is sent, so the client's pace limits the compressed data held to
+ * what a single call produces.
+ *
+ * Returns like cmdserv_connection_transmit().
+ */
+static ssize_t cmdserv_connection_deflate(cmdserv_connection* self,
+                                          const void *buf,
+                                          size_t nbyte,
+                                          int flags) {
+  if (cmdserv_connection_deflate_push(self) == -1)
+    return -1;
+
+  if (self->zbuf != NULL && self->zlen > self->zpos) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  /* Compression has been switched off and its end is sent */
+  if (self->zstream == NULL)
+    return self->transport->write(self->transport_object, buf, nbyte, flags);
+
+  if (cmdserv_connection_deflate_run(self, buf, nbyte, Z_NO_FLUSH) == -1)
+    return -1;
+  self->zdirty = true;
+
+  if (cmdserv_connection_deflate_push(self) == -1)
+    return -1;
+
+  return nbyte;
+}
+
+/**
+ * Private method to run nbyte octets from buf through the compressor
+ * into zbuf, growing it as needed, with the zlib flush mode given.
+ *
+ * Returns 0 or -1 with errno set on failure.
+ */
+static int cmdserv_connection_deflate_run(cmdserv_connection* self,
+                                          const void *buf,
+                                          size_t nbyte,
+                                          int flush) {
+#if CMDSERV_ZLIB
+  z_stream *z = self->zstream;
+  int ret;
+
+  if (self->zpos == self->zlen)
+    self->zpos = self->zlen = 0;
+
+  z->next_in  = (Bytef *)(uintptr_t)buf;
+  z->avail_in = nbyte;
+
+  for (;;) {
+    if (self->zsize - self->zlen < DEFLATE_CHUNK / 4) {
+      size_t size = self->zsize * 2;
+      char *zbuf;
+
+      if ((zbuf = realloc(self->zbuf, size)) == NULL)
+        return -1;
+      self->zbuf  = zbuf;
+      self->zsize = size;
+    }
+
+    z->next_out  = (Bytef *)self->zbuf + self->zlen;
+    z->avail_out = self->zsize - self->zlen;
+    ret          = deflate(z, flush);
+    self->zlen   = self->zsize - z->avail_out;
+
+    if (ret == Z_STREAM_ERROR) {
+      errno = EINVAL;
+      return -1;
+    }
+    if (flush == Z_FINISH
+        ? ret == Z_STREAM_END
+        : z->avail_in == 0 && z->avail_out > 0)
+      return 0;
+  }
+#else
+  (void)self;
+  (void)buf;
+  (void)nbyte;
+  (void)flush;
+  errno = ENOTSUP;
+  return -1;
+#endif
+}
+
+/**
+ * Private method to send as much of the compressed output as the
+ * transport takes.  Once compression is switched off and everything
+ * is sent, zbuf is freed.
+ *
+ * Returns 0 or -1 with errno set on errors other than the transport
+ * not being ready.
+ */
+static int cmdserv_connection_deflate_push(cmdserv_connection* self) {
+  while (self->zlen > self->zpos) {
+    ssize_t sent = self->transport->write(self->transport_object,
+                                          self->zbuf + self->zpos,
+                                          self->zlen - self->zpos,
+                                          MSG_NOSIGNAL);
+
+    if (sent == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        return 0;
+      return -1;
+    }
+    self->zpos += sent;
+  }
+
+  if (self->zstream == NULL) {
+    free(self->zbuf);
+    self->zbuf  = NULL;
+    self->zsize = 0;
+    self->zpos  = self->zlen = 0;
+  }
+
+  return 0;
+}
+
+/**
+ * Private method to flush the compressor, so the client can
+ * decompress everything sent so far, if there has been any output
+ * since the last flush, and to start sending it.
+ *
+ * Returns like cmdserv_connection_deflate_push().
+ */
+static int cmdserv_connection_deflate_sync(cmdserv_connection* self) {
+  if (self->zstream != NULL && self->zdirty) {
+    if (cmdserv_connection_deflate_run(self, NULL, 0, Z_SYNC_FLUSH) == -1)
+      return -1;
+    self->zdirty = false;
+  }
+
+  return cmdserv_connection_deflate_push(self);
+}
+
+/**
+ * Private method to switch compression, at this point of the output:
+ * The current compressed stream (if any) is finished, and the new one
+ * (if zstream isn't NULL) takes over.
+ *
+ * Returns 0 or -1 with errno set on failure (zstream is freed then).
+ */
+static int cmdserv_connection_deflate_switch(cmdserv_connection* self,
+                                             struct z_stream_s *zstream) {
+  if (self->zstream != NULL) {
+    int ret = cmdserv_connection_deflate_run(self, NULL, 0, Z_FINISH);
+
+    cmdserv_connection_deflate_end(self->zstream);
+    self->zstream = NULL;
+    self->zdirty  = false;
+
+    if (ret == -1) {
+      if (zstream != NULL)
+        cmdserv_connection_deflate_end(zstream);
+      return -1;
+    }
+  }
+
+  if (zstream != NULL && self->zbuf == NULL) {
+    if ((self->zbuf = malloc(DEFLATE_CHUNK)) == NULL) {
+      cmdserv_connection_deflate_end(zstream);
+      return -1;
+    }
+    self->zsize = DEFLATE_CHUNK;
+  }
+
+  self->zstream = zstream;
+
+  return cmdserv_connection_deflate_push(self);
+}
+
+/**
+ * Private method to free a compressor.
+ */
+static void cmdserv_connection_deflate_end(struct z_stream_s *zstream) {
+#if CMDSERV_ZLIB
+  deflateEnd(zstream);
+#endif
+  free(zstream);
+}
+
+/**
+ * Private method to send the RESP reply for a status: The output
+ * collected so far as a bulk string for a success, the status text as
+ * a simple string or error otherwise.
+ */
+static ssize_t __attribute__ ((format (printf, 3, 0)))
+cmdserv_connection_resp_status(cmdserv_connection* self,
+                               int status,
+                               const char *fmt, va_list ap) {
+  ssize_t len = 0, added;
+  va_list ap2;
+
+  self->replied = true;
+
+  if (status < 400 && self->resplen > 0)
+    return cmdserv_connection_resp_bulk(self);
+
+  self->resplen = 0;
+
+ CMDSERV_CONNECTION_RESP_STATUS_REDO:
+  added = snprintf(self->writebuf + len,
+                   self->writebuf_size - len,
+                   "%s", status < 400 ? "+" : "-ERR ");
+  WRITEBUF_CHECK_AND_RESIZE(self, len, added, CMDSERV_CONNECTION_RESP_STATUS_REDO);
+
+  va_copy(ap2, ap);
+  added = vsnprintf(self->writebuf + len,
+                    self->writebuf_size - len,
+                    fmt, ap2);
+  va_end(ap2);
+  WRITEBUF_CHECK_AND_RESIZE(self, len, added, CMDSERV_CONNECTION_RESP_STATUS_REDO);
+
+  /* A simple string or error can't span lines */
+  for (ssize_t i = 0; i < len; i++)
+    if (self->writebuf[i] == '\r' || self->writebuf[i] == '\n')
+      self->writebuf[i] = ' ';
+
+  added = snprintf(self->writebuf + len,
+                   self->writebuf_size - len,
+                   "\r\n");
+  WRITEBUF_CHECK_AND_RESIZE(self, len, added, CMDSERV_CONNECTION_RESP_STATUS_REDO);
+
+  return cmdserv_connection_write(self, self->writebuf, len, MSG_NOSIGNAL);
+}
+
+/**
+ * Private method to send the output collected in respbuf as a RESP
+ * bulk string (or a null bulk string if there is none), in one write.
+ */
+static ssize_t cmdserv_connection_resp_bulk(cmdserv_connection* self) {
+  char header[RESP_HEADER_MAX];
+  size_t len = self->resplen;
+  int hlen;
+
+  self->replied = true;
+  self->resplen = 0;
+
+  if (len == 0)
+    return cmdserv_connection_write(self, "$-1\r\n", 5, MSG_NOSIGNAL);
+
+  /* The header goes into the room left in front of the data */
+  hlen = snprintf(header, sizeof(header), "$%zu\r\n", len);
+  memcpy(self->respbuf + RESP_HEADER_MAX - hlen, header, hlen);
+  memcpy(self->respbuf + RESP_HEADER_MAX + len, "\r\n", 2);
+
+  return cmdserv_connection_write(self,
+                                  self->respbuf + RESP_HEADER_MAX - hlen,
+                                  hlen + len + 2,
+                                  MSG_NOSIGNAL);
+}
+
+/**
+ * Private method to collect output for the RESP reply to the current
+ * command.
+ *
+ * Returns nbyte or -1 with errno set on failure.
+ */
+static ssize_t cmdserv_connection_resp_append(cmdserv_connection* self,
+                                              const void *buf,
+                                              size_t nbyte) {
+  size_t need = RESP_HEADER_MAX + self->resplen + nbyte + 2;
+
+  if (need > self->respsize) {
+    size_t new_size = self->respsize > 0 ? self->respsize : 1024;
+    char *new_respbuf;
+
+    while (need > new_size)
+      new_size *= 2;
+
+    if ((new_respbuf = realloc(self->respbuf, new_size)) == NULL)
+      return -1;
+
+    self->respbuf  = new_respbuf;
+    self->respsize = new_size;
+  }
+
+  memcpy(self->respbuf + RESP_HEADER_MAX + self->resplen, buf, nbyte);
+  self->resplen += nbyte;
+
+  return nbyte;
+}
+
+ssize_t cmdserv_connection_print(cmdserv_connection* self,
+                                 const char *str) {
+  return cmdserv_connection_send(self,
+                                 str,
+                                 strlen(str),
+                                 MSG_NOSIGNAL);
+}
+
+ssize_t cmdserv_connection_println(cmdserv_connection* self,
+                                   const char *str) {
+  return cmdserv_connection_printf(self, "%s%s", str, EOL(self));
+}
+
+ssize_t __attribute__ ((format (printf, 2, 3)))
+cmdserv_connection_printf(cmdserv_connection* self,
+                          const char *fmt, ...) {
+  ssize_t sent;
+  va_list args;
+  va_start(args, fmt);
+  sent = cmdserv_connection_vprintf(self, fmt, args);
+  va_end(args);
+  return sent;
+}
+
+ssize_t __attribute__ ((format (printf, 2, 0)))
+cmdserv_connection_vprintf(cmdserv_connection* self,
+                           const char *fmt, va_list ap) {
+  ssize_t len = 0, added;
+  va_list ap2;
+
+ CMDSERV_CONNECTION_VPRINTF_REDO:
+  va_copy(ap2, ap);
+  added = vsnprintf(self->writebuf, self->writebuf_size, fmt, ap2);
+  va_end(ap2);
+  WRITEBUF_CHECK_AND_RESIZE(self, len, added, CMDSERV_CONNECTION_VPRINTF_REDO);
+
+  return cmdserv_connection_send(self, self->writebuf, len, MSG_NOSIGNAL);
+}
+
+ssize_t cmdserv_connection_append_bytes(cmdserv_connection* self,
+                                        const void *buf,
+                                        size_t nbyte) {
+  if (self->framing == CMDSERV_FRAMING_RESP)
+    return cmdserv_connection_resp_append(self, buf, nbyte);
+
+  /* Large amounts are sent right away, together with what's there */
+  if (self->applen + nbyte > APPEND_MAX)
+    return cmdserv_connection_write(self, buf, nbyte, MSG_NOSIGNAL);
+
+  if (self->applen + nbyte > self->appsize) {
+    size_t new_size = self->appsize > 0 ? self->appsize : APPEND_MIN;
+    char *new_appbuf;
+
+    while (self->applen + nbyte > new_size)
+      new_size *= 2;
+
+    if ((new_appbuf = realloc(self->appbuf, new_size)) == NULL)
+      return -1;
+
+    self->appbuf  = new_appbuf;
+    self->appsize = new_size;
+  }
+
+  memcpy(self->appbuf + self->applen, buf, nbyte);
+  self->applen += nbyte;
+
+  return nbyte;
+}
+
+ssize_t cmdserv_connection_append_str(cmdserv_connection* self,
+                                      const char *str) {
+  return cmdserv_connection_append_bytes(self, str, strlen(str));
+}
+
+ssize_t cmdserv_connection_append_u64(cmdserv_connection* self,
+                                      uint64_t value) {
+  char digits[24];
+  size_t len = cmdserv_format_u64(digits + sizeof(digits), value);
+
+  return cmdserv_connection_append_bytes(self,
+                                         digits + sizeof(digits) - len, len);
+}
+
+ssize_t cmdserv_connection_append_i64(cmdserv_connection* self,
+                                      int64_t value) {
+  char digits[24];
+  size_t len = cmdserv_format_u64(digits + sizeof(digits),
+                                  value < 0
+                                  ? -(uint64_t)value
+                                  : (uint64_t)value);
+
+  if (value < 0)
+    digits[sizeof(digits) - ++len] = '-';
+
+  return cmdserv_connection_append_bytes(self,
+                                         digits + sizeof(digits) - len, len);
+}
+
+ssize_t cmdserv_connection_append_double(cmdserv_connection* self,
+                                         double value,
+                                         int precision) {
+  static const uint64_t scale[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+    1000000000
+  };
+  char digits[DBL_MAX_10_EXP + 32];
+  double magnitude = value < 0 ? -value : value;
+  double product, fraction, error;
+  uint64_t scaled;
+  size_t len;
+
+  if (precision < 0 || precision > 9) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Out of the exact range of a double: Leave it to printf() */
+  if (!isfinite(value)
+      || magnitude * scale[precision] >= 9007199254740992.0) {
+    int got = snprintf(digits, sizeof(digits), "%.*f", precision, value);
+
+    return cmdserv_connection_append_bytes(self, digits, got);
+  }
+
+  /* Round the exact product to nearest, ties to even, like printf() */
+  product  = magnitude * scale[precision];
+  scaled   = (uint64_t)product;
+  fraction = product - scaled;
+  error    = cmdserv_product_error(magnitude, scale[precision], product);
+  if (fraction > 0.5
+      || (!(fraction < 0.5)         /* exactly 0.5 */
+          && (error > 0 || (!(error < 0) && scaled % 2 == 1))))
+    scaled++;
+
+  if (precision > 0) {
+    /* The fraction, zero-padded, and the decimal point */
+    len = cmdserv_format_u64(digits + sizeof(digits),
+                             scaled % scale[precision]);
+    while (len < (size_t)precision)
+      digits[sizeof(digits) - ++len] = '0';
+    digits[sizeof(digits) - ++len] = '.';
+    scaled /= scale[precision];
+  } else {
+    len = 0;
+  }
+
+  len += cmdserv_format_u64(digits + sizeof(digits) - len, scaled);
+  if (signbit(value))
+    digits[sizeof(digits) - ++len] = '-';
+
+  return cmdserv_connection_append_bytes(self,
+                                         digits + sizeof(digits) - len, len);
+}
+
+ssize_t cmdserv_connection_append_status(cmdserv_connection* self,
+                                         int status,
+                                         const char *text) {
+  char code[4];
+  const char *eol = EOL(self);
+  ssize_t len = self->applen;
+
+  if (self->framing == CMDSERV_FRAMING_RESP)
+    return cmdserv_connection_send_status(self, status, "%s", text);
+
+  if (status < 100 || status > 999)
+    status = 500;
+
+  code[0] = '0' + status / 100;
+  code[1] = '0' + status / 10 % 10;
+  code[2] = '0' + status % 10;
+  code[3] = ' ';
+
+  if (cmdserv_connection_append_bytes(self, code, sizeof(code)) == -1
+      || cmdserv_connection_append_str(self, text) == -1
+      || cmdserv_connection_append_str(self, eol) == -1)
+    return -1;
+
+  len += sizeof(code) + strlen(text) + strlen(eol);
+
+  return cmdserv_connection_append_flush(self) == -1 ? -1 : len;
+}
+
+/**
+ * Private method to send what the append functions have collected.
+ *
+ * Returns 0 or -1 with errno set on failure.
+ */
+static int cmdserv_connection_append_flush(cmdserv_connection* self) {
+  size_t len = self->applen;
+
+  if (len == 0)
+    return 0;
+
+  self->applen = 0;
+
+  return cmdserv_connection_write(self, self->appbuf, len, MSG_NOSIGNAL)
+    == -1 ? -1 : 0;
+}
+
+/**
+ * Private function to calculate the rounding error of the product p
+ * of a and b exactly (Dekker's algorithm), i.e. a * b - p.
+ */
+static double cmdserv_product_error(double a, double b, double p) {
+  double ca = 134217729.0 * a, cb = 134217729.0 * b;
+  double ahi = ca - (ca - a), alo = a - ahi;
+  double bhi = cb - (cb - b), blo = b - bhi;
+
+  return ((ahi * bhi - p) + ahi * blo + alo * bhi) + alo * blo;
+}
+
+/**
+ * Private function to format value in decimal into the octets right
+ * in front of end (at most 20 of them).
+ *
+ * Returns the number of digits.
+ */
+static size_t cmdserv_format_u64(char *end, uint64_t value) {
+  char *p = end;
+
+  do {
+    *--p = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+
+  return end - p;
+}
+
+void cmdserv_connection_close(cmdserv_connection* self,
+                              enum cmdserv_close_reason reason) {
+  self->close_reason = (reason == CMDSERV_NO_CLOSE
+                        ? CMDSERV_APPLICATION_CLOSE
+                        : reason);
+
+  if (self->state == CMDSERV_CONNECTION_STATE_HANDLED)
+    return;
+
+  cmdserv_connection_log(self, CMDSERV_INFO, "closing");
+  TRACE(self, CMDSERV_TRACE_CLOSE, close, self->close_reason);
+
+  if (self->capture_fd != -1)
+    cmdserv_connection_capture(self, false, "X %llu %llu %d",
+                               (unsigned long long int)cmdserv_monotonic_ns(),
+                               self->id, self->close_reason);
+
+  if (self->close_handler)
+    self->close_handler(self->close_object, self, self->close_reason);
+
+  cmdserv_connection_free(self);
+}
+
+void cmdserv_connection_read(cmdserv_connection* self) {
+  size_t oldbuflen;
+  ssize_t received;
+
+  /* Completions on the error queue wake us up as readable, too */
+  cmdserv_connection_zerocopy_reap(self);
+
+  /* Room for output shows up as input: No new commands before it's out */
+  if (self->transport->room_readable
+      && cmdserv_connection_output_pending(self)
+      && (!cmdserv_connection_send_queued(self)
+          || cmdserv_connection_output_pending(self)))
+    return;
+
+ CMDSERV_CONNECTION_READ_REDO:
+  oldbuflen = self->buflen;
+  received  = self->transport->read(self->transport_object,
+                                    self->buf + self->buflen,
+                                    self->bufsize - self->buflen);
+
+  if (received == 0) {
+    cmdserv_connection_log(self, CMDSERV_INFO, "client disconnect");
+    cmdserv_connection_close(self, CMDSERV_CLIENT_DISCONNECT);
+    return;
+
+  } else if (received == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return;
+    cmdserv_connection_log(self, CMDSERV_ERR,
+                           "recv() error: %s", strerror(errno));
+    cmdserv_connection_close(self, CMDSERV_CLIENT_RECEIVE_ERROR);
+    return;
+  }
+
+  TRACE(self, CMDSERV_TRACE_RECV, recv, received);
+
+  self->time_last = time(NULL);
+
+  self->buflen += received;
+  if (self->buflen > self->buf_peak)
+    self->buf_peak = self->buflen;
+
+  if (self->framing == CMDSERV_FRAMING_AUTO)
+    self->framing = (self->buf[0] == CMDSERV_FRAME_MAGIC
+                     ? CMDSERV_FRAMING_BINARY
+                     : self->buf[0] == '*'
+                     ? CMDSERV_FRAMING_RESP
+                     : CMDSERV_FRAMING_LINE);
+
+  if (self->framing != CMDSERV_FRAMING_LINE) {
+    if (!(self->framing == CMDSERV_FRAMING_RESP
+          ? cmdserv_connection_read_resp(self)
+          : cmdserv_connection_read_frames(self)))
+      return;
+    goto CMDSERV_CONNECTION_READ_SHRINK;
+  }
+
+  if (self->body_handler != NULL) {
+    if (!cmdserv_connection_read_body(self)) {
+      cmdserv_connection_close(self, self->close_reason);
+      return;
+    }
+    oldbuflen = 0; /* Whatever follows the body hasn't been looked at */
+  }
+
+  if (self->body_handler == NULL
+      && !cmdserv_connection_read_lines(self, oldbuflen)) {
+    cmdserv_connection_close(self, self->close_reason);
+    return;
+  }
+
+  /* Make room for the rest of an incomplete line, as far as allowed */
+  if (self->buflen == self->bufsize
+      && (self->bufsize >= self->readbuf_size
+          || cmdserv_connection_resize_readbuf(self, self->bufsize + 1)
+          == NULL)) {
+    self->overflow = true;
+    self->buflen   = 0;
+  }
+
+ CMDSERV_CONNECTION_READ_SHRINK:
+  cmdserv_connection_shrink_readbuf(self);
+
+  /* Let the client decompress the responses to what was read */
+  if (self->zbuf != NULL && self->output == NULL
+      && cmdserv_connection_deflate_sync(self) == -1) {
+    cmdserv_connection_log(self, CMDSERV_ERR,
+                           "send() error: %s", strerror(errno));
+    cmdserv_connection_close(self, CMDSERV_CLIENT_SEND_ERROR);
+    return;
+  }
+
+  /* Readiness won't be signalled again for what the transport holds */
+  if (self->transport->pending
+      && self->transport->pending(self->transport_object))
+    goto CMDSERV_CONNECTION_READ_REDO;
+}
+
+void cmdserv_connection_datagram(cmdserv_connection* self,
+                                 const void *data,
+                                 size_t len,
+                                 bool truncated) {
+  const char *eol = EOL(self);
+  size_t eollen = strlen(eol);
+
+  TRACE(self, CMDSERV_TRACE_RECV, recv, len);
+
+  self->time_last = time(NULL);
+
+  if (truncated || len + eollen > self->readbuf_size) {
+    /* Answer it like a single overlong line */
+    self->overflow = true;
+    len = 0;
+  } else if (len == 0) {
+    return;
+  } else if (len + eollen > self->bufsize
+             && cmdserv_connection_resize_readbuf(self, len + eollen)
+             == NULL) {
+    self->overflow = true;
+    len = 0;
+  } else {
+    memcpy(self->buf, data, len);
+    if (len + eollen > self->buf_peak)
+      self->buf_peak = len + eollen;
+  }
+
+  /* The end of the datagram ends its last line */
+  if (len == 0
+      || self->buf[len - 1] != '\n'
+      || (self->lineterm == CMDSERV_LINETERM_CRLF
+          && (len < 2 || self->buf[len - 2] != '\r'))) {
+    memcpy(self->buf + len, eol, eollen);
+    len += eollen;
+  }
+
+  self->buflen = len;
+
+  /* There's no connection to close, just drop the rest */
+  if (!cmdserv_connection_read_lines(self, 0))
+    self->close_reason = CMDSERV_NO_CLOSE;
+
+  /* A body doesn't go on in the next datagram */
+  if (self->body_handler != NULL)
+    cmdserv_connection_end_body(self, false);
+
+  /* All output (like the rest of a generator's) goes into this reply */
+  while (self->output != NULL) {
+    if (cmdserv_connection_drain(self) == -1) {
+      struct cmdserv_output *output = self->output;
+
+      self->output = output->next;
+      self->output_len -= output->len;
+      cmdserv_connection_output_free(self, output);
+    }
+  }
+  self->output_last  = NULL;
+  self->output_len   = 0;
+  self->close_reason = CMDSERV_NO_CLOSE;
+
+  self->buflen   = 0;
+  self->overflow = false;
+
+  cmdserv_connection_shrink_readbuf(self);
+}
+
+/**
+ * Private method to handle all complete lines in the read buffer,
+ * looking for line terminators from offset from on (everything before
+ * has been looked at already).  What's left of an incomplete line is
+ * moved to the beginning of the buffer.
+ *
+ * Returns false as soon as a cmd_handler has asked for the connection
+ * to be closed, without closing it.
+ */
+static bool cmdserv_connection_read_lines(cmdserv_connection* self,
+                                          size_t from) {
+  for (size_t i = from; i < self->buflen; ) {
+    if (self->buf[i] == '\n'
+        && (self->lineterm == CMDSERV_LINETERM_LF
+            || self->lineterm == CMDSERV_LINETERM_CRLF_OR_LF
+            || (self->lineterm == CMDSERV_LINETERM_CRLF
+                && i > 0 && self->buf[i - 1] == '\r'))) {
+
+      /* End of line found: Parse it */
+      size_t eollen = 1;
+
+      TRACE(self, CMDSERV_TRACE_LINE, line, i + 1);
+
+      if (self->latency || self->capture_fd != -1)
+        self->time_line = cmdserv_monotonic_ns();
+
+      self->buf[i] = '\0';
+      if (self->lineterm == CMDSERV_LINETERM_CRLF
+          || (self->lineterm == CMDSERV_LINETERM_CRLF_OR_LF
+              && i > 0 && self->buf[i - 1] == '\r')) {
+        self->buf[i - 1] = '\0';
+        eollen = 2;
+      }
+
+      /* Keep a copy, the tokenizer is going to overwrite the line */
+      if (self->capture_fd != -1)
+        self->caplen = capture_escape(self->capbuf,
+                                      self->buf, i + 1 - eollen);
+      
+      self->state = CMDSERV_CONNECTION_STATE_HANDLED;
+      cmdserv_connection_handle_line(self, i + 1);
+      self->state = CMDSERV_CONNECTION_STATE_DEFAULT;
+
+      if (self->capture_fd != -1)
+        cmdserv_connection_capture(self, true, "L %llu %llu %llu ",
+                                   (unsigned long long int)self->time_line,
+                                   self->id,
+                                   (unsigned long long int)
+                                   (cmdserv_monotonic_ns() - self->time_line));
+
+      if (self->close_reason != CMDSERV_NO_CLOSE)
+        return false;
+
+      /* Move rest of buffer to beginning */
+      self->buflen -= i + 1;
+      memmove(self->buf,
+              self->buf + i + 1,
+              self->buflen);
+
+      /* The command may have declared that a body follows */
+      if (self->body_handler != NULL) {
+        if (!cmdserv_connection_read_body(self))
+          return false;
+        if (self->body_handler != NULL)
+          return true;
+      }
+
+      i = 0; /* Try again for one more line */
+    } else {
+      i++;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Private method to hand the body declared with
+ * cmdserv_connection_receive_body() on to the body_handler, as far as
+ * it's in the read buffer.  What's left after the body (or, while
+ * waiting for a terminator, a line that might still turn into it) is
+ * moved to the beginning of the buffer.
+ *
+ * Returns false as soon as the body_handler has asked for the
+ * connection to be closed, without closing it.
+ */
+static bool cmdserv_connection_read_body(cmdserv_connection* self) {
+  size_t used = 0;
+
+  while (self->body_handler != NULL) {
+    size_t len, skip = 0;
+    bool complete = false;
+
+    if (self->body_term == NULL) {
+      len = self->buflen - used;
+      if (len > self->body_left)
+        len = self->body_left;
+      self->body_left -= len;
+      complete = self->body_left == 0;
+    } else {
+      size_t termlen = strlen(self->body_term), pos = used;
+
+      while (pos < self->buflen) {
+        const char *line = self->buf + pos;
+        const char *eol = memchr(line, '\n', self->buflen - pos);
+        size_t linelen;
+
+        if (eol == NULL) {
+          linelen = self->buflen - pos;
+          /* Hold back what may still become the terminator line */
+          if (!self->body_bol
+              || linelen > termlen + 1
+              || memcmp(line, self->body_term,
+                        linelen < termlen ? linelen : termlen) != 0) {
+            pos = self->buflen;
+            self->body_bol = false;
+          }
+          break;
+        }
+
+        linelen = eol - line;
+        if (self->body_bol) {
+          size_t cmplen = linelen;
+
+          if (self->lineterm != CMDSERV_LINETERM_LF
+              && cmplen > 0 && line[cmplen - 1] == '\r')
+            cmplen--;
+          if (cmplen == termlen
+              && (cmplen < linelen || self->lineterm != CMDSERV_LINETERM_CRLF)
+              && memcmp(line, self->body_term, termlen) == 0) {
+            skip     = linelen + 1;
+            complete = true;
+            break;
+          }
+        }
+        pos += linelen + 1;
+        self->body_bol = true;
+      }
+
+      len = pos - used;
+    }
+
+    if (len > 0) {
+      self->state = CMDSERV_CONNECTION_STATE_HANDLED;
+      self->body_handler(self->body_object, self, self->buf + used, len);
+      self->state = CMDSERV_CONNECTION_STATE_DEFAULT;
+    }
+    used += len + skip;
+
+    if (self->close_reason != CMDSERV_NO_CLOSE)
+      break;
+
+    if (complete)
+      cmdserv_connection_end_body(self, true);
+    else if (len == 0 || used == self->buflen)
+      break;
+  }
+
+  self->buflen -= used;
+  memmove(self->buf, self->buf + used, self->buflen);
+
+  return self->close_reason == CMDSERV_NO_CLOSE;
+}
+
+/**
+ * Private method to finish the body of a command, calling its
+ * body_handler for the last time: With an empty chunk if it's
+ * complete, with NULL if it's cancelled.
+ */
+static void cmdserv_connection_end_body(cmdserv_connection* self,
+                                        bool complete) {
+  cmdserv_body_handler handler = self->body_handler;
+  void *body_object = self->body_object;
+  enum cmdserv_state state = self->state;
+
+  free(self->body_term);
+  self->body_handler = NULL;
+  self->body_object  = NULL;
+  self->body_term    = NULL;
+  self->body_left    = 0;
+
+  self->state = CMDSERV_CONNECTION_STATE_HANDLED;
+  handler(body_object, self, complete ? "" : NULL, 0);
+  self->state = state;
+}
+
+/**
+ * Private method to write one record to the capture file: The header
+ * formatted from fmt, the escaped line from capbuf if with_line is
+ * set, and a newline.
+ *
+ * On write errors, capturing is switched off for this connection.
+ */
+static void __attribute__ ((format (printf, 3, 4)))
+cmdserv_connection_capture(cmdserv_connection* self,
+                           bool with_line,
+                           const char *fmt, ...) {
+  char header[128];
+  va_list args;
+  int len;
+
+  va_start(args, fmt);
+  len = vsnprintf(header, sizeof(header), fmt, args);
+  va_end(args);
+
+  if (len < 0 || (size_t)len >= sizeof(header))
+    return;
+
+  if (writev(self->capture_fd,
+             (struct iovec[]){
+               { .iov_base = header,             .iov_len = len },
+               { .iov_base = self->capbuf,
+                 .iov_len  = with_line ? self->caplen : 0 },
+               { .iov_base = (char[]){ "\n" },  .iov_len = 1 }
+             }, 3) == -1) {
+    cmdserv_connection_log(self, CMDSERV_ERR,
+                           "capture write error, capturing disabled: %s",
+                           strerror(errno));
+    self->capture_fd = -1;
+  }
+}
+
+/**
+ * Read a 32 bit unsigned big endian number from p.
+ */
+static uint32_t frame_u32(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16
+    | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+/**
+ * Private method to handle all complete binary frames in the read
+ * buffer (see CMDSERV_FRAMING_BINARY).  The arguments are handed to
+ * the cmd_handler in place, only argv and argl are filled in.  What's
+ * left of an incomplete frame is moved to the beginning of the
+ * buffer, which is grown first if the frame wouldn't fit.
+ *
+ * Returns false if the connection has been closed (and freed).
+ */
+static bool cmdserv_connection_read_frames(cmdserv_connection* self) {
+  size_t pos = 0;
+
+  for (;;) {
+    unsigned char *frame = (unsigned char *)self->buf + pos;
+    unsigned int argc;
+    uint32_t bodylen;
+    size_t framelen;
+
+    /* Throw away what's still to come of an overlong frame */
+    if (self->skip > 0) {
+      size_t n = self->buflen - pos < self->skip
+        ? self->buflen - pos
+        : self->skip;
+      pos        += n;
+      self->skip -= n;
+      if (self->skip > 0)
+        break;
+      continue;
+    }
+
+    if (self->buflen - pos < CMDSERV_FRAME_HEADER)
+      break;
+
+    if (frame[0] != CMDSERV_FRAME_MAGIC || frame[1] != CMDSERV_FRAME_VERSION)
+      goto CMDSERV_CONNECTION_PROTOCOL_ERROR;
+
+    argc     = (unsigned int)frame[2] << 8 | frame[3];
+    bodylen  = frame_u32(frame + 4);
+    framelen = CMDSERV_FRAME_HEADER + (size_t)bodylen;
+
+    if (bodylen > self->frame_max
+        || framelen > self->frame_max
+        || (framelen > self->bufsize
+            && cmdserv_connection_resize_readbuf(self, framelen) == NULL)) {
+      /* Answer it like an overlong line, then skip it */
+      self->skip = framelen;
+      self->argv[0] = NULL;
+      self->argc    = CMDSERV_ERR_LINE_TOO_LONG;
+    } else if (self->buflen - pos < framelen) {
+      break;
+    } else {
+      unsigned char *arg = frame + CMDSERV_FRAME_HEADER;
+      unsigned char *end = arg + bodylen;
+
+      for (unsigned int i = 0; i < argc; i++) {
+        uint32_t len;
+
+        if (end - arg < 4)
+          goto CMDSERV_CONNECTION_PROTOCOL_ERROR;
+        len  = frame_u32(arg);
+        arg += 4;
+        if ((size_t)(end - arg) <= len || arg[len] != '\0')
+          goto CMDSERV_CONNECTION_PROTOCOL_ERROR;
+
+        if (i < self->argc_max) {
+          self->argv[i] = (char *)arg;
+          self->argl[i] = len;
+        }
+        arg += (size_t)len + 1;
+      }
+
+      if (arg != end)
+        goto CMDSERV_CONNECTION_PROTOCOL_ERROR;
+
+      if (argc > self->argc_max) {
+        self->argv[0] = NULL;
+        self->argc    = CMDSERV_ERR_TOO_MANY_ARGS;
+      } else {
+        self->argv[argc] = NULL;
+        self->argc       = argc;
+      }
+
+      pos += framelen;
+    }
+
+    if (!cmdserv_connection_handle_frame(self, framelen))
+      return false;
+  }
+
+  /* Move the incomplete rest to the beginning */
+  self->buflen -= pos;
+  memmove(self->buf, self->buf + pos, self->buflen);
+
+  return true;
+
+ CMDSERV_CONNECTION_PROTOCOL_ERROR:
+  cmdserv_connection_protocol_error(self);
+  return false;
+}
+
+/**
+ * Parse the header line of a RESP array (type '*') or bulk string
+ * (type '$') from the avail octets at p into n.
+ *
+ * Returns the length of the line, 0 if it's not complete yet or -1 if
+ * it's malformed.
+ */
+static ssize_t resp_header(const char *p, size_t avail, char type,
+                           size_t *n) {
+  size_t i;
+
+  if (avail == 0)
+    return 0;
+  if (p[0] != type)
+    return -1;
+
+  *n = 0;
+  for (i = 1; i < avail && p[i] >= '0' && p[i] <= '9'; i++) {
+    if (i > RESP_DIGITS_MAX)
+      return -1;
+    *n = *n * 10 + (p[i] - '0');
+  }
+
+  if (i + 2 > avail)
+    return i == avail || p[i] == '\r' ? 0 : -1;
+  if (i == 1 || p[i] != '\r' || p[i + 1] != '\n')
+    return -1;
+
+  return i + 2;
+}
+
+/**
+ * Private method to handle all complete RESP commands in the read
+ * buffer (see CMDSERV_FRAMING_RESP), just like
+ * cmdserv_connection_read_frames() does for binary frames.
+ *
+ * Returns false if the connection has been closed (and freed).
+ */
+static bool cmdserv_connection_read_resp(cmdserv_connection* self) {
+  size_t pos = 0, need = 0;
+
+  while (pos < self->buflen) {
+    char *frame = self->buf + pos;
+    size_t avail = self->buflen - pos, off, argc, arglen;
+    ssize_t hlen;
+
+    if ((hlen = resp_header(frame, avail, '*', &argc)) == -1)
+      goto CMDSERV_CONNECTION_PROTOCOL_ERROR;
+    if (hlen == 0) {
+      need = avail + 1;
+      goto CMDSERV_CONNECTION_RESP_INCOMPLETE;
+    }
+    off = hlen;
+
+    /* First check that the command is complete, then terminate */
+    for (size_t i = 0; i < argc; i++) {
+      if ((hlen = resp_header(frame + off, avail - off, '$', &arglen)) == -1)
+        goto CMDSERV_CONNECTION_PROTOCOL_ERROR;
+      if (hlen == 0) {
+        need = avail + 1;
+        goto CMDSERV_CONNECTION_RESP_INCOMPLETE;
+      }
+      off += hlen;
+
+      if (arglen > self->frame_max)
+        goto CMDSERV_CONNECTION_PROTOCOL_ERROR;
+      if (avail - off < arglen + 2) {
+        need = off + arglen + 2;
+        goto CMDSERV_CONNECTION_RESP_INCOMPLETE;
+      }
+      if (frame[off + arglen] != '\r' || frame[off + arglen + 1] != '\n')
+        goto CMDSERV_CONNECTION_PROTOCOL_ERROR;
+
+      if (i < self->argc_max) {
+        self->argv[i] = frame + off;
+        self->argl[i] = arglen;
+      }
+      off += arglen + 2;
+    }
+
+    for (size_t i = 0; i < argc && i < self->argc_max; i++)
+      self->argv[i][self->argl[i]] = '\0';
+
+    if (argc > self->argc_max) {
+      self->argv[0] = NULL;
+      self->argc    = CMDSERV_ERR_TOO_MANY_ARGS;
+    } else {
+      self->argv[argc] = NULL;
+      self->argc       = argc;
+    }
+
+    pos += off;
+
+    if (!cmdserv_connection_handle_frame(self, off))
+      return false;
+  }
+
+ CMDSERV_CONNECTION_RESP_INCOMPLETE:
+  if (need > self->frame_max
+      || (need > self->bufsize
+          && cmdserv_connection_resize_readbuf(self, need) == NULL))
+    goto CMDSERV_CONNECTION_PROTOCOL_ERROR;
+
+  /* Move the incomplete rest to the beginning */
+  self->buflen -= pos;
+  memmove(self->buf, self->buf + pos, self->buflen);
+
+  return true;
+
+ CMDSERV_CONNECTION_PROTOCOL_ERROR:
+  cmdserv_connection_protocol_error(self);
+  return false;
+}
+
+/**
+ * Private method to dispatch a command parsed from a binary frame or
+ * RESP array of framelen octets.
+ *
+ * Returns false if the connection has been closed (and freed).
+ */
+static bool cmdserv_connection_handle_frame(cmdserv_connection* self,
+                                            size_t framelen) {
+  TRACE(self, CMDSERV_TRACE_LINE, line, framelen);
+
+  if (self->latency)
+    self->time_line = cmdserv_monotonic_ns();
+
+  self->commands++;
+  self->state = CMDSERV_CONNECTION_STATE_HANDLED;
+  cmdserv_connection_dispatch(self, framelen);
+  self->state = CMDSERV_CONNECTION_STATE_DEFAULT;
+
+  if (self->close_reason != CMDSERV_NO_CLOSE) {
+    cmdserv_connection_close(self, self->close_reason);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Private method to give up on a client sending malformed frames.
+ */
+static void cmdserv_connection_protocol_error(cmdserv_connection* self) {
+  cmdserv_connection_log(self, CMDSERV_WARNING, "malformed frame");
+  cmdserv_connection_send_status(self, 400, "Malformed frame");
+  cmdserv_connection_close(self, CMDSERV_CLIENT_PROTOCOL_ERROR);
+}
+
+static void cmdserv_connection_handle_line(cmdserv_connection *self,
+                                           size_t linelen) {
+  self->commands++;
+
+  if (self->overflow) {
+    self->argv[0]  = NULL;
+    self->argc     = CMDSERV_ERR_LINE_TOO_LONG;
+    self->overflow = false;
+  } else if (self->tokenizer == NULL) {
     self->argv[0] = self->buf;
     self->argv[1] = NULL;
     self->argc    = 1;
@@ -446,6 +2784,22 @@ static void cmdserv_connection_handle_line(cmdserv_connection *self) {
     self->argc = self->tokenizer(self->buf, self->argv, self->argc_max + 1);
   }
 
+  cmdserv_connection_dispatch(self, linelen);
+}
+
+/**
+ * Private method to hand the command in argc/argv to the cmd_handler
+ * (or answer its error), whether it came from a line or a frame of len
+ * octets.
+ */
+static void cmdserv_connection_dispatch(cmdserv_connection *self,
+                                        size_t len) {
+  self->replied = false;
+  self->resplen = 0;
+
+  TRACE(self, CMDSERV_TRACE_TOKENIZED, tokenized,
+        self->argc > 0 ? self->argc : 0);
+
   if (self->argc < 0 && !self->forward_errors) {
     switch (self->argc) {
     case CMDSERV_ERR_TOO_MANY_ARGS:
@@ -462,9 +2816,26 @@ static void cmdserv_connection_handle_line(cmdserv_connection *self) {
       cmdserv_connection_send_status(self, 500, "Tokenizer error");
     }
   } else if (self->cmd_handler) {
-      self->cmd_handler(self->cmd_object, self, self->argc, self->argv);
+    const char *command = self->argc > 0 ? self->argv[0] : NULL;
+
+    TRACE(self, CMDSERV_TRACE_HANDLER_ENTRY, handler__entry, len);
+    INTERCEPT_CONTEXT(command);
+    self->cmd_handler(self->cmd_object, self, self->argc, self->argv);
+    INTERCEPT_CONTEXT(NULL);
+    TRACE(self, CMDSERV_TRACE_HANDLER_EXIT, handler__exit, len);
+
+    if (self->latency && command != NULL)
+      cmdserv_latency_record(self->latency, command,
+                             cmdserv_monotonic_ns() - self->time_line);
   }
 
+  /* RESP clients get a reply for every command */
+  if (self->framing == CMDSERV_FRAMING_RESP && !self->replied)
+    cmdserv_connection_resp_bulk(self);
+
+  /* The reply is complete: Send what was appended for it */
+  cmdserv_connection_append_flush(self);
+
   self->argc    = 0;
   self->argv[0] = NULL;
 }
@@ -474,6 +2845,50 @@ cmdserv_connection
                            unsigned long long int conn_id,
                            struct cmdserv_connection_config* config,
                            enum cmdserv_close_reason close_reason) {
+  return cmdserv_connection_accept(listener_fd, conn_id, config,
+                                   close_reason, false);
+}
+
+cmdserv_connection
+*cmdserv_connection_create_shm(int listener_fd,
+                               unsigned long long int conn_id,
+                               struct cmdserv_connection_config* config,
+                               enum cmdserv_close_reason close_reason) {
+  return cmdserv_connection_accept(listener_fd, conn_id, config,
+                                   close_reason, true);
+}
+
+cmdserv_connection
+*cmdserv_connection_create_transport(const struct cmdserv_transport *transport,
+                                     void *transport_object,
+                                     unsigned long long int conn_id,
+                                     struct cmdserv_connection_config* config,
+                                     enum cmdserv_close_reason close_reason) {
+  cmdserv_connection* self;
+
+  if ((self = cmdserv_connection_new(conn_id, config)) == NULL)
+    return NULL;
+
+  self->transport        = transport;
+  self->transport_object = transport_object;
+  self->fd               = transport->fd(transport_object);
+  snprintf(self->clienthost, sizeof(self->clienthost), "%s", transport->name);
+  snprintf(self->clientport, sizeof(self->clientport), "%llu", conn_id);
+
+  cmdserv_connection_open(self, close_reason);
+
+  return self;
+}
+
+/**
+ * Private method to allocate a new connection object with the
+ * default socket transport, but not yet connected to anything.
+ *
+ * Returns NULL with errno set on failure.
+ */
+static cmdserv_connection
+*cmdserv_connection_new(unsigned long long int conn_id,
+                        struct cmdserv_connection_config* config) {
   cmdserv_connection* self;
   int saverrno = 0;
 
@@ -482,6 +2897,9 @@ cmdserv_connection
 
   *self = (struct cmdserv_connection){
     .id            = conn_id,
+    .fd            = -1,
+    .transport     = &cmdserv_socket_transport,
+    .transport_object = &self->fd, /* socket transport: our fd */
     .clientaddrlen = sizeof(((struct cmdserv_connection *)NULL)->clientaddr),
     .clienthost    = { '\0' },
     .clientport    = { '\0' },
@@ -490,14 +2908,65 @@ cmdserv_connection
     .client_timeout= config->client_timeout,
     .writebuf_size = 1024,
     .readbuf_size  = config->readbuf_size,
+    .bufsize       = (config->readbuf_size < READBUF_MIN
+                      ? config->readbuf_size
+                      : READBUF_MIN),
     .buflen        = 0,
+    .buf_peak      = 0,
+    .buf_checked   = 0,
+    .buf_grown     = 0,
+    .buf_shrunk    = 0,
     .overflow      = false,
+    .body_handler  = NULL,
+    .body_object   = NULL,
+    .body_left     = 0,
+    .body_term     = NULL,
+    .body_bol      = true,
+    .commands      = 0,
+    .framing       = config->framing,
+    .frame_max     = (config->frame_max > config->readbuf_size
+                      ? config->frame_max
+                      : config->readbuf_size),
+    .skip          = 0,
     .argc_max      = config->argc_max,
+    .argl          = NULL,
+    .respbuf       = NULL,
+    .respsize      = 0,
+    .appbuf        = NULL,
+    .appsize       = 0,
+    .applen        = 0,
+    .resplen       = 0,
+    .replied       = false,
+    .output        = NULL,
+    .output_last   = NULL,
+    .output_len    = 0,
+    .output_full   = false,
+    .zerocopy_min  = config->zerocopy_min,
+    .zerocopy      = -1,
+    .zerocopy_sent = 0,
+    .zerocopy_done = 0,
+    .completing    = NULL,
+    .completing_last = NULL,
+    .compression   = 0,
+    .zstream       = NULL,
+    .zbuf          = NULL,
+    .zsize         = 0,
+    .zpos          = 0,
+    .zlen          = 0,
+    .zdirty        = false,
     .state         = CMDSERV_CONNECTION_STATE_DEFAULT,
     .close_reason  = CMDSERV_NO_CLOSE,
     .lineterm      = config->lineterm,
     .tokenizer     = config->tokenizer,
     .forward_errors= config->forward_errors,
+    .latency       = config->latency,
+    .time_line     = 0,
+    .trace_handler = config->trace_handler,
+    .trace_object  = config->trace_object,
+    .capture_fd    = config->capture_fd,
+    .capbuf        = NULL,
+    .capsize       = 0,
+    .caplen        = 0,
     .cmd_handler   = config->cmd_handler,
     .cmd_object    = config->cmd_object,
     .open_handler  = config->open_handler,
@@ -514,7 +2983,12 @@ cmdserv_connection
   }
   self->argv[0] = NULL;
 
-  if ((self->buf = calloc(self->readbuf_size, sizeof(char))) == NULL) {
+  if ((self->argl = calloc(self->argc_max + 1, sizeof(size_t))) == NULL) {
+    saverrno = errno;
+    goto CMDSERV_CONNECTION_ABORT;
+  }
+
+  if ((self->buf = calloc(self->bufsize, sizeof(char))) == NULL) {
     saverrno = errno;
     goto CMDSERV_CONNECTION_ABORT;
   }
@@ -524,6 +2998,62 @@ cmdserv_connection
     goto CMDSERV_CONNECTION_ABORT;
   }
 
+  if (self->capture_fd != -1) {
+    if ((self->capbuf = malloc(CAPTURE_ESCAPED_MAX(self->bufsize))) == NULL) {
+      saverrno = errno;
+      goto CMDSERV_CONNECTION_ABORT;
+    }
+    self->capsize = CAPTURE_ESCAPED_MAX(self->bufsize);
+  }
+
+  return self;
+
+ CMDSERV_CONNECTION_ABORT:
+  cmdserv_connection_free(self);
+  errno = saverrno;
+  return NULL;
+}
+
+/**
+ * Private method to announce a freshly connected connection: Log,
+ * trace and capture it, and call the open_handler.
+ */
+static void cmdserv_connection_open(cmdserv_connection* self,
+                                    enum cmdserv_close_reason close_reason) {
+  char client_info[CMDSERV_CLIENT_STR_MAX];
+
+  cmdserv_connection_log(self, CMDSERV_INFO,
+                         "connected from %s",
+                         cmdserv_connection_client_r(self, client_info,
+                                                     sizeof(client_info)));
+
+  TRACE(self, CMDSERV_TRACE_ACCEPT, accept, 0);
+
+  if (self->capture_fd != -1)
+    cmdserv_connection_capture(self, false, "C %llu %llu",
+                               (unsigned long long int)cmdserv_monotonic_ns(),
+                               self->id);
+
+  if (self->open_handler)
+    self->open_handler(self->open_object, self, close_reason);
+}
+
+/**
+ * Private constructor behind cmdserv_connection_create() and
+ * cmdserv_connection_create_shm().
+ */
+static cmdserv_connection
+*cmdserv_connection_accept(int listener_fd,
+                           unsigned long long int conn_id,
+                           struct cmdserv_connection_config* config,
+                           enum cmdserv_close_reason close_reason,
+                           bool shm) {
+  cmdserv_connection* self;
+  int saverrno = 0;
+
+  if ((self = cmdserv_connection_new(conn_id, config)) == NULL)
+    return NULL;
+
   self->fd = accept(listener_fd,
                     (struct sockaddr *)&self->clientaddr,
                     &self->clientaddrlen);
@@ -540,7 +3070,26 @@ cmdserv_connection
   assert(self->clientaddrlen
          <= sizeof(((struct cmdserv_connection *)NULL)->clientaddr));
 
-  {
+  if (self->clientaddr.ss_family == AF_UNIX) {
+    /*
+     * Unix domain socket clients are usually unnamed: Identify them
+     * by their process id where the system tells us.
+     */
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t credlen = sizeof(cred);
+
+    strcpy(self->clienthost, "unix");
+    if (getsockopt(self->fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) == 0)
+      snprintf(self->clientport, sizeof(self->clientport),
+               "pid %ld", (long)cred.pid);
+    else
+      strcpy(self->clientport, "?");
+#else
+    strcpy(self->clienthost, "unix");
+    strcpy(self->clientport, "?");
+#endif
+  } else {
     int gni_status
       = getnameinfo((struct sockaddr *)&self->clientaddr,
                     self->clientaddrlen,
@@ -599,16 +3148,22 @@ cmdserv_connection
     goto CMDSERV_CONNECTION_ABORT;
   }
 
-  {
-    char *client_info = cmdserv_connection_client(self);
-    cmdserv_connection_log(self, CMDSERV_INFO,
-                           "connected from %s",
-                           client_info);
-    free(client_info);
+  if (shm) {
+    cmdserv_shm *rings;
+
+    if ((rings = cmdserv_shm_attach(self->fd)) == NULL) {
+      saverrno = errno;
+      cmdserv_connection_log(self, CMDSERV_ERR,
+                             "cmdserv_shm_attach() error: %s",
+                             strerror(saverrno));
+      goto CMDSERV_CONNECTION_ABORT;
+    }
+    self->transport        = &cmdserv_shm_transport;
+    self->transport_object = rings;
+    strcpy(self->clienthost, cmdserv_shm_transport.name);
   }
 
-  if (self->open_handler)
-    self->open_handler(self->open_object, self, close_reason);
+  cmdserv_connection_open(self, close_reason);
 
   return self;
 
@@ -619,12 +3174,36 @@ cmdserv_connection
 }
 
 static void cmdserv_connection_free(cmdserv_connection* self) {
-  if (self->fd != -1)
-    close(self->fd);
+  if (self->body_handler != NULL)
+    cmdserv_connection_end_body(self, false);
+
+  self->transport->close(self->transport_object);
+
+  /* With the socket closed, the kernel is done with all buffers */
+  while (self->output != NULL) {
+    struct cmdserv_output *next = self->output->next;
+
+    cmdserv_connection_output_free(self, self->output);
+    self->output = next;
+  }
+  while (self->completing != NULL) {
+    struct cmdserv_output *next = self->completing->next;
+
+    cmdserv_connection_output_free(self, self->completing);
+    self->completing = next;
+  }
 
   free(self->argv);
+  free(self->argl);
+  free(self->respbuf);
   free(self->buf);
   free(self->writebuf);
+  free(self->appbuf);
+  free(self->capbuf);
+  free(self->body_term);
+  if (self->zstream != NULL)
+    cmdserv_connection_deflate_end(self->zstream);
+  free(self->zbuf);
 
   /* Be paranoid and zero out before freeing. */
   *self = (struct cmdserv_connection){
@@ -658,3 +3237,108 @@ static void *cmdserv_connection_resize_writebuf(cmdserv_connection* self,
 
   return self->writebuf;
 }
+
+/**
+ * Private method to grow the read buffer to at least req_size octets,
+ * doubling its size, but never beyond readbuf_size for lines or
+ * frame_max for binary frames and RESP commands.
+ *
+ * Returns NULL on failure, leaving the buffer as it was.
+ */
+static void *cmdserv_connection_resize_readbuf(cmdserv_connection* self,
+                                               size_t req_size) {
+  size_t max_size = (self->framing == CMDSERV_FRAMING_BINARY
+                     || self->framing == CMDSERV_FRAMING_RESP
+                     ? self->frame_max
+                     : self->readbuf_size);
+  size_t new_size = self->bufsize;
+  char *new_buf;
+
+  while (req_size > new_size)
+    new_size *= 2;
+  if (new_size > max_size)
+    new_size = max_size;
+
+  if (new_size <= self->bufsize)
+    return self->bufsize >= req_size ? self->buf : NULL;
+
+  /* The escaped copy for the capture has to hold the longest line */
+  if (self->capbuf != NULL) {
+    char *new_capbuf = realloc(self->capbuf, CAPTURE_ESCAPED_MAX(new_size));
+
+    if (new_capbuf == NULL) {
+      cmdserv_connection_log(self, CMDSERV_ERR,
+                             "failed to increase capture buffer to %zu "
+                             "octets: %s",
+                             CAPTURE_ESCAPED_MAX(new_size), strerror(errno));
+      return NULL;
+    }
+
+    self->capbuf  = new_capbuf;
+    self->capsize = CAPTURE_ESCAPED_MAX(new_size);
+  }
+
+  if ((new_buf = realloc(self->buf, new_size)) == NULL) {
+    cmdserv_connection_log(self, CMDSERV_ERR,
+                           "failed to increase read buffer to %zu octets: %s",
+                           new_size, strerror(errno));
+    return NULL;
+  }
+
+  cmdserv_connection_log(self, CMDSERV_DEBUG,
+                         "increased read buffer from %zu to %zu octets",
+                         self->bufsize, new_size);
+
+  self->bufsize = new_size;
+  self->buf     = new_buf;
+  self->buf_grown++;
+
+  return self->buf;
+}
+
+/**
+ * Private method to shrink a grown read buffer again, once
+ * READBUF_SHRINK_COMMANDS commands have been handled since the last
+ * check, if the input in the meantime would have fitted into a
+ * quarter of it (but never below READBUF_MIN).
+ *
+ * Failing to shrink is harmless: The buffer just stays as it was.
+ */
+static void cmdserv_connection_shrink_readbuf(cmdserv_connection* self) {
+  size_t new_size = self->bufsize;
+  char *new_buf;
+
+  if (self->commands - self->buf_checked < READBUF_SHRINK_COMMANDS)
+    return;
+
+  /* Only lines can be cut short: Don't undo room made for a frame */
+  if (self->framing != CMDSERV_FRAMING_LINE && self->buflen > 0)
+    return;
+
+  while (new_size / 2 >= READBUF_MIN
+         && new_size / 2 >= 2 * self->buf_peak
+         && new_size / 2 >= 2 * self->buflen)
+    new_size /= 2;
+
+  self->buf_checked = self->commands;
+  self->buf_peak    = self->buflen;
+
+  if (new_size == self->bufsize
+      || (new_buf = realloc(self->buf, new_size)) == NULL)
+    return;
+
+  cmdserv_connection_log(self, CMDSERV_DEBUG,
+                         "decreased read buffer from %zu to %zu octets",
+                         self->bufsize, new_size);
+
+  self->bufsize = new_size;
+  self->buf     = new_buf;
+  self->buf_shrunk++;
+
+  if (self->capbuf != NULL
+      && (new_buf = realloc(self->capbuf, CAPTURE_ESCAPED_MAX(new_size)))
+      != NULL) {
+    self->capbuf  = new_buf;
+    self->capsize = CAPTURE_ESCAPED_MAX(new_size);
+  }
+}
@@ -45,11 +45,14 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 
 #include "cmdserv_logger.h"
 #include "cmdserv_tokenize.h"
+#include "cmdserv_transport.h"
 struct cmdserv_connection_config;
 
 
@@ -109,6 +112,8 @@ enum cmdserv_close_reason {
   CMDSERV_CLIENT_DISCONNECT           = 490, /**< client closed connection  */
   CMDSERV_CLIENT_RECEIVE_ERROR        = 491, /**< error from recv()         */
   CMDSERV_CLIENT_TIMEOUT              = 492, /**< client inactivity         */
+  CMDSERV_CLIENT_PROTOCOL_ERROR       = 493, /**< malformed binary/RESP    */
+  CMDSERV_CLIENT_SEND_ERROR           = 494, /**< error from send()         */
 
   CMDSERV_SERVER_SHUTDOWN             = 590, /**< cmdserv_shutdown() called */
   CMDSERV_SERVER_TOO_MANY_CONNECTIONS = 591, /**< connections_max reached   */
@@ -179,6 +184,108 @@ enum cmdserv_lineterm {
 };
 
 
+/**
+ * Octet starting every binary frame, see CMDSERV_FRAMING_BINARY.
+ */
+#define CMDSERV_FRAME_MAGIC   0x00
+
+/**
+ * Version of the binary frame format, the second octet of a frame.
+ */
+#define CMDSERV_FRAME_VERSION 0x01
+
+/**
+ * Length of the header of a binary frame in octets.
+ */
+#define CMDSERV_FRAME_HEADER  8
+
+
+/**
+ * How commands are delimited on the wire.
+ */
+enum cmdserv_framing {
+  /**
+   * Commands are lines, split up into arguments by the tokenizer (see
+   * enum cmdserv_lineterm and cmdserv_connection_config::tokenizer).
+   */
+  CMDSERV_FRAMING_LINE,
+
+  /**
+   * Commands are binary frames: An 8 octet header, followed by the
+   * arguments, each one prefixed with its length and followed by a
+   * zero octet.  All numbers are unsigned and big endian:
+   *
+   *     octet 0     CMDSERV_FRAME_MAGIC
+   *     octet 1     CMDSERV_FRAME_VERSION
+   *     octets 2-3  argc (16 bit)
+   *     octets 4-7  number of octets following the header (32 bit)
+   *
+   *     per argument:
+   *       4 octets  length n of the argument (32 bit)
+   *       n octets  the argument, arbitrary binary data
+   *       1 octet   zero
+   *
+   * Nothing is scanned, tokenized or copied: The cmd_handler gets
+   * argv pointing right into the read buffer.  Thanks to the zero
+   * octets the arguments can still be used as C strings, binary
+   * arguments need cmdserv_connection_arglen() though.
+   *
+   * A frame must fit into the read buffer, which grows as needed up
+   * to cmdserv_connection_config::frame_max.  Frames that are longer
+   * are skipped, and the cmd_handler gets CMDSERV_ERR_LINE_TOO_LONG,
+   * just like for overlong lines.  Malformed frames close the
+   * connection with CMDSERV_CLIENT_PROTOCOL_ERROR.  Binary frames
+   * are not captured (see cmdserv_connection_config::capture_fd).
+   *
+   * Responses are sent as in line mode.
+   */
+  CMDSERV_FRAMING_BINARY,
+
+  /**
+   * Decide on the first octet received from the client: Binary if
+   * it's CMDSERV_FRAME_MAGIC (which never starts a line of text),
+   * RESP if it's '*', line mode otherwise.
+   */
+  CMDSERV_FRAMING_AUTO,
+
+  /**
+   * Commands are RESP2 arrays of bulk strings, as sent by Redis
+   * clients:
+   *
+   *     *<argc>\r\n  and per argument  $<length>\r\n<argument>\r\n
+   *
+   * Like with CMDSERV_FRAMING_BINARY, the arguments are binary safe
+   * and handed to the cmd_handler in place (the CR after each one is
+   * replaced by a zero octet), cmdserv_connection_arglen() gives
+   * their lengths.  Inline commands are not supported.  A command may
+   * be up to cmdserv_connection_config::frame_max octets long, longer
+   * and malformed ones close the connection with
+   * CMDSERV_CLIENT_PROTOCOL_ERROR.
+   *
+   * RESP clients expect exactly one reply per command, so the output
+   * of a command is collected and turned into a single reply:
+   *
+   *   - Whatever the print functions and cmdserv_connection_send()
+   *     write is buffered.  A status below 400 then sends it as a
+   *     bulk string, or as a simple string with the status text
+   *     ("+OK") if nothing was written.
+   *
+   *   - A status of 400 and above becomes an error with the status
+   *     text ("-ERR Too many arguments"), the buffered output is
+   *     dropped.
+   *
+   *   - A command without any status gets its output as a bulk
+   *     string, or a null bulk string if there was none.
+   *
+   * Line terminators in status texts are replaced by blanks.  A
+   * status sent outside of the cmd_handler (e.g. a greeting from the
+   * open_handler) still goes out as a simple string or error, which
+   * most RESP clients will not expect.
+   */
+  CMDSERV_FRAMING_RESP,
+};
+
+
 /**
  * For future expansion.
  *
@@ -197,6 +304,15 @@ enum cmdserv_string_treatment {
 typedef struct cmdserv_connection cmdserv_connection;
 
 
+/**
+ * A status line prepared once and sent by reference any number of
+ * times, on any connection, with cmdserv_connection_send_response().
+ *
+ * @see cmdserv_response_prepare()
+ */
+typedef struct cmdserv_response cmdserv_response;
+
+
 /**
  * Accept a new client connection from a listener.
  *
@@ -242,6 +358,55 @@ cmdserv_connection
                            struct cmdserv_connection_config* config,
                            enum cmdserv_close_reason close_reason);
 
+/**
+ * Accept a new client connection from a Unix domain socket listener
+ * and move it on to a pair of shared memory rings.
+ *
+ * Works like cmdserv_connection_create(), the client has to connect
+ * with cmdserv_shm_connect() though.  Only the readiness of the
+ * connection is still signalled on its file descriptor, all data
+ * passes through the rings.
+ *
+ * @see cmdserv_connection_create() cmdserv_shm.h
+ */
+cmdserv_connection
+*cmdserv_connection_create_shm(int listener_fd,
+                               unsigned long long int conn_id,
+                               struct cmdserv_connection_config* config,
+                               enum cmdserv_close_reason close_reason);
+
+/**
+ * Create a client connection on top of an already established
+ * transport instead of accepting it from a listener.
+ *
+ * Works like cmdserv_connection_create() otherwise.  The connection
+ * takes over the transport object and closes it through the
+ * transport when it's closed itself (but not if creating it fails).
+ * Its client host is the transport's name, the client port the
+ * connection ID.
+ *
+ * With a transport without file descriptor (like
+ * cmdserv_memory_transport), the connection can't be served by a
+ * cmdserv main server, the caller has to call
+ * cmdserv_connection_read() whenever there is input.
+ *
+ * @param transport
+ *
+ *     The functions of the transport.
+ *
+ * @param transport_object
+ *
+ *     The state of the transport handed to each of its functions.
+ *
+ * @see cmdserv_connection_create() cmdserv_transport.h
+ */
+cmdserv_connection
+*cmdserv_connection_create_transport(const struct cmdserv_transport *transport,
+                                     void *transport_object,
+                                     unsigned long long int conn_id,
+                                     struct cmdserv_connection_config* config,
+                                     enum cmdserv_close_reason close_reason);
+
 
 /**
  * Close a client connection.
@@ -339,8 +504,9 @@ cmdserv_connection_vlog(cmdserv_connection* connection,
  * truncated to below 512 characters.  Non-printable characters are
  * replaced by escape sequences.
  *
- * The method is not re-entrant.  It's also only valid to call it from
- * within a command handler.
+ * The method is not re-entrant, see
+ * cmdserv_connection_command_string_r() for that.  It's also only
+ * valid to call it from within a command handler.
  *
  * @param connection
  *
@@ -357,6 +523,19 @@ char *cmdserv_connection_command_string(cmdserv_connection* connection,
                                         enum cmdserv_string_treatment trtmt);
 
 
+/**
+ * Re-entrant version of cmdserv_connection_command_string(), writing
+ * the string into the size octets at buf (truncated to fit) instead
+ * of a static buffer.  Nothing is allocated.
+ *
+ * @return buf
+ */
+char *cmdserv_connection_command_string_r(cmdserv_connection* connection,
+                                          enum cmdserv_string_treatment trtmt,
+                                          char *buf,
+                                          size_t size);
+
+
 /**
  * Send a status line on this connection.
  *
@@ -389,6 +568,9 @@ char *cmdserv_connection_command_string(cmdserv_connection* connection,
  *     automatically appended depending on the current setting from
  *     enum cmdserv_lineterm and should not be added to the string.
  *
+ * With CMDSERV_FRAMING_RESP, the status becomes the RESP reply to the
+ * current command instead, see there.
+ *
  * @return The number of octets actually sent or -1 for errors.
  */
 ssize_t __attribute__ ((format (printf, 3, 4)))
@@ -397,16 +579,78 @@ cmdserv_connection_send_status(cmdserv_connection* connection,
                                const char *fmt, ...);
 
 
+/**
+ * Prepare a constant status line for cmdserv_connection_send_response().
+ *
+ * cmdserv_connection_send_status() formats its status line anew on
+ * every call.  For the replies a server sends over and over again
+ * ("200 OK", "404 Not found"), prepare a response object once instead,
+ * e.g. on start-up, and send it without any formatting or copying.
+ * The line terminator is still appended according to the lineterm
+ * setting of the connection it is sent on, and the RESP variant of
+ * the reply is prepared as well.
+ *
+ * @param status
+ *
+ *     A three-digit status between 100 and 999 (500 is used instead
+ *     for anything else), see cmdserv_connection_send_status().
+ *
+ * @param text
+ *
+ *     The human-readable part of the status line, without a line
+ *     terminator.
+ *
+ * @return The new response object, or NULL with errno set if it
+ *     couldn't be allocated.  Free it with cmdserv_response_free()
+ *     once it isn't sent anymore.
+ */
+cmdserv_response *cmdserv_response_prepare(int status, const char *text);
+
+
+/**
+ * Free a response object from cmdserv_response_prepare().
+ *
+ * It must not be referenced by any connection anymore at this point,
+ * which is the case as soon as cmdserv_connection_send_response() has
+ * returned.  NULL is ignored.
+ */
+void cmdserv_response_free(cmdserv_response *response);
+
+
+/**
+ * Send a prepared status line on this connection.
+ *
+ * The same as cmdserv_connection_send_status() with the status and
+ * text the response was prepared with, but without any formatting:
+ * The line and its terminator are handed to the client in one write,
+ * and only copied if the client can't take them right away.
+ *
+ * @return The number of octets sent or queued or -1 for errors.
+ *
+ * @see cmdserv_response_prepare()
+ */
+ssize_t cmdserv_connection_send_response(cmdserv_connection* connection,
+                                         const cmdserv_response *response);
+
+
 /**
  * Send nbyte bytes from the buffer pointed to by buf.
  *
- * This method behaves excactly like your system's send() call, with
- * the only exception being the first argument: A cmdserv connection
- * object instead of a file descriptor.  Refer to your system's
- * send() documentation for further details and semantics.
+ * This method behaves much like your system's send() call, with the
+ * first argument being a cmdserv connection object instead of a file
+ * descriptor.  Refer to your system's send() documentation for
+ * further details and semantics.
+ *
+ * The only difference: What the client can't take right now (all of
+ * it, if there is still output queued on the connection) is queued
+ * and sent later, when the client is ready, in order with the rest of
+ * the output (see cmdserv_connection_flush()).  So a short write is
+ * never reported, all of nbyte is either sent or queued.
  *
  * The library itself uses this method as the low-level operation for
- * all output to client connections.
+ * all output to client connections.  With CMDSERV_FRAMING_RESP, the
+ * data is only collected for the reply to the current command (and
+ * all of nbyte is reported as sent), see there.
  *
  * @param connection
  *
@@ -425,7 +669,7 @@ cmdserv_connection_send_status(cmdserv_connection* connection,
  *     Flags handed over to send().  Pass in MSG_NOSIGNAL unless you
  *     have installed a signal handler for SIGPIPE.
  *
- * @return The number of octets actually sent or -1 for errors.
+ * @return The number of octets sent or queued or -1 for errors.
  */
 ssize_t cmdserv_connection_send(cmdserv_connection* connection,
                                 const void *buf,
@@ -433,6 +677,302 @@ ssize_t cmdserv_connection_send(cmdserv_connection* connection,
                                 int flags);
 
 
+/**
+ * Send the iovcnt buffers described by iov, in this order.
+ *
+ * The same as calling cmdserv_connection_send() for each of the
+ * buffers, but they are handed to the client in one write (with
+ * sendmsg() on sockets) if there's no output queued, saving a system
+ * call per buffer and the copy into one buffer to avoid them.  Only
+ * what the client can't take right away is copied into the queue.
+ *
+ * @return The total length of the buffers, all of it sent or queued,
+ *     or -1 for errors.
+ *
+ * @see cmdserv_connection_send()
+ */
+ssize_t cmdserv_connection_sendv(cmdserv_connection* connection,
+                                 const struct iovec *iov,
+                                 int iovcnt,
+                                 int flags);
+
+
+/**
+ * Send len octets of a file, starting at offset, without copying
+ * them through user space.
+ *
+ * The transfer is queued in order with the other output of the
+ * connection and driven by the client's readiness: On a socket the
+ * octets go straight from the page cache to the socket with
+ * sendfile() where available, everywhere else (and on the other
+ * transports) they are read in chunks with pread().  With
+ * CMDSERV_FRAMING_RESP, the file is read into the reply collected
+ * for the current command right away.
+ *
+ * The file descriptor is duplicated, so you can close fd as soon as
+ * this returns.  The file must not shrink before it has been sent: A
+ * transfer ending early is logged and the rest of it is missing on
+ * the connection.
+ *
+ * @param connection
+ *
+ *     The cmdserv connection object to send on.
+ *
+ * @param fd
+ *
+ *     A file descriptor open for reading, on a file that supports
+ *     pread() (and, for sendfile(), mmap()).
+ *
+ * @param offset
+ *
+ *     Where in the file to start.
+ *
+ * @param len
+ *
+ *     Number of octets to send, or 0 for everything from offset to
+ *     the end of the file.
+ *
+ *     The file must not shrink while the transfer is queued: If it
+ *     ends before len octets went out, the client can't be told and
+ *     the connection is closed with CMDSERV_CLIENT_SEND_ERROR.
+ *
+ * @return 0 if the transfer was sent or queued, -1 with errno set on
+ *     errors.
+ */
+int cmdserv_connection_send_file(cmdserv_connection* connection,
+                                 int fd,
+                                 off_t offset,
+                                 size_t len);
+
+
+/**
+ * Callback releasing a buffer handed to
+ * cmdserv_connection_send_zerocopy() back to the application.
+ *
+ * @param release_object
+ *
+ *     The release_object given to cmdserv_connection_send_zerocopy().
+ *
+ * @param buf
+ *
+ *     The buffer, which may be reused or freed now.
+ */
+typedef void (*cmdserv_release_handler)(void *release_object,
+                                        const void *buf);
+
+/**
+ * Send len octets from buf without copying them into the kernel.
+ *
+ * Meant for large responses generated in memory: On a TCP socket,
+ * buffers of at least cmdserv_connection_config::zerocopy_min octets
+ * are sent with MSG_ZEROCOPY, so the kernel transmits right from the
+ * application's pages.  buf must therefore stay untouched until the
+ * kernel reports it has finished with it on the socket's error
+ * queue, after which release is called.  Shorter buffers, other
+ * transports, CMDSERV_FRAMING_RESP, and systems without MSG_ZEROCOPY
+ * take the usual copying path (and release is called right away).
+ * So does a connection where the kernel had to copy anyway, as it
+ * does on the loopback interface.
+ *
+ * Like all output, the buffer is sent in order with the rest of the
+ * output of the connection, queued if necessary.
+ *
+ * @param connection
+ *
+ *     The cmdserv connection object to send on.
+ *
+ * @param buf
+ *
+ *     The data to send.
+ *
+ * @param len
+ *
+ *     Number of octets to send.
+ *
+ * @param release
+ *
+ *     Called exactly once when buf is no longer needed: Possibly
+ *     before this returns, at the latest when the connection is
+ *     closed, and even if this fails.  May be NULL.
+ *
+ * @param release_object
+ *
+ *     Handed to release as its first argument.
+ *
+ * @return 0 if buf was sent or queued, -1 with errno set on errors.
+ */
+int cmdserv_connection_send_zerocopy(cmdserv_connection* connection,
+                                     const void *buf,
+                                     size_t len,
+                                     cmdserv_release_handler release,
+                                     void *release_object);
+
+
+/**
+ * Callback producing the next chunk of a response, see
+ * cmdserv_connection_send_generator().
+ *
+ * The generator must not send anything on the connection itself, nor
+ * close it.
+ *
+ * @param generator_object
+ *
+ *     The generator_object given to
+ *     cmdserv_connection_send_generator().
+ *
+ * @param connection
+ *
+ *     The cmdserv connection object the response is for.
+ *
+ * @param buf
+ *
+ *     Where to put the next chunk, or NULL if the connection is being
+ *     closed before the generator is done: It won't be called again
+ *     and should just free what it holds.
+ *
+ * @param size
+ *
+ *     The size of buf.
+ *
+ * @return The number of octets put into buf, 0 when done, or -1 on
+ *     errors.  The generator isn't called again after returning 0 or
+ *     -1.
+ */
+typedef ssize_t (*cmdserv_generator)(void *generator_object,
+                                     cmdserv_connection* connection,
+                                     void *buf,
+                                     size_t size);
+
+/**
+ * Send a response produced chunk by chunk by generator, as the client
+ * takes it.
+ *
+ * Instead of producing a huge response up front in the cmd_handler,
+ * register a generator: It's called to fill a buffer of
+ * CMDSERV_GENERATOR_CHUNK octets whenever the previous chunk has been
+ * sent, until it returns 0.  So the memory needed stays the same no
+ * matter how large the response grows, and the main cmdserv server
+ * object serves the other clients between chunks (at most
+ * CMDSERV_GENERATOR_ROUNDS of them per turn).  Like all output, the
+ * response keeps its place among the other output of the connection:
+ * What's sent after this call follows the generator's last chunk.
+ *
+ * If the generator fails (returns -1), the response can't be
+ * completed: The connection is closed with CMDSERV_APPLICATION_CLOSE.
+ *
+ * With CMDSERV_FRAMING_RESP, the generator is run to the end right
+ * away into the reply collected for the current command.
+ *
+ * @param connection
+ *
+ *     The cmdserv connection object to send on.
+ *
+ * @param generator
+ *
+ *     The callback producing the response.
+ *
+ * @param generator_object
+ *
+ *     Handed to generator as its first argument.
+ *
+ * @return 0 if the generator was registered (and possibly already run
+ *     to its end), -1 with errno set on errors.  On errors the
+ *     generator is called with buf NULL before this returns.
+ */
+int cmdserv_connection_send_generator(cmdserv_connection* connection,
+                                      cmdserv_generator generator,
+                                      void *generator_object);
+
+
+/**
+ * Size of the buffer a cmdserv_generator fills per call.
+ */
+#define CMDSERV_GENERATOR_CHUNK 16384
+
+/**
+ * Maximum number of chunks sent from generators per turn of a
+ * connection.
+ */
+#define CMDSERV_GENERATOR_ROUNDS 4
+
+
+/**
+ * Compress all output sent on this connection from now on (or stop
+ * doing so).
+ *
+ * The output becomes a zlib stream (RFC 1950) at the given level.  It's
+ * flushed (Z_SYNC_FLUSH) whenever all responses so far have been
+ * handed to the transport, so the client can always decompress
+ * everything it has received.  Output sent before the call, even if
+ * it's still queued, goes out as it is, so a command can negotiate
+ * compression, send its reply, and then switch it on.  Switching it
+ * off (or to another level) ends the stream.
+ *
+ * Compression is off by default and costs nothing then.  While it's
+ * on, files and buffers handed to cmdserv_connection_send_file() and
+ * cmdserv_connection_send_zerocopy() are copied through the
+ * compressor.  It's meant for stream connections, not for datagram
+ * listeners.
+ *
+ * @param connection
+ *
+ *     The cmdserv connection object.
+ *
+ * @param level
+ *
+ *     1 (fastest) to 9 (best compression), or 0 to switch compression
+ *     off.
+ *
+ * @return The previous level (0 if it was off), or -1 with errno set
+ *     on errors (EINVAL for an invalid level, ENOTSUP if cmdserv was
+ *     built without zlib).
+ */
+int cmdserv_connection_compression(cmdserv_connection* connection, int level);
+
+
+/**
+ * Retrieve the number of octets queued on the connection, waiting for
+ * the client to be ready (see cmdserv_connection_send()), including
+ * what's left of queued file transfers.
+ *
+ * @param connection
+ *
+ *     The cmdserv connection object.
+ *
+ * @return The number of queued octets, 0 if everything is sent.
+ */
+size_t cmdserv_connection_output_queued(cmdserv_connection* connection);
+
+
+/**
+ * Find out whether there is output waiting to be sent on the
+ * connection: Queued octets or a generator that isn't done yet.
+ *
+ * @param connection
+ *
+ *     The cmdserv connection object.
+ *
+ * @return true while cmdserv_connection_flush() has work to do.
+ */
+bool cmdserv_connection_output_pending(cmdserv_connection* connection);
+
+
+/**
+ * Find out how the connection learns that the client can take more
+ * of its pending output: Usually cmdserv_connection_fd() becomes
+ * writable, but once the shared memory rings are full it becomes
+ * readable, and cmdserv_connection_read() sends the output.
+ *
+ * @param connection
+ *
+ *     The cmdserv connection object.
+ *
+ * @return true if pending output waits for cmdserv_connection_fd()
+ *     to become readable.
+ */
+bool cmdserv_connection_room_readable(cmdserv_connection* connection);
+
+
 /**
  * Send a zero-terminated string over the connection.
  *
@@ -529,6 +1069,103 @@ ssize_t cmdserv_connection_vprintf(cmdserv_connection* connection,
                                    const char *fmt, va_list ap);
 
 
+/**
+ * Append nbyte octets from buf to the reply being built.
+ *
+ * The append functions build a reply piece by piece without going
+ * through printf(): Numbers are formatted by specialized code right
+ * into a buffer of the connection, and the whole reply goes to the
+ * client in one write once it's complete.  That's when
+ * cmdserv_connection_append_status() is called, when the command
+ * handler returns, or when cmdserv_connection_flush() is called,
+ * whatever happens first.  (Beyond a few kilobytes, the reply is sent
+ * on as it grows.)
+ *
+ * The append functions may be mixed freely with all the other output
+ * functions, the output always arrives in the order of the calls.
+ * With CMDSERV_FRAMING_RESP, appended output becomes part of the
+ * reply to the current command, like all output.
+ *
+ * @return The number of octets appended or -1 for errors.
+ *
+ * @see cmdserv_connection_append_str() cmdserv_connection_append_u64()
+ *     cmdserv_connection_append_i64() cmdserv_connection_append_double()
+ *     cmdserv_connection_append_status()
+ */
+ssize_t cmdserv_connection_append_bytes(cmdserv_connection* connection,
+                                        const void *buf,
+                                        size_t nbyte);
+
+
+/**
+ * Append the string str to the reply being built, see
+ * cmdserv_connection_append_bytes().
+ *
+ * @return The number of octets appended or -1 for errors.
+ */
+ssize_t cmdserv_connection_append_str(cmdserv_connection* connection,
+                                      const char *str);
+
+
+/**
+ * Append value in decimal to the reply being built, see
+ * cmdserv_connection_append_bytes().
+ *
+ * @return The number of octets appended or -1 for errors.
+ */
+ssize_t cmdserv_connection_append_u64(cmdserv_connection* connection,
+                                      uint64_t value);
+
+
+/**
+ * Append value in decimal, with a leading "-" if it's negative, to
+ * the reply being built, see cmdserv_connection_append_bytes().
+ *
+ * @return The number of octets appended or -1 for errors.
+ */
+ssize_t cmdserv_connection_append_i64(cmdserv_connection* connection,
+                                      int64_t value);
+
+
+/**
+ * Append value with precision digits after the decimal point to the
+ * reply being built, see cmdserv_connection_append_bytes().
+ *
+ * The output is the same as that of printf("%.*f", precision, value).
+ * Values too large to be scaled exactly, infinity and NaN are left to
+ * snprintf() itself.
+ *
+ * @param precision
+ *
+ *     The number of digits after the decimal point, from 0 (no
+ *     decimal point) to 9.
+ *
+ * @return The number of octets appended or -1 for errors (errno is
+ *     set to EINVAL for a precision out of range).
+ */
+ssize_t cmdserv_connection_append_double(cmdserv_connection* connection,
+                                         double value,
+                                         int precision);
+
+
+/**
+ * Append a status line to the reply being built and send it all.
+ *
+ * The status line is that of cmdserv_connection_send_status() with
+ * text as its human-readable part (taken literally, not as a format),
+ * and with CMDSERV_FRAMING_RESP this is cmdserv_connection_send_status()
+ * exactly.
+ *
+ * @return The number of octets sent or queued (including everything
+ *     appended before) or -1 for errors.
+ *
+ * @see cmdserv_connection_append_bytes()
+ */
+ssize_t cmdserv_connection_append_status(cmdserv_connection* connection,
+                                         int status,
+                                         const char *text);
+
+
 /**
  * Retrieve the file descriptor for this connection.
  *
@@ -620,6 +1257,71 @@ void cmdserv_connection_set_client_timeout(cmdserv_connection* connection, time_
 time_t cmdserv_connection_time_connected(cmdserv_connection* connection);
 
 
+/**
+ * Retrieve the number of command lines handled on this connection.
+ *
+ * Every completed line counts, including empty lines and lines
+ * rejected by the tokenizer.
+ *
+ * @param connection
+ *
+ *     The cmdserv connection object for which to retrieve the
+ *     command count.
+ *
+ * @return Number of command lines handled so far.
+ */
+unsigned long long int cmdserv_connection_commands(cmdserv_connection* connection);
+
+
+/**
+ * Retrieve the memory held by the buffers of this connection.
+ *
+ * @param connection
+ *
+ *     The cmdserv connection object for which to retrieve the
+ *     buffer size.
+ *
+ * @return Octets allocated for the read and write buffers, the
+ *     argument vector, and queued output.
+ */
+size_t cmdserv_connection_buffer_size(cmdserv_connection* connection);
+
+
+/**
+ * Retrieve how often the read buffer of this connection has been
+ * grown for a command that didn't fit.
+ *
+ * The read buffer starts out small and only grows (up to the
+ * readbuf_size, or the frame_max for binary frames and RESP) while
+ * commands need it; after a while of shorter commands it's shrunk
+ * again.
+ *
+ * @see cmdserv_connection_readbuf_shrunk()
+ *
+ * @param connection
+ *
+ *     The cmdserv connection object for which to retrieve the count.
+ *
+ * @return Number of times the read buffer has been grown.
+ */
+unsigned long long int cmdserv_connection_readbuf_grown(cmdserv_connection* connection);
+
+
+/**
+ * Retrieve how often the read buffer of this connection has been
+ * shrunk again after a while of shorter commands.
+ *
+ * @see cmdserv_connection_readbuf_grown()
+ *
+ * @param connection
+ *
+ *     The cmdserv connection object for which to retrieve the count.
+ *
+ * @return Number of times the read buffer has been shrunk.
+ */
+unsigned long long int cmdserv_connection_readbuf_shrunk(cmdserv_connection* connection);
+
+
 /**
  * Set a new tokenizer to be used with this connection (and retrieve
  * the current one).
@@ -642,6 +1344,130 @@ cmdserv_tokenizer cmdserv_connection_tokenizer(cmdserv_connection* connection,
                                                cmdserv_tokenizer tokenizer);
 
 
+/**
+ * Set the framing of commands for this connection (and retrieve the
+ * current one).
+ *
+ * Should only be changed before anything has been read from the
+ * client, e.g. in the open_handler.  With CMDSERV_FRAMING_AUTO, the
+ * framing returned later on is the one decided on, once the first
+ * octet has arrived.
+ *
+ * @see enum cmdserv_framing cmdserv_connection_config::framing
+ *
+ * @param connection
+ *
+ *     The cmdserv connection object for which to set the framing.
+ *
+ * @param framing
+ *
+ *     The new framing.
+ *
+ * @return The previous framing.
+ */
+enum cmdserv_framing cmdserv_connection_framing(cmdserv_connection* connection,
+                                                enum cmdserv_framing framing);
+
+
+/**
+ * The length of one argument of the command currently handled, for
+ * arguments that may contain zero octets (with
+ * CMDSERV_FRAMING_BINARY).  Only valid from within the cmd_handler.
+ *
+ * @param connection
+ *
+ *     The cmdserv connection object handed to the cmd_handler.
+ *
+ * @param arg
+ *
+ *     Index of the argument in argv.
+ *
+ * @return The length of argv[arg] in octets, or 0 if there is no
+ *     such argument.
+ */
+size_t cmdserv_connection_arglen(cmdserv_connection* connection, int arg);
+
+
+/**
+ * Callback receiving the body of a command chunk by chunk, see
+ * cmdserv_connection_receive_body().
+ *
+ * Like the cmd_handler, it may send output on the connection and close
+ * it (which cancels the rest of the body).
+ *
+ * @param body_object
+ *
+ *     The body_object given to cmdserv_connection_receive_body().
+ *
+ * @param connection
+ *
+ *     The cmdserv connection object the body arrives on.
+ *
+ * @param chunk
+ *
+ *     The next chunk of the body, only valid during the call.  On the
+ *     last call it's an empty chunk (len 0) if the body is complete,
+ *     or NULL if the connection is being closed before.
+ *
+ * @param len
+ *
+ *     The length of chunk in octets.
+ */
+typedef void (*cmdserv_body_handler)(void *body_object,
+                                     cmdserv_connection* connection,
+                                     const void *chunk,
+                                     size_t len);
+
+/**
+ * Declare that input following the current command line is its body,
+ * to be handed to handler instead of being parsed as commands.  Only
+ * valid from within the cmd_handler, with CMDSERV_FRAMING_LINE.
+ *
+ * The body is either the next len octets or, with a terminator, all
+ * lines up to (not including) the first line that consists of just
+ * the terminator.  It's passed on in chunks as it is received, without
+ * being collected first, so it may be much larger than the
+ * readbuf_size.  Once the body is complete (or cancelled), the
+ * handler is called a last time and parsing of command lines resumes.
+ * The response to the command is usually sent from that last call.
+ *
+ * For a datagram, the body ends with the datagram at the latest: If
+ * it isn't complete by then, it's cancelled.
+ *
+ * @param connection
+ *
+ *     The cmdserv connection object handed to the cmd_handler.
+ *
+ * @param len
+ *
+ *     Length of the body in octets, if terminator is NULL.  A body of
+ *     length 0 is complete right away.
+ *
+ * @param terminator
+ *
+ *     The line ending the body (without line termination), or NULL
+ *     for a body of len octets.  Must be shorter than the readbuf_size
+ *     minus two.
+ *
+ * @param handler
+ *
+ *     The callback receiving the body.
+ *
+ * @param body_object
+ *
+ *     Handed to handler as its first argument.
+ *
+ * @return 0 on success, -1 with errno set on errors (EINVAL if not
+ *     called from within the cmd_handler of a line framed command or
+ *     with an overlong terminator).
+ */
+int cmdserv_connection_receive_body(cmdserv_connection* connection,
+                                    size_t len,
+                                    const char *terminator,
+                                    cmdserv_body_handler handler,
+                                    void *body_object);
+
+
 /**
  * Retrieve human-readable client information for this connection.
  *
@@ -666,6 +1492,25 @@ cmdserv_tokenizer cmdserv_connection_tokenizer(cmdserv_connection* connection,
 char *cmdserv_connection_client(cmdserv_connection* connection);
 
 
+/**
+ * Size of a buffer large enough for any string returned by
+ * cmdserv_connection_client_r().
+ */
+#define CMDSERV_CLIENT_STR_MAX 386
+
+
+/**
+ * Re-entrant version of cmdserv_connection_client(), writing the
+ * client address into the size octets at buf (truncated to fit)
+ * instead of allocating it.
+ *
+ * @return buf
+ */
+char *cmdserv_connection_client_r(cmdserv_connection* connection,
+                                  char *buf,
+                                  size_t size);
+
+
 /**
  * Trigger a read on the connection.
  *
@@ -694,4 +1539,60 @@ char *cmdserv_connection_client(cmdserv_connection* connection);
  */
 void cmdserv_connection_read(cmdserv_connection* connection);
 
+
+/**
+ * Send as much of the output queued on the connection as the client
+ * takes right now, after what the append functions have collected
+ * (see cmdserv_connection_append_bytes()).
+ *
+ * The main cmdserv server object calls this whenever the client is
+ * ready for more, and doesn't read commands from the client while
+ * output is queued.  Like cmdserv_connection_read(), this method is
+ * exposed for testing and users with special needs.
+ *
+ * Note that a connection is closed (and the cmdserv_connection object
+ * free()'d!) with CMDSERV_CLIENT_SEND_ERROR if sending fails, see
+ * cmdserv_connection_read().
+ *
+ * @param connection
+ *
+ *     The cmdserv connection object to send on.
+ */
+void cmdserv_connection_flush(cmdserv_connection* connection);
+
+
+/**
+ * Handle one datagram as input to the connection, instead of reading
+ * from its transport: Each line in it is a command, the end of the
+ * datagram ends the last line as well.  Nothing is carried over to
+ * the next datagram.
+ *
+ * Used for UDP listeners (see cmdserv_udp.h), where one connection
+ * object serves all the datagrams arriving.  A datagram must fit into
+ * the read buffer, one that doesn't (or that was truncated) is
+ * answered like an overlong line.  A cmdserv_connection_close() from
+ * the cmd_handler only drops the rest of the datagram, the connection
+ * stays open.  Only CMDSERV_FRAMING_LINE is supported.
+ *
+ * @param connection
+ *
+ *     The cmdserv connection object to handle the datagram.
+ *
+ * @param data
+ *
+ *     The datagram.
+ *
+ * @param len
+ *
+ *     The length of the datagram in octets.
+ *
+ * @param truncated
+ *
+ *     Whether the datagram was longer than what was received.
+ */
+void cmdserv_connection_datagram(cmdserv_connection* connection,
+                                 const void *data,
+                                 size_t len,
+                                 bool truncated);
+
 #endif /* CMDSERV_CONNECTION_H */
@@ -8,6 +8,9 @@ struct cmdserv_connection_config cmdserv_connection_config_get_defaults() {
     .argc_max      = 8,
     .lineterm      = CMDSERV_LINETERM_CRLF_OR_LF,
     .tokenizer     = CMDSERV_TOKENIZER_DEFAULT,
+    .framing       = CMDSERV_FRAMING_LINE,
+    .frame_max     = 1024 * 1024,
+    .zerocopy_min  = 64 * 1024,
     .forward_errors= false,
     .cmd_handler   = NULL,
     .cmd_object    = NULL,
@@ -18,5 +21,9 @@ struct cmdserv_connection_config cmdserv_connection_config_get_defaults() {
     .log_handler   = &cmdserv_logger_stderr,
     .log_object    = NULL,
     .client_timeout= 0,
+    .latency       = NULL,
+    .trace_handler = NULL,
+    .trace_object  = NULL,
+    .capture_fd    = -1,
   };
 }
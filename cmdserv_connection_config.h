@@ -46,6 +46,8 @@
 #define CMDSERV_CONNECTION_CONFIG_H
 
 #include "cmdserv_connection.h"
+#include "cmdserv_latency.h"
+#include "cmdserv_trace.h"
 
 
 /**
@@ -65,7 +67,12 @@ struct cmdserv_connection_config {
    *
    * One command must fit into the buffer completely. Thus, this setting
    * limits the maximum length of a command in octets (including the
-   * line terminators).
+   * line terminators).  The buffer starts out small and only grows up
+   * to this size while a longer line is coming in, so a generous limit
+   * doesn't cost memory on connections with short commands.  Bulk data
+   * following a command is better streamed with
+   * cmdserv_connection_receive_body() than sent as one huge command
+   * line.
    */
   size_t readbuf_size;
 
@@ -99,6 +106,35 @@ struct cmdserv_connection_config {
    */
   cmdserv_tokenizer tokenizer;
 
+  /**
+   * How commands are delimited: Lines of text (the default), binary
+   * frames with length-prefixed arguments, RESP2 arrays, or decided
+   * on the first octet from the client.  Can be overridden per
+   * listener with the "binary:" and "resp:" prefixes (see
+   * cmdserv_config::listen) and per connection with
+   * cmdserv_connection_framing().
+   *
+   * @see enum cmdserv_framing
+   */
+  enum cmdserv_framing framing;
+
+  /**
+   * The maximum length of a binary frame or RESP command in octets
+   * (including its header).  The read buffer grows up to this length
+   * for longer frames.  Ignored in line mode, where readbuf_size is
+   * the limit.
+   */
+  size_t frame_max;
+
+  /**
+   * The minimum length of a buffer handed to
+   * cmdserv_connection_send_zerocopy() to be sent with MSG_ZEROCOPY.
+   * Pinning the pages and reaping the completion costs more than
+   * copying small buffers, so shorter ones are copied as usual.  Set
+   * to 0 to never use MSG_ZEROCOPY.
+   */
+  size_t zerocopy_min;
+
   /**
    * Decide if errors should be propagated from the tokenizer stage to
    * your command handler.
@@ -208,6 +244,66 @@ struct cmdserv_connection_config {
    * detected.
    */
   time_t client_timeout;
+
+  /**
+   * Record the latency of every command handled into these
+   * histograms.
+   *
+   * The time measured runs from the completion of the command line
+   * up to the return of the cmd_handler and is recorded under the
+   * name of the command (argv[0]).  Empty lines and tokenizer errors
+   * are not recorded.  The same object may be shared by many
+   * connections.  NULL (the default) disables the measurement.
+   *
+   * The cmdserv server sets this up on its own if
+   * cmdserv_config::latency_commands_max is set.
+   *
+   * @see cmdserv_latency_create() cmdserv_server_latency()
+   */
+  cmdserv_latency *latency;
+
+  /**
+   * This callback is called at every trace point along the lifecycle
+   * of the connection (accept, recv, line complete, tokenize done,
+   * handler entry and exit, send, and close).
+   *
+   * It gets the connection id, a byte count and a monotonic
+   * timestamp and can be used to attribute latency within the
+   * library.  NULL (the default) disables the callback, leaving only
+   * the USDT probes (if compiled in).
+   *
+   * @see cmdserv_trace.h enum cmdserv_trace_point
+   */
+  cmdserv_trace_handler trace_handler;
+
+  /**
+   * A pointer to an arbitrary object that will be handed over to you
+   * again in your trace_handler callback as the first argument. Set
+   * it to NULL if you don't need that.
+   */
+  void *trace_object;
+
+  /**
+   * Capture the traffic of the connection into this file descriptor
+   * for later replay (see t/replay.c).  -1 (the default) disables
+   * capturing.
+   *
+   * One record per line is appended, the timestamps are monotonic
+   * nanoseconds (see cmdserv_monotonic_ns()):
+   *
+   *     C <timestamp> <conn id>
+   *     L <timestamp> <conn id> <handler ns> <line>
+   *     X <timestamp> <conn id> <close reason>
+   *
+   * for connect, every line received (without its line terminator,
+   * with backslashes and non-printable bytes escaped as \\ and \xHH),
+   * and close.  The timestamp of a line is the time it was completed,
+   * the handler time runs from there until the cmd_handler returned.
+   *
+   * The file descriptor may be shared by many connections and is
+   * never closed by the connection.
+   */
+  int capture_fd;
 };
 
 
@@ -1,76 +1,103 @@
 #include "cmdserv_helpers.h"
 
 #include <stdio.h>
+#include <string.h>
 
 #define CMDSERV_DURATION_DAYS_LEN 21
 
-static char duration[  /* - */    1
-                     + /* days */ CMDSERV_DURATION_DAYS_LEN
-                     + /* time */ 8
-                     + /* nul */  1];
+static char duration[CMDSERV_DURATION_STR_MAX];
 
 char* cmdserv_duration_str(time_t begin, time_t end) {
-  char* strp = duration;
+  return cmdserv_duration_str_r(begin, end, duration, sizeof(duration));
+}
+
+char* cmdserv_duration_str_r(time_t begin, time_t end,
+                             char *buf, size_t size) {
+  char days_str[CMDSERV_DURATION_DAYS_LEN + 1] = "";
   time_t dur = end - begin;
   time_t days;
-  int len;
 
-  if (dur < 0) {
-    *(strp++) = '-';
+  if (dur < 0)
     dur = -dur;
-  }
 
   days = dur / 86400;
 
   if (days > 0) {
-    len = snprintf(strp,
-                   CMDSERV_DURATION_DAYS_LEN + 1,
-                   "%lldd ",
-                   (long long int)days);
+    if (snprintf(days_str, sizeof(days_str), "%lldd ", (long long int)days)
+        > CMDSERV_DURATION_DAYS_LEN)
+      snprintf(days_str, sizeof(days_str), "?d ");
 
-    if (len > CMDSERV_DURATION_DAYS_LEN)
-      len = sprintf(strp, "?d ");
-
-    strp += len;
-    dur  -= days * 86400;
+    dur -= days * 86400;
   }
 
-  sprintf(strp, "%02d:%02d:%02d",
-          (int)(dur / 3600),
-          (int)((dur % 3600) / 60),
-          (int)((dur % 3600) % 60));
+  snprintf(buf, size, "%s%s%02d:%02d:%02d",
+           end < begin ? "-" : "",
+           days_str,
+           (int)(dur / 3600),
+           (int)((dur % 3600) / 60),
+           (int)((dur % 3600) % 60));
 
-  return duration;
+  return buf;
 }
 
 
-#define LOGSAFE_BUFLEN 512
-
-static char logsafe_string[LOGSAFE_BUFLEN];
+static char logsafe_string[CMDSERV_LOGSAFE_STR_MAX];
 
 char* cmdserv_logsafe_str(const char *s) {
-  size_t i;
+  return cmdserv_logsafe_str_r(s, logsafe_string, sizeof(logsafe_string));
+}
+
+char* cmdserv_logsafe_str_r(const char *s, char *buf, size_t size) {
+  size_t len = 0;
+
+  cmdserv_logsafe_append(buf, size, &len, s, strlen(s));
+
+  return buf;
+}
 
-  for (i = 0; *s != '\0' && i < (LOGSAFE_BUFLEN - (4 + 3 + 1)); s++) {
-    if (*s >= ' ' && *s <= '~') {
-      if (*s == '\\')
-        logsafe_string[i++] = '\\';
-      logsafe_string[i++] = *s;
+bool cmdserv_logsafe_append(char *buf, size_t size, size_t *len,
+                            const char *s, size_t n) {
+  /* Room for the longest escape, the dots, and the terminator */
+  size_t limit = size > (4 + 3 + 1) ? size - (4 + 3 + 1) : 0;
+  size_t i = *len;
+
+  for (; n > 0 && i < limit; s++, n--) {
+    unsigned char c = *s;
+
+    if (c >= ' ' && c <= '~') {
+      if (c == '\\')
+        buf[i++] = '\\';
+      buf[i++] = c;
     } else {
-      logsafe_string[i++] = '\\';
-      logsafe_string[i++] = ((*s)        >> 6) + '0';
-      logsafe_string[i++] = ((*s & 0070) >> 3) + '0';
-      logsafe_string[i++] = ((*s & 0007)     ) + '0';
+      buf[i++] = '\\';
+      buf[i++] = ((c)        >> 6) + '0';
+      buf[i++] = ((c & 0070) >> 3) + '0';
+      buf[i++] = ((c & 0007)     ) + '0';
     }
   }
 
-  if (*s != '\0') {
-    logsafe_string[i++] = '.';
-    logsafe_string[i++] = '.';
-    logsafe_string[i++] = '.';
+  if (n > 0 && size >= 4) {
+    if (i > size - 4)
+      i = size - 4;
+    buf[i++] = '.';
+    buf[i++] = '.';
+    buf[i++] = '.';
   }
-  
-  logsafe_string[i] = '\0';
-  
-  return logsafe_string;
+
+  if (size > 0)
+    buf[i < size ? i : size - 1] = '\0';
+
+  *len = i;
+
+  return n == 0;
+}
+
+
+uint64_t cmdserv_monotonic_ns(void) {
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+    return 0;
+
+  return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
 }
@@ -28,8 +28,23 @@
 #ifndef CMDSERV_HELPERS_H
 #define CMDSERV_HELPERS_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 
+/**
+ * Size of a buffer large enough for any string returned by
+ * cmdserv_duration_str_r().
+ */
+#define CMDSERV_DURATION_STR_MAX 31
+
+/**
+ * Size of the buffer used by cmdserv_logsafe_str(), and a sensible
+ * size for cmdserv_logsafe_str_r().
+ */
+#define CMDSERV_LOGSAFE_STR_MAX 512
+
 /**
  * Formats the difference between two points in time as a
  * human-readable duration string.
@@ -43,7 +58,7 @@
  * other use of functions from time.h, though).  The buffer for the
  * returned string is statically allocated.  Do not call free() on it.
  * And note that it will be overwritten by the next call to this
- * function.
+ * function.  Use cmdserv_duration_str_r() where that matters.
  *
  * @param begin
  *
@@ -58,6 +73,19 @@
 char* cmdserv_duration_str(time_t begin, time_t end);
 
 
+/**
+ * Re-entrant version of cmdserv_duration_str(), formatting the
+ * duration into the size octets at buf instead of a static buffer.
+ *
+ * A buffer of CMDSERV_DURATION_STR_MAX octets is large enough for any
+ * duration, the string is truncated to fit into smaller ones.
+ *
+ * @return buf
+ */
+char* cmdserv_duration_str_r(time_t begin, time_t end,
+                             char *buf, size_t size);
+
+
 /**
  * Replaces everything but printable US-ASCII characters in
  * zero-terminated string s.
@@ -72,8 +100,9 @@ char* cmdserv_duration_str(time_t begin, time_t end);
  *
  * This function is not re-entrant.  The buffer for the returned
  * string is statically allocated and limited to 512 octets.  Do not
- * call free() on it.  And not that it will be overwritten ty the next
- * call to this function.
+ * call free() on it.  And note that it will be overwritten by the next
+ * call to this function.  Use cmdserv_logsafe_str_r() where that
+ * matters.
  *
  * If the input string results in an output string that would not fit
  * safely into the 512 octet buffer, the rest of the string is
@@ -87,4 +116,48 @@ char* cmdserv_duration_str(time_t begin, time_t end);
  */
 char* cmdserv_logsafe_str(const char *s);
 
+
+/**
+ * Re-entrant version of cmdserv_logsafe_str(), writing the output
+ * string into the size octets at buf instead of a static buffer.
+ *
+ * The output is truncated (and appended with "...") as for
+ * cmdserv_logsafe_str(), but to fit into size octets.  The size
+ * should be at least 8 octets to leave room for anything but the
+ * dots.
+ *
+ * @return buf
+ */
+char* cmdserv_logsafe_str_r(const char *s, char *buf, size_t size);
+
+
+/**
+ * Appends the n octets at s, escaped as by cmdserv_logsafe_str(), to
+ * the string of *len octets in the size octets at buf, and updates
+ * *len.
+ *
+ * Builds a log-safe string from several pieces without putting them
+ * together first: If a piece doesn't fit completely, it is truncated
+ * and appended with "..." like by cmdserv_logsafe_str(), and nothing
+ * further should be appended.  The string in buf is zero-terminated
+ * after every call.
+ *
+ * @return true if all of s fit, false if it was truncated.
+ */
+bool cmdserv_logsafe_append(char *buf, size_t size, size_t *len,
+                            const char *s, size_t n);
+
+
+/**
+ * Returns the current time of the monotonic system clock in
+ * nanoseconds.
+ *
+ * The origin of the clock is unspecified, so the value is only
+ * useful to measure durations.  Returns 0 if the monotonic clock is
+ * not available.
+ *
+ * @return Nanoseconds since an arbitrary, but fixed point in time.
+ */
+uint64_t cmdserv_monotonic_ns(void);
+
 #endif /* CMDSERV_HELPERS_H */
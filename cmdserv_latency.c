@@ -0,0 +1,220 @@
+#include "cmdserv_latency.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Number of bits used for the linear sub-buckets within one power of
+ * two: 4 bits give 16 sub-buckets and thus a relative error of at
+ * most 1/16.
+ */
+#define SUB_BITS    4
+#define SUB_COUNT   (1 << SUB_BITS)
+
+/**
+ * Values above 2^MAX_BITS - 1 nanoseconds (about 18 minutes) are all
+ * counted in the topmost bucket.  The exact maximum is kept anyway.
+ */
+#define MAX_BITS    40
+#define MAX_VALUE   ((UINT64_C(1) << MAX_BITS) - 1)
+
+#define BUCKETS     ((MAX_BITS - SUB_BITS - 1) * SUB_COUNT + 2 * SUB_COUNT)
+
+struct cmdserv_latency_entry {
+  char name[CMDSERV_LATENCY_NAME_LEN];
+  unsigned long long int count;
+  uint64_t max;
+  uint64_t sum;
+  uint64_t buckets[BUCKETS];
+};
+
+struct cmdserv_latency {
+  unsigned int commands_max;      /**< named entries (w/o "other")    */
+  unsigned int commands;          /**< named entries in use           */
+  unsigned int index_mask;        /**< size of index minus one        */
+  unsigned int *index;            /**< hash -> entry number plus one  */
+  struct cmdserv_latency_entry entry[];
+};
+
+
+/**
+ * Position of the highest bit set in v (v must not be zero).
+ */
+static inline unsigned int highest_bit(uint64_t v) {
+#if defined(__GNUC__)
+  return 63 - __builtin_clzll(v);
+#else
+  unsigned int bit = 0;
+  while (v >>= 1)
+    bit++;
+  return bit;
+#endif
+}
+
+/**
+ * Map a value to its bucket: Values below 2 * SUB_COUNT get a bucket
+ * of their own, above that each power of two is split linearly into
+ * SUB_COUNT buckets.
+ */
+static inline unsigned int bucket_of(uint64_t v) {
+  unsigned int shift;
+
+  if (v > MAX_VALUE)
+    v = MAX_VALUE;
+  if (v < 2 * SUB_COUNT)
+    return (unsigned int)v;
+
+  shift = highest_bit(v) - SUB_BITS;
+  return shift * SUB_COUNT + (unsigned int)(v >> shift);
+}
+
+/**
+ * The highest value that maps to the given bucket.
+ */
+static uint64_t bucket_highest(unsigned int bucket) {
+  unsigned int shift;
+
+  if (bucket < 2 * SUB_COUNT)
+    return bucket;
+
+  shift = bucket / SUB_COUNT - 1;
+  return ((uint64_t)(bucket % SUB_COUNT + SUB_COUNT) << shift)
+    + ((UINT64_C(1) << shift) - 1);
+}
+
+static uint64_t entry_percentile(struct cmdserv_latency_entry *e,
+                                 unsigned int permille) {
+  unsigned long long int rank = (e->count * permille + 999) / 1000;
+  unsigned long long int seen = 0;
+
+  if (rank == 0)
+    rank = 1;
+
+  for (unsigned int bucket = 0; bucket < BUCKETS; bucket++) {
+    seen += e->buckets[bucket];
+    if (seen >= rank) {
+      uint64_t v = bucket_highest(bucket);
+      return v < e->max ? v : e->max;
+    }
+  }
+
+  return e->max;
+}
+
+static unsigned int name_hash(const char *name) {
+  unsigned int hash = 2166136261u; /* FNV-1a */
+
+  for (size_t i = 0; name[i] != '\0' && i < CMDSERV_LATENCY_NAME_LEN - 1; i++)
+    hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+
+  return hash;
+}
+
+static struct cmdserv_latency_entry *entry_for(cmdserv_latency *self,
+                                               const char *name) {
+  for (unsigned int slot = name_hash(name) & self->index_mask;
+       ;
+       slot = (slot + 1) & self->index_mask) {
+
+    if (self->index[slot] == 0) {
+      struct cmdserv_latency_entry *e;
+
+      if (self->commands == self->commands_max)
+        return &self->entry[self->commands_max];
+
+      e = &self->entry[self->commands];
+      strncpy(e->name, name, CMDSERV_LATENCY_NAME_LEN - 1);
+      e->name[CMDSERV_LATENCY_NAME_LEN - 1] = '\0';
+      self->index[slot] = ++self->commands;
+      return e;
+    }
+
+    if (strncmp(self->entry[self->index[slot] - 1].name,
+                name, CMDSERV_LATENCY_NAME_LEN - 1) == 0)
+      return &self->entry[self->index[slot] - 1];
+  }
+}
+
+cmdserv_latency *cmdserv_latency_create(unsigned int commands_max) {
+  cmdserv_latency *self;
+  unsigned int index_size = 2;
+
+  while (index_size < 2 * commands_max)
+    index_size *= 2;
+
+  if ((self = calloc(1, sizeof(struct cmdserv_latency)
+                     + (sizeof(struct cmdserv_latency_entry)
+                        * (commands_max + 1))))
+      == NULL)
+    return NULL;
+
+  if ((self->index = calloc(index_size, sizeof(unsigned int))) == NULL) {
+    int saverrno = errno;
+    free(self);
+    errno = saverrno;
+    return NULL;
+  }
+
+  self->commands_max = commands_max;
+  self->index_mask   = index_size - 1;
+  cmdserv_latency_reset(self);
+
+  return self;
+}
+
+void cmdserv_latency_free(cmdserv_latency *self) {
+  if (self == NULL)
+    return;
+
+  free(self->index);
+  free(self);
+}
+
+void cmdserv_latency_record(cmdserv_latency *self,
+                            const char *command,
+                            uint64_t ns) {
+  struct cmdserv_latency_entry *e = entry_for(self, command);
+
+  e->count++;
+  e->sum += ns;
+  e->buckets[bucket_of(ns)]++;
+  if (ns > e->max)
+    e->max = ns;
+}
+
+unsigned int cmdserv_latency_stats(cmdserv_latency *self,
+                                   struct cmdserv_latency_stats *stats,
+                                   unsigned int stats_max) {
+  unsigned int n = 0;
+
+  for (unsigned int i = 0; i <= self->commands_max && n < stats_max; i++) {
+    struct cmdserv_latency_entry *e = &self->entry[i];
+
+    if (e->count == 0)
+      continue;
+
+    memcpy(stats[n].command, e->name, CMDSERV_LATENCY_NAME_LEN);
+    stats[n].count = e->count;
+    stats[n].p50   = entry_percentile(e, 500);
+    stats[n].p99   = entry_percentile(e, 990);
+    stats[n].p999  = entry_percentile(e, 999);
+    stats[n].max   = e->max;
+    stats[n].sum   = e->sum;
+    n++;
+  }
+
+  return n;
+}
+
+unsigned int cmdserv_latency_stats_max(cmdserv_latency *self) {
+  return self->commands_max + 1;
+}
+
+void cmdserv_latency_reset(cmdserv_latency *self) {
+  memset(self->index, 0, (self->index_mask + 1) * sizeof(unsigned int));
+  memset(self->entry, 0,
+         sizeof(struct cmdserv_latency_entry) * (self->commands_max + 1));
+  strcpy(self->entry[self->commands_max].name, CMDSERV_LATENCY_OTHER);
+  self->commands = 0;
+}
@@ -0,0 +1,179 @@
+/**
+ * @file cmdserv_latency.h
+ *
+ * Per-command latency histograms.
+ *
+ * @author    Beat Vontobel <beat.vontobel@futhark.ch>
+ * @version   1.0.0
+ * @copyright 2014, Beat Vontobel
+ *
+ * A cmdserv_latency object keeps one log-linear histogram (in the
+ * style of HdrHistogram) of command latencies per command name.  The
+ * cmdserv_connection records the time from the completion of a
+ * command line up to the return of the cmd_handler into it, keyed by
+ * argv[0].
+ *
+ * All memory is allocated once by cmdserv_latency_create().
+ * Recording a sample does not allocate and costs a hash lookup plus
+ * a few integer operations, so the histograms can be left enabled in
+ * production.  Each bucket covers a value range of at most 1/16 of
+ * its lower bound, i.e. reported values are accurate to about 6%.
+ *
+ * @section LICENSE
+ *
+ *     This program is free software; you can redistribute it and/or
+ *     modify it under the terms of the GNU General Public License as
+ *     published by the Free Software Foundation; either version 2 of
+ *     the License, or (at your option) any later version.
+ *
+ *     This program is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public
+ *     License along with this program; if not, write to the Free
+ *     Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *     Boston, MA 02110-1301, USA.
+ *
+ * @see cmdserv_config::latency_commands_max cmdserv_server_latency()
+ */
+
+#ifndef CMDSERV_LATENCY_H
+#define CMDSERV_LATENCY_H
+
+#include <stdint.h>
+
+
+/**
+ * The maximum length of a command name tracked separately (including
+ * the terminating zero).  Longer names are truncated.
+ */
+#define CMDSERV_LATENCY_NAME_LEN 32
+
+/**
+ * The name under which samples are recorded once the table of
+ * command names is full.
+ */
+#define CMDSERV_LATENCY_OTHER "*"
+
+
+/**
+ * A table of latency histograms, one per command name.
+ */
+typedef struct cmdserv_latency cmdserv_latency;
+
+
+/**
+ * Latency summary for one command.
+ *
+ * All latencies are in nanoseconds.
+ *
+ * @see cmdserv_latency_stats()
+ */
+struct cmdserv_latency_stats {
+  char command[CMDSERV_LATENCY_NAME_LEN]; /**< argv[0] of the command */
+  unsigned long long int count;           /**< number of samples      */
+  uint64_t p50;                           /**< median                 */
+  uint64_t p99;                           /**< 99th percentile        */
+  uint64_t p999;                          /**< 99.9th percentile      */
+  uint64_t max;                           /**< exact maximum          */
+  uint64_t sum;                           /**< exact sum of samples   */
+};
+
+
+/**
+ * Create a new, empty table of latency histograms.
+ *
+ * Returns NULL on failure with errno set by an underlying library.
+ *
+ * @param commands_max
+ *
+ *     The number of distinct command names to track.  Samples for
+ *     further commands are all recorded under the name
+ *     CMDSERV_LATENCY_OTHER.
+ *
+ * @return A new cmdserv_latency object or NULL on failure.
+ */
+cmdserv_latency *cmdserv_latency_create(unsigned int commands_max);
+
+
+/**
+ * Free a table of latency histograms.
+ *
+ * @param latency
+ *
+ *     The cmdserv_latency object to free.  May be NULL.
+ */
+void cmdserv_latency_free(cmdserv_latency *latency);
+
+
+/**
+ * Record one latency sample.
+ *
+ * @param latency
+ *
+ *     The cmdserv_latency object to record into.
+ *
+ * @param command
+ *
+ *     The zero-terminated name of the command (usually argv[0]).
+ *
+ * @param ns
+ *
+ *     The latency in nanoseconds.
+ */
+void cmdserv_latency_record(cmdserv_latency *latency,
+                            const char *command,
+                            uint64_t ns);
+
+
+/**
+ * Retrieve the latency summaries for all commands seen so far.
+ *
+ * The summaries are written to the caller-provided array stats in no
+ * particular order.  At most stats_max summaries are written.
+ *
+ * @param latency
+ *
+ *     The cmdserv_latency object to report on.
+ *
+ * @param stats
+ *
+ *     Array of at least stats_max elements to fill in.
+ *
+ * @param stats_max
+ *
+ *     The number of elements in stats.
+ *
+ * @return The number of summaries written to stats.
+ */
+unsigned int cmdserv_latency_stats(cmdserv_latency *latency,
+                                   struct cmdserv_latency_stats *stats,
+                                   unsigned int stats_max);
+
+
+/**
+ * The number of summaries cmdserv_latency_stats() may have to write:
+ * One for each distinct command tracked plus the one for
+ * CMDSERV_LATENCY_OTHER.
+ *
+ * @param latency
+ *
+ *     The cmdserv_latency object to report on.
+ *
+ * @return The number of elements stats needs to get all summaries.
+ */
+unsigned int cmdserv_latency_stats_max(cmdserv_latency *latency);
+
+
+/**
+ * Reset all histograms and forget all command names.
+ *
+ * @param latency
+ *
+ *     The cmdserv_latency object to reset.
+ */
+void cmdserv_latency_reset(cmdserv_latency *latency);
+
+#endif /* CMDSERV_LATENCY_H */
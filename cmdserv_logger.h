@@ -40,6 +40,14 @@
 #define CMDSERV_LOGGER_H
 
 
+/**
+ * Length up to which log messages are formatted in a buffer on the
+ * stack by cmdserv_log() and cmdserv_connection_log().  Only longer
+ * ones are allocated.
+ */
+#define CMDSERV_LOG_MSG_MAX 512
+
+
 /**
  * The severity levels for the logging methods.
  *
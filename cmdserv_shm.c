@@ -0,0 +1,640 @@
+/* for memfd_create() in sys/mman.h */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "intercept.h"
+#include "cmdserv_helpers.h"
+#include "cmdserv_shm.h"
+
+#ifdef __linux__
+
+#define SHM_MAGIC      0x636d6473 /* "cmds" */
+#define SHM_VERSION    2
+#define SHM_CACHELINE  64
+#define SHM_DATA_OFFSET 4096
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/**
+ * The control block of one ring.  Producer and consumer fields live
+ * on separate cache lines, so that the two sides don't keep stealing
+ * the line from each other.  The positions are free running, the
+ * number of octets in the ring is always tail - head.
+ */
+struct shm_ring {
+  uint32_t tail;                   /**< written by the producer only     */
+  char pad_tail[SHM_CACHELINE - sizeof(uint32_t)];
+  uint32_t head;                   /**< written by the consumer only     */
+  char pad_head[SHM_CACHELINE - sizeof(uint32_t)];
+  uint32_t waiting;                /**< consumer wants a doorbell        */
+  uint32_t full;                   /**< producer waits for room          */
+  uint32_t closed;                 /**< producer is gone                 */
+  char pad_flags[SHM_CACHELINE - 3 * sizeof(uint32_t)];
+};
+
+/**
+ * The start of the shared memory, followed by the data of the client
+ * to server ring at SHM_DATA_OFFSET and then the data of the server
+ * to client ring.
+ */
+struct shm_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t ring_size;
+  char pad[SHM_CACHELINE - 3 * sizeof(uint32_t)];
+  struct shm_ring c2s;             /**< client to server                 */
+  struct shm_ring s2c;             /**< server to client                 */
+};
+
+struct cmdserv_shm {
+  bool server;                     /**< which end we are                 */
+  int sockfd;                      /**< Unix socket (doorbell to server) */
+  int eventfd;                     /**< doorbell to the client           */
+  struct shm_header *header;
+  size_t maplen;
+  struct shm_ring *rx, *tx;        /**< our receive and send ring        */
+  char *rxdata, *txdata;
+  uint32_t mask;                   /**< ring_size - 1                    */
+  bool eof;                        /**< peer closed the socket           */
+  uint64_t spin_ns;                /**< client: spin before blocking     */
+};
+
+
+static size_t shm_ring_used(struct shm_ring *ring) {
+  return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)
+    - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Copy up to len octets into the ring and publish them.
+ */
+static size_t shm_ring_put(struct shm_ring *ring, char *data, uint32_t mask,
+                           const void *buf, size_t len) {
+  uint32_t tail = ring->tail;
+  uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  size_t room = mask + 1 - (tail - head);
+  size_t first;
+
+  if (len > room)
+    len = room;
+
+  first = mask + 1 - (tail & mask);
+  if (first > len)
+    first = len;
+  memcpy(data + (tail & mask), buf, first);
+  memcpy(data, (const char *)buf + first, len - first);
+
+  __atomic_store_n(&ring->tail, tail + (uint32_t)len, __ATOMIC_RELEASE);
+  return len;
+}
+
+/**
+ * Copy up to len octets out of the ring and release their room.
+ */
+static size_t shm_ring_get(struct shm_ring *ring, const char *data,
+                           uint32_t mask, void *buf, size_t len) {
+  uint32_t head = ring->head;
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  size_t first;
+
+  if (len > (size_t)(tail - head))
+    len = tail - head;
+
+  first = mask + 1 - (head & mask);
+  if (first > len)
+    first = len;
+  memcpy(buf, data + (head & mask), first);
+  memcpy((char *)buf + first, data, len - first);
+
+  __atomic_store_n(&ring->head, head + (uint32_t)len, __ATOMIC_RELEASE);
+  return len;
+}
+
+/**
+ * Announce that the consumer of ring is about to wait for a doorbell.
+ * Returns false (and withdraws the announcement) if data arrived in
+ * the meantime: The producer publishes before it checks the flag, we
+ * set the flag before we check for data, so one of the two always
+ * sees the other.
+ */
+static bool shm_ring_wait(struct shm_ring *ring) {
+  __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+  if (shm_ring_used(ring) == 0
+      && !__atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST))
+    return true;
+  __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+  return false;
+}
+
+/**
+ * Announce that the producer of ring waits for room, the same way
+ * shm_ring_wait() does for the consumer.  Returns false (and
+ * withdraws the announcement) if room was made in the meantime.
+ */
+static bool shm_ring_wait_room(struct shm_ring *ring, uint32_t mask) {
+  __atomic_store_n(&ring->full, 1, __ATOMIC_SEQ_CST);
+  if (shm_ring_used(ring) > mask)
+    return true;
+  __atomic_store_n(&ring->full, 0, __ATOMIC_RELAXED);
+  return false;
+}
+
+/**
+ * Ring the doorbell of the peer: The eventfd of the client or the
+ * socket of the server.
+ */
+static void shm_ring_bell(cmdserv_shm *self) {
+  if (self->server) {
+    uint64_t one = 1;
+    if (write(self->eventfd, &one, sizeof(one)) == -1) {
+      /* Counter overflow only: The client will be woken up anyway */
+    }
+  } else {
+    send(self->sockfd, "", 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+  }
+}
+
+/**
+ * Ring the doorbell of the peer after publishing data on our send
+ * ring, if the peer is waiting for it.
+ */
+static void shm_doorbell(cmdserv_shm *self) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_exchange_n(&self->tx->waiting, 0, __ATOMIC_SEQ_CST))
+    shm_ring_bell(self);
+}
+
+/**
+ * Ring the doorbell of the peer after taking data off our receive
+ * ring, if the peer is waiting for room.
+ */
+static void shm_room_doorbell(cmdserv_shm *self) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_exchange_n(&self->rx->full, 0, __ATOMIC_SEQ_CST))
+    shm_ring_bell(self);
+}
+
+static void shm_unmap(cmdserv_shm *self) {
+  if (self->header != NULL)
+    munmap(self->header, self->maplen);
+  if (self->eventfd != -1)
+    close(self->eventfd);
+  free(self);
+}
+
+/**
+ * Fill in the ring pointers of self for its side of the connection.
+ */
+static void shm_setup(cmdserv_shm *self, struct shm_header *header,
+                      size_t maplen) {
+  char *c2sdata = (char *)header + SHM_DATA_OFFSET;
+  char *s2cdata = c2sdata + header->ring_size;
+
+  self->header = header;
+  self->maplen = maplen;
+  self->mask   = header->ring_size - 1;
+  self->rx     = self->server ? &header->c2s : &header->s2c;
+  self->tx     = self->server ? &header->s2c : &header->c2s;
+  self->rxdata = self->server ? c2sdata : s2cdata;
+  self->txdata = self->server ? s2cdata : c2sdata;
+}
+
+cmdserv_shm *cmdserv_shm_attach(int sockfd) {
+  size_t maplen = SHM_DATA_OFFSET + 2 * CMDSERV_SHM_RING_SIZE;
+  cmdserv_shm *self;
+  struct shm_header *header;
+  int memfd = -1, saverrno;
+  char cmsgbuf[CMSG_SPACE(2 * sizeof(int))];
+  struct msghdr msg = {
+    .msg_iov        = &(struct iovec){ .iov_base = (char[]){ "S" },
+                                       .iov_len  = 1 },
+    .msg_iovlen     = 1,
+    .msg_control    = cmsgbuf,
+    .msg_controllen = sizeof(cmsgbuf)
+  };
+  struct cmsghdr *cmsg;
+
+  if ((self = malloc(sizeof(cmdserv_shm))) == NULL)
+    return NULL;
+  *self = (cmdserv_shm){ .server = true, .sockfd = sockfd, .eventfd = -1 };
+
+  if ((memfd = memfd_create("cmdserv-shm", MFD_CLOEXEC)) == -1
+      || ftruncate(memfd, maplen) == -1)
+    goto CMDSERV_SHM_ABORT;
+
+  if ((header = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     memfd, 0)) == MAP_FAILED)
+    goto CMDSERV_SHM_ABORT;
+
+  header->magic       = SHM_MAGIC;
+  header->version     = SHM_VERSION;
+  header->ring_size   = CMDSERV_SHM_RING_SIZE;
+  header->c2s.waiting = 1;        /* We're in select() */
+  shm_setup(self, header, maplen);
+
+  if ((self->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+    goto CMDSERV_SHM_ABORT;
+
+  memset(cmsgbuf, 0, sizeof(cmsgbuf));
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type  = SCM_RIGHTS;
+  cmsg->cmsg_len   = CMSG_LEN(2 * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), (int[]){ memfd, self->eventfd }, 2 * sizeof(int));
+
+  if (sendmsg(sockfd, &msg, MSG_NOSIGNAL) != 1)
+    goto CMDSERV_SHM_ABORT;
+
+  close(memfd);
+  return self;
+
+ CMDSERV_SHM_ABORT:
+  saverrno = errno;
+  if (memfd != -1)
+    close(memfd);
+  shm_unmap(self);
+  errno = saverrno;
+  return NULL;
+}
+
+ssize_t cmdserv_shm_read(cmdserv_shm *self, void *buf, size_t len) {
+  char doorbells[64];
+  ssize_t got;
+  size_t n;
+
+  /* We're busy now: The client needn't ring while we're around */
+  __atomic_store_n(&self->rx->waiting, 0, __ATOMIC_SEQ_CST);
+
+  /*
+   * Swallow the doorbells.  A short read means there are no more for
+   * now, and if some come in late, select() will bring us back.
+   */
+  got = recv(self->sockfd, doorbells, sizeof(doorbells), MSG_DONTWAIT);
+  if (got == 0)
+    self->eof = true;
+  else if (got == -1
+           && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    return -1;
+
+  n = shm_ring_get(self->rx, self->rxdata, self->mask, buf, len);
+
+  if (n == 0 && self->eof)
+    return 0;
+
+  if (shm_ring_used(self->rx) == 0)
+    shm_ring_wait(self->rx);
+
+  if (n == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  return n;
+}
+
+bool cmdserv_shm_pending(cmdserv_shm *self) {
+  return shm_ring_used(self->rx) > 0;
+}
+
+ssize_t cmdserv_shm_write(cmdserv_shm *self, const void *buf, size_t len) {
+  size_t n = shm_ring_put(self->tx, self->txdata, self->mask, buf, len);
+
+  /*
+   * Ring full: Have the client ring the doorbell once it made room.
+   * That wakes us up as readable, so swallow what rang so far, or
+   * we'd be woken up right away again.  Doorbells for new input
+   * don't get lost that way, the connection reads once its output
+   * is gone.
+   */
+  while (n < len) {
+    char doorbells[64];
+    ssize_t got;
+
+    while ((got = recv(self->sockfd, doorbells, sizeof(doorbells),
+                       MSG_DONTWAIT)) > 0)
+      ;
+    if (got == 0)
+      self->eof = true;
+
+    if (self->eof) {
+      errno = EPIPE;
+      return -1;
+    }
+
+    if (shm_ring_wait_room(self->tx, self->mask))
+      break;
+    n += shm_ring_put(self->tx, self->txdata, self->mask,
+                      (const char *)buf + n, len - n);
+  }
+
+  if (n > 0)
+    shm_doorbell(self);
+
+  if (n == 0 && len > 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  return n;
+}
+
+void cmdserv_shm_detach(cmdserv_shm *self) {
+  if (self == NULL)
+    return;
+
+  __atomic_store_n(&self->tx->closed, 1, __ATOMIC_SEQ_CST);
+  self->tx->waiting = 1;          /* Ring in any case */
+  shm_doorbell(self);
+  shm_unmap(self);
+}
+
+
+cmdserv_shm *cmdserv_shm_connect(const char *path) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  size_t pathlen = strlen(path);
+  cmdserv_shm *self;
+  struct shm_header *header;
+  struct stat st;
+  int fds[2] = { -1, -1 }, saverrno;
+  char cmsgbuf[CMSG_SPACE(2 * sizeof(int))];
+  char byte;
+  struct msghdr msg = {
+    .msg_iov        = &(struct iovec){ .iov_base = &byte, .iov_len = 1 },
+    .msg_iovlen     = 1,
+    .msg_control    = cmsgbuf,
+    .msg_controllen = sizeof(cmsgbuf)
+  };
+  struct cmsghdr *cmsg;
+
+  if (pathlen >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  memcpy(addr.sun_path, path, pathlen);
+  if (path[0] == '@')
+    addr.sun_path[0] = '\0';
+  else
+    pathlen++;
+
+  if ((self = malloc(sizeof(cmdserv_shm))) == NULL)
+    return NULL;
+  *self = (cmdserv_shm){ .server = false, .sockfd = -1, .eventfd = -1 };
+
+  if ((self->sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1
+      || connect(self->sockfd, (struct sockaddr *)&addr,
+                 offsetof(struct sockaddr_un, sun_path) + pathlen) == -1)
+    goto CMDSERV_SHM_ABORT;
+
+  if (recvmsg(self->sockfd, &msg, MSG_CMSG_CLOEXEC) != 1) {
+    if (errno == 0)
+      errno = ECONNRESET;
+    goto CMDSERV_SHM_ABORT;
+  }
+
+  if ((cmsg = CMSG_FIRSTHDR(&msg)) == NULL
+      || cmsg->cmsg_level != SOL_SOCKET
+      || cmsg->cmsg_type  != SCM_RIGHTS
+      || cmsg->cmsg_len   != CMSG_LEN(2 * sizeof(int))
+      || byte != 'S') {
+    errno = EPROTO;
+    goto CMDSERV_SHM_ABORT;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+  self->eventfd = fds[1];
+
+  if (fstat(fds[0], &st) == -1)
+    goto CMDSERV_SHM_ABORT;
+
+  if ((header = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fds[0], 0)) == MAP_FAILED)
+    goto CMDSERV_SHM_ABORT;
+
+  if (header->magic != SHM_MAGIC || header->version != SHM_VERSION
+      || (size_t)st.st_size != SHM_DATA_OFFSET + 2 * (size_t)header->ring_size
+      || (header->ring_size & (header->ring_size - 1)) != 0) {
+    munmap(header, st.st_size);
+    errno = EPROTO;
+    goto CMDSERV_SHM_ABORT;
+  }
+  shm_setup(self, header, st.st_size);
+
+  /* Spinning on the only CPU just keeps the server from answering */
+  self->spin_ns = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? CMDSERV_SHM_SPIN_NS : 0;
+
+  close(fds[0]);
+  return self;
+
+ CMDSERV_SHM_ABORT:
+  saverrno = errno;
+  if (fds[0] != -1)
+    close(fds[0]);
+  if (self->sockfd != -1)
+    close(self->sockfd);
+  shm_unmap(self);
+  errno = saverrno;
+  return NULL;
+}
+
+ssize_t cmdserv_shm_send(cmdserv_shm *self, const void *buf, size_t len) {
+  size_t sent = 0;
+
+  while (sent < len) {
+    size_t n = shm_ring_put(self->tx, self->txdata, self->mask,
+                            (const char *)buf + sent, len - sent);
+
+    if (n > 0) {
+      shm_doorbell(self);
+      sent += n;
+      continue;
+    }
+
+    /* Ring full: Wait for the server to make room (or go away) */
+    if (__atomic_load_n(&self->rx->closed, __ATOMIC_ACQUIRE)) {
+      errno = EPIPE;
+      return -1;
+    }
+    sched_yield();
+  }
+
+  return len;
+}
+
+ssize_t cmdserv_shm_recv(cmdserv_shm *self, void *buf, size_t len,
+                         int timeout_ms) {
+  uint64_t deadline = timeout_ms < 0
+    ? 0 : cmdserv_monotonic_ns() + timeout_ms * 1000000ULL;
+  uint64_t spin_until = cmdserv_monotonic_ns() + self->spin_ns;
+
+  for (;;) {
+    /* Check before draining, the server's last words precede its close */
+    bool closed = __atomic_load_n(&self->rx->closed, __ATOMIC_ACQUIRE)
+      || self->eof;
+    size_t n = shm_ring_get(self->rx, self->rxdata, self->mask, buf, len);
+    struct pollfd pfd[2] = {
+      { .fd = self->eventfd, .events = POLLIN },
+      { .fd = self->sockfd,  .events = POLLIN }
+    };
+    uint64_t now, counter;
+    int timeout = -1;
+
+    if (n > 0) {
+      shm_room_doorbell(self);
+      return n;
+    }
+    if (closed)
+      return 0;
+
+    if ((now = cmdserv_monotonic_ns()) < spin_until)
+      continue;
+
+    if (deadline != 0) {
+      if (now >= deadline) {
+        errno = EAGAIN;
+        return -1;
+      }
+      timeout = (deadline - now + 999999) / 1000000;
+    }
+
+    if (!shm_ring_wait(self->rx))
+      continue;
+
+    if (poll(pfd, 2, timeout) == -1 && errno != EINTR)
+      return -1;
+    __atomic_store_n(&self->rx->waiting, 0, __ATOMIC_RELAXED);
+
+    if (pfd[0].revents & POLLIN)
+      if (read(self->eventfd, &counter, sizeof(counter)) == -1) {
+        /* Nothing to read: Someone else got it */
+      }
+    if (pfd[1].revents & (POLLIN | POLLHUP))
+      self->eof = true;
+  }
+}
+
+void cmdserv_shm_close(cmdserv_shm *self) {
+  if (self == NULL)
+    return;
+
+  __atomic_store_n(&self->tx->closed, 1, __ATOMIC_SEQ_CST);
+  close(self->sockfd);
+  shm_unmap(self);
+}
+
+static int shm_transport_fd(void *object) {
+  cmdserv_shm *self = object;
+  return self->sockfd;
+}
+
+static void shm_transport_close(void *object) {
+  cmdserv_shm *self = object;
+  int sockfd = self->sockfd;
+
+  cmdserv_shm_detach(self);
+  close(sockfd);
+}
+
+#else /* __linux__ */
+
+cmdserv_shm *cmdserv_shm_attach(int sockfd) {
+  (void)sockfd;
+  errno = ENOSYS;
+  return NULL;
+}
+
+ssize_t cmdserv_shm_read(cmdserv_shm *shm, void *buf, size_t len) {
+  (void)shm; (void)buf; (void)len;
+  errno = ENOSYS;
+  return -1;
+}
+
+bool cmdserv_shm_pending(cmdserv_shm *shm) {
+  (void)shm;
+  return false;
+}
+
+ssize_t cmdserv_shm_write(cmdserv_shm *shm, const void *buf, size_t len) {
+  (void)shm; (void)buf; (void)len;
+  errno = ENOSYS;
+  return -1;
+}
+
+void cmdserv_shm_detach(cmdserv_shm *shm) {
+  (void)shm;
+}
+
+cmdserv_shm *cmdserv_shm_connect(const char *path) {
+  (void)path;
+  errno = ENOSYS;
+  return NULL;
+}
+
+ssize_t cmdserv_shm_send(cmdserv_shm *shm, const void *buf, size_t len) {
+  (void)shm; (void)buf; (void)len;
+  errno = ENOSYS;
+  return -1;
+}
+
+ssize_t cmdserv_shm_recv(cmdserv_shm *shm, void *buf, size_t len,
+                         int timeout_ms) {
+  (void)shm; (void)buf; (void)len; (void)timeout_ms;
+  errno = ENOSYS;
+  return -1;
+}
+
+void cmdserv_shm_close(cmdserv_shm *shm) {
+  (void)shm;
+}
+
+static int shm_transport_fd(void *object) {
+  (void)object;
+  return -1;
+}
+
+static void shm_transport_close(void *object) {
+  (void)object;
+}
+
+#endif /* __linux__ */
+
+static ssize_t shm_transport_read(void *object, void *buf, size_t len) {
+  return cmdserv_shm_read(object, buf, len);
+}
+
+static ssize_t shm_transport_write(void *object, const void *buf, size_t len,
+                                   int flags) {
+  (void)flags;
+  return cmdserv_shm_write(object, buf, len);
+}
+
+static bool shm_transport_pending(void *object) {
+  return cmdserv_shm_pending(object);
+}
+
+const struct cmdserv_transport cmdserv_shm_transport = {
+  .name          = "shm",
+  .read          = &shm_transport_read,
+  .write         = &shm_transport_write,
+  .writev        = NULL,
+  .pending       = &shm_transport_pending,
+  .room_readable = true,
+  .fd            = &shm_transport_fd,
+  .close         = &shm_transport_close
+};
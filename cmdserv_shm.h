@@ -0,0 +1,165 @@
+/**
+ * @file cmdserv_shm.h
+ *
+ * Shared memory transport for clients on the same host.
+ *
+ * @author    Beat Vontobel <beat.vontobel@futhark.ch>
+ * @version   1.0.0
+ * @copyright 2014, Beat Vontobel
+ *
+ * A client connects to a cmdserv listening on a "shm:" endpoint (see
+ * cmdserv_config::listen) through an ordinary Unix domain socket.
+ * The server then creates a memfd holding a pair of single-producer,
+ * single-consumer rings (one per direction) and an eventfd, and hands
+ * both to the client over the socket.  From there on, commands and
+ * responses only pass through the rings:
+ *
+ *   - Client to server: The client rings the doorbell by writing one
+ *     octet to the Unix socket, but only if the server has announced
+ *     that it went back to select().  The socket also makes the
+ *     server notice a client going away, just like on TCP.
+ *
+ *   - Server to client: The server writes to the eventfd, but only if
+ *     the client has announced that it is about to block.  The client
+ *     first spins on the ring for a short while
+ *     (CMDSERV_SHM_SPIN_NS), so that with a busy client no system
+ *     call is needed on either side.
+ *
+ * On the server side, the connection looks like any other
+ * cmdserv_connection to the cmd_handler, with the same tokenizer,
+ * handlers and close reasons.
+ *
+ * The rings are only available on Linux (memfd_create() and eventfd);
+ * elsewhere all functions fail with ENOSYS.
+ *
+ * @section LICENSE
+ *
+ *     This program is free software; you can redistribute it and/or
+ *     modify it under the terms of the GNU General Public License as
+ *     published by the Free Software Foundation; either version 2 of
+ *     the License, or (at your option) any later version.
+ *
+ *     This program is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public
+ *     License along with this program; if not, write to the Free
+ *     Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *     Boston, MA 02110-1301, USA.
+ *
+ * @see cmdserv_config::listen
+ */
+
+#ifndef CMDSERV_SHM_H
+#define CMDSERV_SHM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "cmdserv_transport.h"
+
+/**
+ * Size of each of the two rings in octets (a power of two).
+ */
+#define CMDSERV_SHM_RING_SIZE (64 * 1024)
+
+/**
+ * How long a client spins on an empty ring before it blocks on the
+ * eventfd (unless there is only one CPU to share with the server).
+ */
+#define CMDSERV_SHM_SPIN_NS   50000
+
+/**
+ * One end of a shared memory connection, server or client side.
+ */
+typedef struct cmdserv_shm cmdserv_shm;
+
+/**
+ * The server end as a transport of a cmdserv_connection: The
+ * transport object is the cmdserv_shm returned by
+ * cmdserv_shm_attach(), the readiness file descriptor its socket.
+ * Closing the transport detaches and closes the socket as well.
+ */
+extern const struct cmdserv_transport cmdserv_shm_transport;
+
+
+/**
+ * Server side: Set up the rings for a client freshly accepted on the
+ * Unix socket sockfd, and hand them over to the client.
+ *
+ * The socket stays owned by the caller, it's still needed as the
+ * readiness file descriptor of the connection.
+ *
+ * @return The server end or NULL with errno set on failure.
+ */
+cmdserv_shm *cmdserv_shm_attach(int sockfd);
+
+/**
+ * Server side: Read up to len octets the client has sent.
+ *
+ * @return The number of octets read, 0 if the client has gone away,
+ *         or -1 with errno set (EAGAIN if there's nothing to read).
+ */
+ssize_t cmdserv_shm_read(cmdserv_shm *shm, void *buf, size_t len);
+
+/**
+ * Server side: Whether there is more to read without another
+ * readiness event on the socket.  A reader must keep reading until
+ * this returns false, as the client doesn't ring the doorbell while
+ * the server is busy.
+ */
+bool cmdserv_shm_pending(cmdserv_shm *shm);
+
+/**
+ * Server side: Write up to len octets to the client, never blocking.
+ * If the ring is full, the client rings the doorbell once it made
+ * room, so the socket becomes readable (not writable) then.
+ *
+ * @return The number of octets written (less than len if the ring is
+ *         full), or -1 with errno set to EAGAIN if nothing fit.
+ */
+ssize_t cmdserv_shm_write(cmdserv_shm *shm, const void *buf, size_t len);
+
+/**
+ * Server side: Tell the client that we're gone and release the rings
+ * (but not the socket).
+ */
+void cmdserv_shm_detach(cmdserv_shm *shm);
+
+
+/**
+ * Client side: Connect to a server's "shm:" endpoint at path (a Unix
+ * socket path, or "@NAME" for the abstract namespace).
+ *
+ * @return The client end or NULL with errno set on failure.
+ */
+cmdserv_shm *cmdserv_shm_connect(const char *path);
+
+/**
+ * Client side: Send len octets to the server, waiting for room in the
+ * ring if needed.
+ *
+ * @return len, or -1 with errno set (EPIPE if the server is gone).
+ */
+ssize_t cmdserv_shm_send(cmdserv_shm *shm, const void *buf, size_t len);
+
+/**
+ * Client side: Receive up to len octets from the server, waiting at
+ * most timeout_ms milliseconds (-1 for no limit).  Rings the doorbell
+ * of a server waiting for room in the ring.
+ *
+ * @return The number of octets received, 0 if the server has closed
+ *         the connection, or -1 with errno set (EAGAIN on timeout).
+ */
+ssize_t cmdserv_shm_recv(cmdserv_shm *shm, void *buf, size_t len,
+                         int timeout_ms);
+
+/**
+ * Client side: Close the connection and release everything.
+ */
+void cmdserv_shm_close(cmdserv_shm *shm);
+
+#endif /* CMDSERV_SHM_H */
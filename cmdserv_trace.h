@@ -0,0 +1,137 @@
+/**
+ * @file cmdserv_trace.h
+ *
+ * Trace points along the lifecycle of a cmdserv connection.
+ *
+ * @author    Beat Vontobel <beat.vontobel@futhark.ch>
+ * @version   1.0.0
+ * @copyright 2014, Beat Vontobel
+ *
+ * A cmdserv_connection reports the trace points defined here to an
+ * optional trace_handler callback (see
+ * cmdserv_connection_config::trace_handler).  If the system provides
+ * <sys/sdt.h> (SystemTap/DTrace compatible USDT probes), every trace
+ * point is additionally compiled in as a static probe in the provider
+ * "cmdserv", e.g. for use with bpftrace or perf:
+ *
+ *     bpftrace -e 'usdt:./server:cmdserv:line { @[arg1] = count(); }'
+ *
+ * The probes take the connection id as arg0 and the byte count (see
+ * enum cmdserv_trace_point for the meaning per point) as arg1.
+ *
+ * With no trace_handler set, each trace point costs one well
+ * predicted branch (plus a no-op instruction for the USDT probe).
+ *
+ * @section LICENSE
+ *
+ *     This program is free software; you can redistribute it and/or
+ *     modify it under the terms of the GNU General Public License as
+ *     published by the Free Software Foundation; either version 2 of
+ *     the License, or (at your option) any later version.
+ *
+ *     This program is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public
+ *     License along with this program; if not, write to the Free
+ *     Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *     Boston, MA 02110-1301, USA.
+ *
+ * @see cmdserv_connection_config::trace_handler
+ */
+
+#ifndef CMDSERV_TRACE_H
+#define CMDSERV_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/**
+ * The trace points of a connection.
+ *
+ * The USDT probe name of each point is given in brackets.
+ */
+enum cmdserv_trace_point {
+  /**
+   * [accept] A new connection has been accepted.  Bytes: 0.
+   */
+  CMDSERV_TRACE_ACCEPT,
+
+  /**
+   * [recv] Data has been received.  Bytes: octets received.
+   */
+  CMDSERV_TRACE_RECV,
+
+  /**
+   * [line] A complete line has been found in the read buffer.
+   * Bytes: length of the line including the line terminator.
+   */
+  CMDSERV_TRACE_LINE,
+
+  /**
+   * [tokenized] The tokenizer has finished with the line.  Bytes:
+   * the resulting argc (negative tokenizer errors are reported as
+   * 0).
+   */
+  CMDSERV_TRACE_TOKENIZED,
+
+  /**
+   * [handler__entry] The cmd_handler is about to be called.  Bytes:
+   * length of the line.
+   */
+  CMDSERV_TRACE_HANDLER_ENTRY,
+
+  /**
+   * [handler__exit] The cmd_handler has returned.  Bytes: length of
+   * the line.
+   */
+  CMDSERV_TRACE_HANDLER_EXIT,
+
+  /**
+   * [send] Data has been handed over to the kernel.  Bytes: octets
+   * sent.
+   */
+  CMDSERV_TRACE_SEND,
+
+  /**
+   * [close] The connection is being closed.  Bytes: the close
+   * reason.
+   */
+  CMDSERV_TRACE_CLOSE,
+};
+
+
+/**
+ * Type for a function pointer to a trace handler.
+ *
+ * @param trace_object
+ *
+ *     The trace_object from the connection configuration.
+ *
+ * @param point
+ *
+ *     The trace point reached.
+ *
+ * @param conn_id
+ *
+ *     The id of the connection (see cmdserv_connection_id()).
+ *
+ * @param bytes
+ *
+ *     A byte count, depending on the trace point.
+ *
+ * @param timestamp
+ *
+ *     Monotonic timestamp in nanoseconds (see
+ *     cmdserv_monotonic_ns()).
+ */
+typedef void (*cmdserv_trace_handler)(void *trace_object,
+                                      enum cmdserv_trace_point point,
+                                      unsigned long long int conn_id,
+                                      size_t bytes,
+                                      uint64_t timestamp);
+
+#endif /* CMDSERV_TRACE_H */
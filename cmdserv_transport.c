@@ -0,0 +1,230 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "intercept.h"
+#include "cmdserv_transport.h"
+
+
+/*
+ * Stream sockets
+ */
+
+static ssize_t socket_read(void *object, void *buf, size_t len) {
+  return recv(*(int *)object, buf, len, 0);
+}
+
+static ssize_t socket_write(void *object, const void *buf, size_t len,
+                            int flags) {
+  return send(*(int *)object, buf, len, flags);
+}
+
+static ssize_t socket_writev(void *object, const struct iovec *iov,
+                             int iovcnt, int flags) {
+  struct msghdr msg = {
+    .msg_iov    = (struct iovec *)(uintptr_t)iov,
+    .msg_iovlen = iovcnt
+  };
+
+  return sendmsg(*(int *)object, &msg, flags);
+}
+
+static int socket_fd(void *object) {
+  return *(int *)object;
+}
+
+static void socket_close(void *object) {
+  if (*(int *)object != -1)
+    close(*(int *)object);
+  *(int *)object = -1;
+}
+
+const struct cmdserv_transport cmdserv_socket_transport = {
+  .name          = "socket",
+  .read          = &socket_read,
+  .write         = &socket_write,
+  .writev        = &socket_writev,
+  .pending       = NULL,
+  .room_readable = false,
+  .fd            = &socket_fd,
+  .close         = &socket_close
+};
+
+
+/*
+ * In-process memory
+ */
+
+/**
+ * One direction of a memory transport: The octets from pos up to len
+ * are still to be read.
+ */
+struct memory_buffer {
+  char *buf;
+  size_t size;
+  size_t len;
+  size_t pos;
+};
+
+struct cmdserv_memory {
+  struct memory_buffer in;         /**< client to server                */
+  struct memory_buffer out;        /**< server to client                */
+  bool hangup;                     /**< client has hung up              */
+  bool closed;                     /**< server has closed               */
+};
+
+static int memory_buffer_append(struct memory_buffer *b,
+                                const void *buf, size_t len) {
+  if (len == 0)
+    return 0;
+
+  /* Everything read: Start over at the beginning */
+  if (b->pos == b->len)
+    b->pos = b->len = 0;
+
+  if (b->len + len > b->size) {
+    size_t size = b->size > 0 ? b->size : 4096;
+    char *newbuf;
+
+    /* Move the unread rest down before growing */
+    if (b->pos > 0) {
+      memmove(b->buf, b->buf + b->pos, b->len - b->pos);
+      b->len -= b->pos;
+      b->pos  = 0;
+    }
+
+    while (b->len + len > size)
+      size *= 2;
+
+    if (size > b->size) {
+      if ((newbuf = realloc(b->buf, size)) == NULL)
+        return -1;
+      b->buf  = newbuf;
+      b->size = size;
+    }
+  }
+
+  memcpy(b->buf + b->len, buf, len);
+  b->len += len;
+
+  return 0;
+}
+
+static size_t memory_buffer_take(struct memory_buffer *b,
+                                 void *buf, size_t len) {
+  if (len > b->len - b->pos)
+    len = b->len - b->pos;
+  if (len == 0)
+    return 0;
+
+  memcpy(buf, b->buf + b->pos, len);
+  b->pos += len;
+
+  return len;
+}
+
+static ssize_t memory_read(void *object, void *buf, size_t len) {
+  cmdserv_memory *self = object;
+  size_t taken = memory_buffer_take(&self->in, buf, len);
+
+  if (taken > 0 || len == 0)
+    return taken;
+  if (self->hangup)
+    return 0;
+
+  errno = EAGAIN;
+  return -1;
+}
+
+static ssize_t memory_write(void *object, const void *buf, size_t len,
+                            int flags) {
+  cmdserv_memory *self = object;
+
+  (void)flags;
+
+  if (memory_buffer_append(&self->out, buf, len) == -1)
+    return -1;
+
+  return len;
+}
+
+static bool memory_pending(void *object) {
+  cmdserv_memory *self = object;
+
+  return self->in.pos < self->in.len;
+}
+
+static int memory_fd(void *object) {
+  (void)object;
+  return -1;
+}
+
+static void memory_close(void *object) {
+  cmdserv_memory *self = object;
+
+  self->closed = true;
+}
+
+const struct cmdserv_transport cmdserv_memory_transport = {
+  .name          = "memory",
+  .read          = &memory_read,
+  .write         = &memory_write,
+  .writev        = NULL,
+  .pending       = &memory_pending,
+  .room_readable = false,
+  .fd            = &memory_fd,
+  .close         = &memory_close
+};
+
+cmdserv_memory *cmdserv_memory_create(void) {
+  cmdserv_memory *self;
+
+  if ((self = malloc(sizeof(cmdserv_memory))) == NULL)
+    return NULL;
+
+  *self = (cmdserv_memory){
+    .in     = { .buf = NULL, .size = 0, .len = 0, .pos = 0 },
+    .out    = { .buf = NULL, .size = 0, .len = 0, .pos = 0 },
+    .hangup = false,
+    .closed = false
+  };
+
+  return self;
+}
+
+int cmdserv_memory_push(cmdserv_memory *self, const void *buf, size_t len) {
+  return memory_buffer_append(&self->in, buf, len);
+}
+
+void cmdserv_memory_hangup(cmdserv_memory *self) {
+  self->hangup = true;
+}
+
+size_t cmdserv_memory_pull(cmdserv_memory *self, void *buf, size_t len) {
+  return memory_buffer_take(&self->out, buf, len);
+}
+
+size_t cmdserv_memory_discard(cmdserv_memory *self) {
+  size_t len = self->out.len - self->out.pos;
+
+  self->out.len = self->out.pos = 0;
+
+  return len;
+}
+
+bool cmdserv_memory_closed(cmdserv_memory *self) {
+  return self->closed;
+}
+
+void cmdserv_memory_free(cmdserv_memory *self) {
+  if (self == NULL)
+    return;
+
+  free(self->in.buf);
+  free(self->out.buf);
+  free(self);
+}
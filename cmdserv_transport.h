@@ -0,0 +1,197 @@
+/**
+ * @file cmdserv_transport.h
+ *
+ * The byte streams underneath a cmdserv_connection.
+ *
+ * @author    Beat Vontobel <beat.vontobel@futhark.ch>
+ * @version   1.0.0
+ * @copyright 2014, Beat Vontobel
+ *
+ * A cmdserv_connection doesn't talk to its client directly, but
+ * through a transport: A small table of functions to read, write and
+ * close, together with the file descriptor the server waits on for
+ * the connection to become readable.  Each function gets the
+ * transport object (the state of one connection's transport) as its
+ * first argument.
+ *
+ * Three transports come with the library:
+ *
+ *   - cmdserv_socket_transport: An ordinary stream socket, the
+ *     default for connections accepted by cmdserv_connection_create().
+ *
+ *   - cmdserv_shm_transport: The shared memory rings of
+ *     cmdserv_shm.h, used by cmdserv_connection_create_shm().
+ *
+ *   - cmdserv_memory_transport: Two growing buffers in the same
+ *     process and no file descriptor at all.  Tests and benchmarks
+ *     push input in with cmdserv_memory_push(), drive the connection
+ *     with cmdserv_connection_read() and look at the output with
+ *     cmdserv_memory_pull(), so that millions of commands can go
+ *     through framing, tokenizer and dispatch without a kernel
+ *     network stack adding noise to the measurements.
+ *
+ * Others can be plugged in with cmdserv_connection_create_transport().
+ *
+ * @section LICENSE
+ *
+ *     This program is free software; you can redistribute it and/or
+ *     modify it under the terms of the GNU General Public License as
+ *     published by the Free Software Foundation; either version 2 of
+ *     the License, or (at your option) any later version.
+ *
+ *     This program is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public
+ *     License along with this program; if not, write to the Free
+ *     Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *     Boston, MA 02110-1301, USA.
+ *
+ * @see cmdserv_connection_create_transport()
+ */
+
+#ifndef CMDSERV_TRANSPORT_H
+#define CMDSERV_TRANSPORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+
+/**
+ * The functions of a transport.
+ */
+struct cmdserv_transport {
+  /**
+   * A short name for the transport, used as the client host of
+   * connections that have no address of their own.
+   */
+  const char *name;
+
+  /**
+   * Read up to len octets without blocking.  Returns the number of
+   * octets read, 0 at the end of the stream (client disconnect) or
+   * -1 with errno set (EAGAIN if there is nothing to read right now),
+   * just like recv().
+   */
+  ssize_t (*read)(void *object, void *buf, size_t len);
+
+  /**
+   * Write up to len octets without blocking.  Returns the number of
+   * octets written or -1 with errno set, just like send() (flags are
+   * the send() flags handed to cmdserv_connection_send(), transports
+   * other than sockets ignore them).
+   */
+  ssize_t (*write)(void *object, const void *buf, size_t len, int flags);
+
+  /**
+   * Write the iovcnt buffers of iov in this order without blocking, in
+   * one go if possible, like sendmsg().  Returns like write().  May be
+   * NULL, the buffers are handed to write() one by one then.
+   */
+  ssize_t (*writev)(void *object, const struct iovec *iov, int iovcnt,
+                    int flags);
+
+  /**
+   * Whether more input is already waiting without the readiness file
+   * descriptor signalling it.  cmdserv_connection_read() keeps
+   * reading while this returns true.  May be NULL if the readiness
+   * file descriptor always tells.
+   */
+  bool (*pending)(void *object);
+
+  /**
+   * Whether room for more output is signalled by the readiness file
+   * descriptor becoming readable instead of writable (because it
+   * isn't what the output goes through).  cmdserv_connection_read()
+   * sends queued output first on such transports.
+   */
+  bool room_readable;
+
+  /**
+   * The file descriptor that becomes readable whenever there is input
+   * (or a hangup) for the connection, or -1 if there is none and the
+   * connection is driven by calling cmdserv_connection_read()
+   * directly.
+   */
+  int (*fd)(void *object);
+
+  /**
+   * Close the transport and release the transport object, if it's
+   * owned by the connection.  Called exactly once, when the
+   * connection is freed.
+   */
+  void (*close)(void *object);
+};
+
+
+/**
+ * Stream sockets.  The transport object is a pointer to an int
+ * holding the socket's file descriptor, which stays valid until
+ * close() (which closes the socket).
+ */
+extern const struct cmdserv_transport cmdserv_socket_transport;
+
+
+/**
+ * The state of an in-process memory transport.
+ */
+typedef struct cmdserv_memory cmdserv_memory;
+
+/**
+ * In-process buffers.  The transport object is a cmdserv_memory
+ * created with cmdserv_memory_create().  It stays owned by the
+ * caller: close() only marks it as closed by the server, it has to
+ * be freed with cmdserv_memory_free() after the connection is gone.
+ */
+extern const struct cmdserv_transport cmdserv_memory_transport;
+
+/**
+ * Create an empty memory transport.
+ *
+ * @return The new memory transport or NULL with errno set on failure.
+ */
+cmdserv_memory *cmdserv_memory_create(void);
+
+/**
+ * Client side: Append len octets to the input of the server.
+ *
+ * @return 0 on success or -1 with errno set (ENOMEM).
+ */
+int cmdserv_memory_push(cmdserv_memory *memory, const void *buf, size_t len);
+
+/**
+ * Client side: Hang up, the server reads the end of the stream once
+ * it has read all input pushed so far.
+ */
+void cmdserv_memory_hangup(cmdserv_memory *memory);
+
+/**
+ * Client side: Take up to len octets of the server's output.
+ *
+ * @return The number of octets copied to buf.
+ */
+size_t cmdserv_memory_pull(cmdserv_memory *memory, void *buf, size_t len);
+
+/**
+ * Client side: Throw away all of the server's output not pulled yet.
+ *
+ * @return The number of octets thrown away.
+ */
+size_t cmdserv_memory_discard(cmdserv_memory *memory);
+
+/**
+ * Client side: Whether the server has closed the connection.
+ */
+bool cmdserv_memory_closed(cmdserv_memory *memory);
+
+/**
+ * Release a memory transport.  Must not be called while a
+ * connection is still using it.
+ */
+void cmdserv_memory_free(cmdserv_memory *memory);
+
+#endif /* CMDSERV_TRANSPORT_H */
@@ -0,0 +1,316 @@
+/* for recvmmsg() and sendmmsg() in sys/socket.h */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "intercept.h"
+#include "cmdserv_udp.h"
+
+
+/**
+ * One datagram of a batch: Where it came from, and where its reply is
+ * in the reply buffer.
+ */
+struct udp_datagram {
+  struct sockaddr_storage addr;    /**< sender                           */
+  socklen_t addrlen;
+  size_t len;                      /**< octets received                  */
+  bool truncated;                  /**< didn't fit the buffer            */
+  size_t reply;                    /**< offset of the reply in replybuf  */
+  size_t replylen;                 /**< length of the reply              */
+};
+
+struct cmdserv_udp {
+  int fd;                          /**< datagram socket                  */
+  bool reply;                      /**< send output back                 */
+  cmdserv_connection *connection;  /**< handles all datagrams            */
+  size_t bufsize;                  /**< size of a datagram buffer        */
+  char *bufs;                      /**< CMDSERV_UDP_BATCH buffers        */
+  struct udp_datagram dgrams[CMDSERV_UDP_BATCH];
+  int current;                     /**< datagram being handled or -1     */
+  char *replybuf;                  /**< replies of the batch             */
+  size_t replysize;                /**< allocated size of replybuf       */
+  size_t replylen;                 /**< octets used in replybuf          */
+};
+
+
+/*
+ * The transport of the connection: Output goes to the reply of the
+ * current datagram, input only ever comes through
+ * cmdserv_connection_datagram().
+ */
+
+static ssize_t udp_read(void *object, void *buf, size_t len) {
+  (void)object;
+  (void)buf;
+  (void)len;
+  errno = EAGAIN;
+  return -1;
+}
+
+static ssize_t udp_write(void *object, const void *buf, size_t len,
+                         int flags) {
+  cmdserv_udp *self = object;
+
+  (void)flags;
+
+  if (!self->reply || self->current == -1)
+    return len;
+
+  if (self->replylen + len > self->replysize) {
+    size_t size = self->replysize > 0 ? self->replysize : 4096;
+    char *newbuf;
+
+    while (self->replylen + len > size)
+      size *= 2;
+    if ((newbuf = realloc(self->replybuf, size)) == NULL)
+      return -1;
+    self->replybuf  = newbuf;
+    self->replysize = size;
+  }
+
+  memcpy(self->replybuf + self->replylen, buf, len);
+  self->replylen                      += len;
+  self->dgrams[self->current].replylen += len;
+
+  return len;
+}
+
+/* No readiness of its own: cmdserv waits on the socket for us */
+static int udp_fd(void *object) {
+  (void)object;
+  return -1;
+}
+
+/* The socket is closed by cmdserv_udp_free() */
+static void udp_close(void *object) {
+  (void)object;
+}
+
+static const struct cmdserv_transport cmdserv_udp_transport = {
+  .name          = "udp",
+  .read          = &udp_read,
+  .write         = &udp_write,
+  .writev        = NULL,
+  .pending       = NULL,
+  .room_readable = false,
+  .fd            = &udp_fd,
+  .close         = &udp_close
+};
+
+
+/**
+ * Receive up to CMDSERV_UDP_BATCH datagrams without blocking.
+ *
+ * Returns the number of datagrams received or -1 with errno set.
+ */
+static int udp_receive(cmdserv_udp *self) {
+#ifdef __linux__
+  struct mmsghdr msgs[CMDSERV_UDP_BATCH];
+  struct iovec iov[CMDSERV_UDP_BATCH];
+  int n;
+
+  for (int i = 0; i < CMDSERV_UDP_BATCH; i++) {
+    iov[i] = (struct iovec){
+      .iov_base = self->bufs + i * self->bufsize,
+      .iov_len  = self->bufsize
+    };
+    msgs[i] = (struct mmsghdr){
+      .msg_hdr = {
+        .msg_name    = &self->dgrams[i].addr,
+        .msg_namelen = sizeof(self->dgrams[i].addr),
+        .msg_iov     = &iov[i],
+        .msg_iovlen  = 1
+      }
+    };
+  }
+
+  if ((n = recvmmsg(self->fd, msgs, CMDSERV_UDP_BATCH, MSG_DONTWAIT, NULL))
+      == -1)
+    return -1;
+
+  for (int i = 0; i < n; i++) {
+    self->dgrams[i].addrlen   = msgs[i].msg_hdr.msg_namelen;
+    self->dgrams[i].len       = msgs[i].msg_len;
+    self->dgrams[i].truncated = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+  }
+
+  return n;
+#else
+  int n;
+
+  for (n = 0; n < CMDSERV_UDP_BATCH; n++) {
+    struct iovec iov = {
+      .iov_base = self->bufs + n * self->bufsize,
+      .iov_len  = self->bufsize
+    };
+    struct msghdr msg = {
+      .msg_name    = &self->dgrams[n].addr,
+      .msg_namelen = sizeof(self->dgrams[n].addr),
+      .msg_iov     = &iov,
+      .msg_iovlen  = 1
+    };
+    ssize_t got;
+
+    if ((got = recvmsg(self->fd, &msg, MSG_DONTWAIT)) == -1)
+      return n > 0 ? n : -1;
+
+    self->dgrams[n].addrlen   = msg.msg_namelen;
+    self->dgrams[n].len       = got;
+    self->dgrams[n].truncated = (msg.msg_flags & MSG_TRUNC) != 0;
+  }
+
+  return n;
+#endif
+}
+
+/**
+ * Send the replies to the first n datagrams of the batch.  Replies
+ * that can't be sent are dropped, just like datagrams would be.
+ */
+static void udp_send_replies(cmdserv_udp *self, int n) {
+#ifdef __linux__
+  struct mmsghdr msgs[CMDSERV_UDP_BATCH];
+  struct iovec iov[CMDSERV_UDP_BATCH];
+  int m = 0;
+
+  for (int i = 0; i < n; i++) {
+    if (self->dgrams[i].replylen == 0)
+      continue;
+    iov[m] = (struct iovec){
+      .iov_base = self->replybuf + self->dgrams[i].reply,
+      .iov_len  = self->dgrams[i].replylen
+    };
+    msgs[m] = (struct mmsghdr){
+      .msg_hdr = {
+        .msg_name    = &self->dgrams[i].addr,
+        .msg_namelen = self->dgrams[i].addrlen,
+        .msg_iov     = &iov[m],
+        .msg_iovlen  = 1
+      }
+    };
+    m++;
+  }
+
+  for (int sent = 0; sent < m; ) {
+    int got = sendmmsg(self->fd, msgs + sent, m - sent, MSG_DONTWAIT);
+
+    if (got == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        cmdserv_connection_log(self->connection, CMDSERV_WARNING,
+                               "sendmmsg() error: %s", strerror(errno));
+      got = 1;  /* Drop the one that failed, try the rest */
+    }
+    sent += got;
+  }
+#else
+  for (int i = 0; i < n; i++) {
+    if (self->dgrams[i].replylen == 0)
+      continue;
+    if (sendto(self->fd, self->replybuf + self->dgrams[i].reply,
+               self->dgrams[i].replylen, MSG_DONTWAIT,
+               (struct sockaddr *)&self->dgrams[i].addr,
+               self->dgrams[i].addrlen) == -1
+        && errno != EAGAIN && errno != EWOULDBLOCK)
+      cmdserv_connection_log(self->connection, CMDSERV_WARNING,
+                             "sendto() error: %s", strerror(errno));
+  }
+#endif
+}
+
+cmdserv_udp *cmdserv_udp_create(int fd,
+                                unsigned long long int conn_id,
+                                struct cmdserv_connection_config* config,
+                                bool reply) {
+  struct cmdserv_connection_config udp_config = *config;
+  cmdserv_udp *self;
+  int saverrno;
+
+  if ((self = malloc(sizeof(cmdserv_udp))) == NULL)
+    return NULL;
+
+  *self = (cmdserv_udp){
+    .fd         = fd,
+    .reply      = reply,
+    .connection = NULL,
+    .bufsize    = config->readbuf_size,
+    .bufs       = NULL,
+    .current    = -1,
+    .replybuf   = NULL,
+    .replysize  = 0,
+    .replylen   = 0
+  };
+
+  if ((self->bufs = malloc(CMDSERV_UDP_BATCH * self->bufsize)) == NULL)
+    goto CMDSERV_UDP_ABORT;
+
+  udp_config.framing = CMDSERV_FRAMING_LINE;
+
+  if ((self->connection
+       = cmdserv_connection_create_transport(&cmdserv_udp_transport, self,
+                                             conn_id, &udp_config,
+                                             CMDSERV_NO_CLOSE))
+      == NULL)
+    goto CMDSERV_UDP_ABORT;
+
+  return self;
+
+ CMDSERV_UDP_ABORT:
+  saverrno = errno;
+  free(self->bufs);
+  free(self);
+  errno = saverrno;
+  return NULL;
+}
+
+void cmdserv_udp_read(cmdserv_udp *self) {
+  for (int round = 0; round < CMDSERV_UDP_ROUNDS; round++) {
+    int n = udp_receive(self);
+
+    if (n == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        cmdserv_connection_log(self->connection, CMDSERV_ERR,
+                               "recvmmsg() error: %s", strerror(errno));
+      return;
+    }
+
+    self->replylen = 0;
+    for (int i = 0; i < n; i++) {
+      self->dgrams[i].reply    = self->replylen;
+      self->dgrams[i].replylen = 0;
+      self->current            = i;
+      cmdserv_connection_datagram(self->connection,
+                                  self->bufs + i * self->bufsize,
+                                  self->dgrams[i].len,
+                                  self->dgrams[i].truncated);
+    }
+    self->current = -1;
+
+    if (self->reply)
+      udp_send_replies(self, n);
+
+    if (n < CMDSERV_UDP_BATCH)
+      return;
+  }
+}
+
+int cmdserv_udp_fd(cmdserv_udp *self) {
+  return self->fd;
+}
+
+void cmdserv_udp_free(cmdserv_udp *self, enum cmdserv_close_reason reason) {
+  if (self == NULL)
+    return;
+
+  cmdserv_connection_close(self->connection, reason);
+  close(self->fd);
+  free(self->bufs);
+  free(self->replybuf);
+  free(self);
+}
@@ -0,0 +1,120 @@
+/**
+ * @file cmdserv_udp.h
+ *
+ * Datagram listeners for fire-and-forget commands.
+ *
+ * @author    Beat Vontobel <beat.vontobel@futhark.ch>
+ * @version   1.0.0
+ * @copyright 2014, Beat Vontobel
+ *
+ * For clients sending one-shot commands ("metric put ..."), setting up
+ * and tearing down a connection for each of them costs a lot more
+ * than the command itself.  A cmdserv listening on a "udp:" endpoint
+ * (see cmdserv_config::listen) instead takes every datagram as one or
+ * more command lines, with no connection at all.
+ *
+ * All datagrams of a listener are handled by a single
+ * cmdserv_connection, created along with the listener and closed on
+ * cmdserv_shutdown() (so open_handler and close_handler see it once).
+ * The cmd_handler gets the commands just like from any other client,
+ * tokenized the same way, see cmdserv_connection_datagram().
+ * Whatever it sends is collected per datagram and, if
+ * cmdserv_config::udp_reply is set, sent back to the sender as one
+ * datagram, otherwise thrown away.
+ *
+ * Datagrams are received (and replies sent) in batches of up to
+ * CMDSERV_UDP_BATCH with recvmmsg() and sendmmsg() where available,
+ * one system call per batch instead of one per datagram.
+ *
+ * @section LICENSE
+ *
+ *     This program is free software; you can redistribute it and/or
+ *     modify it under the terms of the GNU General Public License as
+ *     published by the Free Software Foundation; either version 2 of
+ *     the License, or (at your option) any later version.
+ *
+ *     This program is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public
+ *     License along with this program; if not, write to the Free
+ *     Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *     Boston, MA 02110-1301, USA.
+ *
+ * @see cmdserv_config::listen cmdserv_config::udp_reply
+ */
+
+#ifndef CMDSERV_UDP_H
+#define CMDSERV_UDP_H
+
+#include <stdbool.h>
+
+#include "cmdserv_connection.h"
+#include "cmdserv_connection_config.h"
+
+
+/**
+ * Maximum number of datagrams received with one system call.
+ */
+#define CMDSERV_UDP_BATCH 32
+
+/**
+ * Maximum number of batches handled per cmdserv_udp_read(), before
+ * the other clients get their turn again.
+ */
+#define CMDSERV_UDP_ROUNDS 8
+
+
+/**
+ * A datagram listener.
+ */
+typedef struct cmdserv_udp cmdserv_udp;
+
+/**
+ * Create a datagram listener on the bound, non-blocking datagram
+ * socket fd, together with its connection.
+ *
+ * @param fd
+ *
+ *     The datagram socket, closed again by cmdserv_udp_free().
+ *
+ * @param conn_id
+ *
+ *     The id of the connection.
+ *
+ * @param config
+ *
+ *     The connection configuration, the framing is always
+ *     CMDSERV_FRAMING_LINE.
+ *
+ * @param reply
+ *
+ *     Whether to send back what the cmd_handler sends.
+ *
+ * @return The datagram listener or NULL with errno set on failure.
+ */
+cmdserv_udp *cmdserv_udp_create(int fd,
+                                unsigned long long int conn_id,
+                                struct cmdserv_connection_config* config,
+                                bool reply);
+
+/**
+ * Receive and handle the datagrams waiting on the socket, in batches,
+ * and send the replies (if any).
+ */
+void cmdserv_udp_read(cmdserv_udp *udp);
+
+/**
+ * The socket of the datagram listener, to wait for readability.
+ */
+int cmdserv_udp_fd(cmdserv_udp *udp);
+
+/**
+ * Close the connection with reason, close the socket and release the
+ * datagram listener.
+ */
+void cmdserv_udp_free(cmdserv_udp *udp, enum cmdserv_close_reason reason);
+
+#endif /* CMDSERV_UDP_H */
@@ -1,11 +1,16 @@
 #ifndef INTERCEPT_H
 #define INTERCEPT_H
 
+#include <stdbool.h>
+#include <stdio.h>
+
 #include "interceptors.h"
+#include "interceptors.def" /* To get the headers for intercepted functions */
 
 enum intercept_funcs {
   INTERCEPTED_INVALID = -1,
-#define EXPAND_INTERCEPTOR(ret_type, func_name, derr, dret, ...)        \
+#define EXPAND_INTERCEPTOR(ret_type, func_name, derr, dret, bytes,      \
+                           shortlen, ...)                              \
   INTERCEPT_IDX(func_name),
 #include "interceptors.def"
   INTERCEPTED_COUNT
@@ -18,15 +23,140 @@ enum intercept_funcs {
 #define select(...)        INTERCEPT_FUNC(select)(__VA_ARGS__)
 #define socket(...)        INTERCEPT_FUNC(socket)(__VA_ARGS__)
 #define recv(...)          INTERCEPT_FUNC(recv)(__VA_ARGS__)
+#define send(...)          INTERCEPT_FUNC(send)(__VA_ARGS__)
+#define sendmsg(...)       INTERCEPT_FUNC(sendmsg)(__VA_ARGS__)
 #define setsockopt(...)    INTERCEPT_FUNC(setsockopt)(__VA_ARGS__)
 #define listen(...)        INTERCEPT_FUNC(listen)(__VA_ARGS__)
 #define bind(...)          INTERCEPT_FUNC(bind)(__VA_ARGS__)
 #define accept(...)        INTERCEPT_FUNC(accept)(__VA_ARGS__)
+#define fcntl(...)         INTERCEPT_FUNC(fcntl)(__VA_ARGS__)
 #define getnameinfo(...)   INTERCEPT_FUNC(getnameinfo)(__VA_ARGS__)
+
+/**
+ * Attribute everything counted from here on to the command name
+ * (NULL: to no command at all).
+ */
+#define INTERCEPT_CONTEXT(name) intercept_context(name)
+
+/**
+ * Environment variable read by cmdserv_start() and passed to
+ * intercept_configure().
+ */
+#define INTERCEPT_ENV "CMDSERV_INTERCEPT"
+#else
+#define INTERCEPT_CONTEXT(name)
 #endif /* INTERCEPT */
 
-#define EXPAND_INTERCEPTOR(ret_type, func_name, derr, dret, ...)        \
+#define EXPAND_INTERCEPTOR(ret_type, func_name, derr, dret, bytes,      \
+                           shortlen, ...)                              \
   ret_type INTERCEPT_FUNC(func_name)(GET_TYPES(__VA_ARGS__));
 #include "interceptors.def"
 
+/**
+ * Let the intercepted function func succeed another after times, and
+ * then fail with fail_errno and retval on every call, until reset
+ * with intercept_reset().
+ */
+void intercept_i_after(enum intercept_funcs func,
+                       int after, int fail_errno, int retval);
+void intercept_ptr_after(enum intercept_funcs func,
+                         int after, int fail_errno, void *retval);
+void intercept_sst_after(enum intercept_funcs func,
+                         int after, int fail_errno, ssize_t retval);
+
+/**
+ * Let the intercepted function func pass through to the real
+ * function again.
+ */
+void intercept_reset(enum intercept_funcs func);
+
+/**
+ * Delay every call of the intercepted function func by a random time
+ * between min_us and max_us microseconds (0 and 0 for no delay).
+ */
+void intercept_delay(enum intercept_funcs func,
+                     unsigned int min_us, unsigned int max_us);
+
+/**
+ * Shorten the length argument of a call of the intercepted function
+ * func (only recv() and send() have one, and the total length of the
+ * iovec of sendmsg()) to a random length of at least one octet
+ * (log-uniformly distributed), with the probability rate (0.0 to
+ * 1.0).
+ */
+void intercept_short(enum intercept_funcs func, double rate);
+
+/**
+ * Let a call of the intercepted function func fail with EAGAIN (and
+ * its default failure return value) without calling the real
+ * function, with the probability rate (0.0 to 1.0).
+ */
+void intercept_eagain(enum intercept_funcs func, double rate);
+
+/**
+ * Seed the pseudo random number generator used for delays, short
+ * counts and EAGAIN, so that a run can be reproduced.
+ */
+void intercept_seed(unsigned long long int seed);
+
+/**
+ * Set up delays, short counts and EAGAIN from a string, e.g. from an
+ * environment variable:
+ *
+ *     seed=42;recv:delay=100-500,short=0.5;send:eagain=0.1
+ *
+ * Entries are separated by semicolons, each one either seed=N or a
+ * function name followed by a colon and a comma separated list of
+ * delay=MIN_US[-MAX_US], short=RATE, and eagain=RATE.  NULL or an
+ * empty string leaves everything as is.  Returns 0 on success, -1
+ * with errno set to EINVAL on a malformed string (entries before the
+ * malformed one are applied).
+ */
+int intercept_configure(const char *spec);
+
+/**
+ * Counters for an intercepted function within one context.
+ */
+struct intercept_count {
+  unsigned long long int calls; /**< number of calls                  */
+  unsigned long long int bytes; /**< bytes allocated/received/sent    */
+  unsigned long long int ns;    /**< time spent in the real function  */
+};
+
+/**
+ * Enable or disable the counting mode: While enabled, every call to
+ * an intercepted function that is passed through to the real
+ * function is counted against the current context.
+ */
+void intercept_counting(bool enable);
+
+/**
+ * Zero all counters and forget all contexts.
+ */
+void intercept_counts_reset(void);
+
+/**
+ * Set the current context (usually the name of the command currently
+ * executing, NULL for none).  There is room for a limited number of
+ * contexts, anything beyond is counted as no context.
+ */
+void intercept_context(const char *name);
+
+/**
+ * The counters of a context (NULL for none), indexed by enum
+ * intercept_funcs, or NULL if nothing was counted for that context.
+ */
+const struct intercept_count *intercept_counts(const char *name);
+
+/**
+ * The name of an intercepted function.
+ */
+const char *intercept_func_name(enum intercept_funcs func);
+
+/**
+ * Write a report with one line per context and intercepted function
+ * called within that context to out.
+ */
+void intercept_report(FILE *out);
+
 #endif /* INTERCEPT_H */
@@ -1,11 +1,19 @@
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "cmdserv_helpers.h"
 #include "interceptors.h"
 #include "interceptors.def" /* To get the headers for intercepted functions */
 #undef INTERCEPT /* To suppress the intercept macros... */
 #include "intercept.h" /* ...while importing declarations and enum */
 
+#define CONTEXTS_MAX     32
+#define CONTEXT_NAME_MAX 32
+
 struct interception {
+  bool armed;
   int fail_after;
   int fail_errno;
   union {
@@ -15,11 +23,42 @@ struct interception {
   } fail_retval;
 };
 
+struct perturbation {
+  bool active;
+  unsigned int delay_min_us;
+  unsigned int delay_max_us;
+  double short_rate;
+  double eagain_rate;
+};
+
+/**
+ * The counters of one context: Slot 0 is used for "no context".
+ */
+struct context {
+  char name[CONTEXT_NAME_MAX];
+  struct intercept_count counts[INTERCEPTED_COUNT];
+};
+
 static struct interception failures[INTERCEPTED_COUNT];
+static struct perturbation perturbations[INTERCEPTED_COUNT];
+static uint64_t prng_state = 0x9e3779b97f4a7c15ULL;
+
+static bool counting = false;
+static struct context contexts[CONTEXTS_MAX];
+static size_t contexts_used = 1;
+static struct context *current = &contexts[0];
+
+static const char *func_names[] = {
+#define EXPAND_INTERCEPTOR(ret_type, func_name, derr, dret, bytes,      \
+                           shortlen, ...)                              \
+  #func_name,
+#include "interceptors.def"
+};
 
 void intercept_i_after(enum intercept_funcs func, int after, int fail_errno, int retval) {
   if (func >= 0 && func < INTERCEPTED_COUNT)
     failures[func] = (struct interception){
+      .armed = true,
       .fail_after = after,
       .fail_errno = fail_errno,
       .fail_retval.i = retval
@@ -29,6 +68,7 @@ void intercept_i_after(enum intercept_funcs func, int after, int fail_errno, int
 void intercept_ptr_after(enum intercept_funcs func, int after, int fail_errno, void *retval) {
   if (func >= 0 && func < INTERCEPTED_COUNT)
     failures[func] = (struct interception){
+      .armed = true,
       .fail_after = after,
       .fail_errno = fail_errno,
       .fail_retval.ptr = retval
@@ -38,21 +78,348 @@ void intercept_ptr_after(enum intercept_funcs func, int after, int fail_errno, v
 void intercept_sst_after(enum intercept_funcs func, int after, int fail_errno, ssize_t retval) {
   if (func >= 0 && func < INTERCEPTED_COUNT)
     failures[func] = (struct interception){
+      .armed = true,
       .fail_after = after,
       .fail_errno = fail_errno,
       .fail_retval.sst = retval
     };
 }
 
+void intercept_reset(enum intercept_funcs func) {
+  if (func >= 0 && func < INTERCEPTED_COUNT) {
+    failures[func]      = (struct interception){ .armed = false };
+    perturbations[func] = (struct perturbation){ .active = false };
+  }
+}
+
+static void intercept_update_active(enum intercept_funcs func) {
+  struct perturbation *p = &perturbations[func];
+
+  p->active = p->delay_max_us > 0 || p->short_rate > 0 || p->eagain_rate > 0;
+}
+
+void intercept_delay(enum intercept_funcs func,
+                     unsigned int min_us, unsigned int max_us) {
+  if (func >= 0 && func < INTERCEPTED_COUNT) {
+    perturbations[func].delay_min_us = min_us;
+    perturbations[func].delay_max_us = max_us < min_us ? min_us : max_us;
+    intercept_update_active(func);
+  }
+}
+
+void intercept_short(enum intercept_funcs func, double rate) {
+  if (func >= 0 && func < INTERCEPTED_COUNT) {
+    perturbations[func].short_rate = rate;
+    intercept_update_active(func);
+  }
+}
+
+void intercept_eagain(enum intercept_funcs func, double rate) {
+  if (func >= 0 && func < INTERCEPTED_COUNT) {
+    perturbations[func].eagain_rate = rate;
+    intercept_update_active(func);
+  }
+}
+
+void intercept_seed(unsigned long long int seed) {
+  prng_state = seed ? seed : 0x9e3779b97f4a7c15ULL;
+}
+
+/**
+ * xorshift64*: Good enough for fault injection, independent of
+ * rand() and reproducible with intercept_seed().
+ */
+static uint64_t intercept_random(void) {
+  prng_state ^= prng_state >> 12;
+  prng_state ^= prng_state << 25;
+  prng_state ^= prng_state >> 27;
+  return prng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static bool intercept_roll(double rate) {
+  return rate > 0 && (intercept_random() >> 11) * 0x1.0p-53 < rate;
+}
+
+/**
+ * Shorten *len to a random length between 1 and *len - 1 with the
+ * short rate of the perturbation p: Log-uniform, as buffers are
+ * usually much larger than what is pending on the socket.
+ *
+ * Returns true if *len was shortened.
+ */
+static bool intercept_shorten(const struct perturbation *p, size_t *len) {
+  unsigned int bits = 0;
+  size_t max;
+
+  if (*len <= 1 || !intercept_roll(p->short_rate))
+    return false;
+
+  while (bits < 8 * sizeof(size_t) - 1 && ((size_t)1 << (bits + 1)) < *len)
+    bits++;
+  max = (size_t)1 << (intercept_random() % (bits + 1));
+  *len = 1 + intercept_random() % (max < *len - 1 ? max : *len - 1);
+
+  return true;
+}
+
+/**
+ * Apply the perturbation p to a call: Returns true if the call
+ * should fail with EAGAIN, otherwise sleeps and shortens *len as
+ * configured.
+ */
+static bool intercept_perturb(const struct perturbation *p, size_t *len) {
+  if (intercept_roll(p->eagain_rate))
+    return true;
+
+  if (p->delay_max_us > 0) {
+    unsigned int us = p->delay_min_us
+      + intercept_random() % (p->delay_max_us - p->delay_min_us + 1);
+
+    nanosleep(&(struct timespec){ .tv_sec  = us / 1000000,
+                                  .tv_nsec = (us % 1000000) * 1000L },
+              NULL);
+  }
+
+  if (len != NULL)
+    intercept_shorten(p, len);
+
+  return false;
+}
+
+/**
+ * The short length of sendmsg(): Shortens the total length of the
+ * iovec of *msg and points *msg to a copy cut down to that length.
+ * Leaves messages with more than IOV_SHORT_MAX buffers alone.
+ *
+ * Returns NULL, as there's no length argument left to shorten.
+ */
+#define IOV_SHORT_MAX 16
+static size_t *intercept_msg_short(const struct msghdr **msg) {
+  static struct msghdr shortmsg;
+  static struct iovec shortiov[IOV_SHORT_MAX];
+  size_t len = 0;
+
+  if ((size_t)(*msg)->msg_iovlen > IOV_SHORT_MAX)
+    return NULL;
+
+  for (size_t i = 0; i < (size_t)(*msg)->msg_iovlen; i++)
+    len += (*msg)->msg_iov[i].iov_len;
+
+  if (!intercept_shorten(&perturbations[INTERCEPTED_sendmsg], &len))
+    return NULL;
+
+  shortmsg = **msg;
+  shortmsg.msg_iov    = shortiov;
+  shortmsg.msg_iovlen = 0;
+  for (size_t i = 0; len > 0; i++) {
+    shortiov[i] = (*msg)->msg_iov[i];
+    if (shortiov[i].iov_len > len)
+      shortiov[i].iov_len = len;
+    len -= shortiov[i].iov_len;
+    shortmsg.msg_iovlen++;
+  }
+  *msg = &shortmsg;
+
+  return NULL;
+}
+
+static enum intercept_funcs intercept_func_idx(const char *name, size_t len) {
+  for (int f = 0; f < INTERCEPTED_COUNT; f++)
+    if (strlen(func_names[f]) == len && strncmp(func_names[f], name, len) == 0)
+      return f;
+
+  return INTERCEPTED_INVALID;
+}
+
+static int intercept_configure_option(enum intercept_funcs func,
+                                      const char *opt, size_t len) {
+  char *end;
+
+  if (strncmp(opt, "delay=", 6) == 0) {
+    unsigned long min_us = strtoul(opt + 6, &end, 10), max_us = min_us;
+
+    if (end == opt + 6)
+      return -1;
+    if (*end == '-') {
+      const char *max = end + 1;
+
+      max_us = strtoul(max, &end, 10);
+      if (end == max)
+        return -1;
+    }
+    if (end != opt + len)
+      return -1;
+    intercept_delay(func, min_us, max_us);
+
+  } else if (strncmp(opt, "short=", 6) == 0
+             || strncmp(opt, "eagain=", 7) == 0) {
+    const char *val = strchr(opt, '=') + 1;
+    double rate = strtod(val, &end);
+
+    if (end == val || end != opt + len || rate < 0 || rate > 1)
+      return -1;
+    if (*opt == 's')
+      intercept_short(func, rate);
+    else
+      intercept_eagain(func, rate);
+
+  } else {
+    return -1;
+  }
+
+  return 0;
+}
+
+int intercept_configure(const char *spec) {
+  const char *entry = spec;
+
+  while (entry != NULL && *entry != '\0') {
+    size_t len = strcspn(entry, ";");
+    const char *colon = memchr(entry, ':', len);
+
+    if (strncmp(entry, "seed=", 5) == 0 && colon == NULL) {
+      char *end;
+
+      intercept_seed(strtoull(entry + 5, &end, 10));
+      if (end != entry + len)
+        goto INVALID;
+
+    } else if (colon != NULL) {
+      enum intercept_funcs func = intercept_func_idx(entry, colon - entry);
+      const char *opt = colon + 1;
+
+      if (func == INTERCEPTED_INVALID)
+        goto INVALID;
+
+      while (opt < entry + len) {
+        size_t optlen = strcspn(opt, ",;");
+
+        if (intercept_configure_option(func, opt, optlen) == -1)
+          goto INVALID;
+        opt += optlen + (opt[optlen] == ',');
+      }
+
+    } else if (len > 0) {
+      goto INVALID;
+    }
+
+    entry += len + (entry[len] == ';');
+  }
+
+  return 0;
+
+ INVALID:
+  errno = EINVAL;
+  return -1;
+}
+
+void intercept_counting(bool enable) {
+  counting = enable;
+}
+
+void intercept_counts_reset(void) {
+  memset(contexts, 0, sizeof(contexts));
+  contexts_used = 1;
+  current = &contexts[0];
+}
+
+static struct context *intercept_find_context(const char *name) {
+  if (name == NULL)
+    return &contexts[0];
+
+  for (size_t i = 1; i < contexts_used; i++)
+    if (strncmp(contexts[i].name, name, CONTEXT_NAME_MAX - 1) == 0)
+      return &contexts[i];
+
+  return NULL;
+}
+
+void intercept_context(const char *name) {
+  if ((current = intercept_find_context(name)) != NULL)
+    return;
+
+  if (contexts_used == CONTEXTS_MAX) {
+    current = &contexts[0];
+    return;
+  }
+
+  current = &contexts[contexts_used++];
+  strncpy(current->name, name, CONTEXT_NAME_MAX - 1);
+}
+
+const struct intercept_count *intercept_counts(const char *name) {
+  struct context *context = intercept_find_context(name);
+
+  return context ? context->counts : NULL;
+}
+
+const char *intercept_func_name(enum intercept_funcs func) {
+  if (func >= 0 && func < INTERCEPTED_COUNT)
+    return func_names[func];
+  return NULL;
+}
+
+void intercept_report(FILE *out) {
+  fprintf(out, "%-16s %-12s %10s %12s %12s\n",
+          "context", "function", "calls", "bytes", "ns");
+
+  for (size_t i = 0; i < contexts_used; i++) {
+    for (int f = 0; f < INTERCEPTED_COUNT; f++) {
+      struct intercept_count *count = &contexts[i].counts[f];
+
+      if (count->calls == 0)
+        continue;
+
+      fprintf(out, "%-16s %-12s %10llu %12llu %12llu\n",
+              i == 0 ? "-" : contexts[i].name, func_names[f],
+              count->calls, count->bytes, count->ns);
+    }
+  }
+}
+
+static inline void intercept_account(enum intercept_funcs func,
+                                     unsigned long long int bytes,
+                                     uint64_t start) {
+  struct intercept_count *count = &current->counts[func];
+
+  count->calls++;
+  count->bytes += bytes;
+  count->ns    += cmdserv_monotonic_ns() - start;
+}
+
 #define INTERCEPTION(func_name) failures[INTERCEPT_IDX(func_name)]
-#define EXPAND_INTERCEPTOR(ret_type, func_name, derr, dret, ...)        \
+#define PERTURBATION(func_name) perturbations[INTERCEPT_IDX(func_name)]
+#define EXPAND_INTERCEPTOR(ret_type, func_name, derr, dret, bytes,      \
+                           shortlen, ...)                              \
   ret_type INTERCEPT_FUNC(func_name)(GET_TYPES(__VA_ARGS__)) {          \
-    if (INTERCEPTION(func_name).fail_after--)                           \
+    ret_type ret;                                                       \
+    uint64_t start;                                                     \
+    int saverrno;                                                       \
+                                                                        \
+    if (INTERCEPTION(func_name).armed                                   \
+        && INTERCEPTION(func_name).fail_after-- <= 0) {                 \
+      INTERCEPTION(func_name).fail_after = 0;                           \
+      errno = INTERCEPTION(func_name).fail_errno;                       \
+      return (*(ret_type *)&(INTERCEPTION(func_name).fail_retval));     \
+    }                                                                   \
+                                                                        \
+    if (PERTURBATION(func_name).active                                  \
+        && intercept_perturb(&PERTURBATION(func_name), shortlen)) {     \
+      errno = EAGAIN;                                                   \
+      return (ret_type)(dret);                                          \
+    }                                                                   \
+                                                                        \
+    if (!counting)                                                      \
       return func_name(GET_VARS(__VA_ARGS__));                          \
                                                                         \
-    INTERCEPTION(func_name).fail_after = 0;                             \
-    errno = INTERCEPTION(func_name).fail_errno;                         \
-    return (*(ret_type *)&(INTERCEPTION(func_name).fail_retval));       \
+    start = cmdserv_monotonic_ns();                                     \
+    ret = func_name(GET_VARS(__VA_ARGS__));                             \
+    saverrno = errno;                                                   \
+    intercept_account(INTERCEPT_IDX(func_name),                         \
+                      (unsigned long long int)bytes, start);            \
+    errno = saverrno;                                                   \
+    return ret;                                                         \
   }
 #include "interceptors.def"
+#undef PERTURBATION
 #undef INTERCEPTION
@@ -0,0 +1,387 @@
+/**
+ * @file bench.c
+ *
+ * Throughput and latency benchmark for a running cmdserv.
+ *
+ * Opens a number of concurrent connections, drives a weighted mix of
+ * command lines against the server with a configurable pipelining
+ * depth, and reports commands/sec and latency percentiles as JSON on
+ * stdout (or into a file), so that runs can be compared across
+ * builds:
+ *
+ *     t/bench -c 8 -p 4 -n 10000 -m '3:value get' -m 'help' 12346
+ *
+ * PORT may also be the path of a Unix domain socket (or "@NAME" for
+ * one in the abstract namespace) to compare against TCP.
+ *
+ * Every status line (three digits followed by a space) received from
+ * the server completes the oldest outstanding command on the
+ * connection; all other lines are treated as response body.  A
+ * greeting status line sent by the server on connect (if any, as with
+ * t/test_cmdserv) is consumed before the clock starts.
+ *
+ * Latencies are measured from handing the command line to the kernel
+ * up to the reception of its status line and recorded into
+ * cmdserv_latency histograms, per command name (the first word of the
+ * command line) and overall.
+ */
+
+#include "clientlib.h"
+#include "../cmdserv_helpers.h"
+#include "../cmdserv_latency.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define MIX_MAX       32
+#define CONNS_MAX     1024
+#define DEPTH_MAX     1024
+#define INBUF_LEN     65536
+#define GREETING_MS   200
+
+struct mix_entry {
+  const char *line;
+  unsigned int weight;
+};
+
+struct conn {
+  int fd;
+  unsigned long long int sent;       /**< commands sent                 */
+  unsigned long long int done;       /**< status lines received         */
+  bool greeted;                      /**< greeting status line seen     */
+  unsigned int mix[DEPTH_MAX];       /**< mix entry of outstanding cmds */
+  uint64_t time_sent[DEPTH_MAX];     /**< send time of outstanding cmds */
+  size_t inlen;
+  char in[INBUF_LEN];
+};
+
+static struct mix_entry mix[MIX_MAX];
+static unsigned int mix_count   = 0;
+static unsigned int mix_weights = 0;
+static char mix_names[MIX_MAX][CMDSERV_LATENCY_NAME_LEN];
+
+static unsigned long long int errors = 0;
+
+
+static void usage(const char *prog) {
+  errx(EXIT_FAILURE,
+       "Usage: %s [-c CONNS] [-p DEPTH] [-n COMMANDS] "
+       "[-m [WEIGHT:]COMMAND]... [-o FILE] [[HOST] PORT]",
+       prog);
+}
+
+static unsigned long int number(const char *arg, const char *prog) {
+  char *end;
+  unsigned long int n = strtoul(arg, &end, 10);
+
+  if (*arg == '\0' || *end != '\0' || n == 0)
+    usage(prog);
+
+  return n;
+}
+
+static void mix_add(char *arg, const char *prog) {
+  char *colon = strchr(arg, ':');
+  unsigned int weight = 1;
+  size_t namelen;
+
+  if (mix_count == MIX_MAX)
+    errx(EXIT_FAILURE, "too many commands in mix (max. %d)", MIX_MAX);
+
+  if (colon != NULL && colon != arg
+      && strspn(arg, "0123456789") == (size_t)(colon - arg)) {
+    *colon = '\0';
+    weight = number(arg, prog);
+    arg = colon + 1;
+  }
+
+  namelen = strcspn(arg, " \t");
+  if (namelen >= CMDSERV_LATENCY_NAME_LEN)
+    namelen = CMDSERV_LATENCY_NAME_LEN - 1;
+  memcpy(mix_names[mix_count], arg, namelen);
+  mix_names[mix_count][namelen] = '\0';
+
+  mix[mix_count++] = (struct mix_entry){ .line = arg, .weight = weight };
+  mix_weights += weight;
+}
+
+/**
+ * Pick the next command from the mix: A deterministic weighted round
+ * robin over the global sequence number of the command, so that runs
+ * are repeatable.
+ */
+static unsigned int mix_pick(unsigned long long int seq) {
+  unsigned int w = (unsigned int)(seq % mix_weights);
+
+  for (unsigned int m = 0; m < mix_count; m++) {
+    if (w < mix[m].weight)
+      return m;
+    w -= mix[m].weight;
+  }
+
+  return 0;
+}
+
+static void send_command(struct conn *c, unsigned long long int seq,
+                         unsigned int depth) {
+  unsigned int m = mix_pick(seq);
+  unsigned int slot = (unsigned int)(c->sent % depth);
+  char line[1024];
+  int len = snprintf(line, sizeof(line), "%s\r\n", mix[m].line);
+  ssize_t written;
+
+  if (len < 0 || (size_t)len >= sizeof(line))
+    errx(EXIT_FAILURE, "command too long: %s", mix[m].line);
+
+  c->mix[slot]       = m;
+  c->time_sent[slot] = cmdserv_monotonic_ns();
+
+  if ((written = send(c->fd, line, len, MSG_NOSIGNAL)) == -1)
+    err(EXIT_FAILURE, "send(#%d)", c->fd);
+  if (written != len) /* only small lines here, so don't bother */
+    errx(EXIT_FAILURE, "send(#%d): Could not write entire line", c->fd);
+
+  c->sent++;
+}
+
+static bool is_status_line(const char *line, size_t len) {
+  return len >= 4
+    && isdigit((unsigned char)line[0])
+    && isdigit((unsigned char)line[1])
+    && isdigit((unsigned char)line[2])
+    && line[3] == ' ';
+}
+
+/**
+ * Read whatever is available on the connection and complete one
+ * outstanding command per status line.
+ *
+ * @return The number of commands completed.
+ */
+static unsigned int receive(struct conn *c, unsigned int depth,
+                            cmdserv_latency *per_command,
+                            cmdserv_latency *overall) {
+  ssize_t received;
+  size_t start = 0;
+  unsigned int completed = 0;
+
+  received = recv(c->fd, c->in + c->inlen, INBUF_LEN - c->inlen, 0);
+  if (received == -1)
+    err(EXIT_FAILURE, "recv(#%d)", c->fd);
+  if (received == 0)
+    errx(EXIT_FAILURE, "#%d: server closed connection", c->fd);
+
+  c->inlen += received;
+
+  for (size_t i = 0; i < c->inlen; i++) {
+    if (c->in[i] != '\n')
+      continue;
+
+    if (is_status_line(c->in + start, i - start)) {
+      if (!c->greeted) {
+        c->greeted = true;
+      } else {
+        unsigned int slot = (unsigned int)(c->done % depth);
+        uint64_t ns = cmdserv_monotonic_ns() - c->time_sent[slot];
+
+        if (c->in[start] != '1' && c->in[start] != '2')
+          errors++;
+
+        cmdserv_latency_record(per_command, mix_names[c->mix[slot]], ns);
+        cmdserv_latency_record(overall, CMDSERV_LATENCY_OTHER, ns);
+        c->done++;
+        completed++;
+      }
+    }
+
+    start = i + 1;
+  }
+
+  if (start == 0 && c->inlen == INBUF_LEN) /* overlong body line */
+    start = c->inlen;
+
+  c->inlen -= start;
+  memmove(c->in, c->in + start, c->inlen);
+
+  return completed;
+}
+
+static void print_stats(FILE *out, const struct cmdserv_latency_stats *s) {
+  fprintf(out,
+          "\"count\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+          "\"p999_ns\": %llu, \"max_ns\": %llu, \"mean_ns\": %llu",
+          s->count,
+          (unsigned long long int)s->p50,
+          (unsigned long long int)s->p99,
+          (unsigned long long int)s->p999,
+          (unsigned long long int)s->max,
+          (unsigned long long int)(s->count ? s->sum / s->count : 0));
+}
+
+static void print_json_string(FILE *out, const char *str) {
+  fputc('"', out);
+  for (; *str != '\0'; str++) {
+    if (*str == '"' || *str == '\\')
+      fprintf(out, "\\%c", *str);
+    else if ((unsigned char)*str < 0x20)
+      fprintf(out, "\\u%04x", (unsigned char)*str);
+    else
+      fputc(*str, out);
+  }
+  fputc('"', out);
+}
+
+int main(int argc, char **argv) {
+  unsigned long int conns = 8, depth = 1, commands = 10000;
+  const char *outfile = NULL;
+  FILE *out = stdout;
+  struct conn *conn;
+  struct pollfd *pfd;
+  cmdserv_latency *per_command, *overall;
+  struct cmdserv_latency_stats stats[MIX_MAX + 1];
+  unsigned long long int seq = 0, done = 0, greeted = 0;
+  uint64_t time_start, time_end;
+  unsigned int n;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "c:p:n:m:o:")) != -1) {
+    switch (opt) {
+    case 'c': conns    = number(optarg, argv[0]); break;
+    case 'p': depth    = number(optarg, argv[0]); break;
+    case 'n': commands = number(optarg, argv[0]); break;
+    case 'm': mix_add(optarg, argv[0]);           break;
+    case 'o': outfile  = optarg;                  break;
+    default:  usage(argv[0]);
+    }
+  }
+
+  if (conns > CONNS_MAX || depth > DEPTH_MAX)
+    errx(EXIT_FAILURE, "at most %d connections and depth %d",
+         CONNS_MAX, DEPTH_MAX);
+
+  if (mix_count == 0)
+    mix_add((char[]){ "echo" }, argv[0]);
+
+  /* cmdserv_connect() expects its arguments in argv[1] and up */
+  argv[optind - 1] = argv[0];
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if ((conn = calloc(conns, sizeof(struct conn))) == NULL
+      || (pfd = calloc(conns, sizeof(struct pollfd))) == NULL)
+    err(EXIT_FAILURE, "calloc()");
+
+  if ((per_command = cmdserv_latency_create(MIX_MAX)) == NULL
+      || (overall = cmdserv_latency_create(0)) == NULL)
+    err(EXIT_FAILURE, "cmdserv_latency_create()");
+
+  for (unsigned long int c = 0; c < conns; c++) {
+    conn[c].fd = cmdserv_connect(argc, argv);
+    /* Don't let Nagle's algorithm on our side delay pipelined commands */
+    if (setsockopt(conn[c].fd, IPPROTO_TCP, TCP_NODELAY, &(int){1},
+                   sizeof(int)) == -1 && errno != EOPNOTSUPP)
+      err(EXIT_FAILURE, "setsockopt(#%d, ..., TCP_NODELAY, ...)", conn[c].fd);
+    pfd[c] = (struct pollfd){ .fd = conn[c].fd, .events = POLLIN };
+  }
+
+  /*
+   * Wait for all greetings before starting the clock.  Servers without
+   * a greeting (like t/minimal_cmdserv) stay silent, so give up after
+   * GREETING_MS without any data.
+   */
+  while (greeted < conns) {
+    int ready;
+
+    if ((ready = poll(pfd, conns, GREETING_MS)) == -1)
+      err(EXIT_FAILURE, "poll()");
+    if (ready == 0)
+      break;
+    for (unsigned long int c = 0; c < conns; c++) {
+      if (pfd[c].revents == 0 || conn[c].greeted)
+        continue;
+      receive(&conn[c], depth, per_command, overall);
+      if (conn[c].greeted)
+        greeted++;
+    }
+  }
+
+  for (unsigned long int c = 0; c < conns; c++)
+    conn[c].greeted = true;
+
+  time_start = cmdserv_monotonic_ns();
+
+  for (unsigned long int c = 0; c < conns; c++)
+    for (unsigned long int d = 0; d < depth && seq < commands; d++)
+      send_command(&conn[c], seq++, depth);
+
+  while (done < commands) {
+    if (poll(pfd, conns, -1) == -1)
+      err(EXIT_FAILURE, "poll()");
+
+    for (unsigned long int c = 0; c < conns; c++) {
+      if (pfd[c].revents == 0)
+        continue;
+
+      if (!(pfd[c].revents & POLLIN))
+        errx(EXIT_FAILURE, "#%d: connection error", conn[c].fd);
+
+      for (n = receive(&conn[c], depth, per_command, overall); n > 0; n--) {
+        done++;
+        if (seq < commands)
+          send_command(&conn[c], seq++, depth);
+      }
+    }
+  }
+
+  time_end = cmdserv_monotonic_ns();
+
+  for (unsigned long int c = 0; c < conns; c++)
+    cmdserv_close(conn[c].fd);
+
+  if (outfile != NULL && (out = fopen(outfile, "w")) == NULL)
+    err(EXIT_FAILURE, "fopen(%s)", outfile);
+
+  fprintf(out, "{\n");
+  fprintf(out, "  \"connections\": %lu,\n", conns);
+  fprintf(out, "  \"pipeline_depth\": %lu,\n", depth);
+  fprintf(out, "  \"commands\": %llu,\n", done);
+  fprintf(out, "  \"errors\": %llu,\n", errors);
+  fprintf(out, "  \"elapsed_s\": %.6f,\n",
+          (double)(time_end - time_start) / 1e9);
+  fprintf(out, "  \"commands_per_sec\": %.1f,\n",
+          (double)done * 1e9 / (double)(time_end - time_start));
+
+  if (cmdserv_latency_stats(overall, stats, 1) == 1) {
+    fprintf(out, "  \"latency\": { ");
+    print_stats(out, &stats[0]);
+    fprintf(out, " },\n");
+  }
+
+  fprintf(out, "  \"per_command\": [");
+  n = cmdserv_latency_stats(per_command, stats, MIX_MAX + 1);
+  for (unsigned int s = 0; s < n; s++) {
+    fprintf(out, "%s\n    { \"command\": ", s > 0 ? "," : "");
+    print_json_string(out, stats[s].command);
+    fprintf(out, ", ");
+    print_stats(out, &stats[s]);
+    fprintf(out, " }");
+  }
+  fprintf(out, "%s]\n}\n", n > 0 ? "\n  " : "");
+
+  if (out != stdout && fclose(out) != 0)
+    err(EXIT_FAILURE, "fclose(%s)", outfile);
+
+  cmdserv_latency_free(per_command);
+  cmdserv_latency_free(overall);
+  free(conn);
+  free(pfd);
+
+  return errors > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,376 @@
+/**
+ * @file bench_idle.c
+ *
+ * Idle connection scaling benchmark.
+ *
+ * Forks a cmdserv server, then opens increasing numbers of idle
+ * connections to it (1k, 10k and 50k by default) while one active
+ * client measures round-trip latency.  For each scale the server's
+ * CPU time per cmdserv_sleep() iteration, its RSS and the round-trip
+ * latency percentiles are reported as JSON on stdout:
+ *
+ *     t/bench_idle [-s SCALE]... [-r ROUNDTRIPS] [-P PORT]
+ *
+ * This shows whether the event loop costs scale with the number of
+ * idle connections or only with the active ones.
+ *
+ * RLIMIT_NOFILE is raised as far as the hard limit allows; scales
+ * beyond that are capped (and reported with the number of
+ * connections actually requested).  Connections the server turns
+ * away (connections_max, or file descriptors select() can't handle)
+ * are closed again and show up as the difference between
+ * "connections_requested" and "connections_open".
+ *
+ * The idle connections are spread over the destination addresses
+ * 127.0.0.1 to 127.0.0.255 so that the ephemeral port range does
+ * not limit the number of connections to a single server port.
+ */
+
+#include "clientlib.h"
+#include "../cmdserv.h"
+#include "../cmdserv_helpers.h"
+#include "../cmdserv_latency.h"
+
+#include <err.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SCALES_MAX     16
+#define DEFAULT_PORT   12348
+#define FD_RESERVE     64
+#define LINE_LEN       256
+
+/**
+ * State of the forked server, reported by its "stats" command.
+ */
+static unsigned long long int server_loops = 0;
+static unsigned long long int server_seen  = 0;
+static unsigned long long int server_open  = 0;
+
+
+/*
+ * Server side
+ */
+
+static void server_open_handler(void *open_object,
+                                cmdserv_connection *connection,
+                                enum cmdserv_close_reason reason) {
+  (void)open_object;
+  (void)connection;
+
+  server_seen++;
+  if (reason == CMDSERV_NO_CLOSE)
+    server_open++;
+}
+
+static void server_close_handler(void *close_object,
+                                 cmdserv_connection *connection,
+                                 enum cmdserv_close_reason reason) {
+  (void)close_object;
+  (void)connection;
+  (void)reason;
+
+  server_open--;
+}
+
+static void server_cmd_handler(void *cmd_object,
+                               cmdserv_connection *connection,
+                               int argc, char **argv) {
+  (void)cmd_object;
+
+  if (argc == 1 && strcmp(argv[0], "stats") == 0) {
+    struct rusage usage;
+    long int rss_pages = 0;
+    FILE *statm;
+
+    if (getrusage(RUSAGE_SELF, &usage) == -1) {
+      cmdserv_connection_send_status(connection, 500, "getrusage(): %s",
+                                     strerror(errno));
+      return;
+    }
+
+    if ((statm = fopen("/proc/self/statm", "r")) != NULL) {
+      if (fscanf(statm, "%*d %ld", &rss_pages) != 1)
+        rss_pages = 0;
+      fclose(statm);
+    }
+
+    cmdserv_connection_send_status(connection, 200, "%llu %llu %ld %llu %llu",
+                                   server_loops,
+                                   (unsigned long long int)
+                                   ((usage.ru_utime.tv_sec
+                                     + usage.ru_stime.tv_sec) * 1000000ULL
+                                    + usage.ru_utime.tv_usec
+                                    + usage.ru_stime.tv_usec),
+                                   rss_pages * (sysconf(_SC_PAGESIZE) / 1024),
+                                   server_seen,
+                                   server_open);
+  } else {
+    cmdserv_connection_send_status(connection, 200, "OK");
+  }
+}
+
+static void server_run(unsigned int port, int connections_max) {
+  struct cmdserv_config config = cmdserv_config_get_defaults();
+  struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+  cmdserv *server;
+
+  config.port                             = port;
+  config.connections_max                  = connections_max;
+  config.connections_backlog              = 4096;
+  config.log_handler                      = NULL;
+  config.connection_config.log_handler    = NULL;
+  config.connection_config.cmd_handler    = &server_cmd_handler;
+  config.connection_config.open_handler   = &server_open_handler;
+  config.connection_config.close_handler  = &server_close_handler;
+
+  if ((server = cmdserv_start(config)) == NULL)
+    err(EXIT_FAILURE, "cmdserv_start()");
+
+  for (;;) {
+    cmdserv_sleep(server, &timeout);
+    server_loops++;
+  }
+}
+
+
+/*
+ * Client side
+ */
+
+struct server_stats {
+  unsigned long long int loops;
+  unsigned long long int cpu_us;
+  unsigned long long int rss_kb;
+  unsigned long long int seen;
+  unsigned long long int open;
+};
+
+static int connect_to(unsigned int port, unsigned int n, bool fail_ok) {
+  int fd;
+
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+    if (fail_ok)
+      return -1;
+    err(EXIT_FAILURE, "socket()");
+  }
+
+  if (connect(fd,
+              (struct sockaddr*)&(struct sockaddr_in){
+                .sin_family      = AF_INET,
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK + n % 255),
+                .sin_port        = htons(port)
+              },
+              sizeof(struct sockaddr_in)) == -1) {
+    if (fail_ok) {
+      close(fd);
+      return -1;
+    }
+    err(EXIT_FAILURE, "connect()");
+  }
+
+  if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int)) == -1)
+    err(EXIT_FAILURE, "setsockopt(#%d, ..., TCP_NODELAY, ...)", fd);
+
+  return fd;
+}
+
+/**
+ * Send one command line and wait for the status line.
+ */
+static void roundtrip(int fd, const char *cmd, char *line) {
+  size_t len = 0;
+  ssize_t received;
+
+  if (send(fd, cmd, strlen(cmd), MSG_NOSIGNAL) != (ssize_t)strlen(cmd))
+    err(EXIT_FAILURE, "send()");
+
+  do {
+    if ((received = recv(fd, line + len, LINE_LEN - 1 - len, 0)) <= 0)
+      errx(EXIT_FAILURE, "recv(): server gone");
+    len += received;
+  } while (len < LINE_LEN - 1 && line[len - 1] != '\n');
+
+  line[len] = '\0';
+}
+
+static struct server_stats stats(int fd) {
+  struct server_stats s;
+  char line[LINE_LEN];
+
+  roundtrip(fd, "stats\r\n", line);
+
+  if (sscanf(line, "200 %llu %llu %llu %llu %llu",
+             &s.loops, &s.cpu_us, &s.rss_kb, &s.seen, &s.open) != 5)
+    errx(EXIT_FAILURE, "unexpected stats reply: %s", line);
+
+  return s;
+}
+
+/**
+ * Close all idle connections the server turned away.
+ */
+static void reap_rejected(int *fds, unsigned int count) {
+  struct pollfd pfd;
+
+  for (unsigned int i = 0; i < count; i++) {
+    if (fds[i] == -1)
+      continue;
+    pfd = (struct pollfd){ .fd = fds[i], .events = POLLIN };
+    if (poll(&pfd, 1, 0) == 1) {
+      close(fds[i]);
+      fds[i] = -1;
+    }
+  }
+}
+
+static void usage(const char *prog) {
+  errx(EXIT_FAILURE,
+       "Usage: %s [-s SCALE]... [-r ROUNDTRIPS] [-P PORT]", prog);
+}
+
+int main(int argc, char **argv) {
+  unsigned int scales[SCALES_MAX] = { 1000, 10000, 50000 };
+  unsigned int nscales = 0, roundtrips = 1000, port = DEFAULT_PORT;
+  unsigned int scale_max = 0, requested = 0;
+  int *fds, active, opt;
+  struct rlimit rlim;
+  pid_t server;
+  cmdserv_latency *latency;
+
+  while ((opt = getopt(argc, argv, "s:r:P:")) != -1) {
+    switch (opt) {
+    case 's':
+      if (nscales == SCALES_MAX)
+        usage(argv[0]);
+      scales[nscales++] = strtoul(optarg, NULL, 10);
+      break;
+    case 'r': roundtrips = strtoul(optarg, NULL, 10); break;
+    case 'P': port       = strtoul(optarg, NULL, 10); break;
+    default:  usage(argv[0]);
+    }
+  }
+  if (nscales == 0)
+    nscales = 3;
+  if (roundtrips == 0)
+    usage(argv[0]);
+
+  for (unsigned int s = 0; s < nscales; s++)
+    if (scales[s] > scale_max)
+      scale_max = scales[s];
+
+  /* Raise the limit for both, client and (forked) server */
+  if (getrlimit(RLIMIT_NOFILE, &rlim) == -1)
+    err(EXIT_FAILURE, "getrlimit()");
+  if (rlim.rlim_max == RLIM_INFINITY || rlim.rlim_max > scale_max + FD_RESERVE)
+    rlim.rlim_cur = scale_max + FD_RESERVE;
+  else
+    rlim.rlim_cur = rlim.rlim_max;
+  if (setrlimit(RLIMIT_NOFILE, &rlim) == -1)
+    err(EXIT_FAILURE, "setrlimit()");
+  if (rlim.rlim_cur < scale_max + FD_RESERVE)
+    warnx("RLIMIT_NOFILE hard limit is %llu, capping scales",
+          (unsigned long long int)rlim.rlim_cur);
+
+  if ((server = fork()) == -1)
+    err(EXIT_FAILURE, "fork()");
+  if (server == 0)
+    server_run(port, scale_max + 1);
+
+  if ((fds = malloc(scale_max * sizeof(int))) == NULL)
+    err(EXIT_FAILURE, "malloc()");
+
+  if ((latency = cmdserv_latency_create(0)) == NULL)
+    err(EXIT_FAILURE, "cmdserv_latency_create()");
+
+  /* The active client connects first, so it is never turned away */
+  for (int tries = 0; (active = connect_to(port, 0, true)) == -1; tries++) {
+    if (tries == 50)
+      errx(EXIT_FAILURE, "could not connect to server");
+    millisleep(100);
+  }
+
+  printf("{\n  \"roundtrips\": %u,\n  \"scales\": [", roundtrips);
+
+  for (unsigned int s = 0; s < nscales; s++) {
+    unsigned int scale = scales[s];
+    struct server_stats before, after;
+    struct cmdserv_latency_stats lat;
+    char line[LINE_LEN];
+    unsigned int open = 0;
+
+    if (scale > rlim.rlim_cur - FD_RESERVE)
+      scale = rlim.rlim_cur - FD_RESERVE;
+
+    for (; requested < scale; requested++)
+      if ((fds[requested] = connect_to(port, requested + 1, true)) == -1)
+        break;
+    scale = requested;
+
+    /* Wait for the server to have handled all connection attempts */
+    while (stats(active).seen < (unsigned long long int)requested + 1)
+      millisleep(10);
+    reap_rejected(fds, requested);
+
+    for (unsigned int i = 0; i < requested; i++)
+      if (fds[i] != -1)
+        open++;
+
+    cmdserv_latency_reset(latency);
+    before = stats(active);
+
+    for (unsigned int r = 0; r < roundtrips; r++) {
+      uint64_t start = cmdserv_monotonic_ns();
+      roundtrip(active, "ping\r\n", line);
+      cmdserv_latency_record(latency, CMDSERV_LATENCY_OTHER,
+                             cmdserv_monotonic_ns() - start);
+    }
+
+    after = stats(active);
+    cmdserv_latency_stats(latency, &lat, 1);
+
+    printf("%s\n    { \"connections_requested\": %u, "
+           "\"connections_open\": %u, "
+           "\"loops\": %llu, \"cpu_ns_per_loop\": %.0f, "
+           "\"server_rss_kb\": %llu, "
+           "\"rtt_p50_ns\": %llu, \"rtt_p99_ns\": %llu, "
+           "\"rtt_p999_ns\": %llu, \"rtt_max_ns\": %llu }",
+           s > 0 ? "," : "",
+           scale, open,
+           after.loops - before.loops,
+           (double)(after.cpu_us - before.cpu_us) * 1000.0
+           / (double)(after.loops - before.loops),
+           after.rss_kb,
+           (unsigned long long int)lat.p50,
+           (unsigned long long int)lat.p99,
+           (unsigned long long int)lat.p999,
+           (unsigned long long int)lat.max);
+    fflush(stdout);
+  }
+
+  printf("\n  ]\n}\n");
+
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+
+  for (unsigned int i = 0; i < requested; i++)
+    if (fds[i] != -1)
+      close(fds[i]);
+  close(active);
+
+  cmdserv_latency_free(latency);
+  free(fds);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,229 @@
+/**
+ * @file bench_shm.c
+ *
+ * Round-trip latency of small commands over the different local
+ * transports.
+ *
+ * Forks a cmdserv server listening on TCP (loopback), on a Unix
+ * domain socket and on a shared memory endpoint, then sends one
+ * command at a time over each of them and waits for its status line.
+ * The round-trip latency percentiles per transport are reported as
+ * JSON on stdout:
+ *
+ *     t/bench_shm [-r ROUNDTRIPS] [-P PORT]
+ */
+
+#include "clientlib.h"
+#include "../cmdserv.h"
+#include "../cmdserv_helpers.h"
+#include "../cmdserv_latency.h"
+#include "../cmdserv_shm.h"
+
+#include <err.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define DEFAULT_PORT   12352
+#define UNIX_ENDPOINT  "@cmdserv-bench-shm-unix"
+#define SHM_ENDPOINT   "@cmdserv-bench-shm"
+#define LINE_LEN       256
+#define TIMEOUT_MS     5000
+
+static void usage(const char *prog) {
+  errx(EXIT_FAILURE, "Usage: %s [-r ROUNDTRIPS] [-P PORT]", prog);
+}
+
+
+/*
+ * Server side
+ */
+
+static void server_cmd_handler(void *cmd_object,
+                               cmdserv_connection *connection,
+                               int argc, char **argv) {
+  (void)cmd_object;
+  (void)argc;
+  (void)argv;
+  cmdserv_connection_send_status(connection, 200, "OK");
+}
+
+static void server_run(unsigned int port) {
+  struct cmdserv_config config = cmdserv_config_get_defaults();
+  struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+  char tcp[32];
+  cmdserv *server;
+
+  snprintf(tcp, sizeof(tcp), "127.0.0.1:%u", port);
+
+  config.listen[0]                     = tcp;
+  config.listen[1]                     = UNIX_ENDPOINT;
+  config.listen[2]                     = "shm:" SHM_ENDPOINT;
+  config.log_handler                   = NULL;
+  config.connection_config.log_handler = NULL;
+  config.connection_config.cmd_handler = &server_cmd_handler;
+
+  if ((server = cmdserv_start(config)) == NULL)
+    err(EXIT_FAILURE, "cmdserv_start()");
+
+  for (;;)
+    cmdserv_sleep(server, &timeout);
+}
+
+
+/*
+ * Client side
+ */
+
+/**
+ * The client end of one of the transports: Either a socket or the
+ * shared memory rings.
+ */
+struct client {
+  int fd;
+  cmdserv_shm *shm;
+  size_t inlen;
+  char in[LINE_LEN];
+};
+
+static void client_send(struct client *c, const char *line, size_t len) {
+  ssize_t sent = c->shm
+    ? cmdserv_shm_send(c->shm, line, len)
+    : send(c->fd, line, len, MSG_NOSIGNAL);
+
+  if (sent != (ssize_t)len)
+    err(EXIT_FAILURE, "send()");
+}
+
+/**
+ * Read until a complete status line is in, then drop it.
+ */
+static void client_status(struct client *c) {
+  for (;;) {
+    char *eol = memchr(c->in, '\n', c->inlen);
+    ssize_t got;
+
+    if (eol != NULL) {
+      c->inlen -= eol + 1 - c->in;
+      memmove(c->in, eol + 1, c->inlen);
+      return;
+    }
+
+    if (c->inlen == LINE_LEN)
+      errx(EXIT_FAILURE, "line too long from server");
+
+    got = c->shm
+      ? cmdserv_shm_recv(c->shm, c->in + c->inlen, LINE_LEN - c->inlen,
+                         TIMEOUT_MS)
+      : recv(c->fd, c->in + c->inlen, LINE_LEN - c->inlen, 0);
+    if (got == -1)
+      err(EXIT_FAILURE, "recv()");
+    if (got == 0)
+      errx(EXIT_FAILURE, "server closed connection");
+    c->inlen += got;
+  }
+}
+
+int main(int argc, char **argv) {
+  unsigned int roundtrips = 100000, port = DEFAULT_PORT;
+  const char *names[] = { "tcp", "unix", "shm" };
+  cmdserv_latency *latency;
+  char portarg[16];
+  pid_t server;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "r:P:")) != -1) {
+    switch (opt) {
+    case 'r': roundtrips = strtoul(optarg, NULL, 10); break;
+    case 'P': port       = strtoul(optarg, NULL, 10); break;
+    default:  usage(argv[0]);
+    }
+  }
+  if (roundtrips == 0 || port == 0 || port > 65535)
+    usage(argv[0]);
+
+  if ((server = fork()) == -1)
+    err(EXIT_FAILURE, "fork()");
+  if (server == 0)
+    server_run(port);
+
+  if ((latency = cmdserv_latency_create(0)) == NULL)
+    err(EXIT_FAILURE, "cmdserv_latency_create()");
+
+  /* Give the server a moment to listen */
+  millisleep(200);
+
+  printf("{\n  \"roundtrips\": %u,\n  \"transports\": [", roundtrips);
+
+  for (unsigned int t = 0; t < sizeof(names) / sizeof(names[0]); t++) {
+    struct client c = { .fd = -1, .shm = NULL, .inlen = 0 };
+    struct cmdserv_latency_stats lat;
+
+    if (t == 0) {
+      char name[] = "bench_shm", host[] = "127.0.0.1";
+      char *args[] = { name, host, portarg, NULL };
+
+      snprintf(portarg, sizeof(portarg), "%u", port);
+      c.fd = cmdserv_connect(3, args);
+      if (setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int))
+          == -1)
+        err(EXIT_FAILURE, "setsockopt(TCP_NODELAY)");
+    } else if (t == 1) {
+      char name[] = "bench_shm", path[] = UNIX_ENDPOINT;
+      char *args[] = { name, path, NULL };
+
+      c.fd = cmdserv_connect(2, args);
+    } else {
+      c.shm = cmdserv_connect_shm(SHM_ENDPOINT);
+    }
+
+    /* Warm up, the first round trips take the slow paths */
+    for (unsigned int r = 0; r < 1000; r++) {
+      client_send(&c, "ping\r\n", 6);
+      client_status(&c);
+    }
+
+    cmdserv_latency_reset(latency);
+
+    for (unsigned int r = 0; r < roundtrips; r++) {
+      uint64_t start = cmdserv_monotonic_ns();
+      client_send(&c, "ping\r\n", 6);
+      client_status(&c);
+      cmdserv_latency_record(latency, CMDSERV_LATENCY_OTHER,
+                             cmdserv_monotonic_ns() - start);
+    }
+
+    cmdserv_latency_stats(latency, &lat, 1);
+
+    printf("%s\n    { \"transport\": \"%s\", "
+           "\"rtt_p50_ns\": %llu, \"rtt_p99_ns\": %llu, "
+           "\"rtt_p999_ns\": %llu, \"rtt_max_ns\": %llu }",
+           t > 0 ? "," : "",
+           names[t],
+           (unsigned long long int)lat.p50,
+           (unsigned long long int)lat.p99,
+           (unsigned long long int)lat.p999,
+           (unsigned long long int)lat.max);
+    fflush(stdout);
+
+    if (c.shm)
+      cmdserv_close_shm(c.shm);
+    else
+      close(c.fd);
+  }
+
+  printf("\n  ]\n}\n");
+
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+
+  cmdserv_latency_free(latency);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,452 @@
+/**
+ * @file bench_tokenize.c
+ *
+ * In-process microbenchmark for the per-byte hot paths of cmdserv:
+ * cmdserv_tokenize() and the line framing in
+ * cmdserv_connection_read().
+ *
+ * A set of generated, representative corpora (short commands, long
+ * unquoted arguments, heavy quoting and escapes, with CRLF and LF line
+ * terminators) is fed
+ *
+ *   - line by line through cmdserv_tokenize() ("tokenize"),
+ *
+ *   - through a cmdserv_connection over a loopback TCP connection,
+ *     one line per send ("frame-single") and in pipelined bursts of
+ *     up to BURST_LEN octets per send ("frame-burst"),
+ *
+ *   - through a cmdserv_connection on the in-process memory
+ *     transport, the whole corpus at once ("frame-memory"), and the
+ *     same again with the corpus tokenized beforehand and encoded as
+ *     binary frames ("binary-memory", see CMDSERV_FRAMING_BINARY) or
+ *     RESP2 arrays ("resp-memory", see CMDSERV_FRAMING_RESP); their
+ *     ns/byte are per octet of the encoded commands.
+ *
+ * The framing paths include the tokenizer, a trivial cmd_handler and
+ * (but for frame-memory) the recv() syscalls, so subtracting the
+ * tokenize numbers gives a rough idea of the framing overhead, and
+ * frame-memory shows it without the noise of the kernel.  The tokenize
+ * path includes a memcpy() to restore the corpus before each round.
+ * binary-memory is what's left when the server doesn't have to scan
+ * for line terminators and tokenize at all, resp-memory what it costs
+ * to still parse the decimal lengths of RESP.
+ *
+ * Results are written as JSON (ns/byte and ns/line per corpus and
+ * path) to stdout:
+ *
+ *     t/bench_tokenize [-r ROUNDS]
+ */
+
+#include "clientlib.h"
+#include "../cmdserv_connection.h"
+#include "../cmdserv_connection_config.h"
+#include "../cmdserv_helpers.h"
+#include "../cmdserv_tokenize.h"
+#include "../cmdserv_transport.h"
+
+#include <err.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define CORPUS_LINES  4096
+#define ARGC_MAX      16
+#define READBUF_SIZE  4096
+#define BURST_LEN     4096
+
+struct corpus {
+  const char *name;
+  const char *eol;
+  char *buf;                    /**< all lines, terminated with eol */
+  size_t len;
+  size_t lines;
+};
+
+struct result {
+  unsigned long long int lines;
+  unsigned long long int args;
+};
+
+
+/**
+ * The generators: Each one writes the n-th line of its corpus
+ * (without line terminator) into line.
+ */
+static void gen_short(char *line, size_t size, unsigned int n) {
+  static const char *cmds[] = { "get x", "set key 1", "help",
+                                "value get", "ping", "del a b" };
+  snprintf(line, size, "%s", cmds[n % (sizeof(cmds) / sizeof(cmds[0]))]);
+}
+
+static void gen_long(char *line, size_t size, unsigned int n) {
+  size_t len = 0;
+
+  len += snprintf(line + len, size - len, "store%u", n % 10);
+  for (unsigned int a = 0; a < 6; a++) {
+    line[len++] = ' ';
+    for (unsigned int c = 0; c < 120; c++)
+      line[len++] = "abcdefghijklmnopqrstuvwxyz0123456789"[(n + a + c) % 36];
+  }
+  line[len] = '\0';
+}
+
+static void gen_quoted(char *line, size_t size, unsigned int n) {
+  snprintf(line, size,
+           "set \"key %u with spaces\" 'it\\'s \"quoted\"' "
+           "escaped\\ space\\ %u \"\\\"nested\\\" \\\\ back\" "
+           "ab\"cd\"'ef' \"\"",
+           n, n * 7);
+}
+
+static struct corpus corpus_create(const char *name, const char *eol,
+                                   void (*gen)(char*, size_t, unsigned int)) {
+  struct corpus corpus = { .name = name, .eol = eol, .lines = CORPUS_LINES };
+  size_t size = 0;
+  char line[1024];
+
+  for (unsigned int n = 0; n < CORPUS_LINES; n++) {
+    gen(line, sizeof(line), n);
+    size += strlen(line) + strlen(eol);
+  }
+
+  if ((corpus.buf = malloc(size + 1)) == NULL)
+    err(EXIT_FAILURE, "malloc()");
+
+  for (unsigned int n = 0; n < CORPUS_LINES; n++) {
+    gen(line, sizeof(line), n);
+    corpus.len += sprintf(corpus.buf + corpus.len, "%s%s", line, eol);
+  }
+
+  return corpus;
+}
+
+/**
+ * Encoder for a tokenized command, cmdserv_frame() or cmdserv_resp().
+ */
+typedef ssize_t (*frame_encoder)(void *buf, size_t size, int argc,
+                                 const char *const *argv, const size_t *argl);
+
+/**
+ * The corpus with each line tokenized and encoded with encode.
+ */
+static struct corpus corpus_frames(struct corpus *corpus,
+                                   frame_encoder encode) {
+  struct corpus frames = { .name = corpus->name, .eol = "",
+                           .lines = corpus->lines };
+  size_t size = corpus->len
+    + corpus->lines * (CMDSERV_FRAME_HEADER + ARGC_MAX * 16);
+  char *work, *line;
+
+  if ((frames.buf = malloc(size)) == NULL
+      || (work = malloc(corpus->len + 1)) == NULL)
+    err(EXIT_FAILURE, "malloc()");
+  memcpy(work, corpus->buf, corpus->len);
+  work[corpus->len] = '\0';
+
+  for (line = work; *line != '\0'; ) {
+    char *eol = strchr(line, '\n');
+    char *argv[ARGC_MAX];
+    int args;
+    ssize_t len;
+
+    *eol = '\0';
+    if (eol > line && eol[-1] == '\r')
+      eol[-1] = '\0';
+    if ((args = cmdserv_tokenize(line, argv, ARGC_MAX)) < 0)
+      errx(EXIT_FAILURE, "%s: tokenizer error %d", corpus->name, args);
+    if ((len = encode(frames.buf + frames.len, size - frames.len,
+                      args, (const char *const *)argv, NULL)) == -1)
+      errx(EXIT_FAILURE, "%s: frames too long", corpus->name);
+    frames.len += len;
+    line = eol + 1;
+  }
+
+  free(work);
+
+  return frames;
+}
+
+/**
+ * Tokenize all lines of a corpus: A working copy is made once per
+ * round, the line terminators are replaced by zeros while scanning.
+ */
+static void run_tokenize(struct corpus *corpus, char *work,
+                         struct result *result) {
+  char *argv[ARGC_MAX];
+  size_t eollen = strlen(corpus->eol);
+  char *line = work;
+
+  memcpy(work, corpus->buf, corpus->len);
+
+  for (char *p = work; p < work + corpus->len; p++) {
+    if (*p != '\n')
+      continue;
+    *(p + 1 - eollen) = '\0';
+
+    result->args += cmdserv_tokenize(line, argv, ARGC_MAX);
+    result->lines++;
+    line = p + 1;
+  }
+}
+
+static void count_handler(void *cmd_object,
+                          cmdserv_connection *connection,
+                          int argc, char **argv) {
+  struct result *result = cmd_object;
+
+  (void)connection;
+  (void)argv;
+
+  result->lines++;
+  result->args += argc;
+}
+
+/**
+ * Push a corpus through the line framing of a cmdserv_connection: The
+ * corpus is sent over the loopback connection in chunks of at most
+ * chunklen octets, always ending at a line boundary, and read back
+ * until all lines of the chunk have been handled.
+ */
+static void run_frame(struct corpus *corpus, int client_fd,
+                      cmdserv_connection *connection,
+                      size_t chunklen, struct result *result) {
+  size_t pos = 0;
+
+  while (pos < corpus->len) {
+    size_t len = 0, lines = 0;
+    unsigned long long int expected;
+
+    for (size_t i = pos; i < corpus->len; i++) {
+      if (corpus->buf[i] != '\n')
+        continue;
+      if (lines > 0 && i + 1 - pos > chunklen)
+        break;
+      len = i + 1 - pos;
+      lines++;
+      if (len >= chunklen)
+        break;
+    }
+
+    if (send(client_fd, corpus->buf + pos, len, 0) != (ssize_t)len)
+      err(EXIT_FAILURE, "send()");
+
+    for (expected = result->lines + lines; result->lines < expected; )
+      cmdserv_connection_read(connection);
+
+    pos += len;
+  }
+}
+
+/**
+ * Push a corpus through the framing of a cmdserv_connection on
+ * the memory transport: All of it at once, handled by a single
+ * cmdserv_connection_read(), the responses are thrown away.
+ */
+static void run_memory(struct corpus *corpus, cmdserv_memory *memory,
+                       cmdserv_connection *connection) {
+  if (cmdserv_memory_push(memory, corpus->buf, corpus->len) == -1)
+    err(EXIT_FAILURE, "cmdserv_memory_push()");
+  cmdserv_connection_read(connection);
+  cmdserv_memory_discard(memory);
+}
+
+static int listen_loopback(void) {
+  int fd;
+
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    err(EXIT_FAILURE, "socket()");
+
+  if (bind(fd,
+           (struct sockaddr*)&(struct sockaddr_in){
+             .sin_family      = AF_INET,
+             .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+             .sin_port        = 0
+           },
+           sizeof(struct sockaddr_in)) == -1)
+    err(EXIT_FAILURE, "bind()");
+
+  if (listen(fd, 1) == -1)
+    err(EXIT_FAILURE, "listen()");
+
+  return fd;
+}
+
+static int connect_loopback(int listener_fd) {
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  int fd;
+
+  if (getsockname(listener_fd, (struct sockaddr*)&addr, &addrlen) == -1)
+    err(EXIT_FAILURE, "getsockname()");
+
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    err(EXIT_FAILURE, "socket()");
+
+  if (connect(fd, (struct sockaddr*)&addr, addrlen) == -1)
+    err(EXIT_FAILURE, "connect()");
+
+  return fd;
+}
+
+static void report(bool *first, struct corpus *corpus, const char *path,
+                   unsigned int rounds, uint64_t ns,
+                   struct result *result) {
+  double bytes = (double)corpus->len * rounds;
+
+  if (result->lines != (unsigned long long int)corpus->lines * rounds)
+    errx(EXIT_FAILURE, "%s/%s: %llu lines handled, expected %llu",
+         corpus->name, path, result->lines,
+         (unsigned long long int)corpus->lines * rounds);
+
+  printf("%s\n    { \"corpus\": \"%s\", \"path\": \"%s\", "
+         "\"bytes\": %.0f, \"lines\": %llu, \"args\": %llu, "
+         "\"ns_per_byte\": %.3f, \"ns_per_line\": %.1f }",
+         *first ? "" : ",",
+         corpus->name, path, bytes, result->lines, result->args,
+         (double)ns / bytes, (double)ns / (double)result->lines);
+
+  *first = false;
+}
+
+int main(int argc, char **argv) {
+  static const struct {
+    const char *path;
+    enum cmdserv_framing framing;
+    frame_encoder encode;
+  } memory_paths[] = {
+    { "frame-memory",  CMDSERV_FRAMING_LINE,   NULL           },
+    { "binary-memory", CMDSERV_FRAMING_BINARY, &cmdserv_frame },
+    { "resp-memory",   CMDSERV_FRAMING_RESP,   &cmdserv_resp  },
+  };
+  unsigned int rounds = 50;
+  struct corpus corpora[] = {
+    corpus_create("short-crlf",  "\r\n", &gen_short),
+    corpus_create("short-lf",    "\n",   &gen_short),
+    corpus_create("long-crlf",   "\r\n", &gen_long),
+    corpus_create("long-lf",     "\n",   &gen_long),
+    corpus_create("quoted-crlf", "\r\n", &gen_quoted),
+    corpus_create("quoted-lf",   "\n",   &gen_quoted),
+  };
+  size_t ncorpora = sizeof(corpora) / sizeof(corpora[0]);
+  struct result result;
+  bool first = true;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "r:")) != -1) {
+    if (opt != 'r' || (rounds = strtoul(optarg, NULL, 10)) == 0)
+      errx(EXIT_FAILURE, "Usage: %s [-r ROUNDS]", argv[0]);
+  }
+
+  printf("{\n  \"rounds\": %u,\n  \"results\": [", rounds);
+
+  for (size_t c = 0; c < ncorpora; c++) {
+    struct corpus *corpus = &corpora[c];
+    char *work;
+    uint64_t start;
+
+    if ((work = malloc(corpus->len)) == NULL)
+      err(EXIT_FAILURE, "malloc()");
+
+    result = (struct result){ 0, 0 };
+    start = cmdserv_monotonic_ns();
+    for (unsigned int r = 0; r < rounds; r++)
+      run_tokenize(corpus, work, &result);
+    report(&first, corpus, "tokenize", rounds,
+           cmdserv_monotonic_ns() - start, &result);
+
+    free(work);
+  }
+
+  for (size_t c = 0; c < ncorpora; c++) {
+    struct corpus *corpus = &corpora[c];
+
+    for (int burst = 0; burst <= 1; burst++) {
+      struct cmdserv_connection_config config
+        = cmdserv_connection_config_get_defaults();
+      cmdserv_connection *connection;
+      int listener_fd = listen_loopback();
+      int client_fd = connect_loopback(listener_fd);
+      uint64_t start;
+
+      config.readbuf_size = READBUF_SIZE;
+      config.argc_max     = ARGC_MAX - 1;
+      config.lineterm     = corpus->eol[0] == '\r'
+                            ? CMDSERV_LINETERM_CRLF
+                            : CMDSERV_LINETERM_LF;
+      config.cmd_handler  = &count_handler;
+      config.cmd_object   = &result;
+      config.log_handler  = NULL;
+
+      if ((connection = cmdserv_connection_create(listener_fd, 0, &config,
+                                                  CMDSERV_NO_CLOSE))
+          == NULL)
+        err(EXIT_FAILURE, "cmdserv_connection_create()");
+
+      result = (struct result){ 0, 0 };
+      start = cmdserv_monotonic_ns();
+      for (unsigned int r = 0; r < rounds; r++)
+        run_frame(corpus, client_fd, connection,
+                  burst ? BURST_LEN : 1, &result);
+      report(&first, corpus, burst ? "frame-burst" : "frame-single",
+             rounds, cmdserv_monotonic_ns() - start, &result);
+
+      cmdserv_connection_close(connection, CMDSERV_SERVER_SHUTDOWN);
+      close(client_fd);
+      close(listener_fd);
+    }
+
+    for (size_t p = 0; p < sizeof(memory_paths) / sizeof(memory_paths[0]);
+         p++) {
+      struct cmdserv_connection_config config
+        = cmdserv_connection_config_get_defaults();
+      struct corpus frames = memory_paths[p].encode
+        ? corpus_frames(corpus, memory_paths[p].encode)
+        : *corpus;
+      cmdserv_connection *connection;
+      cmdserv_memory *memory;
+      uint64_t start;
+
+      config.framing      = memory_paths[p].framing;
+      config.readbuf_size = READBUF_SIZE;
+      config.argc_max     = ARGC_MAX - 1;
+      config.lineterm     = corpus->eol[0] == '\r'
+                            ? CMDSERV_LINETERM_CRLF
+                            : CMDSERV_LINETERM_LF;
+      config.cmd_handler  = &count_handler;
+      config.cmd_object   = &result;
+      config.log_handler  = NULL;
+
+      if ((memory = cmdserv_memory_create()) == NULL)
+        err(EXIT_FAILURE, "cmdserv_memory_create()");
+      if ((connection
+           = cmdserv_connection_create_transport(&cmdserv_memory_transport,
+                                                 memory, 0, &config,
+                                                 CMDSERV_NO_CLOSE))
+          == NULL)
+        err(EXIT_FAILURE, "cmdserv_connection_create_transport()");
+
+      result = (struct result){ 0, 0 };
+      start = cmdserv_monotonic_ns();
+      for (unsigned int r = 0; r < rounds; r++)
+        run_memory(&frames, memory, connection);
+      report(&first, &frames, memory_paths[p].path,
+             rounds, cmdserv_monotonic_ns() - start, &result);
+
+      cmdserv_connection_close(connection, CMDSERV_SERVER_SHUTDOWN);
+      cmdserv_memory_free(memory);
+      if (memory_paths[p].encode)
+        free(frames.buf);
+    }
+  }
+
+  printf("\n  ]\n}\n");
+
+  for (size_t c = 0; c < ncorpora; c++)
+    free(corpora[c].buf);
+
+  return EXIT_SUCCESS;
+}
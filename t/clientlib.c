@@ -2,8 +2,13 @@
 
 #include <errno.h>
 #include <netdb.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <time.h>
 
 #define HOSTBUFLEN  256
@@ -13,6 +18,37 @@
 
 int src_port = 0;
 
+/**
+ * Connect to a Unix domain socket at path, or in the Linux abstract
+ * namespace if path starts with "@".
+ */
+static int cmdserv_connect_unix(const char *path) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  size_t len = strlen(path);
+  int fd;
+
+  if (len >= sizeof(addr.sun_path))
+    errx(EXIT_FAILURE, "Unix socket path too long: %s", path);
+  memcpy(addr.sun_path, path, len);
+  if (path[0] == '@')
+    addr.sun_path[0] = '\0';
+  else
+    len++;
+
+  info("Trying Unix socket %s...", path);
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    err(EXIT_FAILURE, "socket()");
+
+  if (connect(fd, (struct sockaddr*)&addr,
+              offsetof(struct sockaddr_un, sun_path) + len) != 0)
+    err(EXIT_FAILURE, "connect(#%d, %s)", fd, path);
+
+  info("#%d connected", fd);
+
+  return fd;
+}
+
 int cmdserv_connect(int argc, char** argv) {
   struct addrinfo* ai;
   char *host = NULL;
@@ -37,6 +73,9 @@ int cmdserv_connect(int argc, char** argv) {
     port     = argv[1];
   }
 
+  if (strchr(port, '/') != NULL || port[0] == '@')
+    return cmdserv_connect_unix(port);
+
   if ((ai_res = getaddrinfo(host,
                             port,
                             &(struct addrinfo){
@@ -125,6 +164,164 @@ int cmdserv_connect(int argc, char** argv) {
   return fd;
 }
 
+cmdserv_shm *cmdserv_connect_shm(const char *path) {
+  cmdserv_shm *shm;
+
+  info("Trying shared memory on %s...", path);
+
+  if ((shm = cmdserv_shm_connect(path)) == NULL)
+    err(EXIT_FAILURE, "cmdserv_shm_connect(%s)", path);
+
+  info("%s connected", path);
+
+  return shm;
+}
+
+void cmdserv_close_shm(cmdserv_shm *shm) {
+  cmdserv_shm_close(shm);
+  info("shared memory closed");
+}
+
+cmdserv_connection *cmdserv_connect_memory(struct cmdserv_connection_config
+                                           *config,
+                                           cmdserv_memory **memory) {
+  return cmdserv_connect_transport(&cmdserv_memory_transport, config, memory);
+}
+
+cmdserv_connection *cmdserv_connect_transport(const struct cmdserv_transport
+                                              *transport,
+                                              struct cmdserv_connection_config
+                                              *config,
+                                              cmdserv_memory **memory) {
+  cmdserv_connection *connection;
+
+  if ((*memory = cmdserv_memory_create()) == NULL)
+    err(EXIT_FAILURE, "cmdserv_memory_create()");
+
+  if ((connection = cmdserv_connection_create_transport(transport,
+                                                        *memory, 1, config,
+                                                        CMDSERV_NO_CLOSE))
+      == NULL)
+    err(EXIT_FAILURE, "cmdserv_connection_create_transport()");
+
+  return connection;
+}
+
+void cmdserv_push_memory(cmdserv_connection *connection,
+                         cmdserv_memory *memory,
+                         const void *buf, size_t len, size_t piece) {
+  for (size_t pos = 0; pos < len && !cmdserv_memory_closed(memory); ) {
+    size_t n = len - pos < piece ? len - pos : piece;
+
+    if (cmdserv_memory_push(memory, (const char *)buf + pos, n) == -1)
+      err(EXIT_FAILURE, "cmdserv_memory_push()");
+    cmdserv_connection_read(connection);
+    pos += n;
+  }
+}
+
+void cmdserv_drain(cmdserv_connection *connection, const bool *closed) {
+  struct pollfd pfd;
+
+  while (!*closed) {
+    pfd = (struct pollfd){ .fd     = cmdserv_connection_fd(connection),
+                           .events = POLLIN };
+    if (poll(&pfd, 1, 100) != 1)
+      return;
+    cmdserv_connection_read(connection);
+  }
+}
+
+size_t cmdserv_pull_memory(cmdserv_memory *memory, void *buf, size_t size) {
+  size_t len = 0, got;
+
+  while (len < size
+         && (got = cmdserv_memory_pull(memory, (char *)buf + len,
+                                       size - len)) > 0)
+    len += got;
+
+  return len;
+}
+
+void cmdserv_print_memory(cmdserv_memory *memory) {
+  char buf[1024];
+  size_t len;
+
+  while ((len = cmdserv_memory_pull(memory, buf, sizeof(buf))) > 0)
+    fwrite(buf, 1, len, stdout);
+}
+
+void cmdserv_hangup_memory(cmdserv_connection *connection,
+                           cmdserv_memory *memory) {
+  if (!cmdserv_memory_closed(memory)) {
+    cmdserv_memory_hangup(memory);
+    cmdserv_connection_read(connection);
+  }
+  cmdserv_print_memory(memory);
+  cmdserv_memory_free(memory);
+}
+
+static void put_u32(unsigned char *p, size_t n) {
+  p[0] = n >> 24 & 0xff;
+  p[1] = n >> 16 & 0xff;
+  p[2] = n >>  8 & 0xff;
+  p[3] = n       & 0xff;
+}
+
+ssize_t cmdserv_frame(void *buf, size_t size,
+                      int argc, const char *const *argv, const size_t *argl) {
+  unsigned char *frame = buf;
+  size_t len = CMDSERV_FRAME_HEADER;
+
+  if (size < len)
+    return -1;
+
+  for (int i = 0; i < argc; i++) {
+    size_t arglen = argl ? argl[i] : strlen(argv[i]);
+
+    if (size - len < 4 + arglen + 1)
+      return -1;
+    put_u32(frame + len, arglen);
+    memcpy(frame + len + 4, argv[i], arglen);
+    frame[len + 4 + arglen] = '\0';
+    len += 4 + arglen + 1;
+  }
+
+  frame[0] = CMDSERV_FRAME_MAGIC;
+  frame[1] = CMDSERV_FRAME_VERSION;
+  frame[2] = argc >> 8 & 0xff;
+  frame[3] = argc      & 0xff;
+  put_u32(frame + 4, len - CMDSERV_FRAME_HEADER);
+
+  return len;
+}
+
+ssize_t cmdserv_resp(void *buf, size_t size,
+                     int argc, const char *const *argv, const size_t *argl) {
+  char *resp = buf;
+  size_t len;
+  int n;
+
+  if ((n = snprintf(resp, size, "*%d\r\n", argc)) < 0 || (size_t)n >= size)
+    return -1;
+  len = n;
+
+  for (int i = 0; i < argc; i++) {
+    size_t arglen = argl ? argl[i] : strlen(argv[i]);
+
+    if ((n = snprintf(resp + len, size - len, "$%zu\r\n", arglen)) < 0
+        || (size_t)n >= size - len
+        || size - len - n < arglen + 2)
+      return -1;
+    len += n;
+    memcpy(resp + len, argv[i], arglen);
+    memcpy(resp + len + arglen, "\r\n", 2);
+    len += arglen + 2;
+  }
+
+  return len;
+}
+
 void cmdserv_relay(int in_fd, int out_fd) {
   ssize_t buflen, crlflen, writelen;
   char buf[RELAYBUFLEN];
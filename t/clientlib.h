@@ -2,13 +2,76 @@
 #define CLIENTLIB_H
 
 #include <err.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "../cmdserv_connection.h"
+#include "../cmdserv_connection_config.h"
+#include "../cmdserv_shm.h"
+#include "../cmdserv_transport.h"
+
 #define info(...) warnx(__VA_ARGS__)
 
+/* PORT may also be a Unix socket path (or "@NAME" for an abstract one) */
 int cmdserv_connect(int argc, char** argv);
 
+/* PATH of a "shm:" endpoint, without the prefix */
+cmdserv_shm *cmdserv_connect_shm(const char *path);
+
+void cmdserv_close_shm(cmdserv_shm *shm);
+
+/* A connection over a fresh memory transport, returned in *memory */
+cmdserv_connection *cmdserv_connect_memory(struct cmdserv_connection_config
+                                           *config,
+                                           cmdserv_memory **memory);
+
+/* The same over transport, which has to wrap the memory transport */
+cmdserv_connection *cmdserv_connect_transport(const struct cmdserv_transport
+                                              *transport,
+                                              struct cmdserv_connection_config
+                                              *config,
+                                              cmdserv_memory **memory);
+
+/*
+ * Push len octets in pieces of at most piece octets, letting the
+ * connection read after each, until it closes.
+ */
+void cmdserv_push_memory(cmdserv_connection *connection,
+                         cmdserv_memory *memory,
+                         const void *buf, size_t len, size_t piece);
+
+/*
+ * Let the connection read whatever it has got waiting on its socket,
+ * until *closed is set or nothing more arrives within 100ms.
+ */
+void cmdserv_drain(cmdserv_connection *connection, const bool *closed);
+
+/* Pull what the connection has sent, up to size octets, return the length */
+size_t cmdserv_pull_memory(cmdserv_memory *memory, void *buf, size_t size);
+
+/* Copy everything the connection has sent so far to stdout */
+void cmdserv_print_memory(cmdserv_memory *memory);
+
+/*
+ * Hang up (unless the connection is closed already), print the rest
+ * of the output and free the memory transport.
+ */
+void cmdserv_hangup_memory(cmdserv_connection *connection,
+                           cmdserv_memory *memory);
+
+/*
+ * Encode argv as a binary frame (see CMDSERV_FRAMING_BINARY) into buf
+ * and return its length, or -1 if it doesn't fit into size octets.
+ * argl holds the argument lengths, if NULL they're taken as strings.
+ */
+ssize_t cmdserv_frame(void *buf, size_t size,
+                      int argc, const char *const *argv, const size_t *argl);
+
+/* The same as a RESP2 array of bulk strings (see CMDSERV_FRAMING_RESP) */
+ssize_t cmdserv_resp(void *buf, size_t size,
+                     int argc, const char *const *argv, const size_t *argl);
+
 void cmdserv_relay(int in_fd, int out_fd);
 
 void cmdserv_close(int fd);
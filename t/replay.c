@@ -0,0 +1,451 @@
+/**
+ * @file replay.c
+ *
+ * Replay a traffic capture against a cmdserv.
+ *
+ * Reads a capture written by a connection with
+ * cmdserv_connection_config::capture_fd set and plays it back against
+ * a (local) server, recreating every recorded connection with its
+ * recorded lines:
+ *
+ *     t/replay [-s SPEED] [-g] CAPTURE [[HOST] PORT]
+ *
+ * SPEED is the time scale: 1 (the default) replays in real time, N
+ * runs N times faster, 0 as fast as possible.  Connections are opened
+ * and closed, and lines are sent at their (scaled) recorded times, so
+ * the concurrency of the recording is preserved.  Within a connection
+ * the order is kept strictly: The next line is only sent after the
+ * status line for the previous one has been received, so a slow
+ * server delays the session instead of getting flooded.  Use -g if
+ * the server sends a greeting status line on connect.
+ *
+ * Reports JSON on stdout, comparing the recording (server side
+ * handler times, throughput) with the replay (client side round-trip
+ * times, throughput).
+ */
+
+#include "clientlib.h"
+#include "../cmdserv_helpers.h"
+#include "../cmdserv_latency.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define INBUF_LEN 65536
+
+struct line {
+  uint64_t time;                  /**< recorded completion time       */
+  uint64_t handler_ns;            /**< recorded handler time          */
+  char *data;                     /**< unescaped, with CRLF appended  */
+  size_t len;
+};
+
+struct session {
+  unsigned long long int id;
+  uint64_t time_connect;
+  uint64_t time_close;            /**< 0 if never closed in capture   */
+  struct line *lines;
+  size_t nlines, lines_size;
+
+  int fd;                         /**< -1 if not (or no longer) open  */
+  bool done;
+  bool greeted;
+  size_t next;                    /**< next line to send              */
+  bool outstanding;               /**< waiting for a status line      */
+  uint64_t time_sent;
+  size_t inlen;
+  char in[INBUF_LEN];
+};
+
+static struct session **sessions = NULL;
+static size_t nsessions = 0, sessions_size = 0;
+static uint64_t time_first = 0, time_last = 0;
+
+static unsigned long long int errors = 0;
+
+
+static struct session *session_find(unsigned long long int id) {
+  for (size_t s = nsessions; s > 0; s--) /* recent ones are likelier */
+    if (sessions[s - 1]->id == id)
+      return sessions[s - 1];
+  return NULL;
+}
+
+static struct session *session_add(unsigned long long int id,
+                                   uint64_t time) {
+  struct session *session;
+
+  if (nsessions == sessions_size) {
+    sessions_size = sessions_size ? 2 * sessions_size : 64;
+    if ((sessions = realloc(sessions, sessions_size * sizeof(*sessions)))
+        == NULL)
+      err(EXIT_FAILURE, "realloc()");
+  }
+
+  if ((session = calloc(1, sizeof(struct session))) == NULL)
+    err(EXIT_FAILURE, "calloc()");
+
+  session->id           = id;
+  session->time_connect = time;
+  session->fd           = -1;
+
+  return sessions[nsessions++] = session;
+}
+
+/**
+ * Undo the escaping of the capture file in place and append CRLF.
+ * The buffer has to provide room for one more byte than the escaped
+ * string (plus terminator): "\\" and "\xHH" shrink, CRLF is two bytes
+ * though.
+ */
+static size_t unescape(char *str) {
+  size_t d = 0;
+
+  for (size_t i = 0; str[i] != '\0'; i++) {
+    if (str[i] == '\\' && str[i + 1] == '\\') {
+      str[d++] = '\\';
+      i++;
+    } else if (str[i] == '\\' && str[i + 1] == 'x'
+               && isxdigit((unsigned char)str[i + 2])
+               && isxdigit((unsigned char)str[i + 3])) {
+      char hex[3] = { str[i + 2], str[i + 3], '\0' };
+      str[d++] = (char)strtoul(hex, NULL, 16);
+      i += 3;
+    } else {
+      str[d++] = str[i];
+    }
+  }
+
+  str[d++] = '\r';
+  str[d++] = '\n';
+
+  return d;
+}
+
+static void load(const char *filename) {
+  FILE *in;
+  char *record = NULL;
+  size_t record_size = 0;
+  ssize_t len;
+  unsigned long long int lineno = 0;
+
+  if ((in = fopen(filename, "r")) == NULL)
+    err(EXIT_FAILURE, "fopen(%s)", filename);
+
+  while ((len = getline(&record, &record_size, in)) != -1) {
+    unsigned long long int time, id, handler_ns;
+    struct session *session;
+    struct line *line;
+    int offset = 0;
+
+    lineno++;
+    if (len > 0 && record[len - 1] == '\n')
+      record[--len] = '\0';
+    if (len == 0 || record[0] == '#')
+      continue;
+
+    switch (record[0]) {
+    case 'C':
+      if (sscanf(record, "C %llu %llu", &time, &id) != 2)
+        errx(EXIT_FAILURE, "%s:%llu: malformed record", filename, lineno);
+      session_add(id, time);
+      break;
+
+    case 'L':
+      /* Exactly one space separates the (unescaped) line */
+      if (sscanf(record, "L %llu %llu %llu%n",
+                 &time, &id, &handler_ns, &offset) != 3
+          || record[offset] != ' ')
+        errx(EXIT_FAILURE, "%s:%llu: malformed record", filename, lineno);
+
+      if ((session = session_find(id)) == NULL)
+        session = session_add(id, time); /* capture started late */
+
+      if (session->nlines == session->lines_size) {
+        session->lines_size = session->lines_size
+          ? 2 * session->lines_size : 16;
+        if ((session->lines = realloc(session->lines,
+                                      session->lines_size
+                                      * sizeof(struct line)))
+            == NULL)
+          err(EXIT_FAILURE, "realloc()");
+      }
+
+      line = &session->lines[session->nlines++];
+      if ((line->data = malloc(strlen(record + offset + 1) + 3)) == NULL)
+        err(EXIT_FAILURE, "malloc()");
+      strcpy(line->data, record + offset + 1);
+      line->len        = unescape(line->data);
+      line->time       = time;
+      line->handler_ns = handler_ns;
+      break;
+
+    case 'X':
+      if (sscanf(record, "X %llu %llu", &time, &id) != 2)
+        errx(EXIT_FAILURE, "%s:%llu: malformed record", filename, lineno);
+      if ((session = session_find(id)) != NULL)
+        session->time_close = time;
+      break;
+
+    default:
+      errx(EXIT_FAILURE, "%s:%llu: unknown record type '%c'",
+           filename, lineno, record[0]);
+    }
+
+    if (time_first == 0)
+      time_first = time;
+    time_last = time;
+  }
+
+  if (ferror(in))
+    err(EXIT_FAILURE, "getline(%s)", filename);
+
+  free(record);
+  fclose(in);
+}
+
+/**
+ * The replay time for a recorded time at the given speed.
+ */
+static uint64_t scheduled(uint64_t start, uint64_t time, double speed) {
+  if (speed <= 0.0)
+    return start;
+  return start + (uint64_t)((double)(time - time_first) / speed);
+}
+
+static bool is_status_line(const char *line, size_t len) {
+  return len >= 4
+    && isdigit((unsigned char)line[0])
+    && isdigit((unsigned char)line[1])
+    && isdigit((unsigned char)line[2])
+    && line[3] == ' ';
+}
+
+static void session_close(struct session *session) {
+  cmdserv_close(session->fd);
+  session->fd   = -1;
+  session->done = true;
+}
+
+static void session_receive(struct session *session,
+                            cmdserv_latency *replayed) {
+  ssize_t received;
+  size_t start = 0;
+
+  received = recv(session->fd, session->in + session->inlen,
+                  INBUF_LEN - session->inlen, 0);
+  if (received == -1)
+    err(EXIT_FAILURE, "recv(#%d)", session->fd);
+
+  if (received == 0) { /* e.g. after a recorded "quit" */
+    if (session->outstanding || session->next < session->nlines)
+      warnx("#%d: server closed session %llu early",
+            session->fd, session->id);
+    session_close(session);
+    return;
+  }
+
+  session->inlen += received;
+
+  for (size_t i = 0; i < session->inlen; i++) {
+    if (session->in[i] != '\n')
+      continue;
+
+    if (is_status_line(session->in + start, i - start)) {
+      if (!session->greeted) {
+        session->greeted = true;
+      } else if (session->outstanding) {
+        cmdserv_latency_record(replayed, CMDSERV_LATENCY_OTHER,
+                               cmdserv_monotonic_ns() - session->time_sent);
+        if (session->in[start] != '1' && session->in[start] != '2')
+          errors++;
+        session->outstanding = false;
+      }
+    }
+
+    start = i + 1;
+  }
+
+  if (start == 0 && session->inlen == INBUF_LEN) /* overlong body line */
+    start = session->inlen;
+
+  session->inlen -= start;
+  memmove(session->in, session->in + start, session->inlen);
+}
+
+static void print_stats(FILE *out, cmdserv_latency *latency) {
+  struct cmdserv_latency_stats s = { .count = 0 };
+
+  cmdserv_latency_stats(latency, &s, 1);
+  fprintf(out,
+          "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, "
+          "\"max_ns\": %llu, \"mean_ns\": %llu",
+          (unsigned long long int)s.p50,
+          (unsigned long long int)s.p99,
+          (unsigned long long int)s.p999,
+          (unsigned long long int)s.max,
+          (unsigned long long int)(s.count ? s.sum / s.count : 0));
+}
+
+int main(int argc, char **argv) {
+  double speed = 1.0;
+  bool greeting = false;
+  cmdserv_latency *recorded, *replayed;
+  struct pollfd *pfd;
+  struct session **polled;
+  unsigned long long int lines = 0;
+  uint64_t start, end;
+  size_t done = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:g")) != -1) {
+    switch (opt) {
+    case 's': speed    = strtod(optarg, NULL); break;
+    case 'g': greeting = true;                 break;
+    default:
+      errx(EXIT_FAILURE,
+           "Usage: %s [-s SPEED] [-g] CAPTURE [[HOST] PORT]", argv[0]);
+    }
+  }
+
+  if (optind >= argc)
+    errx(EXIT_FAILURE,
+         "Usage: %s [-s SPEED] [-g] CAPTURE [[HOST] PORT]", argv[0]);
+
+  load(argv[optind]);
+
+  /* cmdserv_connect() expects its arguments in argv[1] and up */
+  argv[optind] = argv[0];
+  argc -= optind;
+  argv += optind;
+
+  if ((recorded = cmdserv_latency_create(0)) == NULL
+      || (replayed = cmdserv_latency_create(0)) == NULL)
+    err(EXIT_FAILURE, "cmdserv_latency_create()");
+
+  for (size_t s = 0; s < nsessions; s++) {
+    for (size_t l = 0; l < sessions[s]->nlines; l++)
+      cmdserv_latency_record(recorded, CMDSERV_LATENCY_OTHER,
+                             sessions[s]->lines[l].handler_ns);
+    lines += sessions[s]->nlines;
+    sessions[s]->greeted = !greeting;
+  }
+
+  if ((pfd = calloc(nsessions, sizeof(struct pollfd))) == NULL
+      || (polled = calloc(nsessions, sizeof(struct session*))) == NULL)
+    err(EXIT_FAILURE, "calloc()");
+
+  start = cmdserv_monotonic_ns();
+
+  while (done < nsessions) {
+    uint64_t now = cmdserv_monotonic_ns();
+    uint64_t wake = UINT64_MAX;
+    nfds_t npfd = 0;
+
+    for (size_t s = 0; s < nsessions; s++) {
+      struct session *session = sessions[s];
+      uint64_t at;
+
+      if (session->done)
+        continue;
+
+      if (session->fd == -1) {
+        if ((at = scheduled(start, session->time_connect, speed)) > now) {
+          wake = at < wake ? at : wake;
+          continue;
+        }
+        session->fd = cmdserv_connect(argc, argv);
+        if (setsockopt(session->fd, IPPROTO_TCP, TCP_NODELAY, &(int){1},
+                       sizeof(int)) == -1 && errno != EOPNOTSUPP)
+          err(EXIT_FAILURE, "setsockopt(#%d, ..., TCP_NODELAY, ...)",
+              session->fd);
+      }
+
+      if (session->greeted && !session->outstanding) {
+        if (session->next < session->nlines) {
+          struct line *line = &session->lines[session->next];
+
+          if ((at = scheduled(start, line->time, speed)) > now) {
+            wake = at < wake ? at : wake;
+          } else {
+            if (send(session->fd, line->data, line->len, MSG_NOSIGNAL)
+                != (ssize_t)line->len)
+              err(EXIT_FAILURE, "send(#%d)", session->fd);
+            session->time_sent   = cmdserv_monotonic_ns();
+            session->outstanding = true;
+            session->next++;
+          }
+        } else if (session->time_close == 0
+                   || (at = scheduled(start, session->time_close, speed))
+                   <= now) {
+          session_close(session);
+          done++;
+          continue;
+        } else {
+          wake = at < wake ? at : wake;
+        }
+      }
+
+      pfd[npfd]      = (struct pollfd){ .fd = session->fd, .events = POLLIN };
+      polled[npfd++] = session;
+    }
+
+    if (npfd == 0 && wake == UINT64_MAX)
+      continue;
+
+    now = cmdserv_monotonic_ns();
+    if (poll(pfd, npfd,
+             wake == UINT64_MAX ? -1
+             : wake <= now ? 0
+             : (int)((wake - now + 999999) / 1000000)) == -1)
+      err(EXIT_FAILURE, "poll()");
+
+    for (nfds_t p = 0; p < npfd; p++) {
+      if (pfd[p].revents == 0)
+        continue;
+      session_receive(polled[p], replayed);
+      if (polled[p]->done)
+        done++;
+    }
+  }
+
+  end = cmdserv_monotonic_ns();
+
+  printf("{\n");
+  printf("  \"speed\": %g,\n", speed);
+  printf("  \"connections\": %zu,\n", nsessions);
+  printf("  \"lines\": %llu,\n", lines);
+  printf("  \"errors\": %llu,\n", errors);
+  printf("  \"recorded\": { \"elapsed_s\": %.6f, \"lines_per_sec\": %.1f, ",
+         (double)(time_last - time_first) / 1e9,
+         time_last > time_first
+         ? (double)lines * 1e9 / (double)(time_last - time_first) : 0.0);
+  print_stats(stdout, recorded);
+  printf(" },\n");
+  printf("  \"replayed\": { \"elapsed_s\": %.6f, \"lines_per_sec\": %.1f, ",
+         (double)(end - start) / 1e9,
+         end > start ? (double)lines * 1e9 / (double)(end - start) : 0.0);
+  print_stats(stdout, replayed);
+  printf(" }\n}\n");
+
+  for (size_t s = 0; s < nsessions; s++) {
+    for (size_t l = 0; l < sessions[s]->nlines; l++)
+      free(sessions[s]->lines[l].data);
+    free(sessions[s]->lines);
+    free(sessions[s]);
+  }
+  free(sessions);
+  free(pfd);
+  free(polled);
+  cmdserv_latency_free(recorded);
+  cmdserv_latency_free(replayed);
+
+  return errors > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,440 @@
+/**
+ * @file soak.c
+ *
+ * Long-running soak test tracking memory and descriptor growth.
+ *
+ * Forks a cmdserv server and churns connect/command/disconnect cycles
+ * against it: Most cycles send a few pipelined commands and let the
+ * server close the connection, every LARGE_EVERY-th cycle asks for a
+ * large reply (growing the connection's write buffer), and every
+ * TIMEOUT_EVERY-th cycle sets a short client timeout and leaves the
+ * connection idle until the server times it out.
+ *
+ * In regular intervals the server's RSS, heap usage and fragmentation
+ * (mallinfo2(), where available), its number of open file descriptors
+ * and the throughput are sampled and written as JSON to stdout:
+ *
+ *     t/soak [-n CYCLES] [-d SECONDS] [-i INTERVAL] [-t PERCENT] [-P PORT]
+ *
+ * At the end, the median of each metric over the first third of the
+ * samples (after a warm-up sample) is compared with the median over
+ * the last third.  If any of them grew by more than PERCENT (plus a
+ * small absolute slack against noise), the test fails.
+ */
+
+#include "clientlib.h"
+#include "../cmdserv.h"
+#include "../cmdserv_helpers.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#include <malloc.h>
+#define HAVE_MALLINFO2 1
+#else
+#define HAVE_MALLINFO2 0
+#endif
+
+#define DEFAULT_PORT    12349
+#define LARGE_EVERY     97
+#define LARGE_BYTES     65536
+#define TIMEOUT_EVERY   1009
+#define IDLE_MAX        16
+#define SAMPLES_MAX     4096
+#define LINE_LEN        256
+
+/* Absolute slack per metric, so that noise on small values won't fail */
+#define SLACK_RSS_KB    1024
+#define SLACK_HEAP_KB   256
+#define SLACK_FRAG      0.05
+#define SLACK_FDS       2
+
+
+/*
+ * Server side
+ */
+
+static void server_cmd_handler(void *cmd_object,
+                               cmdserv_connection *connection,
+                               int argc, char **argv) {
+  (void)cmd_object;
+
+  if (argc == 0) {
+    cmdserv_connection_send_status(connection, 400, "Empty line");
+
+  } else if (strcmp(argv[0], "exit") == 0) {
+    cmdserv_connection_close(connection, CMDSERV_APPLICATION_CLOSE);
+
+  } else if (strcmp(argv[0], "big") == 0 && argc == 2) {
+    size_t len = strtoul(argv[1], NULL, 10);
+    cmdserv_connection_printf(connection, "%0*d\r\n", (int)len, 0);
+    cmdserv_connection_send_status(connection, 200, "OK");
+
+  } else if (strcmp(argv[0], "timeout") == 0 && argc == 2) {
+    cmdserv_connection_set_client_timeout(connection, atoi(argv[1]));
+    cmdserv_connection_send_status(connection, 200, "OK");
+
+  } else if (strcmp(argv[0], "stats") == 0) {
+    unsigned long long int heap_used = 0, heap_free = 0;
+    long int rss_pages = 0;
+    unsigned int fds = 0;
+    FILE *statm;
+    DIR *dir;
+
+#if HAVE_MALLINFO2
+    struct mallinfo2 mi = mallinfo2();
+    heap_used = mi.uordblks + mi.hblkhd;
+    heap_free = mi.fordblks;
+#endif
+
+    if ((statm = fopen("/proc/self/statm", "r")) != NULL) {
+      if (fscanf(statm, "%*d %ld", &rss_pages) != 1)
+        rss_pages = 0;
+      fclose(statm);
+    }
+
+    if ((dir = opendir("/proc/self/fd")) != NULL) {
+      while (readdir(dir) != NULL)
+        fds++;
+      closedir(dir);
+      fds -= 3; /* ".", "..", and the one of opendir() itself */
+    }
+
+    cmdserv_connection_send_status(connection, 200, "%ld %llu %llu %u",
+                                   rss_pages * (sysconf(_SC_PAGESIZE) / 1024),
+                                   heap_used / 1024, heap_free / 1024, fds);
+
+  } else {
+    cmdserv_connection_send_status(connection, 200, "OK");
+  }
+}
+
+static void server_run(unsigned int port) {
+  struct cmdserv_config config = cmdserv_config_get_defaults();
+  struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+  cmdserv *server;
+
+  config.port                          = port;
+  config.connections_max               = IDLE_MAX + 16;
+  config.connections_backlog           = 64;
+  config.log_handler                   = NULL;
+  config.connection_config.log_handler = NULL;
+  config.connection_config.cmd_handler = &server_cmd_handler;
+
+  if ((server = cmdserv_start(config)) == NULL)
+    err(EXIT_FAILURE, "cmdserv_start()");
+
+  for (;;)
+    cmdserv_sleep(server, &timeout);
+}
+
+
+/*
+ * Client side
+ */
+
+struct sample {
+  double time;                     /**< seconds since start          */
+  unsigned long long int cycles;
+  double cycles_per_sec;
+  unsigned long long int rss_kb;
+  unsigned long long int heap_used_kb;
+  unsigned long long int heap_free_kb;
+  double frag;                     /**< free / (used + free) of heap */
+  unsigned long long int fds;
+};
+
+static int connect_to(unsigned int port, unsigned long long int n) {
+  int fd;
+
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    err(EXIT_FAILURE, "socket()");
+
+  /* Spread over 127.0.0.0/24, to not run out of ephemeral ports */
+  if (connect(fd,
+              (struct sockaddr*)&(struct sockaddr_in){
+                .sin_family      = AF_INET,
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK + n % 255),
+                .sin_port        = htons(port)
+              },
+              sizeof(struct sockaddr_in)) == -1)
+    err(EXIT_FAILURE, "connect()");
+
+  if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int)) == -1)
+    err(EXIT_FAILURE, "setsockopt(#%d, ..., TCP_NODELAY, ...)", fd);
+
+  return fd;
+}
+
+static void send_all(int fd, const char *str) {
+  if (send(fd, str, strlen(str), MSG_NOSIGNAL) != (ssize_t)strlen(str))
+    err(EXIT_FAILURE, "send(#%d)", fd);
+}
+
+/**
+ * Read until the server closes the connection.
+ *
+ * @return The number of octets received.
+ */
+static size_t drain(int fd) {
+  char buf[16384];
+  size_t total = 0;
+  ssize_t received;
+
+  while ((received = recv(fd, buf, sizeof(buf), 0)) > 0)
+    total += received;
+
+  if (received == -1 && errno != ECONNRESET)
+    err(EXIT_FAILURE, "recv(#%d)", fd);
+
+  return total;
+}
+
+static struct sample sample(int control, uint64_t start,
+                            unsigned long long int cycles,
+                            struct sample *previous) {
+  struct sample s = { .cycles = cycles };
+  char line[LINE_LEN];
+  size_t len = 0;
+  ssize_t received;
+
+  send_all(control, "stats\r\n");
+  do {
+    if ((received = recv(control, line + len, LINE_LEN - 1 - len, 0)) <= 0)
+      errx(EXIT_FAILURE, "recv(): server gone");
+    len += received;
+  } while (len < LINE_LEN - 1 && line[len - 1] != '\n');
+  line[len] = '\0';
+
+  if (sscanf(line, "200 %llu %llu %llu %llu",
+             &s.rss_kb, &s.heap_used_kb, &s.heap_free_kb, &s.fds) != 4)
+    errx(EXIT_FAILURE, "unexpected stats reply: %s", line);
+
+  s.time = (double)(cmdserv_monotonic_ns() - start) / 1e9;
+  s.frag = s.heap_used_kb + s.heap_free_kb > 0
+    ? (double)s.heap_free_kb / (double)(s.heap_used_kb + s.heap_free_kb)
+    : 0.0;
+
+  if (previous != NULL && s.time > previous->time)
+    s.cycles_per_sec = (double)(s.cycles - previous->cycles)
+      / (s.time - previous->time);
+
+  return s;
+}
+
+static void print_sample(struct sample *s, bool first) {
+  printf("%s\n    { \"time_s\": %.1f, \"cycles\": %llu, "
+         "\"cycles_per_sec\": %.0f, \"rss_kb\": %llu, "
+         "\"heap_used_kb\": %llu, \"heap_free_kb\": %llu, "
+         "\"fragmentation\": %.3f, \"fds\": %llu }",
+         first ? "" : ",",
+         s->time, s->cycles, s->cycles_per_sec, s->rss_kb,
+         s->heap_used_kb, s->heap_free_kb, s->frag, s->fds);
+  fflush(stdout);
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Median of one metric over samples[from] up to samples[to - 1].
+ */
+static double median(struct sample *samples, size_t from, size_t to,
+                     double (*metric)(struct sample*)) {
+  double values[SAMPLES_MAX];
+  size_t n = 0;
+
+  for (size_t i = from; i < to; i++)
+    values[n++] = metric(&samples[i]);
+
+  qsort(values, n, sizeof(double), &compare_double);
+
+  return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+static double metric_rss(struct sample *s)  { return (double)s->rss_kb;       }
+static double metric_heap(struct sample *s) { return (double)s->heap_used_kb; }
+static double metric_frag(struct sample *s) { return s->frag;                 }
+static double metric_fds(struct sample *s)  { return (double)s->fds;          }
+
+static void usage(const char *prog) {
+  errx(EXIT_FAILURE,
+       "Usage: %s [-n CYCLES] [-d SECONDS] [-i INTERVAL] [-t PERCENT] "
+       "[-P PORT]", prog);
+}
+
+int main(int argc, char **argv) {
+  unsigned long long int cycles_max = 1000000, cycles = 0;
+  unsigned long int duration = 0, interval = 5, port = DEFAULT_PORT;
+  double threshold = 10.0;
+  static struct sample samples[SAMPLES_MAX];
+  size_t nsamples = 0;
+  int idle[IDLE_MAX], nidle = 0;
+  int control, opt;
+  uint64_t start, next_sample;
+  pid_t server;
+  bool ok = true;
+
+  while ((opt = getopt(argc, argv, "n:d:i:t:P:")) != -1) {
+    switch (opt) {
+    case 'n': cycles_max = strtoull(optarg, NULL, 10); break;
+    case 'd': duration   = strtoul(optarg, NULL, 10);  break;
+    case 'i': interval   = strtoul(optarg, NULL, 10);  break;
+    case 't': threshold  = strtod(optarg, NULL);       break;
+    case 'P': port       = strtoul(optarg, NULL, 10);  break;
+    default:  usage(argv[0]);
+    }
+  }
+  if (cycles_max == 0 || interval == 0)
+    usage(argv[0]);
+
+  if ((server = fork()) == -1)
+    err(EXIT_FAILURE, "fork()");
+  if (server == 0)
+    server_run(port);
+
+  for (int tries = 0; ; tries++) {
+    if ((control = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+      err(EXIT_FAILURE, "socket()");
+    if (connect(control,
+                (struct sockaddr*)&(struct sockaddr_in){
+                  .sin_family      = AF_INET,
+                  .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+                  .sin_port        = htons(port)
+                },
+                sizeof(struct sockaddr_in)) == 0)
+      break;
+    close(control);
+    if (tries == 50)
+      errx(EXIT_FAILURE, "could not connect to server");
+    millisleep(100);
+  }
+
+  start       = cmdserv_monotonic_ns();
+  next_sample = start;
+
+  printf("{\n  \"samples\": [");
+
+  while (cycles < cycles_max) {
+    uint64_t now = cmdserv_monotonic_ns();
+    int fd;
+
+    if (now >= next_sample) {
+      if (nsamples == SAMPLES_MAX)
+        break;
+      samples[nsamples] = sample(control, start, cycles,
+                                 nsamples ? &samples[nsamples - 1] : NULL);
+      print_sample(&samples[nsamples], nsamples == 0);
+      nsamples++;
+      next_sample += interval * UINT64_C(1000000000);
+
+      if (duration > 0 && now - start >= duration * UINT64_C(1000000000))
+        break;
+    }
+
+    /* Reap idle connections the server has timed out meanwhile */
+    for (int i = 0; i < nidle; i++) {
+      struct pollfd pfd = { .fd = idle[i], .events = POLLIN };
+      if (poll(&pfd, 1, 0) == 1) {
+        drain(idle[i]);
+        close(idle[i]);
+        idle[i--] = idle[--nidle];
+      }
+    }
+
+    fd = connect_to(port, cycles);
+
+    if (cycles % TIMEOUT_EVERY == 0 && nidle < IDLE_MAX) {
+      char reply[LINE_LEN];
+      send_all(fd, "timeout 1\r\n");
+      /* Consume the status line, so the fd polls readable on close only */
+      if (recv(fd, reply, sizeof(reply), 0) <= 0)
+        errx(EXIT_FAILURE, "no reply to timeout");
+      idle[nidle++] = fd;
+    } else {
+      if (cycles % LARGE_EVERY == 0) {
+        char cmd[64];
+        snprintf(cmd, sizeof(cmd), "big %d\r\nexit\r\n", LARGE_BYTES);
+        send_all(fd, cmd);
+        if (drain(fd) < LARGE_BYTES)
+          errx(EXIT_FAILURE, "short large reply");
+      } else {
+        send_all(fd, "ping\r\nping a b c\r\nping\r\nexit\r\n");
+        drain(fd);
+      }
+      close(fd);
+    }
+
+    cycles++;
+  }
+
+  /* One last sample with all idle connections gone */
+  while (nidle > 0) {
+    drain(idle[--nidle]);
+    close(idle[nidle]);
+  }
+  if (nsamples < SAMPLES_MAX) {
+    millisleep(100);
+    samples[nsamples] = sample(control, start, cycles,
+                               nsamples ? &samples[nsamples - 1] : NULL);
+    print_sample(&samples[nsamples], nsamples == 0);
+    nsamples++;
+  }
+
+  printf("\n  ],\n  \"cycles\": %llu,\n  \"threshold_percent\": %.1f,\n",
+         cycles, threshold);
+
+  if (nsamples < 7) {
+    printf("  \"trends\": null,\n  \"ok\": true\n}\n");
+    warnx("too few samples (%zu) for a trend, run longer", nsamples);
+  } else {
+    /* Skip the first sample (warm-up), compare first and last third */
+    size_t third = (nsamples - 1) / 3;
+    struct {
+      const char *name;
+      double (*metric)(struct sample*);
+      double slack;
+    } checks[] = {
+      { "rss_kb",        &metric_rss,  SLACK_RSS_KB  },
+      { "heap_used_kb",  &metric_heap, SLACK_HEAP_KB },
+      { "fragmentation", &metric_frag, SLACK_FRAG    },
+      { "fds",           &metric_fds,  SLACK_FDS     },
+    };
+
+    printf("  \"trends\": {");
+    for (size_t c = 0; c < sizeof(checks) / sizeof(checks[0]); c++) {
+      double first = median(samples, 1, 1 + third, checks[c].metric);
+      double last  = median(samples, nsamples - third, nsamples,
+                            checks[c].metric);
+      bool grew = last > first * (1.0 + threshold / 100.0) + checks[c].slack;
+
+      printf("%s\n    \"%s\": { \"first\": %g, \"last\": %g, "
+             "\"ok\": %s }",
+             c ? "," : "", checks[c].name, first, last,
+             grew ? "false" : "true");
+      if (grew) {
+        warnx("%s grew from %g to %g", checks[c].name, first, last);
+        ok = false;
+      }
+    }
+    printf("\n  },\n  \"ok\": %s\n}\n", ok ? "true" : "false");
+  }
+
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+  close(control);
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
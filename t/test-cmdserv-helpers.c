@@ -30,7 +30,7 @@
 int main(void) {
   char *data = NULL;
   char *func;
-  size_t len;
+  size_t len, size;
   long int begin, end;
   char *token;
 
@@ -52,6 +52,43 @@ int main(void) {
              func, begin, end,
              cmdserv_duration_str((time_t)begin, (time_t)end));
 
+    } else if (strcmp(func, "cmdserv_duration_str_r") == 0) {
+      char buf[CMDSERV_DURATION_STR_MAX];
+
+      if ((token = strtok(NULL, " ")) == NULL)
+        errx(EXIT_FAILURE, "Missing buffer size on line %d", line);
+      size = atol(token);
+      if (size > sizeof(buf))
+        errx(EXIT_FAILURE, "Buffer size too large on line %d", line);
+
+      if ((token = strtok(NULL, " ")) == NULL)
+        errx(EXIT_FAILURE, "Missing begin duration on line %d", line);
+      begin = atol(token);
+
+      if ((token = strtok(NULL, "|")) == NULL)
+        errx(EXIT_FAILURE, "Missing end duration on line %d", line);
+      end = atol(token);
+
+      printf("%s %zu %ld %ld|%s\n",
+             func, size, begin, end,
+             cmdserv_duration_str_r((time_t)begin, (time_t)end, buf, size));
+
+    } else if (strcmp(func, "cmdserv_logsafe_str_r") == 0) {
+      char buf[CMDSERV_LOGSAFE_STR_MAX];
+
+      if ((token = strtok(NULL, " ")) == NULL)
+        errx(EXIT_FAILURE, "Missing buffer size on line %d", line);
+      size = atol(token);
+      if (size > sizeof(buf))
+        errx(EXIT_FAILURE, "Buffer size too large on line %d", line);
+
+      if ((token = strtok(NULL, "|")) == NULL)
+        errx(EXIT_FAILURE, "Missing input string on line %d", line);
+
+      printf("%s %zu %s|%s\n",
+             func, size, token,
+             cmdserv_logsafe_str_r(token, buf, size));
+
     } else if (strcmp(func, "cmdserv_logsafe_str") == 0) {
       if ((token = strtok(NULL, "|")) == NULL)
         errx(EXIT_FAILURE, "Missing input string on line %d", line);
@@ -96,6 +96,8 @@ void handler(void *cmd_object, cmdserv_connection* connection, int argc, char **
     cmdserv_connection_println(connection, "      Check or change timeout setting.");
     cmdserv_connection_println(connection, "  server status");
     cmdserv_connection_println(connection, "      Display server status.");
+    cmdserv_connection_println(connection, "  server latency [reset]");
+    cmdserv_connection_println(connection, "      Display (or reset) command latencies.");
     cmdserv_connection_println(connection, "  parse [ARGS...]");
     cmdserv_connection_println(connection, "      Echo back the parsed command string.");
     cmdserv_connection_println(connection, "  server shutdown");
@@ -146,12 +148,23 @@ void handler(void *cmd_object, cmdserv_connection* connection, int argc, char **
     cmdserv_connection_send_status(connection, 200, "OK");
 
   } else if (strcmp("parse", argv[0]) == 0) { /* parse */
+    char command[512];
+
     cmdserv_connection_send_status(connection, 200,
                                    "%s",
-                                   cmdserv_connection_command_string(connection,
-                                                                     CMDSERV_LOG_SAFE));
+                                   cmdserv_connection_command_string_r(connection,
+                                                                       CMDSERV_LOG_SAFE,
+                                                                       command,
+                                                                       sizeof(command)));
 
   } else if (strcmp("server", argv[0]) == 0) { /* server control commands */
+    if (argc == 3 && strcmp("latency", argv[1]) == 0
+        && strcmp("reset", argv[2]) == 0) {
+      cmdserv_latency_reset(cmdserv_server_latency(server));
+      cmdserv_connection_send_status(connection, 200, "OK");
+      return;
+    }
+
     if (argc != 2)
       goto WRONG_ARGUMENTS;
 
@@ -167,6 +180,25 @@ void handler(void *cmd_object, cmdserv_connection* connection, int argc, char **
         cmdserv_connection_send_status(connection, 200, "OK");
       }
 
+    } else if (strcmp("latency", argv[1]) == 0) {
+      struct cmdserv_latency_stats stats[16];
+      unsigned int n = cmdserv_latency_stats(cmdserv_server_latency(server),
+                                             stats, 16);
+
+      cmdserv_connection_printf(connection,
+                                "%-16s %10s %10s %10s %10s %10s\r\n",
+                                "command", "count",
+                                "p50 us", "p99 us", "p99.9 us", "max us");
+      for (unsigned int i = 0; i < n; i++)
+        cmdserv_connection_printf(connection,
+                                  "%-16s %10llu %10.1f %10.1f %10.1f %10.1f\r\n",
+                                  stats[i].command, stats[i].count,
+                                  stats[i].p50  / 1000.0,
+                                  stats[i].p99  / 1000.0,
+                                  stats[i].p999 / 1000.0,
+                                  stats[i].max  / 1000.0);
+      cmdserv_connection_send_status(connection, 200, "OK");
+
     } else if (strcmp("shutdown", argv[1]) == 0) {
       shutdownreq = true;
       cmdserv_connection_send_status(connection, 200, "OK");
@@ -194,6 +226,8 @@ int main(void) {
 
   config.port                            = 12346;
   config.connections_max                 = 4;
+  config.latency_commands_max            = 15;
+  config.metrics_port                    = 12347;
   config.connection_config.cmd_handler   = &handler;
   config.connection_config.open_handler  = &banner;
   config.connection_config.close_handler = &banner;
@@ -1,6 +1,7 @@
 #!/bin/sh
 
 CMDSERV_PORT=12346
+CMDSERV_METRICS_PORT=12347
 CMDSERV_HOST=::1
 
 TEST_OUT_CLIENT=t/test_cmdserv.conn
@@ -123,6 +124,16 @@ printf "value get\r\server status\r\nvalue get\r\n" \
 
 __TESTCASE__ 6
 
+# Only the counters that do not depend on timing
+printf "GET /metrics HTTP/1.0\r\n\r\n" \
+    | $NETCAT -q5 $CMDSERV_HOST $CMDSERV_METRICS_PORT \
+    | grep -E '^(HTTP/|cmdserv_connections_(total|active|max) |cmdserv_commands_total |cmdserv_connections_closed_total\{reason="(application_close|client_timeout|server_too_many_connections)"\})' \
+    >> t/test_cmdserv.conn
+
+printf "GET /status HTTP/1.0\r\n\r\n" \
+    | $NETCAT -q5 $CMDSERV_HOST $CMDSERV_METRICS_PORT \
+    >> t/test_cmdserv.conn
+
 printf "value get\r\nparse This is a \"nice command!\"\r\nserver shutdown\r\n" \
     | $NETCAT -p $SOURCE_PORT -q5 $CMDSERV_HOST $CMDSERV_PORT \
     >> t/test_cmdserv.conn
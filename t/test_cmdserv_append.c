@@ -0,0 +1,231 @@
+/*
+ *  test_cmdserv_append.c
+ *
+ *    -- test program for the cmdserv_connection_append_*() functions:
+ *       Compares the number formatting with printf(), checks that a
+ *       reply built from many appends goes out in a single write, in
+ *       order with output from the other functions, and that large
+ *       replies and RESP framing work, too.
+ *
+ *
+ *  Copyright (C) 2014  Beat Vontobel <beat.vontobel@futhark.ch>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301, USA.
+ *
+ */
+
+#include "clientlib.h"
+
+#include <err.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define OUT_SIZE (1024 * 1024)
+
+/**
+ * The memory transport, counting the writes.
+ */
+static int writes;
+
+static ssize_t counting_read(void *object, void *buf, size_t len) {
+  return cmdserv_memory_transport.read(object, buf, len);
+}
+
+static ssize_t counting_write(void *object, const void *buf, size_t len,
+                              int flags) {
+  writes++;
+  return cmdserv_memory_transport.write(object, buf, len, flags);
+}
+
+static int counting_fd(void *object) {
+  return cmdserv_memory_transport.fd(object);
+}
+
+static void counting_close(void *object) {
+  cmdserv_memory_transport.close(object);
+}
+
+static const struct cmdserv_transport counting_transport = {
+  .read    = &counting_read,
+  .write   = &counting_write,
+  .writev  = NULL,
+  .pending = NULL,
+  .fd      = &counting_fd,
+  .close   = &counting_close
+};
+
+/**
+ * "numbers": Integers and doubles, a line each, then "200 OK".
+ * "mixed": Appends between prints.  "big COUNT": COUNT
+ * numbered lines.  "pending": Appends, left for the handler's return.
+ */
+static void cmd_handler(void *cmd_object, cmdserv_connection *connection,
+                        int argc, char **argv) {
+  (void)cmd_object;
+
+  if (argc == 1 && strcmp(argv[0], "numbers") == 0) {
+    cmdserv_connection_append_u64(connection, 0);
+    cmdserv_connection_append_str(connection, " ");
+    cmdserv_connection_append_u64(connection, UINT64_MAX);
+    cmdserv_connection_append_str(connection, " ");
+    cmdserv_connection_append_i64(connection, INT64_MIN);
+    cmdserv_connection_append_str(connection, " ");
+    cmdserv_connection_append_i64(connection, -42);
+    cmdserv_connection_append_str(connection, "\r\n");
+    cmdserv_connection_append_double(connection, -7.0, 0);
+    cmdserv_connection_append_str(connection, " ");
+    cmdserv_connection_append_double(connection, 3.14159265, 4);
+    cmdserv_connection_append_str(connection, " ");
+    cmdserv_connection_append_double(connection, 1e300, 1);
+    cmdserv_connection_append_str(connection, " ");
+    cmdserv_connection_append_double(connection, INFINITY, 2);
+    cmdserv_connection_append_str(connection, "\r\n");
+    if (cmdserv_connection_append_double(connection, 1.0, 10) == -1
+        && errno == EINVAL)
+      cmdserv_connection_append_str(connection, "precision 10: EINVAL\r\n");
+    cmdserv_connection_append_status(connection, 200, "OK");
+  } else if (argc == 1 && strcmp(argv[0], "mixed") == 0) {
+    cmdserv_connection_append_str(connection, "a");
+    cmdserv_connection_print(connection, "b");
+    cmdserv_connection_append_str(connection, "c");
+    cmdserv_connection_append_u64(connection, 1);
+    cmdserv_connection_printf(connection, "%s", "d");
+    cmdserv_connection_append_str(connection, "e\r\n");
+    cmdserv_connection_append_status(connection, 200, "mixed");
+  } else if (argc == 2 && strcmp(argv[0], "big") == 0) {
+    for (int i = 0; i < atoi(argv[1]); i++) {
+      cmdserv_connection_append_str(connection, "line ");
+      cmdserv_connection_append_i64(connection, i);
+      cmdserv_connection_append_str(connection, "\r\n");
+    }
+    cmdserv_connection_append_status(connection, 200, "big");
+  } else if (argc == 1 && strcmp(argv[0], "pending") == 0) {
+    cmdserv_connection_append_str(connection, "left for the end\r\n");
+  } else {
+    cmdserv_connection_append_status(connection, 404, "Not found");
+  }
+}
+
+static cmdserv_connection *open_connection(cmdserv_memory **memory,
+                                           enum cmdserv_framing framing) {
+  struct cmdserv_connection_config config
+    = cmdserv_connection_config_get_defaults();
+
+  config.cmd_handler = &cmd_handler;
+  config.log_handler = NULL;
+  config.framing     = framing;
+  config.lineterm    = CMDSERV_LINETERM_CRLF;
+
+  return cmdserv_connect_transport(&counting_transport, &config, memory);
+}
+
+static char out[OUT_SIZE];
+
+/**
+ * Send cmd and return what arrived in out, counting the writes.
+ */
+static size_t command(cmdserv_connection *connection, cmdserv_memory *memory,
+                      const char *cmd) {
+  writes = 0;
+  cmdserv_push_memory(connection, memory, cmd, strlen(cmd), strlen(cmd));
+
+  return cmdserv_pull_memory(memory, out, OUT_SIZE);
+}
+
+static void show(const char *name, size_t outlen) {
+  printf("-- %s (%s)\n", name, writes == 1 ? "one write" : "several writes");
+  for (size_t i = 0; i < outlen; i++)
+    if (out[i] != '\r')
+      putchar(out[i]);
+}
+
+/**
+ * Compare the formatting of doubles with printf().
+ */
+static void compare_doubles(cmdserv_connection *connection,
+                            cmdserv_memory *memory) {
+  static const double values[] = {
+    0.0, -0.0, 1.0, -1.0, 0.1, 0.2, 0.3, 2.5e-7, 123456.789, -98765.4321,
+    0.125, 0.375, -2.5, 0.5, 1.5, 1e-5 * 5, 1.005, 2.675,
+    1e15, 4503599627370495.0, 0.999999999, 1234.5678e-3, 1e-12
+  };
+  char expect[64];
+  char got[64];
+  int differ = 0;
+
+  for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+    for (int precision = 0; precision <= 9; precision++) {
+      size_t outlen, len;
+
+      cmdserv_connection_append_double(connection, values[i], precision);
+      cmdserv_connection_flush(connection);
+      outlen = cmdserv_memory_pull(memory, got, sizeof(got) - 1);
+      got[outlen] = '\0';
+
+      len = snprintf(expect, sizeof(expect), "%.*f", precision, values[i]);
+      if (len != outlen || strcmp(expect, got) != 0) {
+        printf("%.17g with precision %d: \"%s\", printf() \"%s\"\n",
+               values[i], precision, got, expect);
+        differ++;
+      }
+    }
+
+  printf("-- doubles: %d differ from printf()\n", differ);
+}
+
+int main(void) {
+  cmdserv_memory *memory;
+  cmdserv_connection *connection = open_connection(&memory, CMDSERV_FRAMING_LINE);
+  size_t outlen;
+  char *p;
+  int lines;
+
+  show("numbers", command(connection, memory, "numbers\r\n"));
+  show("mixed", command(connection, memory, "mixed\r\n"));
+  show("pending", command(connection, memory, "pending\r\n"));
+  show("unknown", command(connection, memory, "unknown\r\n"));
+
+  outlen = command(connection, memory, "big 10000\r\n");
+  lines  = 0;
+  for (p = out; p < out + outlen; p = strchr(p, '\n') + 1) {
+    char expect[32];
+
+    snprintf(expect, sizeof(expect), "line %d\r\n", lines);
+    if (strncmp(p, expect, strlen(expect)) != 0)
+      break;
+    lines++;
+  }
+  printf("-- big (%s): %d lines intact, then %.*s",
+         writes == 1 ? "one write" : "several writes",
+         lines, (int)(outlen - (p - out)), p);
+
+  compare_doubles(connection, memory);
+
+  cmdserv_connection_close(connection, CMDSERV_SERVER_SHUTDOWN);
+  cmdserv_memory_free(memory);
+
+  connection = open_connection(&memory, CMDSERV_FRAMING_RESP);
+  show("RESP mixed", command(connection, memory, "*1\r\n$5\r\nmixed\r\n"));
+  show("RESP pending", command(connection, memory, "*1\r\n$7\r\npending\r\n"));
+  show("RESP unknown", command(connection, memory, "*1\r\n$1\r\nx\r\n"));
+  cmdserv_connection_close(connection, CMDSERV_SERVER_SHUTDOWN);
+  cmdserv_memory_free(memory);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,218 @@
+/*
+ *  test_cmdserv_body.c
+ *
+ *    -- test program for cmdserv_connection_receive_body(): Streams
+ *       bodies much larger than the read buffer after a command, of a
+ *       given length and up to a terminator line (arriving in pieces
+ *       of all sizes, down to single octets), and checks that the
+ *       commands around them are still parsed.  Then cancels a body by
+ *       closing the connection, and tries invalid calls.
+ *
+ *
+ *  Copyright (C) 2014  Beat Vontobel <beat.vontobel@futhark.ch>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301, USA.
+ *
+ */
+
+#include "clientlib.h"
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define READBUF_SIZE 64
+#define BIG          100000
+
+/**
+ * What has arrived of a body so far: Its length and a checksum, and
+ * its beginning to show.
+ */
+struct body {
+  size_t len;
+  unsigned long sum;
+  size_t chunks;
+  char text[256];
+};
+
+static struct body body;
+
+static void body_handler(void *body_object, cmdserv_connection *connection,
+                         const void *chunk, size_t len) {
+  (void)body_object;
+
+  if (chunk == NULL) {
+    printf("body cancelled after %zu octets\n", body.len);
+    return;
+  }
+
+  if (len == 0) {
+    cmdserv_connection_send_status(connection, 200,
+                                   "%zu octets, sum %lu",
+                                   body.len, body.sum);
+    return;
+  }
+
+  for (size_t i = 0; i < len; i++) {
+    if (body.len + i < sizeof(body.text) - 1)
+      body.text[body.len + i] = ((const char *)chunk)[i];
+    body.sum += ((const unsigned char *)chunk)[i];
+  }
+  body.len += len;
+  body.chunks++;
+}
+
+/**
+ * "upload LENGTH", "text TERMINATOR", "bad": Receive a body.
+ * Anything else: "200 OK ARG0".
+ */
+static void cmd_handler(void *cmd_object, cmdserv_connection *connection,
+                        int argc, char **argv) {
+  int ret = 0;
+
+  (void)cmd_object;
+
+  if (argc < 1) {
+    cmdserv_connection_send_status(connection, 400, "Empty");
+    return;
+  }
+
+  if (strcmp(argv[0], "upload") == 0 || strcmp(argv[0], "text") == 0
+      || strcmp(argv[0], "bad") == 0)
+    memset(&body, 0, sizeof(body));
+
+  if (argc == 2 && strcmp(argv[0], "upload") == 0)
+    ret = cmdserv_connection_receive_body(connection, atol(argv[1]), NULL,
+                                          &body_handler, NULL);
+  else if (argc == 2 && strcmp(argv[0], "text") == 0)
+    ret = cmdserv_connection_receive_body(connection, 0, argv[1],
+                                          &body_handler, NULL);
+  else if (strcmp(argv[0], "bad") == 0)
+    ret = cmdserv_connection_receive_body(connection, 0,
+                                          "0123456789012345678901234567890"
+                                          "12345678901234567890123456789012",
+                                          &body_handler, NULL);
+  else
+    cmdserv_connection_send_status(connection, 200, "OK %s", argv[0]);
+
+  if (ret == -1)
+    cmdserv_connection_send_status(connection, 500, "%s",
+                                   errno == EINVAL ? "EINVAL" : "error");
+}
+
+static void close_handler(void *close_object, cmdserv_connection *connection,
+                          enum cmdserv_close_reason reason) {
+  (void)close_object;
+  (void)connection;
+  printf("closed: %d\n", reason);
+}
+
+static cmdserv_connection *open_connection(cmdserv_memory **memory) {
+  struct cmdserv_connection_config config
+    = cmdserv_connection_config_get_defaults();
+
+  config.readbuf_size  = READBUF_SIZE;
+  config.cmd_handler   = &cmd_handler;
+  config.close_handler = &close_handler;
+  config.log_handler   = NULL;
+  config.framing       = CMDSERV_FRAMING_LINE;
+
+  return cmdserv_connect_memory(&config, memory);
+}
+
+static void upload(size_t piece) {
+  cmdserv_memory *memory;
+  cmdserv_connection *connection = open_connection(&memory);
+  char *in;
+  int len;
+
+  if ((in = malloc(BIG + 64)) == NULL)
+    err(EXIT_FAILURE, "malloc()");
+
+  len = sprintf(in, "upload %d\n", BIG);
+  for (int i = 0; i < BIG; i++)
+    in[len++] = i % 251;
+  len += sprintf(in + len, "ping\n");
+
+  printf("-- upload of %d octets in pieces of %zu\n", BIG, piece);
+  cmdserv_push_memory(connection, memory, in, len, piece);
+  cmdserv_print_memory(memory);
+  printf("%s chunks\n", body.chunks > 1 ? "several" : "one");
+
+  cmdserv_connection_close(connection, CMDSERV_SERVER_SHUTDOWN);
+  cmdserv_memory_free(memory);
+  free(in);
+}
+
+static void text(const char *in, size_t piece) {
+  cmdserv_memory *memory;
+  cmdserv_connection *connection = open_connection(&memory);
+
+  printf("-- text in pieces of %zu\n", piece);
+  cmdserv_push_memory(connection, memory, in, strlen(in), piece);
+  cmdserv_print_memory(memory);
+  printf("body: [%s]\n", body.text);
+
+  cmdserv_connection_close(connection, CMDSERV_SERVER_SHUTDOWN);
+  cmdserv_memory_free(memory);
+}
+
+int main(void) {
+  static const char *lines =
+    "text .\r\n"
+    "first line\r\n"
+    "..\r\n"
+    ". not the end\r\n"
+    ".\r\n"
+    "ping\r\n";
+  char longline[512];
+  cmdserv_memory *memory;
+  cmdserv_connection *connection;
+
+  upload(BIG + 64);
+  upload(4096);
+  upload(7);
+
+  text(lines, 1024);
+  text(lines, 1);
+  text(lines, 3);
+
+  /* A body line much longer than the read buffer */
+  snprintf(longline, sizeof(longline), "text END\n%0300d\nEND\nping\n", 0);
+  text(longline, 1024);
+  text(longline, 5);
+
+  printf("-- empty bodies\n");
+  connection = open_connection(&memory);
+  cmdserv_push_memory(connection, memory,
+                      "upload 0\nping\ntext .\n.\nping\n", 28, 1024);
+  cmdserv_print_memory(memory);
+
+  printf("-- overlong terminator\n");
+  cmdserv_push_memory(connection, memory, "bad\nping\n", 9, 1024);
+  cmdserv_print_memory(memory);
+
+  printf("-- closed in the middle of a body\n");
+  cmdserv_push_memory(connection, memory,
+                      "upload 1000\n0123456789", 22, 1024);
+  cmdserv_print_memory(memory);
+  cmdserv_connection_close(connection, CMDSERV_SERVER_SHUTDOWN);
+  cmdserv_memory_free(memory);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,212 @@
+/*
+ *  test_cmdserv_budget.c
+ *
+ *    -- test program for the syscall and allocation cost of simple
+ *       commands.  Runs "value get", a prepared response and replies
+ *       built with the append API (with and without sendmsg()) over
+ *       a loopback connection to a cmdserv_connection built
+ *       with the interceptors (-DINTERCEPT) in counting mode and
+ *       fails if the syscalls and allocations per command, within
+ *       the command handler and outside of it, exceed their budget
+ *       (or go uncounted).  Writes the full intercept report to
+ *       stderr on failure.
+ *
+ *
+ *  Copyright (C) 2014  Beat Vontobel <beat.vontobel@futhark.ch>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301, USA.
+ *
+ */
+
+#include "../cmdserv_connection.h"
+#include "../cmdserv_connection_config.h"
+
+#include <err.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#undef INTERCEPT /* Only count what the library does, not the test itself */
+#include "../intercept.h"
+
+#define COMMANDS 100
+
+/**
+ * The budget per command: context NULL is everything outside of the
+ * command handler (i.e. reading and framing the request).
+ */
+static const struct budget {
+  const char *context;
+  const char *command;
+  unsigned int syscalls;
+  unsigned int allocs;
+} budgets[] = {
+  { NULL,       NULL,        1, 0 }, /* recv()                        */
+  { "value",    "value get", 2, 0 }, /* send() for value and status   */
+  { "response", "response",  1, 0 }, /* sendmsg() of the response     */
+  { "append",   "append",    1, 0 }, /* sendmsg() of reply and status */
+  { "appendst", "appendst",  1, 0 }, /* send() of reply and status    */
+};
+
+#define BUDGETS (sizeof(budgets) / sizeof(budgets[0]))
+
+static cmdserv_response *ok;
+
+static void cmd_handler(void *cmd_object, cmdserv_connection *connection,
+                        int argc, char **argv) {
+  (void)cmd_object;
+
+  if (argc == 2 && strcmp("value", argv[0]) == 0
+      && strcmp("get", argv[1]) == 0) {
+    cmdserv_connection_println(connection, "budget");
+    cmdserv_connection_send_status(connection, 200, "OK");
+  } else if (argc == 1 && strcmp("response", argv[0]) == 0) {
+    cmdserv_connection_send_response(connection, ok);
+  } else if (argc == 1 && (strcmp("append", argv[0]) == 0
+                            || strcmp("appendst", argv[0]) == 0)) {
+    cmdserv_connection_append_str(connection, "budget ");
+    cmdserv_connection_append_u64(connection, 42);
+    cmdserv_connection_append_str(connection, "\r\n");
+    if (strcmp("append", argv[0]) == 0) /* Appended output goes first */
+      cmdserv_connection_send_status(connection, 200, "OK");
+    else
+      cmdserv_connection_append_status(connection, 200, "OK");
+  } else {
+    cmdserv_connection_send_status(connection, 400, "Bad request");
+  }
+}
+
+/**
+ * Send the command and wait for its status line.
+ */
+static void roundtrip(int client, cmdserv_connection *connection,
+                      const char *command) {
+  char cmd[64], buf[256];
+  int cmdlen = snprintf(cmd, sizeof(cmd), "%s\r\n", command);
+  size_t len = 0;
+  ssize_t got;
+  struct pollfd pfd = { .fd     = cmdserv_connection_fd(connection),
+                        .events = POLLIN };
+
+  if (send(client, cmd, cmdlen, 0) != cmdlen)
+    err(EXIT_FAILURE, "send()");
+
+  if (poll(&pfd, 1, 1000) != 1)
+    errx(EXIT_FAILURE, "command not received");
+  cmdserv_connection_read(connection);
+
+  while (len == 0 || strstr(buf, "200 OK\r\n") == NULL) {
+    if ((got = recv(client, buf + len, sizeof(buf) - 1 - len, 0)) <= 0)
+      err(EXIT_FAILURE, "recv()");
+    len += got;
+    buf[len] = '\0';
+  }
+}
+
+int main(void) {
+  struct cmdserv_connection_config config
+    = cmdserv_connection_config_get_defaults();
+  struct sockaddr_in addr = {
+    .sin_family      = AF_INET,
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    .sin_port        = 0
+  };
+  socklen_t addrlen = sizeof(addr);
+  cmdserv_connection *connection;
+  int listener, client;
+  bool over = false;
+
+  if ((listener = socket(AF_INET, SOCK_STREAM, 0)) == -1
+      || bind(listener, (struct sockaddr*)&addr, addrlen) == -1
+      || listen(listener, 1) == -1
+      || getsockname(listener, (struct sockaddr*)&addr, &addrlen) == -1
+      || (client = socket(AF_INET, SOCK_STREAM, 0)) == -1
+      || connect(client, (struct sockaddr*)&addr, addrlen) == -1)
+    err(EXIT_FAILURE, "loopback connection");
+
+  config.cmd_handler = &cmd_handler;
+  config.log_handler = NULL;
+
+  if ((ok = cmdserv_response_prepare(200, "OK")) == NULL)
+    err(EXIT_FAILURE, "cmdserv_response_prepare()");
+
+  if ((connection = cmdserv_connection_create(listener, 1, &config,
+                                              CMDSERV_NO_CLOSE))
+      == NULL)
+    err(EXIT_FAILURE, "cmdserv_connection_create()");
+
+  intercept_counting(true);
+
+  for (size_t b = 1; b < BUDGETS; b++)
+    roundtrip(client, connection, budgets[b].command); /* warm up */
+  intercept_counts_reset();
+
+  for (int i = 0; i < COMMANDS; i++)
+    for (size_t b = 1; b < BUDGETS; b++)
+      roundtrip(client, connection, budgets[b].command);
+
+  intercept_counting(false);
+
+  if (intercept_counts("value") == NULL) {
+    fprintf(stderr, "SKIPPED: library not built with -DINTERCEPT\n");
+    goto DONE;
+  }
+
+  for (size_t b = 0; b < BUDGETS; b++) {
+    const struct intercept_count *counts
+      = intercept_counts(budgets[b].context);
+    unsigned long long int syscalls = 0, allocs = 0;
+    /* Outside of the handlers it's all the commands together */
+    unsigned int commands = budgets[b].command ? COMMANDS
+      : COMMANDS * (BUDGETS - 1);
+
+    for (int f = 0; counts != NULL && f < INTERCEPTED_COUNT; f++) {
+      if (f == INTERCEPTED_calloc || f == INTERCEPTED_malloc
+          || f == INTERCEPTED_realloc)
+        allocs += counts[f].calls;
+      else
+        syscalls += counts[f].calls;
+    }
+
+    /* Less than a syscall per command: Some went past the interceptors */
+    if (syscalls > (unsigned long long int)budgets[b].syscalls * commands
+        || allocs > (unsigned long long int)budgets[b].allocs * commands
+        || syscalls < commands) {
+      fprintf(stderr, "%s: %.2f syscalls, %.2f allocations per command, "
+              "budget is %u and %u\n",
+              budgets[b].context ? budgets[b].context : "-",
+              (double)syscalls / commands, (double)allocs / commands,
+              budgets[b].syscalls, budgets[b].allocs);
+      over = true;
+    }
+  }
+
+  if (over)
+    intercept_report(stderr);
+
+ DONE:
+  cmdserv_connection_close(connection, CMDSERV_SERVER_SHUTDOWN);
+  cmdserv_response_free(ok);
+  close(client);
+  close(listener);
+
+  return over ? EXIT_FAILURE : EXIT_SUCCESS;
+}
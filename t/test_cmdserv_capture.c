@@ -0,0 +1,129 @@
+/*
+ *  test_cmdserv_capture.c
+ *
+ *    -- test program for the traffic capture of cmdserv_connection.
+ *       Sends everything from stdin over a loopback connection to a
+ *       cmdserv_connection with capturing enabled, closes the
+ *       connection and writes the resulting capture to stdout, with
+ *       the timestamps and handler times (that differ from run to
+ *       run) replaced by "T".
+ *
+ *
+ *  Copyright (C) 2014  Beat Vontobel <beat.vontobel@futhark.ch>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301, USA.
+ *
+ */
+
+#include "clientlib.h"
+
+#include <err.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static bool closed = false;
+
+static void cmd_handler(void *cmd_object, cmdserv_connection *connection,
+                        int argc, char **argv) {
+  (void)cmd_object;
+  (void)connection;
+  (void)argc;
+  (void)argv;
+}
+
+static void close_handler(void *close_object, cmdserv_connection *connection,
+                          enum cmdserv_close_reason reason) {
+  (void)close_object;
+  (void)connection;
+  (void)reason;
+  closed = true;
+}
+
+int main(void) {
+  struct cmdserv_connection_config config
+    = cmdserv_connection_config_get_defaults();
+  struct sockaddr_in addr = {
+    .sin_family      = AF_INET,
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    .sin_port        = 0
+  };
+  socklen_t addrlen = sizeof(addr);
+  cmdserv_connection *connection;
+  FILE *capture;
+  char buf[4096], *record = NULL;
+  size_t record_size = 0;
+  ssize_t len;
+  int listener, client;
+
+  if ((capture = tmpfile()) == NULL)
+    err(EXIT_FAILURE, "tmpfile()");
+
+  if ((listener = socket(AF_INET, SOCK_STREAM, 0)) == -1
+      || bind(listener, (struct sockaddr*)&addr, addrlen) == -1
+      || listen(listener, 1) == -1
+      || getsockname(listener, (struct sockaddr*)&addr, &addrlen) == -1
+      || (client = socket(AF_INET, SOCK_STREAM, 0)) == -1
+      || connect(client, (struct sockaddr*)&addr, addrlen) == -1)
+    err(EXIT_FAILURE, "loopback connection");
+
+  config.cmd_handler   = &cmd_handler;
+  config.close_handler = &close_handler;
+  config.log_handler   = NULL;
+  config.capture_fd    = fileno(capture);
+
+  if ((connection = cmdserv_connection_create(listener, 42, &config,
+                                              CMDSERV_NO_CLOSE))
+      == NULL)
+    err(EXIT_FAILURE, "cmdserv_connection_create()");
+
+  while ((len = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+    if (send(client, buf, len, 0) != len)
+      err(EXIT_FAILURE, "send()");
+    cmdserv_drain(connection, &closed);
+  }
+
+  close(client);
+  cmdserv_drain(connection, &closed);
+  if (!closed)
+    errx(EXIT_FAILURE, "connection not closed");
+
+  rewind(capture);
+  while (getline(&record, &record_size, capture) != -1) {
+    char type;
+    unsigned long long int time, id, handler_ns;
+    int offset, skip;
+
+    if (sscanf(record, "%c %llu %llu%n", &type, &time, &id, &offset) != 3)
+      errx(EXIT_FAILURE, "malformed record: %s", record);
+
+    if (type == 'L'
+        && sscanf(record + offset, " %llu%n", &handler_ns, &skip) == 1)
+      printf("L T %llu T%s", id, record + offset + skip);
+    else
+      printf("%c T %llu%s", type, id, record + offset);
+  }
+
+  free(record);
+  fclose(capture);
+  close(listener);
+
+  return EXIT_SUCCESS;
+}
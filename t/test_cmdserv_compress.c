@@ -0,0 +1,235 @@
+/*
+ *  test_cmdserv_compress.c
+ *
+ *    -- test program for cmdserv_connection_compression(): Switches
+ *       compression on with a command, checks that the reply to it
+ *       still goes out plain, that every later response can be
+ *       decompressed as soon as it has arrived (including a generated
+ *       one), and that switching compression off behind queued output
+ *       ends the stream in the right place.
+ *
+ *
+ *  Copyright (C) 2014  Beat Vontobel <beat.vontobel@futhark.ch>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301, USA.
+ *
+ */
+
+#include "clientlib.h"
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define OUT_SIZE (8 * 1024 * 1024)
+
+static const char line[] = "the quick brown fox jumps over the lazy dog\r\n";
+
+static ssize_t lines_generator(void *generator_object,
+                               cmdserv_connection *connection,
+                               void *buf, size_t size) {
+  int *left = generator_object;
+  size_t len = 0;
+
+  (void)connection;
+
+  if (buf == NULL) {
+    free(left);
+    return 0;
+  }
+
+  while (*left > 0 && size - len >= sizeof(line) - 1) {
+    memcpy((char *)buf + len, line, sizeof(line) - 1);
+    len += sizeof(line) - 1;
+    (*left)--;
+  }
+
+  if (len == 0)
+    free(left);
+
+  return len;
+}
+
+/**
+ * "compress LEVEL": Reply, then switch compression.
+ * "dump COUNT": COUNT lines right away.  "lines COUNT": Generated.
+ * Anything else: "200 OK ARG0".
+ */
+static void cmd_handler(void *cmd_object, cmdserv_connection *connection,
+                        int argc, char **argv) {
+  (void)cmd_object;
+
+  if (argc == 2 && strcmp(argv[0], "compress") == 0) {
+    int level = atoi(argv[1]);
+
+    cmdserv_connection_send_status(connection, 200, "level %d", level);
+    if (cmdserv_connection_compression(connection, level) == -1)
+      cmdserv_connection_send_status(connection, 500, "%s",
+                                     errno == EINVAL ? "EINVAL" : "error");
+  } else if (argc == 2 && strcmp(argv[0], "dump") == 0) {
+    for (int i = atoi(argv[1]); i > 0; i--)
+      cmdserv_connection_print(connection, line);
+    cmdserv_connection_send_status(connection, 200, "dumped");
+  } else if (argc == 2 && strcmp(argv[0], "lines") == 0) {
+    int *left;
+
+    if ((left = malloc(sizeof(*left))) == NULL)
+      err(EXIT_FAILURE, "malloc()");
+    *left = atoi(argv[1]);
+    if (cmdserv_connection_send_generator(connection, &lines_generator, left)
+        == 0)
+      cmdserv_connection_send_status(connection, 200, "generated");
+  } else {
+    cmdserv_connection_send_status(connection, 200, "OK %s",
+                                   argc > 0 ? argv[0] : "");
+  }
+}
+
+static cmdserv_memory *memory;
+static cmdserv_connection *connection;
+static char *in, *out;
+static z_stream inflater;
+
+/**
+ * Send cmd, let the connection send everything it has to, and return
+ * what arrived in in.
+ */
+static size_t command(const char *cmd) {
+  size_t inlen = 0;
+
+  cmdserv_push_memory(connection, memory, cmd, strlen(cmd), strlen(cmd));
+
+  for (;;) {
+    inlen += cmdserv_pull_memory(memory, in + inlen, OUT_SIZE - inlen);
+    if (!cmdserv_connection_output_pending(connection))
+      break;
+    cmdserv_connection_flush(connection);
+  }
+
+  return inlen;
+}
+
+/**
+ * Decompress len octets from buf into out, up to the end of the
+ * stream.  Returns the length of the output, *used is set to the
+ * octets of input used.
+ */
+static size_t decompress(const char *buf, size_t len, size_t *used,
+                         bool *end) {
+  int ret;
+
+  inflater.next_in   = (Bytef *)(uintptr_t)buf;
+  inflater.avail_in  = len;
+  inflater.next_out  = (Bytef *)out;
+  inflater.avail_out = OUT_SIZE;
+
+  ret = inflate(&inflater, Z_SYNC_FLUSH);
+  if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+    errx(EXIT_FAILURE, "inflate(): %d", ret);
+
+  *used = len - inflater.avail_in;
+  *end  = ret == Z_STREAM_END;
+
+  return OUT_SIZE - inflater.avail_out;
+}
+
+/**
+ * Check that out has count lines followed by the status, or print it
+ * all if count is 0.
+ */
+static void check(const char *name, size_t outlen, int count,
+                  size_t inlen) {
+  const char *p = out;
+
+  printf("%s: ", name);
+
+  if (count == 0) {
+    fwrite(out, 1, outlen, stdout);
+    return;
+  }
+
+  for (int i = 0; i < count; i++, p += sizeof(line) - 1)
+    if (outlen < (size_t)(p - out) + sizeof(line) - 1
+        || memcmp(p, line, sizeof(line) - 1) != 0) {
+      printf("line %d missing\n", i);
+      return;
+    }
+
+  printf("%d lines intact, compressed %s tenfold, then: %.*s",
+         count, inlen * 10 < outlen ? "more than" : "less than",
+         (int)(outlen - (p - out)), p);
+}
+
+int main(void) {
+  struct cmdserv_connection_config config
+    = cmdserv_connection_config_get_defaults();
+  size_t inlen, outlen, used;
+  bool end;
+
+  config.cmd_handler = &cmd_handler;
+  config.log_handler = NULL;
+
+  if ((in = malloc(OUT_SIZE)) == NULL || (out = malloc(OUT_SIZE)) == NULL)
+    err(EXIT_FAILURE, "malloc()");
+
+  connection = cmdserv_connect_memory(&config, &memory);
+
+  if (inflateInit(&inflater) != Z_OK)
+    errx(EXIT_FAILURE, "inflateInit()");
+
+  printf("-- invalid level\n");
+  inlen = command("compress 10\n");
+  fwrite(in, 1, inlen, stdout);
+
+  printf("-- the reply to switching it on is plain\n");
+  inlen = command("ping\ncompress 6\n");
+  fwrite(in, 1, inlen, stdout);
+
+  printf("-- every response can be decompressed right away\n");
+  inlen  = command("dump 20000\n");
+  outlen = decompress(in, inlen, &used, &end);
+  check("dump", outlen, 20000, inlen);
+
+  inlen  = command("hello\n");
+  outlen = decompress(in, inlen, &used, &end);
+  check("hello", outlen, 0, inlen);
+
+  inlen  = command("lines 50000\n");
+  outlen = decompress(in, inlen, &used, &end);
+  check("generated", outlen, 50000, inlen);
+
+  printf("-- switched off behind queued output\n");
+  inlen  = command("lines 50000\ncompress 0\nping\n");
+  outlen = decompress(in, inlen, &used, &end);
+  check("generated", outlen, 50000, inlen);
+  printf("stream %s, then plain: %.*s",
+         end ? "ended" : "not ended", (int)(inlen - used), in + used);
+
+  inlen = command("ping\n");
+  fwrite(in, 1, inlen, stdout);
+
+  inflateEnd(&inflater);
+  cmdserv_connection_close(connection, CMDSERV_SERVER_SHUTDOWN);
+  cmdserv_memory_free(memory);
+  free(in);
+  free(out);
+
+  return EXIT_SUCCESS;
+}
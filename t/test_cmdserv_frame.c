@@ -0,0 +1,195 @@
+/*
+ *  test_cmdserv_frame.c
+ *
+ *    -- test program for the binary framing of cmdserv_connection on
+ *       top of the in-process memory transport.  Sends binary
+ *       arguments, frames split up and packed together, frames larger
+ *       than the read buffer and beyond frame_max, too many arguments
+ *       and a malformed frame, and lets CMDSERV_FRAMING_AUTO decide on
+ *       both kinds of clients.  Writes everything the connections send
+ *       back to stdout.
+ *
+ *
+ *  Copyright (C) 2014  Beat Vontobel <beat.vontobel@futhark.ch>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301, USA.
+ *
+ */
+
+#include "clientlib.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define READBUF_SIZE 64
+#define FRAME_MAX    4096
+#define ARGC_MAX     4
+
+static const char *framings[] = { "line", "binary", "auto" };
+
+static void cmd_handler(void *cmd_object, cmdserv_connection *connection,
+                        int argc, char **argv) {
+  (void)cmd_object;
+
+  if (argc > 0 && strcmp(argv[0], "len") == 0) {
+    enum cmdserv_framing framing
+      = cmdserv_connection_framing(connection, CMDSERV_FRAMING_LINE);
+
+    cmdserv_connection_framing(connection, framing);
+    for (int i = 1; i < argc; i++)
+      cmdserv_connection_printf(connection, "%zu ",
+                                cmdserv_connection_arglen(connection, i));
+    cmdserv_connection_send_status(connection, 200, "%s", framings[framing]);
+    return;
+  }
+
+  /* Echo the arguments, showing what's not printable */
+  cmdserv_connection_printf(connection, "%d:", argc);
+  for (int i = 0; i < argc; i++) {
+    size_t len = cmdserv_connection_arglen(connection, i);
+
+    cmdserv_connection_print(connection, " [");
+    for (size_t c = 0; c < len; c++) {
+      unsigned char ch = (unsigned char)argv[i][c];
+
+      if (ch < 0x20 || ch > 0x7e)
+        cmdserv_connection_printf(connection, "\\x%02x", ch);
+      else
+        cmdserv_connection_printf(connection, "%c", ch);
+    }
+    cmdserv_connection_print(connection, "]");
+  }
+  cmdserv_connection_print(connection, "\r\n");
+  cmdserv_connection_send_status(connection, 200, "OK");
+}
+
+static void close_handler(void *close_object, cmdserv_connection *connection,
+                          enum cmdserv_close_reason reason) {
+  (void)close_object;
+  (void)connection;
+  printf("closed: %d\n", reason);
+}
+
+/**
+ * Push len octets in pieces of at most chunk octets, reading after
+ * every piece, and print the output.
+ */
+static void push(cmdserv_connection *connection, cmdserv_memory *memory,
+                 const void *buf, size_t len, size_t chunk) {
+  cmdserv_push_memory(connection, memory, buf, len, chunk);
+  cmdserv_print_memory(memory);
+}
+
+/**
+ * Encode argv into frame at offset, return the new end of the frames.
+ */
+static size_t frame(unsigned char *buf, size_t size, size_t offset,
+                    int argc, const char *const *argv, const size_t *argl) {
+  ssize_t len = cmdserv_frame(buf + offset, size - offset, argc, argv, argl);
+
+  if (len == -1)
+    errx(EXIT_FAILURE, "frame buffer too small");
+  return offset + len;
+}
+
+int main(void) {
+  struct cmdserv_connection_config config
+    = cmdserv_connection_config_get_defaults();
+  static unsigned char buf[FRAME_MAX * 2], big[FRAME_MAX];
+  cmdserv_connection *connection;
+  cmdserv_memory *memory;
+  size_t len;
+
+  config.readbuf_size  = READBUF_SIZE;
+  config.argc_max      = ARGC_MAX;
+  config.framing       = CMDSERV_FRAMING_BINARY;
+  config.frame_max     = FRAME_MAX;
+  config.cmd_handler   = &cmd_handler;
+  config.close_handler = &close_handler;
+  config.log_handler   = NULL;
+
+  connection = cmdserv_connect_memory(&config, &memory);
+
+  /* Zero octets and line terminators are just data */
+  printf("# binary arguments\n");
+  len = frame(buf, sizeof(buf), 0, 3,
+              (const char *[]){ "echo", "a\0b", "c\r\nd" },
+              (size_t[]){ 4, 3, 4 });
+  push(connection, memory, buf, len, len);
+
+  /* Several frames at once, then one octet at a time */
+  printf("# packed and split\n");
+  len = frame(buf, sizeof(buf), 0,   2, (const char *[]){ "echo", "one" }, NULL);
+  len = frame(buf, sizeof(buf), len, 3, (const char *[]){ "echo", "", "two" }, NULL);
+  len = frame(buf, sizeof(buf), len, 0, NULL, NULL);
+  push(connection, memory, buf, len, len);
+  len = frame(buf, sizeof(buf), 0, 2, (const char *[]){ "echo", "three" }, NULL);
+  push(connection, memory, buf, len, 1);
+
+  /* Larger than the read buffer, which has to grow */
+  printf("# larger than readbuf_size\n");
+  memset(big, 'x', 1000);
+  len = frame(buf, sizeof(buf), 0, 3,
+              (const char *[]){ "len", (const char *)big, "end" },
+              (size_t[]){ 3, 1000, 3 });
+  push(connection, memory, buf, len, 100);
+
+  /* Beyond frame_max: skipped, the next frame is fine again */
+  printf("# larger than frame_max\n");
+  memset(big, 'y', sizeof(big));
+  len = frame(buf, sizeof(buf), 0, 2,
+              (const char *[]){ "len", (const char *)big },
+              (size_t[]){ 3, sizeof(big) });
+  len = frame(buf, sizeof(buf), len, 2, (const char *[]){ "echo", "after" }, NULL);
+  push(connection, memory, buf, len, 1000);
+
+  printf("# too many arguments\n");
+  len = frame(buf, sizeof(buf), 0, 5,
+              (const char *[]){ "echo", "1", "2", "3", "4" }, NULL);
+  len = frame(buf, sizeof(buf), len, 4,
+              (const char *[]){ "echo", "1", "2", "3" }, NULL);
+  push(connection, memory, buf, len, len);
+
+  /* Argument lengths not adding up to the frame's length */
+  printf("# malformed\n");
+  len = frame(buf, sizeof(buf), 0, 2, (const char *[]){ "echo", "bad" }, NULL);
+  buf[len - 1] = 'X';
+  push(connection, memory, buf, len, len);
+  cmdserv_hangup_memory(connection, memory);
+
+  printf("# bad version\n");
+  connection = cmdserv_connect_memory(&config, &memory);
+  len = frame(buf, sizeof(buf), 0, 1, (const char *[]){ "echo" }, NULL);
+  buf[1] = CMDSERV_FRAME_VERSION + 1;
+  push(connection, memory, buf, len, len);
+  cmdserv_hangup_memory(connection, memory);
+
+  /* Auto negotiation for line and binary clients */
+  config.framing = CMDSERV_FRAMING_AUTO;
+
+  printf("# auto: line\n");
+  connection = cmdserv_connect_memory(&config, &memory);
+  push(connection, memory, "len \"a b\" c\r\n", 13, 13);
+  cmdserv_hangup_memory(connection, memory);
+
+  printf("# auto: binary\n");
+  connection = cmdserv_connect_memory(&config, &memory);
+  len = frame(buf, sizeof(buf), 0, 3, (const char *[]){ "len", "a b", "c" }, NULL);
+  push(connection, memory, buf, len, len);
+  cmdserv_hangup_memory(connection, memory);
+
+  return EXIT_SUCCESS;
+}
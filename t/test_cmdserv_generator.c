@@ -0,0 +1,228 @@
+/*
+ *  test_cmdserv_generator.c
+ *
+ *    -- test program for cmdserv_connection_send_generator(): Streams
+ *       a large response from a generator over the in-process memory
+ *       transport while a second connection keeps being served, then
+ *       closes a connection in the middle of a response, lets a
+ *       generator fail, and runs one for a RESP client.
+ *
+ *
+ *  Copyright (C) 2014  Beat Vontobel <beat.vontobel@futhark.ch>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301, USA.
+ *
+ */
+
+#include "clientlib.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * State of a "lines" response: Lines from next up to count, failing
+ * at fail (if not 0).
+ */
+struct lines {
+  int next;
+  int count;
+  int fail;
+  int calls;
+};
+
+static ssize_t lines_generator(void *generator_object,
+                               cmdserv_connection *connection,
+                               void *buf, size_t size) {
+  struct lines *lines = generator_object;
+  size_t len = 0;
+
+  (void)connection;
+
+  if (buf == NULL) {
+    printf("generator cancelled at line %d after %d calls\n",
+           lines->next, lines->calls);
+    free(lines);
+    return 0;
+  }
+
+  lines->calls++;
+
+  if (lines->fail > 0 && lines->next >= lines->fail) {
+    printf("generator failing at line %d\n", lines->next);
+    free(lines);
+    return -1;
+  }
+
+  while (lines->next < lines->count) {
+    int n = snprintf((char *)buf + len, size - len,
+                     "line %d\r\n", lines->next);
+
+    if ((size_t)n >= size - len)
+      break;
+    len += n;
+    lines->next++;
+  }
+
+  if (len == 0) {
+    printf("generator done after %d calls\n", lines->calls);
+    free(lines);
+  }
+
+  return len;
+}
+
+/**
+ * "lines COUNT [FAIL]": COUNT lines between a "begin" and an "end".
+ * Anything else: "200 OK".
+ */
+static void cmd_handler(void *cmd_object, cmdserv_connection *connection,
+                        int argc, char **argv) {
+  struct lines *lines;
+
+  (void)cmd_object;
+
+  if (argc < 2 || strcmp(argv[0], "lines") != 0) {
+    cmdserv_connection_send_status(connection, 200, "OK");
+    return;
+  }
+
+  if ((lines = malloc(sizeof(*lines))) == NULL)
+    err(EXIT_FAILURE, "malloc()");
+  *lines = (struct lines){
+    .next  = 0,
+    .count = atoi(argv[1]),
+    .fail  = argc > 2 ? atoi(argv[2]) : 0,
+    .calls = 0
+  };
+
+  cmdserv_connection_print(connection, "begin\r\n");
+  if (cmdserv_connection_send_generator(connection, &lines_generator, lines)
+      == 0)
+    cmdserv_connection_send_status(connection, 200, "end");
+}
+
+static void close_handler(void *close_object, cmdserv_connection *connection,
+                          enum cmdserv_close_reason reason) {
+  (void)close_object;
+  (void)connection;
+  printf("closed: %d\n", reason);
+}
+
+static cmdserv_connection *open_connection(cmdserv_memory **memory,
+                                           enum cmdserv_framing framing) {
+  struct cmdserv_connection_config config
+    = cmdserv_connection_config_get_defaults();
+
+  config.cmd_handler   = &cmd_handler;
+  config.close_handler = &close_handler;
+  config.log_handler   = NULL;
+  config.framing       = framing;
+
+  return cmdserv_connect_memory(&config, memory);
+}
+
+static void command(cmdserv_connection *connection, cmdserv_memory *memory,
+                    const char *cmd) {
+  cmdserv_push_memory(connection, memory, cmd, strlen(cmd), strlen(cmd));
+}
+
+static void check_lines(const char *out, size_t outlen, int count) {
+  const char *p = out;
+  char expect[32];
+
+  if (outlen < 7 || memcmp(p, "begin\r\n", 7) != 0) {
+    printf("missing begin\n");
+    return;
+  }
+  p += 7;
+
+  for (int i = 0; i < count; i++) {
+    int n = snprintf(expect, sizeof(expect), "line %d\r\n", i);
+    if ((size_t)(out + outlen - p) < (size_t)n || memcmp(p, expect, n) != 0) {
+      printf("line %d missing\n", i);
+      return;
+    }
+    p += n;
+  }
+
+  printf("%d lines intact, then: %.*s", count, (int)(out + outlen - p), p);
+}
+
+int main(void) {
+  cmdserv_memory *memory, *other_memory;
+  cmdserv_connection *connection, *other;
+  size_t size = 4 * 1024 * 1024, outlen = 0;
+  int turns = 0, served = 0;
+  char *out, buf[64];
+
+  if ((out = malloc(size)) == NULL)
+    err(EXIT_FAILURE, "malloc()");
+
+  printf("-- streaming, served alternately with another connection\n");
+  connection = open_connection(&memory, CMDSERV_FRAMING_LINE);
+  other      = open_connection(&other_memory, CMDSERV_FRAMING_LINE);
+
+  command(connection, memory, "lines 100000\n");
+  while (cmdserv_connection_output_pending(connection)) {
+    outlen += cmdserv_pull_memory(memory, out + outlen, size - outlen);
+    cmdserv_connection_flush(connection);
+    turns++;
+
+    command(other, other_memory, "ping\n");
+    if (cmdserv_memory_pull(other_memory, buf, sizeof(buf)) == 8)
+      served++;
+  }
+  outlen += cmdserv_pull_memory(memory, out + outlen, size - outlen);
+  check_lines(out, outlen, 100000);
+  printf("%s turns, other connection served every turn: %s\n",
+         turns > 10 ? "many" : "few", served == turns ? "yes" : "no");
+
+  printf("-- output after the generator waits for it\n");
+  outlen = 0;
+  command(connection, memory, "lines 3\nping\n");
+  while (cmdserv_connection_output_pending(connection))
+    cmdserv_connection_flush(connection);
+  outlen += cmdserv_pull_memory(memory, out + outlen, size - outlen);
+  check_lines(out, outlen, 3);
+
+  printf("-- closed in the middle\n");
+  command(connection, memory, "lines 100000\n");
+  cmdserv_connection_close(connection, CMDSERV_SERVER_SHUTDOWN);
+  cmdserv_memory_free(memory);
+
+  printf("-- failing generator\n");
+  connection = open_connection(&memory, CMDSERV_FRAMING_LINE);
+  command(connection, memory, "lines 100000 5000\n");
+  while (!cmdserv_memory_closed(memory))
+    cmdserv_connection_flush(connection);
+  cmdserv_memory_free(memory);
+
+  printf("-- RESP\n");
+  connection = open_connection(&memory, CMDSERV_FRAMING_RESP);
+  command(connection, memory, "*2\r\n$5\r\nlines\r\n$1\r\n2\r\n");
+  outlen = cmdserv_pull_memory(memory, out, size);
+  fwrite(out, 1, outlen, stdout);
+  cmdserv_connection_close(connection, CMDSERV_SERVER_SHUTDOWN);
+  cmdserv_memory_free(memory);
+
+  cmdserv_connection_close(other, CMDSERV_SERVER_SHUTDOWN);
+  cmdserv_memory_free(other_memory);
+  free(out);
+
+  return EXIT_SUCCESS;
+}
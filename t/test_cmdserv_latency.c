@@ -0,0 +1,91 @@
+/*
+ *  test_cmdserv_latency.c
+ *
+ *    -- test program for the cmdserv_latency histograms. Reads
+ *       commands line after line from stdin ("record NAME NS",
+ *       "stats", or "reset") and applies them to one latency table
+ *       with room for COMMANDS_MAX distinct commands. Writes
+ *       the resulting summaries to stdout in a diff'able format.
+ *
+ *
+ *  Copyright (C) 2014  Beat Vontobel <beat.vontobel@futhark.ch>
+ *                                                                                 
+ *  This program is free software; you can redistribute it and/or                  
+ *  modify it under the terms of the GNU General Public License                    
+ *  as published by the Free Software Foundation; either version 2                 
+ *  of the License, or (at your option) any later version.                         
+ *                                                                                 
+ *  This program is distributed in the hope that it will be useful,                
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of                 
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                  
+ *  GNU General Public License for more details.                                   
+ *                                                                                 
+ *  You should have received a copy of the GNU General Public License              
+ *  along with this program; if not, write to the Free Software                    
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301, USA.
+ *
+ */
+
+#include "../cmdserv_latency.h"
+
+#include <err.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define COMMANDS_MAX 3
+
+int main(void) {
+  char *line = NULL;
+  size_t len = 0;
+  struct cmdserv_latency_stats stats[COMMANDS_MAX + 1];
+  cmdserv_latency *latency = cmdserv_latency_create(COMMANDS_MAX);
+
+  if (latency == NULL)
+    err(EXIT_FAILURE, "cmdserv_latency_create()");
+  printf("stats max: %u\n", cmdserv_latency_stats_max(latency));
+
+  for (int lineno = 1; getline(&line, &len, stdin) != -1; lineno++) {
+    char *op = strtok(line, " \n");
+
+    if (op == NULL || *op == '#') {
+      continue;
+
+    } else if (strcmp(op, "record") == 0) {
+      char *name  = strtok(NULL, " \n");
+      char *value = strtok(NULL, " \n");
+      long long int count = 1;
+      char *repeat;
+
+      if (name == NULL || value == NULL)
+        errx(EXIT_FAILURE, "Missing arguments on line %d", lineno);
+      if ((repeat = strtok(NULL, " \n")) != NULL)
+        count = atoll(repeat);
+
+      while (count-- > 0)
+        cmdserv_latency_record(latency, name, strtoull(value, NULL, 10));
+
+    } else if (strcmp(op, "stats") == 0) {
+      unsigned int n = cmdserv_latency_stats(latency, stats, COMMANDS_MAX + 1);
+
+      printf("stats: %u\n", n);
+      for (unsigned int i = 0; i < n; i++)
+        printf("  [%s] count=%llu p50=%" PRIu64 " p99=%" PRIu64
+               " p999=%" PRIu64 " max=%" PRIu64 "\n",
+               stats[i].command, stats[i].count,
+               stats[i].p50, stats[i].p99, stats[i].p999, stats[i].max);
+
+    } else if (strcmp(op, "reset") == 0) {
+      cmdserv_latency_reset(latency);
+      printf("reset\n");
+
+    } else {
+      errx(EXIT_FAILURE, "Unknown operation '%s' on line %d", op, lineno);
+    }
+  }
+
+  cmdserv_latency_free(latency);
+  free(line);
+}
@@ -0,0 +1,162 @@
+/*
+ *  test_cmdserv_listen.c
+ *
+ *    -- test program for a cmdserv listening on several endpoints
+ *       at once: TCP on one address, TCP on all addresses, a Unix
+ *       domain socket in the file system (replacing a stale one) and
+ *       one in the abstract namespace.  Connects to each of them in
+ *       turn and writes the server's idea of the client to stdout.
+ *
+ *
+ *  Copyright (C) 2014  Beat Vontobel <beat.vontobel@futhark.ch>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301, USA.
+ *
+ */
+
+#include "clientlib.h"
+#include "../cmdserv.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define SOCKET_PATH "t/test_cmdserv_listen.sock"
+
+static void who_handler(void *cmd_object, cmdserv_connection *connection,
+                        int argc, char **argv) {
+  char *client = cmdserv_connection_client(connection);
+
+  (void)cmd_object;
+  (void)argc;
+  (void)argv;
+
+  /* Strip the port (or process id), that differs from run to run */
+  if (client != NULL && strrchr(client, ':') != NULL)
+    *strrchr(client, ':') = '\0';
+  cmdserv_connection_send_status(connection, 200, "%s",
+                                 client ? client : "?");
+  free(client);
+}
+
+/**
+ * Leave a socket file behind at path, just like a crashed server.
+ */
+static void make_stale_socket(const char *path) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  int fd;
+
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1
+      || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    err(EXIT_FAILURE, "stale socket %s", path);
+  close(fd);
+}
+
+/**
+ * Send "who" to one endpoint and let the server run until the answer
+ * arrives.
+ */
+static void who(cmdserv *server, const char *host, const char *port) {
+  char name[] = "test_cmdserv_listen", hostarg[64], portarg[128];
+  char *argv[] = { name, hostarg, portarg, NULL };
+  char buf[256];
+  ssize_t len = 0, got;
+  int fd;
+
+  snprintf(hostarg, sizeof(hostarg), "%s", host ? host : port);
+  snprintf(portarg, sizeof(portarg), "%s", port);
+  fd = cmdserv_connect(host ? 3 : 2, argv);
+
+  if (send(fd, "who\r\n", 5, 0) != 5)
+    err(EXIT_FAILURE, "send()");
+
+  while (len == 0 || buf[len - 1] != '\n') {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    cmdserv_sleep(server, &(struct timeval){ .tv_sec = 0, .tv_usec = 10000 });
+    if (poll(&pfd, 1, 0) != 1)
+      continue;
+    if ((got = recv(fd, buf + len, sizeof(buf) - 1 - len, 0)) <= 0)
+      errx(EXIT_FAILURE, "%s: no answer", port);
+    len += got;
+  }
+  buf[len] = '\0';
+
+  printf("%s%s%s: %s", host ? host : "", host ? " " : "", port, buf);
+  close(fd);
+}
+
+/**
+ * Try to start a second server on the socket of a live one, which
+ * must not take it over.
+ */
+static void take_over(const char *path) {
+  struct cmdserv_config config = cmdserv_config_get_defaults();
+  cmdserv *server;
+
+  config.listen[0] = path;
+  config.log_handler = NULL;
+  config.connection_config.cmd_handler = &who_handler;
+  config.connection_config.log_handler = NULL;
+
+  if ((server = cmdserv_start(config)) != NULL) {
+    printf("%s: taken over\n", path);
+    cmdserv_shutdown(server);
+  } else {
+    printf("%s: %s\n", path, strerror(errno));
+  }
+}
+
+int main(void) {
+  struct cmdserv_config config = cmdserv_config_get_defaults();
+  struct stat st;
+  cmdserv *server;
+
+  make_stale_socket(SOCKET_PATH);
+
+  config.listen[0] = "127.0.0.1:12350";
+  config.listen[1] = "*:12351";
+  config.listen[2] = SOCKET_PATH;
+  config.listen[3] = "@cmdserv-test-listen";
+  config.log_handler = NULL;
+  config.connection_config.cmd_handler = &who_handler;
+  config.connection_config.log_handler = NULL;
+
+  if ((server = cmdserv_start(config)) == NULL)
+    err(EXIT_FAILURE, "cmdserv_start()");
+
+  who(server, "127.0.0.1", "12350");
+  who(server, "127.0.0.1", "12351");
+  who(server, NULL, SOCKET_PATH);
+  who(server, NULL, "@cmdserv-test-listen");
+
+  /* Live socket: Left alone, and still answering */
+  take_over(SOCKET_PATH);
+  who(server, NULL, SOCKET_PATH);
+
+  cmdserv_shutdown(server);
+
+  printf("%s %s\n", SOCKET_PATH,
+         stat(SOCKET_PATH, &st) == 0 ? "left behind" : "removed");
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,168 @@
+/*
+ *  test_cmdserv_perturb.c
+ *
+ *    -- test program for the line framing of cmdserv_connection
+ *       under partial and slow I/O.  Sends everything from stdin over
+ *       a loopback connection to a cmdserv_connection built with the
+ *       interceptors (-DINTERCEPT), with recv() delayed, returning
+ *       short counts and failing with EAGAIN at random, and writes
+ *       every command received to stdout.  Every command is also
+ *       echoed back to the client with cmdserv_connection_sendv(),
+ *       with sendmsg() returning short counts and failing with
+ *       EAGAIN, and must arrive intact.  The output must not depend
+ *       on the perturbation.
+ *
+ *
+ *  Copyright (C) 2014  Beat Vontobel <beat.vontobel@futhark.ch>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301, USA.
+ *
+ */
+
+#include "clientlib.h"
+
+#include <err.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#undef INTERCEPT /* Only perturb the library, not the test itself */
+#include "../intercept.h"
+
+#define PERTURBATION "seed=11;recv:delay=0-200,short=0.9,eagain=0.3;" \
+                     "sendmsg:short=0.9,eagain=0.3"
+
+static bool closed = false;
+static char echoed[4096];
+static size_t echolen = 0;
+
+static void cmd_handler(void *cmd_object, cmdserv_connection *connection,
+                        int argc, char **argv) {
+  char count[16], args[1024] = "", nl[] = "\n";
+  size_t len = 0;
+  struct iovec iov[3] = {
+    { .iov_base = count },
+    { .iov_base = args  },
+    { .iov_base = nl, .iov_len = 1 }
+  };
+  (void)cmd_object;
+
+  iov[0].iov_len = snprintf(count, sizeof(count), "%d:", argc);
+  for (int i = 0; i < argc && len < sizeof(args); i++)
+    len += snprintf(args + len, sizeof(args) - len, " [%s]", argv[i]);
+  iov[1].iov_len = len < sizeof(args) ? len : sizeof(args) - 1;
+
+  printf("%s%s\n", count, args);
+
+  for (int i = 0; i < 3 && echolen + iov[i].iov_len <= sizeof(echoed); i++) {
+    memcpy(echoed + echolen, iov[i].iov_base, iov[i].iov_len);
+    echolen += iov[i].iov_len;
+  }
+  if (cmdserv_connection_sendv(connection, iov, 3, 0) == -1)
+    err(EXIT_FAILURE, "cmdserv_connection_sendv()");
+}
+
+static void close_handler(void *close_object, cmdserv_connection *connection,
+                          enum cmdserv_close_reason reason) {
+  (void)close_object;
+  (void)connection;
+  (void)reason;
+  closed = true;
+}
+
+/**
+ * Receive everything echoed back to the client and compare it to
+ * what the command handler sent.
+ */
+static void check_echo(int client, cmdserv_connection *connection) {
+  static char buf[sizeof(echoed)];
+  struct pollfd pfd = { .fd = client, .events = POLLIN };
+  size_t len = 0;
+  ssize_t got;
+
+  while (cmdserv_connection_output_pending(connection))
+    cmdserv_connection_flush(connection);
+
+  while (len < echolen) {
+    if (poll(&pfd, 1, 1000) != 1)
+      errx(EXIT_FAILURE, "echo: %zu of %zu octets received", len, echolen);
+    if ((got = recv(client, buf + len, sizeof(buf) - len, 0)) <= 0)
+      err(EXIT_FAILURE, "recv()");
+    len += got;
+  }
+
+  if (memcmp(buf, echoed, echolen) != 0)
+    errx(EXIT_FAILURE, "echo: garbled");
+}
+
+int main(void) {
+  struct cmdserv_connection_config config
+    = cmdserv_connection_config_get_defaults();
+  struct sockaddr_in addr = {
+    .sin_family      = AF_INET,
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    .sin_port        = 0
+  };
+  socklen_t addrlen = sizeof(addr);
+  cmdserv_connection *connection;
+  char buf[4096];
+  ssize_t len;
+  int listener, client;
+
+  if ((listener = socket(AF_INET, SOCK_STREAM, 0)) == -1
+      || bind(listener, (struct sockaddr*)&addr, addrlen) == -1
+      || listen(listener, 1) == -1
+      || getsockname(listener, (struct sockaddr*)&addr, &addrlen) == -1
+      || (client = socket(AF_INET, SOCK_STREAM, 0)) == -1
+      || connect(client, (struct sockaddr*)&addr, addrlen) == -1)
+    err(EXIT_FAILURE, "loopback connection");
+
+  config.cmd_handler   = &cmd_handler;
+  config.close_handler = &close_handler;
+  config.log_handler   = NULL;
+
+  if ((connection = cmdserv_connection_create(listener, 1, &config,
+                                              CMDSERV_NO_CLOSE))
+      == NULL)
+    err(EXIT_FAILURE, "cmdserv_connection_create()");
+
+  if (intercept_configure(PERTURBATION) == -1)
+    err(EXIT_FAILURE, "intercept_configure()");
+
+  while ((len = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+    if (send(client, buf, len, 0) != len)
+      err(EXIT_FAILURE, "send()");
+    cmdserv_drain(connection, &closed);
+  }
+
+  check_echo(client, connection);
+  close(client);
+  cmdserv_drain(connection, &closed);
+  if (!closed)
+    errx(EXIT_FAILURE, "connection not closed");
+
+  intercept_reset(INTERCEPTED_recv);
+  intercept_reset(INTERCEPTED_sendmsg);
+  close(listener);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,123 @@
+/*
+ *  test_cmdserv_readbuf.c
+ *
+ *    -- test program for the growing read buffer: Sends short lines, a
+ *       long one (in one piece and trickling in), and an overlong one,
+ *       then shorter lines again, and shows how the read buffer follows
+ *       the line lengths.
+ *
+ *
+ *  Copyright (C) 2014  Beat Vontobel <beat.vontobel@futhark.ch>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301, USA.
+ *
+ */
+
+#include "clientlib.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define READBUF_SIZE 4096
+
+static void cmd_handler(void *cmd_object, cmdserv_connection *connection,
+                        int argc, char **argv) {
+  (void)cmd_object;
+
+  if (argc < 0) {
+    cmdserv_connection_send_status(connection, 400, "Error %d", argc);
+    return;
+  }
+
+  cmdserv_connection_send_status(connection, 200, "%zu",
+                                 argc > 0 ? strlen(argv[0]) : 0);
+}
+
+static cmdserv_memory *memory;
+static cmdserv_connection *connection;
+static size_t base;
+
+/**
+ * Push len octets in pieces of at most piece octets, reading after
+ * each, and print the last reply and the state of the read buffer
+ * (unless name is NULL).
+ */
+static void input(const char *name, const char *buf, size_t len,
+                  size_t piece) {
+  char out[256];
+  size_t outlen = 0, got;
+
+  cmdserv_push_memory(connection, memory, buf, len, piece);
+
+  while ((got = cmdserv_memory_pull(memory, out, sizeof(out))) > 0)
+    outlen = got;
+
+  if (name == NULL)
+    return;
+
+  printf("%-12s %-24.*s read buffer +%zu, grown %llu, shrunk %llu\n",
+         name, outlen >= 2 ? (int)outlen - 2 : 0, out,
+         cmdserv_connection_buffer_size(connection) - base,
+         cmdserv_connection_readbuf_grown(connection),
+         cmdserv_connection_readbuf_shrunk(connection));
+}
+
+static void line(const char *name, size_t len, size_t piece) {
+  char *buf;
+
+  if ((buf = malloc(len + 1)) == NULL)
+    err(EXIT_FAILURE, "malloc()");
+  memset(buf, 'x', len);
+  buf[len] = '\n';
+
+  input(name, buf, len + 1, piece);
+  free(buf);
+}
+
+int main(void) {
+  struct cmdserv_connection_config config
+    = cmdserv_connection_config_get_defaults();
+
+  config.readbuf_size = READBUF_SIZE;
+  config.cmd_handler  = &cmd_handler;
+  config.log_handler  = NULL;
+
+  connection = cmdserv_connect_memory(&config, &memory);
+
+  base = cmdserv_connection_buffer_size(connection);
+
+  line("short", 10, 1024);
+  line("long", 3000, 8192);
+  line("trickling", 3000, 100);
+  line("limit", READBUF_SIZE - 1, 8192);
+  line("overlong", 10000, 8192);
+
+  for (int i = 0; i < 130; i++)
+    line(NULL, 10, 1024);
+  line("short again", 10, 1024);
+
+  line("mid-size", 400, 8192);
+  for (int i = 0; i < 130; i++)
+    line(NULL, 200, 1024);
+  line("200 octets", 200, 1024);
+
+  cmdserv_connection_close(connection, CMDSERV_SERVER_SHUTDOWN);
+  cmdserv_memory_free(memory);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,188 @@
+/*
+ *  test_cmdserv_resp.c
+ *
+ *    -- test program for the RESP2 framing of cmdserv_connection on
+ *       top of the in-process memory transport.  Sends binary
+ *       arguments, pipelined and split up commands, a command larger
+ *       than the read buffer, too many arguments and malformed input,
+ *       and checks how output and status map onto RESP replies.
+ *       Writes everything the connections send back to stdout.
+ *
+ *
+ *  Copyright (C) 2014  Beat Vontobel <beat.vontobel@futhark.ch>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301, USA.
+ *
+ */
+
+#include "clientlib.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define READBUF_SIZE 64
+#define FRAME_MAX    4096
+#define ARGC_MAX     4
+
+static void cmd_handler(void *cmd_object, cmdserv_connection *connection,
+                        int argc, char **argv) {
+  (void)cmd_object;
+
+  if (argc == 0) {
+    cmdserv_connection_send_status(connection, 400, "empty");
+  } else if (strcmp(argv[0], "ping") == 0) {
+    cmdserv_connection_send_status(connection, 200, "PONG");
+  } else if (strcmp(argv[0], "fail") == 0) {
+    cmdserv_connection_println(connection, "dropped");
+    cmdserv_connection_send_status(connection, 500, "two\r\nlines");
+  } else if (strcmp(argv[0], "silent") == 0) {
+    /* No output, no status */
+  } else if (strcmp(argv[0], "len") == 0) {
+    for (int i = 1; i < argc; i++)
+      cmdserv_connection_printf(connection, "%zu ",
+                                cmdserv_connection_arglen(connection, i));
+  } else {
+    /* Echo the arguments, showing what's not printable */
+    cmdserv_connection_printf(connection, "%d:", argc);
+    for (int i = 0; i < argc; i++) {
+      size_t len = cmdserv_connection_arglen(connection, i);
+
+      cmdserv_connection_print(connection, " [");
+      for (size_t c = 0; c < len; c++) {
+        unsigned char ch = (unsigned char)argv[i][c];
+
+        if (ch < 0x20 || ch > 0x7e)
+          cmdserv_connection_printf(connection, "\\x%02x", ch);
+        else
+          cmdserv_connection_printf(connection, "%c", ch);
+      }
+      cmdserv_connection_print(connection, "]");
+    }
+    cmdserv_connection_send_status(connection, 200, "OK");
+  }
+}
+
+static void close_handler(void *close_object, cmdserv_connection *connection,
+                          enum cmdserv_close_reason reason) {
+  (void)close_object;
+  (void)connection;
+  printf("closed: %d\n", reason);
+}
+
+/**
+ * Push len octets in pieces of at most chunk octets, reading after
+ * every piece, and print the output.
+ */
+static void push(cmdserv_connection *connection, cmdserv_memory *memory,
+                 const void *buf, size_t len, size_t chunk) {
+  cmdserv_push_memory(connection, memory, buf, len, chunk);
+  cmdserv_print_memory(memory);
+}
+
+/**
+ * Encode argv as RESP into buf at offset, return the new end.
+ */
+static size_t resp(char *buf, size_t size, size_t offset,
+                   int argc, const char *const *argv, const size_t *argl) {
+  ssize_t len = cmdserv_resp(buf + offset, size - offset, argc, argv, argl);
+
+  if (len == -1)
+    errx(EXIT_FAILURE, "RESP buffer too small");
+  return offset + len;
+}
+
+int main(void) {
+  struct cmdserv_connection_config config
+    = cmdserv_connection_config_get_defaults();
+  static char buf[FRAME_MAX * 2], big[FRAME_MAX];
+  cmdserv_connection *connection;
+  cmdserv_memory *memory;
+  size_t len;
+
+  config.readbuf_size  = READBUF_SIZE;
+  config.argc_max      = ARGC_MAX;
+  config.framing       = CMDSERV_FRAMING_RESP;
+  config.frame_max     = FRAME_MAX;
+  config.cmd_handler   = &cmd_handler;
+  config.close_handler = &close_handler;
+  config.log_handler   = NULL;
+
+  connection = cmdserv_connect_memory(&config, &memory);
+
+  printf("# replies\n");
+  len = resp(buf, sizeof(buf), 0,   1, (const char *[]){ "ping" }, NULL);
+  len = resp(buf, sizeof(buf), len, 1, (const char *[]){ "fail" }, NULL);
+  len = resp(buf, sizeof(buf), len, 1, (const char *[]){ "silent" }, NULL);
+  len = resp(buf, sizeof(buf), len, 0, NULL, NULL);
+  len = resp(buf, sizeof(buf), len, 3,
+             (const char *[]){ "len", "abc", "" }, NULL);
+  push(connection, memory, buf, len, len);
+
+  /* Zero octets and line terminators are just data */
+  printf("# binary arguments\n");
+  len = resp(buf, sizeof(buf), 0, 3,
+             (const char *[]){ "echo", "a\0b", "c\r\nd" },
+             (size_t[]){ 4, 3, 4 });
+  push(connection, memory, buf, len, len);
+
+  /* Pipelined, then one octet at a time */
+  printf("# pipelined and split\n");
+  len = resp(buf, sizeof(buf), 0,   2, (const char *[]){ "echo", "one" }, NULL);
+  len = resp(buf, sizeof(buf), len, 2, (const char *[]){ "echo", "two" }, NULL);
+  push(connection, memory, buf, len, len);
+  len = resp(buf, sizeof(buf), 0, 2, (const char *[]){ "echo", "three" }, NULL);
+  push(connection, memory, buf, len, 1);
+
+  /* Larger than the read buffer, which has to grow */
+  printf("# larger than readbuf_size\n");
+  memset(big, 'x', 1000);
+  len = resp(buf, sizeof(buf), 0, 3,
+             (const char *[]){ "len", big, "end" },
+             (size_t[]){ 3, 1000, 3 });
+  push(connection, memory, buf, len, 100);
+
+  printf("# too many arguments\n");
+  len = resp(buf, sizeof(buf), 0, 5,
+             (const char *[]){ "echo", "1", "2", "3", "4" }, NULL);
+  len = resp(buf, sizeof(buf), len, 4,
+             (const char *[]){ "echo", "1", "2", "3" }, NULL);
+  push(connection, memory, buf, len, len);
+
+  /* Bulk string length not matching its data */
+  printf("# malformed\n");
+  push(connection, memory, "*1\r\n$3\r\nping\r\n", 14, 14);
+  cmdserv_hangup_memory(connection, memory);
+
+  /* Beyond frame_max */
+  printf("# larger than frame_max\n");
+  connection = cmdserv_connect_memory(&config, &memory);
+  memset(big, 'y', sizeof(big));
+  len = resp(buf, sizeof(buf), 0, 2,
+             (const char *[]){ "len", big }, (size_t[]){ 3, sizeof(big) });
+  push(connection, memory, buf, len, 1000);
+  cmdserv_hangup_memory(connection, memory);
+
+  /* Auto negotiation */
+  config.framing = CMDSERV_FRAMING_AUTO;
+
+  printf("# auto\n");
+  connection = cmdserv_connect_memory(&config, &memory);
+  len = resp(buf, sizeof(buf), 0, 1, (const char *[]){ "ping" }, NULL);
+  push(connection, memory, buf, len, len);
+  cmdserv_hangup_memory(connection, memory);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,208 @@
+/*
+ *  test_cmdserv_response.c
+ *
+ *    -- test program for cmdserv_response_prepare() and
+ *       cmdserv_connection_sendv(): Sends prepared responses with both
+ *       line terminators and as RESP replies, and large vectors over a
+ *       socket that can't take them in one go, checking that nothing
+ *       is lost or reordered on the way through the queue.
+ *
+ *
+ *  Copyright (C) 2014  Beat Vontobel <beat.vontobel@futhark.ch>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301, USA.
+ *
+ */
+
+#include "clientlib.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define VEC_LEN  100000
+#define OUT_SIZE (4 * VEC_LEN)
+
+static cmdserv_response *ok, *not_found;
+static char vec[3][VEC_LEN];
+
+/**
+ * "ok", "missing": The prepared responses.  "echo ARG": ARG, then
+ * "ok".  "vec": Three vectors of VEC_LEN octets in one go, then "ok".
+ */
+static void cmd_handler(void *cmd_object, cmdserv_connection *connection,
+                        int argc, char **argv) {
+  (void)cmd_object;
+
+  if (argc == 1 && strcmp(argv[0], "ok") == 0) {
+    cmdserv_connection_send_response(connection, ok);
+  } else if (argc == 2 && strcmp(argv[0], "echo") == 0) {
+    cmdserv_connection_print(connection, argv[1]);
+    cmdserv_connection_send_response(connection, ok);
+  } else if (argc == 1 && strcmp(argv[0], "vec") == 0) {
+    struct iovec iov[3] = {
+      { .iov_base = vec[0], .iov_len = VEC_LEN },
+      { .iov_base = vec[1], .iov_len = VEC_LEN },
+      { .iov_base = vec[2], .iov_len = VEC_LEN }
+    };
+
+    if (cmdserv_connection_sendv(connection, iov, 3, MSG_NOSIGNAL)
+        != 3 * VEC_LEN)
+      cmdserv_connection_send_status(connection, 500, "%s", strerror(errno));
+    cmdserv_connection_send_response(connection, ok);
+  } else {
+    cmdserv_connection_send_response(connection, not_found);
+  }
+}
+
+static void test_memory(const char *name, enum cmdserv_framing framing,
+                        enum cmdserv_lineterm lineterm, const char *cmd) {
+  struct cmdserv_connection_config config
+    = cmdserv_connection_config_get_defaults();
+  cmdserv_connection *connection;
+  cmdserv_memory *memory;
+  char out[1024];
+  size_t got;
+
+  config.cmd_handler = &cmd_handler;
+  config.log_handler = NULL;
+  config.framing     = framing;
+  config.lineterm    = lineterm;
+
+  connection = cmdserv_connect_memory(&config, &memory);
+  cmdserv_push_memory(connection, memory, cmd, strlen(cmd), strlen(cmd));
+
+  printf("-- %s\n", name);
+  while ((got = cmdserv_memory_pull(memory, out, sizeof(out))) > 0)
+    for (size_t i = 0; i < got; i++)
+      if (out[i] == '\r')
+        printf("\\r");
+      else
+        putchar(out[i]);
+
+  cmdserv_connection_close(connection, CMDSERV_SERVER_SHUTDOWN);
+  cmdserv_memory_free(memory);
+}
+
+static void test_socket(const char *cmd) {
+  struct cmdserv_connection_config config
+    = cmdserv_connection_config_get_defaults();
+  cmdserv_connection *connection;
+  size_t outlen = 0, queued = 0;
+  const char *p;
+  char *out;
+  int sv[2];
+
+  config.cmd_handler = &cmd_handler;
+  config.log_handler = NULL;
+  config.lineterm    = CMDSERV_LINETERM_LF;
+
+  if ((out = malloc(OUT_SIZE)) == NULL)
+    err(EXIT_FAILURE, "malloc()");
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1
+      || setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &(int){ 4096 },
+                    sizeof(int)) == -1
+      || fcntl(sv[0], F_SETFL, O_NONBLOCK) == -1)
+    err(EXIT_FAILURE, "socketpair()");
+
+  if ((connection = cmdserv_connection_create_transport(&cmdserv_socket_transport,
+                                                        &sv[0], 1, &config,
+                                                        CMDSERV_NO_CLOSE))
+      == NULL)
+    err(EXIT_FAILURE, "cmdserv_connection_create_transport()");
+
+  if (write(sv[1], cmd, strlen(cmd)) != (ssize_t)strlen(cmd))
+    err(EXIT_FAILURE, "write()");
+  cmdserv_connection_read(connection);
+
+  for (;;) {
+    struct pollfd pfd = { .fd = sv[1], .events = POLLIN };
+    ssize_t got;
+
+    if (cmdserv_connection_output_queued(connection) > queued)
+      queued = cmdserv_connection_output_queued(connection);
+    cmdserv_connection_flush(connection);
+
+    if (poll(&pfd, 1, 100) != 1)
+      break;
+    if ((got = read(sv[1], out + outlen, OUT_SIZE - outlen)) <= 0)
+      break;
+    outlen += got;
+  }
+
+  printf("-- socket: %s", cmd);
+  p = out;
+  while (p < out + outlen) {
+    if (*p == vec[0][0]) {
+      if (outlen - (p - out) < 3 * VEC_LEN
+          || memcmp(p, vec[0], VEC_LEN) != 0
+          || memcmp(p + VEC_LEN, vec[1], VEC_LEN) != 0
+          || memcmp(p + 2 * VEC_LEN, vec[2], VEC_LEN) != 0) {
+        printf("vectors broken\n");
+        break;
+      }
+      printf("vectors intact\n");
+      p += 3 * VEC_LEN;
+    } else {
+      const char *eol = memchr(p, '\n', outlen - (p - out));
+
+      if (eol == NULL)
+        eol = out + outlen - 1;
+      fwrite(p, 1, eol + 1 - p, stdout);
+      p = eol + 1;
+    }
+  }
+  printf("output was %squeued\n", queued > 0 ? "" : "not ");
+
+  cmdserv_connection_close(connection, CMDSERV_SERVER_SHUTDOWN);
+  close(sv[1]);
+  free(out);
+}
+
+int main(void) {
+  for (int i = 0; i < 3; i++)
+    for (size_t j = 0; j < VEC_LEN; j++)
+      vec[i][j] = 'A' + (i * 7 + j) % 26;
+  vec[0][0] = '#';
+
+  if ((ok = cmdserv_response_prepare(200, "OK")) == NULL
+      || (not_found = cmdserv_response_prepare(404, "Not found")) == NULL)
+    err(EXIT_FAILURE, "cmdserv_response_prepare()");
+
+  test_memory("LF", CMDSERV_FRAMING_LINE, CMDSERV_LINETERM_LF,
+              "ok\nmissing\necho hello\n");
+  test_memory("CRLF", CMDSERV_FRAMING_LINE, CMDSERV_LINETERM_CRLF,
+              "ok\r\nmissing\r\n");
+  test_memory("RESP", CMDSERV_FRAMING_RESP, CMDSERV_LINETERM_CRLF,
+              "*1\r\n$2\r\nok\r\n"
+              "*1\r\n$7\r\nmissing\r\n"
+              "*2\r\n$4\r\necho\r\n$5\r\nhello\r\n");
+
+  test_socket("ok\n");
+  test_socket("ok\nvec\nok\n");
+
+  cmdserv_response_free(ok);
+  cmdserv_response_free(not_found);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,301 @@
+/*
+ *  test_cmdserv_sendfile.c
+ *
+ *    -- test program for cmdserv_connection_send_file() and the output
+ *       queue: Sends parts of a file between other output, over a
+ *       socket with a small send buffer (so the transfer has to be
+ *       queued and driven by the client's readiness), over the
+ *       in-process memory transport (pread() fallback) and as a RESP
+ *       reply, and checks what arrives.  Finally truncates the file
+ *       under a queued transfer, which must cost the connection.
+ *
+ *
+ *  Copyright (C) 2014  Beat Vontobel <beat.vontobel@futhark.ch>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301, USA.
+ *
+ */
+
+#include "../cmdserv_connection.h"
+#include "../cmdserv_connection_config.h"
+#include "../cmdserv_transport.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define FILE_PATH "t/test_cmdserv_sendfile.tmp"
+#define FILE_SIZE (1024 * 1024)
+
+static int file_fd;
+
+/**
+ * "file OFFSET LENGTH": The part of the file between two lines.
+ */
+static void cmd_handler(void *cmd_object, cmdserv_connection *connection,
+                        int argc, char **argv) {
+  (void)cmd_object;
+
+  if (argc != 3 || strcmp(argv[0], "file") != 0) {
+    cmdserv_connection_send_status(connection, 400, "Usage");
+    return;
+  }
+
+  cmdserv_connection_print(connection, "begin\r\n");
+  if (cmdserv_connection_send_file(connection, file_fd,
+                                   atol(argv[1]), atol(argv[2])) == -1)
+    cmdserv_connection_send_status(connection, 500, "%s", strerror(errno));
+  else
+    cmdserv_connection_send_status(connection, 200, "end");
+}
+
+static char file_octet(size_t pos) {
+  return 'a' + pos % 26;
+}
+
+static void make_file(void) {
+  char buf[4096];
+
+  if ((file_fd = open(FILE_PATH, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1)
+    err(EXIT_FAILURE, "open(%s)", FILE_PATH);
+  unlink(FILE_PATH);
+
+  for (size_t pos = 0; pos < FILE_SIZE; pos += sizeof(buf)) {
+    for (size_t i = 0; i < sizeof(buf); i++)
+      buf[i] = file_octet(pos + i);
+    if (write(file_fd, buf, sizeof(buf)) != sizeof(buf))
+      err(EXIT_FAILURE, "write(%s)", FILE_PATH);
+  }
+}
+
+/**
+ * Check that out has len octets of the file from offset between the
+ * "begin" and the "200 end" lines, or print it if it's short.
+ */
+static void check(const char *name, const char *out, size_t outlen,
+                  size_t offset, size_t len) {
+  const char *data = out + 7;
+
+  if (len <= 64) {
+    printf("%s: ", name);
+    fwrite(out, 1, outlen, stdout);
+    return;
+  }
+
+  if (outlen != 7 + len + 9
+      || memcmp(out, "begin\r\n", 7) != 0
+      || memcmp(data + len, "200 end\r\n", 9) != 0) {
+    printf("%s: %zu octets, framing broken\n", name, outlen);
+    return;
+  }
+  for (size_t i = 0; i < len; i++)
+    if (data[i] != file_octet(offset + i)) {
+      printf("%s: data differs at %zu\n", name, i);
+      return;
+    }
+  printf("%s: %zu octets of file intact\n", name, len);
+}
+
+static void test_socket(const char *cmd, size_t offset, size_t len) {
+  struct cmdserv_connection_config config
+    = cmdserv_connection_config_get_defaults();
+  cmdserv_connection *connection;
+  size_t outlen = 0, queued = 0;
+  char *out;
+  int sv[2];
+
+  config.cmd_handler = &cmd_handler;
+  config.log_handler = NULL;
+
+  if ((out = malloc(FILE_SIZE + 64)) == NULL)
+    err(EXIT_FAILURE, "malloc()");
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1
+      || setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &(int){ 4096 },
+                    sizeof(int)) == -1
+      || fcntl(sv[0], F_SETFL, O_NONBLOCK) == -1)
+    err(EXIT_FAILURE, "socketpair()");
+
+  if ((connection = cmdserv_connection_create_transport(&cmdserv_socket_transport,
+                                                        &sv[0], 1, &config,
+                                                        CMDSERV_NO_CLOSE))
+      == NULL)
+    err(EXIT_FAILURE, "cmdserv_connection_create_transport()");
+
+  if (write(sv[1], cmd, strlen(cmd)) != (ssize_t)strlen(cmd))
+    err(EXIT_FAILURE, "write()");
+  cmdserv_connection_read(connection);
+
+  for (;;) {
+    struct pollfd pfd = { .fd = sv[1], .events = POLLIN };
+    ssize_t got;
+
+    if (cmdserv_connection_output_queued(connection) > queued)
+      queued = cmdserv_connection_output_queued(connection);
+    cmdserv_connection_flush(connection);
+
+    if (poll(&pfd, 1, 100) != 1)
+      break;
+    if ((got = read(sv[1], out + outlen, FILE_SIZE + 64 - outlen)) <= 0)
+      break;
+    outlen += got;
+  }
+
+  check("socket", out, outlen, offset, len);
+  if (len > 64)
+    printf("socket: output was %squeued\n", queued > 0 ? "" : "not ");
+
+  cmdserv_connection_close(connection, CMDSERV_SERVER_SHUTDOWN);
+  close(sv[1]);
+  free(out);
+}
+
+static void test_memory(enum cmdserv_framing framing,
+                        const char *cmd, size_t offset, size_t len) {
+  struct cmdserv_connection_config config
+    = cmdserv_connection_config_get_defaults();
+  cmdserv_connection *connection;
+  cmdserv_memory *memory;
+  size_t outlen = 0, got;
+  char *out;
+
+  config.cmd_handler = &cmd_handler;
+  config.log_handler = NULL;
+  config.framing     = framing;
+
+  if ((out = malloc(FILE_SIZE + 64)) == NULL
+      || (memory = cmdserv_memory_create()) == NULL)
+    err(EXIT_FAILURE, "malloc()");
+
+  if ((connection = cmdserv_connection_create_transport(&cmdserv_memory_transport,
+                                                        memory, 1, &config,
+                                                        CMDSERV_NO_CLOSE))
+      == NULL)
+    err(EXIT_FAILURE, "cmdserv_connection_create_transport()");
+
+  if (cmdserv_memory_push(memory, cmd, strlen(cmd)) == -1)
+    err(EXIT_FAILURE, "cmdserv_memory_push()");
+  cmdserv_connection_read(connection);
+
+  while ((got = cmdserv_memory_pull(memory, out + outlen,
+                                    FILE_SIZE + 64 - outlen)) > 0)
+    outlen += got;
+
+  check(framing == CMDSERV_FRAMING_RESP ? "resp" : "memory",
+        out, outlen, offset, len);
+
+  cmdserv_connection_close(connection, CMDSERV_SERVER_SHUTDOWN);
+  cmdserv_memory_free(memory);
+  free(out);
+}
+
+static void close_handler(void *close_object, cmdserv_connection *connection,
+                          enum cmdserv_close_reason reason) {
+  (void)connection;
+  *(enum cmdserv_close_reason *)close_object = reason;
+}
+
+/**
+ * Truncate the file once part of it went out: The client was
+ * promised the full length, so the connection has to go.
+ */
+static void test_truncated(void) {
+  struct cmdserv_connection_config config
+    = cmdserv_connection_config_get_defaults();
+  enum cmdserv_close_reason reason = CMDSERV_NO_CLOSE;
+  cmdserv_connection *connection;
+  size_t outlen = 0;
+  char *out;
+  int sv[2];
+
+  config.cmd_handler   = &cmd_handler;
+  config.log_handler   = NULL;
+  config.close_handler = &close_handler;
+  config.close_object  = &reason;
+
+  if ((out = malloc(FILE_SIZE + 64)) == NULL)
+    err(EXIT_FAILURE, "malloc()");
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1
+      || setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &(int){ 4096 },
+                    sizeof(int)) == -1
+      || fcntl(sv[0], F_SETFL, O_NONBLOCK) == -1)
+    err(EXIT_FAILURE, "socketpair()");
+
+  if ((connection = cmdserv_connection_create_transport(&cmdserv_socket_transport,
+                                                        &sv[0], 1, &config,
+                                                        CMDSERV_NO_CLOSE))
+      == NULL)
+    err(EXIT_FAILURE, "cmdserv_connection_create_transport()");
+
+  if (write(sv[1], "file 0 0\n", 9) != 9)
+    err(EXIT_FAILURE, "write()");
+  cmdserv_connection_read(connection);
+
+  for (;;) {
+    struct pollfd pfd = { .fd = sv[1], .events = POLLIN };
+    ssize_t got;
+
+    if (reason == CMDSERV_NO_CLOSE) {
+      if (outlen >= FILE_SIZE / 4
+          && ftruncate(file_fd, FILE_SIZE / 8) == -1)
+        err(EXIT_FAILURE, "ftruncate()");
+      cmdserv_connection_flush(connection);
+    }
+
+    if (poll(&pfd, 1, 100) != 1)
+      break;
+    if ((got = read(sv[1], out + outlen, FILE_SIZE + 64 - outlen)) <= 0)
+      break;
+    outlen += got;
+  }
+
+  printf("truncated: %s with reason %d after %s of the file\n",
+         reason == CMDSERV_NO_CLOSE ? "still open" : "closed", reason,
+         outlen < 7 + FILE_SIZE ? "part" : "all");
+
+  if (reason == CMDSERV_NO_CLOSE)
+    cmdserv_connection_close(connection, CMDSERV_SERVER_SHUTDOWN);
+  close(sv[1]);
+  free(out);
+}
+
+int main(void) {
+  make_file();
+
+  test_socket("file 0 0\n", 0, FILE_SIZE);
+  test_socket("file 1000 10\n", 1000, 10);
+  test_socket("file 5000 300000\n", 5000, 300000);
+  test_socket("file 2000000 0\n", 0, 0);
+
+  test_memory(CMDSERV_FRAMING_LINE, "file 0 0\n", 0, FILE_SIZE);
+  test_memory(CMDSERV_FRAMING_LINE, "file 1000 10\n", 1000, 10);
+
+  test_memory(CMDSERV_FRAMING_RESP,
+              "*3\r\n$4\r\nfile\r\n$4\r\n1000\r\n$2\r\n10\r\n", 1000, 10);
+
+  test_truncated();
+
+  close(file_fd);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,313 @@
+/*
+ *  test_cmdserv_shm.c
+ *
+ *    -- test program for the shared memory transport: Forks a cmdserv
+ *       on two "shm:" endpoints and talks to it through the rings.
+ *       Checks greeting, pipelined commands split across sends, an
+ *       overlong line, a response larger than the read buffer, and
+ *       the close reasons of server and client side closes.  Writes
+ *       what the client receives to stdout.
+ *
+ *
+ *  Copyright (C) 2014  Beat Vontobel <beat.vontobel@futhark.ch>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301, USA.
+ *
+ */
+
+#include "clientlib.h"
+#include "../cmdserv.h"
+#include "../cmdserv_helpers.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define SOCKET_PATH "t/test_cmdserv_shm.sock"
+#define BIG_LEN     10000
+#define HUGE_LEN    (4 * CMDSERV_SHM_RING_SIZE)
+#define TIMEOUT_MS  5000
+
+static enum cmdserv_close_reason last_close = CMDSERV_NO_CLOSE;
+static bool shutdown_requested = false;
+
+static void cmd_handler(void *cmd_object, cmdserv_connection *connection,
+                        int argc, char **argv) {
+  (void)cmd_object;
+
+  if (argc < 1) {
+    cmdserv_connection_send_status(connection, 400, "error %d", argc);
+  } else if (strcmp(argv[0], "who") == 0) {
+    char *client = cmdserv_connection_client(connection);
+
+    /* Strip the process id, that differs from run to run */
+    if (client != NULL && strrchr(client, ':') != NULL)
+      *strrchr(client, ':') = '\0';
+    cmdserv_connection_send_status(connection, 200, "%s",
+                                   client ? client : "?");
+    free(client);
+  } else if (strcmp(argv[0], "big") == 0) {
+    static char big[BIG_LEN + 3];
+
+    memset(big, 'x', BIG_LEN);
+    strcpy(big + BIG_LEN, "\r\n");
+    cmdserv_connection_print(connection, big);
+    cmdserv_connection_send_status(connection, 200, "big");
+  } else if (strcmp(argv[0], "huge") == 0) {
+    static char huge[HUGE_LEN];
+
+    memset(huge, 'z', HUGE_LEN);
+    cmdserv_connection_send(connection, huge, HUGE_LEN, 0);
+    cmdserv_connection_send_status(connection, 200, "huge");
+  } else if (strcmp(argv[0], "cpu") == 0) {
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    cmdserv_connection_send_status(connection, 200, "%ld",
+                                   (usage.ru_utime.tv_sec
+                                    + usage.ru_stime.tv_sec) * 1000L
+                                   + (usage.ru_utime.tv_usec
+                                      + usage.ru_stime.tv_usec) / 1000);
+  } else if (strcmp(argv[0], "last") == 0) {
+    cmdserv_connection_send_status(connection, 200, "last close %d",
+                                   last_close);
+  } else if (strcmp(argv[0], "shutdown") == 0) {
+    shutdown_requested = true;
+    cmdserv_connection_send_status(connection, 200, "shutting down");
+  } else if (strcmp(argv[0], "quit") == 0) {
+    cmdserv_connection_send_status(connection, 200, "bye");
+    cmdserv_connection_close(connection, CMDSERV_APPLICATION_CLOSE);
+  } else {
+    cmdserv_connection_printf(connection, "%d:", argc);
+    for (int i = 0; i < argc; i++)
+      cmdserv_connection_printf(connection, " [%s]", argv[i]);
+    cmdserv_connection_print(connection, "\r\n");
+    cmdserv_connection_send_status(connection, 200, "OK");
+  }
+}
+
+static void open_handler(void *open_object, cmdserv_connection *connection,
+                         enum cmdserv_close_reason reason) {
+  (void)open_object;
+  (void)reason;
+  cmdserv_connection_send_status(connection, 200, "welcome");
+}
+
+static void close_handler(void *close_object, cmdserv_connection *connection,
+                          enum cmdserv_close_reason reason) {
+  (void)close_object;
+  (void)connection;
+  last_close = reason;
+}
+
+static void server_run(pid_t parent) {
+  struct cmdserv_config config = cmdserv_config_get_defaults();
+  cmdserv *server;
+
+  config.listen[0] = "shm:" SOCKET_PATH;
+  config.listen[1] = "shm:@cmdserv-test-shm";
+  config.log_handler = NULL;
+  config.connection_config.readbuf_size  = 1024;
+  config.connection_config.cmd_handler   = &cmd_handler;
+  config.connection_config.open_handler  = &open_handler;
+  config.connection_config.close_handler = &close_handler;
+  config.connection_config.log_handler   = NULL;
+
+  if ((server = cmdserv_start(config)) == NULL)
+    err(EXIT_FAILURE, "cmdserv_start()");
+
+  /* Don't outlive a failed test */
+  while (!shutdown_requested && getppid() == parent)
+    cmdserv_sleep(server, &(struct timeval){ .tv_sec = 1, .tv_usec = 0 });
+
+  cmdserv_shutdown(server);
+  exit(EXIT_SUCCESS);
+}
+
+/**
+ * Connect to path, retrying while the server is still starting up.
+ */
+static cmdserv_shm *connect_shm(const char *path) {
+  cmdserv_shm *shm;
+
+  for (int tries = 0; tries < 50; tries++) {
+    if ((shm = cmdserv_shm_connect(path)) != NULL)
+      return shm;
+    millisleep(100);
+  }
+
+  return cmdserv_connect_shm(path);
+}
+
+/**
+ * Collect what arrives on shm, until the number of status lines
+ * expected have been seen or the server has closed the connection.
+ * Overlong lines are only shown by length.
+ */
+static void expect(cmdserv_shm *shm, int statuses) {
+  static char buf[BIG_LEN * 2];
+  static size_t len = 0;
+  ssize_t got;
+
+  while (statuses > 0) {
+    char *eol;
+
+    if ((got = cmdserv_shm_recv(shm, buf + len, sizeof(buf) - len,
+                                TIMEOUT_MS)) == 0) {
+      printf("client: closed by server\n");
+      return;
+    }
+    if (got == -1)
+      err(EXIT_FAILURE, "cmdserv_shm_recv()");
+    len += got;
+
+    while ((eol = memchr(buf, '\n', len)) != NULL) {
+      size_t linelen = eol - buf + 1;
+
+      if (linelen > 100)
+        printf("client: (%zu octets)\n", linelen);
+      else
+        printf("client: %.*s", (int)linelen, buf);
+
+      if (linelen >= 4 && buf[3] == ' ')
+        statuses--;
+
+      len -= linelen;
+      memmove(buf, buf + linelen, len);
+    }
+  }
+}
+
+static void send_str(cmdserv_shm *shm, const char *str) {
+  if (cmdserv_shm_send(shm, str, strlen(str)) == -1)
+    err(EXIT_FAILURE, "cmdserv_shm_send()");
+}
+
+/**
+ * The milliseconds of CPU time the server has used so far.
+ */
+static long server_cpu(cmdserv_shm *shm) {
+  char buf[64];
+  size_t len = 0;
+  ssize_t got;
+
+  send_str(shm, "cpu\r\n");
+  while (memchr(buf, '\n', len) == NULL) {
+    if ((got = cmdserv_shm_recv(shm, buf + len, sizeof(buf) - 1 - len,
+                                TIMEOUT_MS)) <= 0)
+      errx(EXIT_FAILURE, "cmdserv_shm_recv(): no CPU time");
+    len += got;
+  }
+  buf[len] = '\0';
+
+  return atol(buf + 4);
+}
+
+/**
+ * Take a reply larger than the ring slowly, in small bites: The
+ * server has to wait for room all the while, which mustn't keep it
+ * busy.
+ */
+static void slow_reader(cmdserv_shm *shm) {
+  static char buf[HUGE_LEN + 64];
+  size_t len = 0;
+  uint64_t begin;
+  long cpu;
+  ssize_t got;
+  size_t i;
+
+  cpu   = server_cpu(shm);
+  begin = cmdserv_monotonic_ns();
+  send_str(shm, "huge\r\n");
+  while (len < HUGE_LEN + 10) {
+    if ((got = cmdserv_shm_recv(shm, buf + len, 4096, TIMEOUT_MS)) <= 0)
+      errx(EXIT_FAILURE, "cmdserv_shm_recv(): reply incomplete");
+    len += got;
+    millisleep(5);
+  }
+  cpu = server_cpu(shm) - cpu;
+
+  for (i = 0; i < HUGE_LEN && buf[i] == 'z'; i++)
+    ;
+  printf("client: huge reply %s\n",
+         i == HUGE_LEN && memcmp(buf + HUGE_LEN, "200 huge\r\n", 10) == 0
+         ? "intact" : "broken");
+  printf("client: server %s while waiting for room\n",
+         cpu * 1000000 < (long)(cmdserv_monotonic_ns() - begin) / 2
+         ? "idle" : "busy");
+}
+
+int main(void) {
+  char overlong[2048];
+  struct stat st;
+  cmdserv_shm *shm;
+  pid_t server;
+  int status;
+
+  unlink(SOCKET_PATH);
+
+  if ((server = fork()) == -1)
+    err(EXIT_FAILURE, "fork()");
+  if (server == 0)
+    server_run(getppid());
+
+  /* Commands split across sends and several in one send */
+  shm = connect_shm(SOCKET_PATH);
+  expect(shm, 1);
+  send_str(shm, "who\r\nec");
+  send_str(shm, "ho a \"b c\"\r\nnoop\r\n");
+  expect(shm, 3);
+
+  /* Larger than the read buffer, both ways */
+  memset(overlong, 'y', sizeof(overlong) - 3);
+  strcpy(overlong + sizeof(overlong) - 3, "\r\n");
+  send_str(shm, overlong);
+  send_str(shm, "big\r\n");
+  expect(shm, 2);
+
+  /* Slow reader of a reply larger than the ring */
+  slow_reader(shm);
+
+  /* Server side close */
+  send_str(shm, "quit\r\n");
+  expect(shm, 2);
+  cmdserv_close_shm(shm);
+
+  /* Client side close, seen by the next client */
+  shm = connect_shm("@cmdserv-test-shm");
+  expect(shm, 1);
+  send_str(shm, "last\r\n");
+  expect(shm, 1);
+  cmdserv_close_shm(shm);
+
+  shm = connect_shm("@cmdserv-test-shm");
+  expect(shm, 1);
+  send_str(shm, "last\r\nshutdown\r\n");
+  expect(shm, 2);
+  cmdserv_close_shm(shm);
+
+  if (waitpid(server, &status, 0) == -1)
+    err(EXIT_FAILURE, "waitpid()");
+  printf("server exit %d\n", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+
+  printf("%s %s\n", SOCKET_PATH,
+         stat(SOCKET_PATH, &st) == 0 ? "left behind" : "removed");
+
+  return EXIT_SUCCESS;
+}
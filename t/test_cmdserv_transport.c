@@ -0,0 +1,101 @@
+/*
+ *  test_cmdserv_transport.c
+ *
+ *    -- test program for cmdserv_connection on top of the in-process
+ *       memory transport.  Pushes stdin into the connection in chunks
+ *       of growing size (so that lines are split up and several lines
+ *       arrive at once, more than fit the read buffer), and writes
+ *       everything the connection sends back to stdout, followed by
+ *       the close reason once stdin is exhausted.
+ *
+ *
+ *  Copyright (C) 2014  Beat Vontobel <beat.vontobel@futhark.ch>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301, USA.
+ *
+ */
+
+#include "clientlib.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define READBUF_SIZE 64
+
+static void cmd_handler(void *cmd_object, cmdserv_connection *connection,
+                        int argc, char **argv) {
+  (void)cmd_object;
+
+  if (argc > 0 && strcmp(argv[0], "who") == 0) {
+    char *client = cmdserv_connection_client(connection);
+    cmdserv_connection_send_status(connection, 200, "%s",
+                                   client ? client : "?");
+    free(client);
+    return;
+  }
+
+  cmdserv_connection_printf(connection, "%d:", argc);
+  for (int i = 0; i < argc; i++)
+    cmdserv_connection_printf(connection, " [%s]", argv[i]);
+  cmdserv_connection_print(connection, "\r\n");
+  cmdserv_connection_send_status(connection, 200, "OK");
+}
+
+static void close_handler(void *close_object, cmdserv_connection *connection,
+                          enum cmdserv_close_reason reason) {
+  (void)close_object;
+  (void)connection;
+  printf("closed: %d\n", reason);
+}
+
+int main(void) {
+  struct cmdserv_connection_config config
+    = cmdserv_connection_config_get_defaults();
+  cmdserv_connection *connection;
+  cmdserv_memory *memory;
+  char buf[4096];
+  size_t chunk = 1;
+  ssize_t len;
+
+  config.readbuf_size  = READBUF_SIZE;
+  config.lineterm      = CMDSERV_LINETERM_CRLF_OR_LF;
+  config.cmd_handler   = &cmd_handler;
+  config.close_handler = &close_handler;
+  config.log_handler   = NULL;
+
+  connection = cmdserv_connect_memory(&config, &memory);
+
+  while ((len = read(STDIN_FILENO, buf, chunk)) > 0) {
+    cmdserv_push_memory(connection, memory, buf, len, len);
+    cmdserv_print_memory(memory);
+
+    if (cmdserv_memory_closed(memory))
+      break;
+
+    if (chunk < sizeof(buf))
+      chunk *= 2;
+  }
+
+  if (len == -1)
+    err(EXIT_FAILURE, "read()");
+
+  cmdserv_hangup_memory(connection, memory);
+
+  return EXIT_SUCCESS;
+}
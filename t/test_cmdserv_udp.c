@@ -0,0 +1,194 @@
+/*
+ *  test_cmdserv_udp.c
+ *
+ *    -- test program for cmdserv datagram listeners: Sends command
+ *       lines as datagrams (one and several per datagram, unterminated,
+ *       overlong, with a "quit" in the middle, and a whole burst at
+ *       once) and writes the replies to stdout, then does the same on
+ *       a listener that doesn't reply.
+ *
+ *
+ *  Copyright (C) 2014  Beat Vontobel <beat.vontobel@futhark.ch>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301, USA.
+ *
+ */
+
+#include "../cmdserv.h"
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define READBUF_SIZE 64
+#define BURST        40
+
+static int commands = 0;
+
+static void cmd_handler(void *cmd_object, cmdserv_connection *connection,
+                        int argc, char **argv) {
+  (void)cmd_object;
+
+  commands++;
+
+  if (argc > 0 && strcmp(argv[0], "quit") == 0) {
+    cmdserv_connection_send_status(connection, 200, "bye");
+    cmdserv_connection_close(connection, CMDSERV_APPLICATION_CLOSE);
+    return;
+  }
+
+  cmdserv_connection_printf(connection, "%d:", argc);
+  for (int i = 0; i < argc; i++)
+    cmdserv_connection_printf(connection, " [%s]", argv[i]);
+  cmdserv_connection_print(connection, "\r\n");
+  cmdserv_connection_send_status(connection, 200, "OK");
+}
+
+static void open_handler(void *open_object, cmdserv_connection *connection,
+                         enum cmdserv_close_reason reason) {
+  (void)open_object;
+  (void)connection;
+  printf("opened: %d\n", reason);
+}
+
+static void close_handler(void *close_object, cmdserv_connection *connection,
+                          enum cmdserv_close_reason reason) {
+  (void)close_object;
+  (void)connection;
+  printf("closed: %d\n", reason);
+}
+
+static cmdserv *start(const char *endpoint, bool reply) {
+  struct cmdserv_config config = cmdserv_config_get_defaults();
+  cmdserv *server;
+
+  config.listen[0]    = endpoint;
+  config.udp_reply    = reply;
+  config.log_handler  = NULL;
+  config.connection_config.readbuf_size  = READBUF_SIZE;
+  config.connection_config.cmd_handler   = &cmd_handler;
+  config.connection_config.open_handler  = &open_handler;
+  config.connection_config.close_handler = &close_handler;
+  config.connection_config.log_handler   = NULL;
+
+  if ((server = cmdserv_start(config)) == NULL)
+    err(EXIT_FAILURE, "cmdserv_start(%s)", endpoint);
+
+  return server;
+}
+
+static int client(unsigned int port) {
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_port   = htons(port)
+  };
+  int fd;
+
+  inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+  if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1
+      || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    err(EXIT_FAILURE, "client socket");
+
+  return fd;
+}
+
+static void put(int fd, const char *dgram, size_t len) {
+  if (send(fd, dgram, len, 0) != (ssize_t)len)
+    err(EXIT_FAILURE, "send()");
+}
+
+/**
+ * Let the server handle everything sent so far, then print all
+ * replies and return how many there were.
+ */
+static int replies(cmdserv *server, int fd, bool print) {
+  char buf[1024];
+  ssize_t len;
+  int count = 0;
+
+  cmdserv_sleep(server, &(struct timeval){ .tv_sec = 0, .tv_usec = 100000 });
+
+  while ((len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) >= 0) {
+    count++;
+    if (print) {
+      printf("reply: ");
+      fwrite(buf, 1, len, stdout);
+    }
+  }
+  if (errno != EAGAIN && errno != EWOULDBLOCK)
+    err(EXIT_FAILURE, "recv()");
+
+  return count;
+}
+
+int main(void) {
+  char big[READBUF_SIZE * 2];
+  cmdserv *server;
+  int fd, count;
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  server = start("udp:127.0.0.1:12353", true);
+  fd     = client(12353);
+
+  printf("-- one command, unterminated\n");
+  put(fd, "hello world", 11);
+  replies(server, fd, true);
+
+  printf("-- several lines in one datagram\n");
+  put(fd, "a b\nc \"d e\"\r\nf\n", 15);
+  replies(server, fd, true);
+
+  printf("-- overlong datagram\n");
+  memset(big, 'x', sizeof(big));
+  put(fd, big, sizeof(big));
+  replies(server, fd, true);
+
+  printf("-- quit drops the rest of the datagram only\n");
+  put(fd, "one\nquit\ntwo\n", 13);
+  replies(server, fd, true);
+  put(fd, "three", 5);
+  replies(server, fd, true);
+
+  printf("-- burst\n");
+  commands = 0;
+  for (int i = 0; i < BURST; i++)
+    put(fd, "x", 1);
+  count = replies(server, fd, false);
+  printf("%d commands, %d replies\n", commands, count);
+
+  close(fd);
+  cmdserv_shutdown(server);
+
+  printf("-- no replies\n");
+  server = start("udp:12354", false);
+  fd     = client(12354);
+  commands = 0;
+  put(fd, "a\nb\n", 4);
+  count = replies(server, fd, true);
+  printf("%d commands, %d replies\n", commands, count);
+
+  close(fd);
+  cmdserv_shutdown(server);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,217 @@
+/*
+ *  test_cmdserv_zerocopy.c
+ *
+ *    -- test program for cmdserv_connection_send_zerocopy(): Sends a
+ *       small and a large buffer over a TCP connection on the loopback
+ *       interface and checks that they arrive intact, in order with
+ *       the other output, and that each buffer is released exactly
+ *       once -- also when the connection is closed before the client
+ *       has read it.
+ *
+ *
+ *  Copyright (C) 2014  Beat Vontobel <beat.vontobel@futhark.ch>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301, USA.
+ *
+ */
+
+#include "../cmdserv_connection.h"
+#include "../cmdserv_connection_config.h"
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define BIG (4 * 1024 * 1024)
+
+static int released;
+static bool released_in_handler;
+
+static void release_handler(void *release_object, const void *buf) {
+  (void)release_object;
+  released++;
+  free((void *)(uintptr_t)buf);
+}
+
+/**
+ * "data LENGTH": A buffer of that length between two lines.
+ */
+static void cmd_handler(void *cmd_object, cmdserv_connection *connection,
+                        int argc, char **argv) {
+  size_t len;
+  char *buf;
+
+  (void)cmd_object;
+
+  if (argc != 2 || strcmp(argv[0], "data") != 0) {
+    cmdserv_connection_send_status(connection, 400, "Usage");
+    return;
+  }
+
+  len = atol(argv[1]);
+  if ((buf = malloc(len)) == NULL)
+    err(EXIT_FAILURE, "malloc()");
+  for (size_t i = 0; i < len; i++)
+    buf[i] = 'a' + i % 26;
+
+  released = 0;
+  cmdserv_connection_print(connection, "begin\r\n");
+  if (cmdserv_connection_send_zerocopy(connection, buf, len,
+                                       &release_handler, NULL) == -1)
+    cmdserv_connection_send_status(connection, 500, "%s", strerror(errno));
+  else
+    cmdserv_connection_send_status(connection, 200, "end");
+  released_in_handler = released > 0;
+}
+
+static int listen_loopback(struct sockaddr_in *addr) {
+  socklen_t addrlen = sizeof(*addr);
+  int fd;
+
+  *addr = (struct sockaddr_in){ .sin_family = AF_INET };
+  inet_pton(AF_INET, "127.0.0.1", &addr->sin_addr);
+
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1
+      || bind(fd, (struct sockaddr *)addr, sizeof(*addr)) == -1
+      || listen(fd, 1) == -1
+      || getsockname(fd, (struct sockaddr *)addr, &addrlen) == -1)
+    err(EXIT_FAILURE, "listen");
+
+  return fd;
+}
+
+static cmdserv_connection *connect_loopback(int *client) {
+  struct cmdserv_connection_config config
+    = cmdserv_connection_config_get_defaults();
+  cmdserv_connection *connection;
+  struct sockaddr_in addr;
+  int listener = listen_loopback(&addr);
+
+  config.cmd_handler = &cmd_handler;
+  config.log_handler = NULL;
+
+  if ((*client = socket(AF_INET, SOCK_STREAM, 0)) == -1
+      || connect(*client, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    err(EXIT_FAILURE, "connect");
+
+  if ((connection = cmdserv_connection_create(listener, 1, &config,
+                                              CMDSERV_NO_CLOSE)) == NULL)
+    err(EXIT_FAILURE, "cmdserv_connection_create()");
+
+  close(listener);
+  return connection;
+}
+
+static void command(cmdserv_connection *connection, int client,
+                    const char *cmd) {
+  if (write(client, cmd, strlen(cmd)) != (ssize_t)strlen(cmd))
+    err(EXIT_FAILURE, "write()");
+  while (poll(&(struct pollfd){ .fd = cmdserv_connection_fd(connection),
+                                .events = POLLIN }, 1, 1000) != 1)
+    ;
+  cmdserv_connection_read(connection);
+}
+
+/**
+ * Read the response to "data len" and check it.
+ */
+static void receive(const char *name, cmdserv_connection *connection,
+                    int client, size_t len) {
+  size_t outlen = 0, want = 7 + len + 9;
+  char *out;
+
+  if ((out = malloc(want)) == NULL)
+    err(EXIT_FAILURE, "malloc()");
+
+  while (outlen < want) {
+    struct pollfd pfd = { .fd = client, .events = POLLIN };
+    ssize_t got;
+
+    cmdserv_connection_flush(connection);
+    if (poll(&pfd, 1, 1000) != 1)
+      break;
+    if ((got = read(client, out + outlen, want - outlen)) <= 0)
+      break;
+    outlen += got;
+  }
+
+  /* The completion may come in after the last octet arrived */
+  for (int i = 0; i < 100 && released == 0; i++) {
+    poll(NULL, 0, 10);
+    cmdserv_connection_read(connection);
+  }
+
+  if (outlen != want
+      || memcmp(out, "begin\r\n", 7) != 0
+      || memcmp(out + 7 + len, "200 end\r\n", 9) != 0) {
+    printf("%s: %zu octets, framing broken\n", name, outlen);
+  } else {
+    size_t i;
+
+    for (i = 0; i < len && out[7 + i] == 'a' + (char)(i % 26); i++)
+      ;
+    if (i < len)
+      printf("%s: data differs at %zu\n", name, i);
+    else
+      printf("%s: %zu octets intact\n", name, len);
+  }
+
+  /* Whether large buffers are released right away depends on the kernel */
+  printf("%s: released %d time(s)%s\n", name, released,
+         len < 1024 && released_in_handler ? " right away" : "");
+  free(out);
+}
+
+int main(void) {
+  cmdserv_connection *connection;
+  char cmd[64];
+  int client;
+
+  connection = connect_loopback(&client);
+
+  command(connection, client, "data 100\n");
+  receive("small", connection, client, 100);
+
+  snprintf(cmd, sizeof(cmd), "data %d\n", BIG);
+  command(connection, client, cmd);
+  receive("big", connection, client, BIG);
+
+  /* Again: The kernel may have turned MSG_ZEROCOPY off by now */
+  command(connection, client, cmd);
+  receive("again", connection, client, BIG);
+
+  cmdserv_connection_close(connection, CMDSERV_SERVER_SHUTDOWN);
+  close(client);
+
+  /* The client never reads: Released when closing at the latest */
+  connection = connect_loopback(&client);
+  command(connection, client, cmd);
+  cmdserv_connection_close(connection, CMDSERV_SERVER_SHUTDOWN);
+  printf("unread: released %d time(s) after close\n", released);
+
+  close(client);
+
+  return EXIT_SUCCESS;
+}